@@ -0,0 +1,941 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <crtdbg.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "Benchmarks.h"
+#include "UFSImage.h"
+#include "UFSImageBuild.h"
+#include "WriteCoalescer.h"
+#include "DirectIo.h"
+#include "ParallelProbe.h"
+
+#define UFS_BENCHMARK_BATCHES 11
+#define UFS_BENCHMARK_BATCH_MICROSECONDS 5000
+#define UFS_BENCHMARK_WHITEOUTS 1024
+#define UFS_BENCHMARK_DIRECTORY_ENTRIES 64
+#define UFS_BENCHMARK_SHADOWED_ENTRIES 16
+#define UFS_BENCHMARK_DATA_SIZE (1024 * 1024)
+#define UFS_BENCHMARK_READ_SIZE 4096
+#define UFS_BENCHMARK_WRITE_SIZE 65536
+#define UFS_BENCHMARK_APPEND_SIZE 512
+/* The sparse file holds UFS_BENCHMARK_SPARSE_EXTENTS data chunks spread over UFS_BENCHMARK_SPARSE_SIZE. */
+#define UFS_BENCHMARK_SPARSE_SIZE (64 * 1024 * 1024)
+#define UFS_BENCHMARK_SPARSE_EXTENTS 4
+/* Larger than the caches of the disks, so a pass of the stream file measures the disk and the system cache. */
+#define UFS_BENCHMARK_STREAM_SIZE (256 * 1024 * 1024)
+/* The round trip added to the probes of the emulated remote roots. */
+#define UFS_BENCHMARK_PROBE_MILLISECONDS 2
+
+/* The heap allocations made while a benchmark is counted, by an allocation hook of the debug heap that is
+ * set only then. Release builds have no hook and report -1 allocations per operation.
+ */
+static volatile LONG gAllocations;
+
+#ifdef _DEBUG
+static int __cdecl CountAllocation(int aType, void*, size_t, int aBlockType, long, const unsigned char*, int)
+{
+	if (aType == _HOOK_ALLOC && aBlockType != _CRT_BLOCK)
+		InterlockedIncrement(&gAllocations);
+	return TRUE;
+}
+#endif
+
+/* Results are folded into this so the compiler cannot drop the benchmarked work. */
+static volatile ULONG64 gSink;
+
+static const WCHAR gBenchmarkPath[] = L"\\UFSBench\\src\\engine\\union\\WinUnionFS.cpp";
+static const WCHAR gReadOnlyFile[] = L"\\UFSBench\\readonly.txt";
+static const WCHAR gDirectory[] = L"\\UFSBench\\dir";
+static WCHAR gDeepFile[MAX_PATHW];
+static const WCHAR gDataFile[] = L"\\UFSBench\\data.txt";
+static const WCHAR gImageFile[] = L"\\UFSBench\\bench.img";
+static const WCHAR gWrittenFile[] = L"\\UFSBench\\written.bin";
+/* Outside \UFSBench, whose image would hold the holes as compressed zeros. */
+static const WCHAR gSparseFile[] = L"\\UFSBenchSparse.bin";
+static const WCHAR gStreamFile[] = L"\\UFSBenchStream.bin";
+
+static void BenchPatchPath(ULONG aIterations)
+{
+	WCHAR path[MAX_PATHW];
+	size_t lengthB = sizeof(gBenchmarkPath) - sizeof(WCHAR);
+	for (ULONG i = 0; i < aIterations; ++i) {
+		PatchPath(path, gWriteLayer->Root(), gBenchmarkPath, gWriteLayer->RootLength(), lengthB);
+		gSink += path[i & 15];
+	}
+}
+
+static void BenchCleanFileName(ULONG aIterations)
+{
+	for (ULONG i = 0; i < aIterations; ++i) {
+		wstring path(gBenchmarkPath);
+		CleanFileName(path);
+		gSink += path[i & 15];
+	}
+}
+
+/** Whiteouts are looked up alternately for present and absent paths. */
+static vector<wstring> gWhiteoutProbes;
+
+static void BenchCheckDeletedClean(ULONG aIterations)
+{
+	size_t probes = gWhiteoutProbes.size();
+	for (ULONG i = 0; i < aIterations; ++i)
+		gSink += CheckDeletedClean(gWhiteoutProbes[i % probes]);
+}
+
+static void BenchCheckDeleted(ULONG aIterations)
+{
+	for (ULONG i = 0; i < aIterations; ++i)
+		gSink += CheckDeleted(gBenchmarkPath);
+}
+
+static void BenchGetFilePath(ULONG aIterations)
+{
+	WCHAR path[MAX_PATHW];
+	for (ULONG i = 0; i < aIterations; ++i)
+		gSink += GetFilePath(path, gReadOnlyFile);
+}
+
+static void BenchMakeContext(ULONG aIterations)
+{
+	for (ULONG i = 0; i < aIterations; ++i)
+		gSink += MakeContext((HANDLE)(ULONG_PTR)(i | 4), (i & 1) != 0, i & (GENERIC_READ | GENERIC_WRITE | FILE_READ_DATA | FILE_WRITE_DATA),
+			i & 7, FILE_FLAG_BACKUP_SEMANTICS);
+}
+
+/** The merge of a directory with entries in both roots, some of them shadowed and some whited out. */
+static void BenchFindFilesMerge(ULONG aIterations)
+{
+	WIN32_FIND_DATAW findData;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		UnionDirEnumerator enumerator;
+		int status = enumerator.Open(gDirectory);
+		while (!status && (status = enumerator.Next(&findData)) > 0) {
+			gSink += findData.cFileName[0];
+			status = 0;
+		}
+	}
+}
+
+/** The same directory listed for the names matching a pattern, as dir r1* would. */
+static void BenchFindFilesPattern(ULONG aIterations)
+{
+	WIN32_FIND_DATAW findData;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		UnionDirEnumerator enumerator;
+		int status = enumerator.Open(gDirectory, L"r1*");
+		while (!status && (status = enumerator.Next(&findData)) > 0) {
+			gSink += findData.cFileName[0];
+			status = 0;
+		}
+	}
+}
+
+/** The same directory listed in pages of 16 entries, each page reopened from the cursor of the previous one. */
+static void BenchFindFilesResume(ULONG aIterations)
+{
+	WIN32_FIND_DATAW findData;
+	UnionDirCursor cursor;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		bool more = true;
+		for (bool first = true; more; first = false) {
+			UnionDirEnumerator enumerator;
+			int status = enumerator.Open(gDirectory, NULL, first ? NULL : &cursor);
+			ULONG count = 0;
+			while (!status && count < 16 && (status = enumerator.Next(&findData)) > 0) {
+				gSink += findData.cFileName[0];
+				++count;
+				status = 0;
+			}
+			more = !status && count == 16;
+			if (more)
+				enumerator.Save(cursor);
+		}
+	}
+}
+
+static void SinkFindData(const WIN32_FIND_DATAW& aFindData, void*)
+{
+	gSink += aFindData.cFileName[0];
+}
+
+/** The same pages listed through the listing kept for an open, which continues without reopening. */
+static void BenchFindFilesPages(ULONG aIterations)
+{
+	for (ULONG i = 0; i < aIterations; ++i) {
+		int status = ListDirectory(1, gDirectory, NULL, true, 16, SinkFindData, NULL);
+		while (status > 0)
+			status = ListDirectory(1, gDirectory, NULL, false, 16, SinkFindData, NULL);
+	}
+	ForgetDirectoryListing(1);
+}
+
+/** The common case, all parents already exist in the write root. */
+static void BenchCreateParentDirectories(ULONG aIterations)
+{
+	WCHAR path[MAX_PATHW];
+	size_t lengthB = wcslen(gDeepFile) * sizeof(WCHAR);
+	for (ULONG i = 0; i < aIterations; ++i) {
+		MakeWritePath(path, gDeepFile, lengthB);
+		gSink += CreateParentDirectories(path);
+	}
+}
+
+/* The Loose and Image benchmarks do the same work on the read root directory \UFSBench and on a compressed
+ * image of it, whose paths start below \UFSBench. */
+static ImageLayer* gpImageLayer;
+static HANDLE gLooseData = INVALID_HANDLE_VALUE, gImageData = INVALID_HANDLE_VALUE;
+
+static void Stat(UFSLayer& aLayer, LPCWSTR aRelativePath, ULONG aIterations)
+{
+	WCHAR path[MAX_PATHW];
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	aLayer.MakePath(path, aRelativePath, wcslen(aRelativePath) * sizeof(WCHAR));
+	for (ULONG i = 0; i < aIterations; ++i)
+		gSink += aLayer.GetAttributesEx(path, &data) + data.nFileSizeLow;
+}
+
+static void List(UFSLayer& aLayer, LPCWSTR aRelativePattern, ULONG aIterations)
+{
+	WCHAR pattern[MAX_PATHW];
+	WIN32_FIND_DATAW findData;
+	aLayer.MakePath(pattern, aRelativePattern, wcslen(aRelativePattern) * sizeof(WCHAR));
+	for (ULONG i = 0; i < aIterations; ++i) {
+		HANDLE find = aLayer.FindFirst(pattern, &findData);
+		if (find == INVALID_HANDLE_VALUE)
+			continue;
+		do
+			gSink += findData.cFileName[0];
+		while (aLayer.FindNext(find, &findData));
+		aLayer.FindEnd(find);
+	}
+}
+
+/** Reads blocks of the data file in a sequence that jumps around it. */
+static void Read(UFSLayer& aLayer, HANDLE aFile, ULONG aIterations)
+{
+	static BYTE buffer[UFS_BENCHMARK_READ_SIZE];
+	DWORD readLength;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		LONGLONG offset = (LONGLONG)((i * 7919) % (UFS_BENCHMARK_DATA_SIZE / UFS_BENCHMARK_READ_SIZE)) * UFS_BENCHMARK_READ_SIZE;
+		gSink += aLayer.Read(aFile, buffer, sizeof(buffer), &readLength, offset) + buffer[readLength / 2];
+	}
+}
+
+/** What GetFileInformation costs without a context handle, before and after the stat path. */
+static void BenchInformationByHandle(ULONG aIterations)
+{
+	WCHAR path[MAX_PATHW];
+	BY_HANDLE_FILE_INFORMATION information;
+	gReadLayer->MakePath(path, gReadOnlyFile, sizeof(gReadOnlyFile) - sizeof(WCHAR));
+	for (ULONG i = 0; i < aIterations; ++i) {
+		HANDLE handle = gReadLayer->Open(path, 0, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS);
+		if (handle == INVALID_HANDLE_VALUE)
+			continue;
+		gSink += gReadLayer->GetInformation(handle, &information) + information.nFileSizeLow;
+		gReadLayer->Close(handle);
+	}
+}
+
+static void BenchInformationByName(ULONG aIterations)
+{
+	BY_HANDLE_FILE_INFORMATION information;
+	for (ULONG i = 0; i < aIterations; ++i)
+		gSink += GetUnionFileInformation(gReadOnlyFile, &information) + information.nFileSizeLow;
+}
+
+/** ls -l: the directory listed, then every entry queried by name. */
+static void ListThenStat(ULONG aIterations, bool aPrime)
+{
+	WIN32_FIND_DATAW findData;
+	BY_HANDLE_FILE_INFORMATION information;
+	WCHAR path[MAX_PATH];
+	for (ULONG i = 0; i < aIterations; ++i) {
+		InvalidateUnionFileInformation();
+		UnionDirEnumerator enumerator;
+		int status = enumerator.Open(gDirectory);
+		while (!status && (status = enumerator.Next(&findData, aPrime ? &information : NULL)) > 0) {
+			swprintf(path, L"%s\\%s", gDirectory, findData.cFileName);
+			gSink += GetUnionFileInformation(path, &information) + information.nFileSizeLow;
+			status = 0;
+		}
+	}
+}
+
+static void BenchListThenStat(ULONG aIterations)
+{
+	ListThenStat(aIterations, false);
+}
+
+/** The same with the listing priming the information, as a readdirplus would. */
+static void BenchListPlusThenStat(ULONG aIterations)
+{
+	ListThenStat(aIterations, true);
+}
+
+static void BenchLooseStat(ULONG aIterations)
+{
+	Stat(*gReadLayer, L"\\UFSBench\\dir\\r42", aIterations);
+}
+
+static void BenchImageStat(ULONG aIterations)
+{
+	Stat(*gpImageLayer, L"\\dir\\r42", aIterations);
+}
+
+static void BenchLooseList(ULONG aIterations)
+{
+	List(*gReadLayer, L"\\UFSBench\\dir\\*", aIterations);
+}
+
+static void BenchImageList(ULONG aIterations)
+{
+	List(*gpImageLayer, L"\\dir\\*", aIterations);
+}
+
+static void BenchLooseRead(ULONG aIterations)
+{
+	Read(*gReadLayer, gLooseData, aIterations);
+}
+
+static void BenchImageRead(ULONG aIterations)
+{
+	Read(*gpImageLayer, gImageData, aIterations);
+}
+
+/** A write root file written sequentially, as a copy would, with or without its final size announced first. */
+static void Write(ULONG aIterations, bool aPreallocate)
+{
+	static BYTE buffer[UFS_BENCHMARK_WRITE_SIZE];
+	WCHAR path[MAX_PATHW];
+	if (gWriteLayer->MakePath(path, gWrittenFile, sizeof(gWrittenFile) - sizeof(WCHAR)))
+		return;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		HANDLE file = gWriteLayer->Open(path, GENERIC_WRITE, 0, CREATE_ALWAYS, 0);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		if (aPreallocate)
+			gSink += SetWriteAllocation(file, UFS_BENCHMARK_DATA_SIZE);
+		DWORD written;
+		for (ULONG size = 0; size < UFS_BENCHMARK_DATA_SIZE; size += UFS_BENCHMARK_WRITE_SIZE)
+			gSink += WriteFile(file, buffer, UFS_BENCHMARK_WRITE_SIZE, &written, NULL);
+		gWriteLayer->Close(file);
+	}
+}
+
+static void BenchGrowingWrite(ULONG aIterations)
+{
+	Write(aIterations, false);
+}
+
+static void BenchPreallocatedWrite(ULONG aIterations)
+{
+	Write(aIterations, true);
+}
+
+/** A write root file appended to in UFS_BENCHMARK_APPEND_SIZE chunks, as a log or a linker would. */
+static void SmallAppend(ULONG aIterations, bool aCoalesce)
+{
+	static BYTE buffer[UFS_BENCHMARK_APPEND_SIZE];
+	WCHAR path[MAX_PATHW];
+	if (gWriteLayer->MakePath(path, gWrittenFile, sizeof(gWrittenFile) - sizeof(WCHAR)))
+		return;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		HANDLE file = gWriteLayer->Open(path, GENERIC_WRITE, 0, CREATE_ALWAYS, 0);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		if (aCoalesce)
+			RememberFileKey(file);
+		for (LONGLONG offset = 0; offset < UFS_BENCHMARK_DATA_SIZE; offset += UFS_BENCHMARK_APPEND_SIZE) {
+			DWORD written;
+			if (aCoalesce)
+				gSink += CoalescedWrite(file, buffer, UFS_BENCHMARK_APPEND_SIZE, offset);
+			else {
+				LARGE_INTEGER position;
+				position.QuadPart = offset;
+				gSink += SetFilePointerEx(file, position, NULL, FILE_BEGIN) && WriteFile(file, buffer, UFS_BENCHMARK_APPEND_SIZE, &written, NULL);
+			}
+		}
+		if (aCoalesce) {
+			gSink += ReleaseCoalescedWrites(file);
+			ForgetFileKey(file);
+		}
+		gWriteLayer->Close(file);
+	}
+}
+
+static void BenchSmallAppend(ULONG aIterations)
+{
+	SmallAppend(aIterations, false);
+}
+
+static void BenchCoalescedSmallAppend(ULONG aIterations)
+{
+	SmallAppend(aIterations, true);
+}
+
+/** The copy-up of a mostly sparse read root file, by CopyFile as before or by the layer. */
+static void CopyUpSparse(ULONG aIterations, bool aDense)
+{
+	WCHAR readPath[MAX_PATHW], writePath[MAX_PATHW];
+	size_t lengthB = sizeof(gSparseFile) - sizeof(WCHAR);
+	if (gReadLayer->MakePath(readPath, gSparseFile, lengthB) || gWriteLayer->MakePath(writePath, gSparseFile, lengthB))
+		return;
+	for (ULONG i = 0; i < aIterations; ++i)
+		gSink += aDense ? CopyFile(readPath, writePath, FALSE) : gReadLayer->CopyOut(readPath, writePath, FALSE);
+}
+
+static void BenchDenseCopyUp(ULONG aIterations)
+{
+	CopyUpSparse(aIterations, true);
+}
+
+static void BenchSparseCopyUp(ULONG aIterations)
+{
+	CopyUpSparse(aIterations, false);
+}
+
+/** A chunk written then released again. */
+static void BenchPunchHole(ULONG aIterations)
+{
+	static BYTE buffer[UFS_BENCHMARK_WRITE_SIZE];
+	WCHAR path[MAX_PATHW];
+	if (gWriteLayer->MakePath(path, gWrittenFile, sizeof(gWrittenFile) - sizeof(WCHAR)))
+		return;
+	HANDLE file = gWriteLayer->Open(path, GENERIC_WRITE, 0, CREATE_ALWAYS, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		DWORD written;
+		LARGE_INTEGER start;
+		start.QuadPart = 0;
+		gSink += SetFilePointerEx(file, start, NULL, FILE_BEGIN) && WriteFile(file, buffer, UFS_BENCHMARK_WRITE_SIZE, &written, NULL);
+		gSink += ZeroWriteRange(file, 0, UFS_BENCHMARK_WRITE_SIZE);
+	}
+	gWriteLayer->Close(file);
+}
+
+/* GetPerformanceInfo, looked up in psapi.dll when first needed, with its structure. */
+struct UFSPerformanceInformation {
+	DWORD mSize;
+	SIZE_T mCommitTotal, mCommitLimit, mCommitPeak, mPhysicalTotal, mPhysicalAvailable, mSystemCache;
+	SIZE_T mKernelTotal, mKernelPaged, mKernelNonpaged, mPageSize;
+	DWORD mHandleCount, mProcessCount, mThreadCount;
+};
+typedef BOOL (WINAPI *GetPerformanceInfoFunction)(UFSPerformanceInformation*, DWORD);
+
+/** The size of the system cache in bytes, 0 if unknown. */
+static ULONG64 SystemCacheSize()
+{
+	static GetPerformanceInfoFunction getPerformanceInfo;
+	static bool lookedUp;
+	if (!lookedUp) {
+		HMODULE psapi = LoadLibrary(L"psapi.dll");
+		getPerformanceInfo = psapi ? (GetPerformanceInfoFunction)GetProcAddress(psapi, "GetPerformanceInfo") : NULL;
+		lookedUp = true;
+	}
+	UFSPerformanceInformation information;
+	if (!getPerformanceInfo || !getPerformanceInfo(&information, sizeof(information)))
+		return 0;
+	return (ULONG64)information.mSystemCache * information.mPageSize;
+}
+
+/** The processor time of the process in 100 ns units. */
+static ULONG64 ProcessorTime()
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return 0;
+	return (((ULONG64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) + (((ULONG64)user.dwHighDateTime << 32) | user.dwLowDateTime);
+}
+
+/* The read root stream file read by BufferedStream and DirectStream through handles opened with and without
+ * the system cache, into a buffer misaligned like the Dokan buffers can be. */
+static HANDLE gStreamFiles[2] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
+static LONGLONG gStreamOffsets[2];
+static BYTE gStreamBuffer[UFS_DIRECT_BUFFER_SIZE + 1];
+
+static bool ReadStream(int aDirect, LONGLONG aOffset, LPDWORD apReadLength)
+{
+	if (aDirect)
+		return DirectRead(gReadLayer, gStreamFiles[1], gStreamBuffer + 1, UFS_DIRECT_BUFFER_SIZE, apReadLength, aOffset);
+	return !gReadLayer->Read(gStreamFiles[0], gStreamBuffer + 1, UFS_DIRECT_BUFFER_SIZE, apReadLength, aOffset);
+}
+
+/** Reads the whole stream file once and prints the throughput, the processor time and the growth of the
+ * system cache as a comment, which baselines skip. */
+static void ReportStream(LPCWSTR aName, int aDirect)
+{
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	ULONG64 cache = SystemCacheSize(), processorTime = ProcessorTime();
+	QueryPerformanceCounter(&start);
+	DWORD got;
+	for (LONGLONG offset = 0; offset < UFS_BENCHMARK_STREAM_SIZE; offset += UFS_DIRECT_BUFFER_SIZE)
+		if (ReadStream(aDirect, offset, &got))
+			return;
+	QueryPerformanceCounter(&end);
+	double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+	double megabytes = UFS_BENCHMARK_STREAM_SIZE / (1024.0 * 1024.0);
+	wprintf(L"# %s pass\t%.0f MB/s\t%.3f processor s/GB\tsystem cache %+.0f MB\n", aName, megabytes / seconds,
+		(double)(LONGLONG)(ProcessorTime() - processorTime) / 1e7 * 1024 / megabytes,
+		((double)(LONGLONG)SystemCacheSize() - (double)(LONGLONG)cache) / (1024 * 1024));
+}
+
+/** Writes the stream file unbuffered, so it starts out of the cache, opens it both ways and reports a pass
+ * of each, the direct one first.
+ * @return false on success.
+ */
+static bool PrepareStream()
+{
+	static bool prepared;
+	if (prepared)
+		return gStreamFiles[1] == INVALID_HANDLE_VALUE;
+	prepared = true;
+	WCHAR path[MAX_PATHW];
+	if ((!gDirectIoEnabled && DirectIoStart(NULL, 0)) || gReadLayer->MakePath(path, gStreamFile, sizeof(gStreamFile) - sizeof(WCHAR)))
+		return true;
+	HANDLE handle = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+	BYTE* chunk = (BYTE*)VirtualAlloc(NULL, UFS_DIRECT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	bool failed = handle == INVALID_HANDLE_VALUE || !chunk;
+	if (chunk)
+		memset(chunk, 'x', UFS_DIRECT_BUFFER_SIZE);
+	for (LONGLONG size = 0; !failed && size < UFS_BENCHMARK_STREAM_SIZE; size += UFS_DIRECT_BUFFER_SIZE) {
+		DWORD written;
+		failed = !WriteFile(handle, chunk, UFS_DIRECT_BUFFER_SIZE, &written, NULL);
+	}
+	if (chunk)
+		VirtualFree(chunk, 0, MEM_RELEASE);
+	if (handle != INVALID_HANDLE_VALUE)
+		CloseHandle(handle);
+	if (failed)
+		return true;
+	gStreamFiles[0] = gReadLayer->Open(path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, 0);
+	gStreamFiles[1] = gReadLayer->Open(path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING);
+	if (gStreamFiles[0] == INVALID_HANDLE_VALUE || gStreamFiles[1] == INVALID_HANDLE_VALUE) {
+		gStreamFiles[1] = INVALID_HANDLE_VALUE;
+		return true;
+	}
+	ReportStream(L"DirectStream", 1);
+	ReportStream(L"BufferedStream", 0);
+	return false;
+}
+
+/** The stream file read sequentially in UFS_DIRECT_BUFFER_SIZE chunks, over and over. */
+static void Stream(ULONG aIterations, int aDirect)
+{
+	if (PrepareStream())
+		return;
+	for (ULONG i = 0; i < aIterations; ++i) {
+		DWORD got = 0;
+		gSink += ReadStream(aDirect, gStreamOffsets[aDirect], &got) + got;
+		if ((gStreamOffsets[aDirect] += UFS_DIRECT_BUFFER_SIZE) >= UFS_BENCHMARK_STREAM_SIZE)
+			gStreamOffsets[aDirect] = 0;
+	}
+}
+
+static void BenchBufferedStream(ULONG aIterations)
+{
+	Stream(aIterations, 0);
+}
+
+static void BenchDirectStream(ULONG aIterations)
+{
+	Stream(aIterations, 1);
+}
+
+/** A root answering probes like a remote share would, one round trip late. */
+class SlowLayer : public Win32Layer
+{
+public:
+	SlowLayer(LPCWSTR aRoot, size_t aRootLength) : Win32Layer(aRoot, aRootLength) {}
+	virtual DWORD GetAttributes(LPCWSTR aPath) {
+		Sleep(UFS_BENCHMARK_PROBE_MILLISECONDS);
+		return Win32Layer::GetAttributes(aPath);
+	}
+};
+
+/** Resolves a read root file like UFSCreateFile does, both roots being remote: the write root misses. */
+static void Resolve(ULONG aIterations, bool aParallel)
+{
+	SlowLayer readLayer(gReadLayer->Root(), gReadLayer->RootLength()), writeLayer(gWriteLayer->Root(), gWriteLayer->RootLength());
+	bool started = aParallel && !gParallelProbesEnabled && !ParallelProbesStart();
+	UFSLayer* realReadLayer = gReadLayer;
+	UFSLayer* realWriteLayer = gWriteLayer;
+	gReadLayer = &readLayer;
+	gWriteLayer = &writeLayer;
+	WCHAR writePath[MAX_PATHW], readPath[MAX_PATHW];
+	size_t length = sizeof(gReadOnlyFile) - sizeof(WCHAR);
+	for (ULONG i = 0; i < aIterations; ++i) {
+		if (MakeWritePath(writePath, gReadOnlyFile, length) || MakeReadPath(readPath, gReadOnlyFile, length))
+			break;
+		ReadRootProbe probe(aParallel ? readPath : NULL);
+		if (gWriteLayer->GetAttributes(writePath) == INVALID_FILE_ATTRIBUTES)
+			gSink += !CheckDeleted(gReadOnlyFile) && probe.Attributes(readPath) != INVALID_FILE_ATTRIBUTES;
+	}
+	ParallelProbesWait(); // The dropped probes use the layers on the stack.
+	gReadLayer = realReadLayer;
+	gWriteLayer = realWriteLayer;
+	if (started)
+		ParallelProbesStop();
+}
+
+static void BenchSerialResolve(ULONG aIterations)
+{
+	Resolve(aIterations, false);
+}
+
+static void BenchParallelResolve(ULONG aIterations)
+{
+	Resolve(aIterations, true);
+}
+
+struct Benchmark {
+	LPCWSTR mName;
+	void (*mpBody)(ULONG aIterations);
+};
+
+static const Benchmark gBenchmarks[] = {
+	{L"PatchPath", BenchPatchPath},
+	{L"CleanFileName", BenchCleanFileName},
+	{L"CheckDeletedClean", BenchCheckDeletedClean},
+	{L"CheckDeleted", BenchCheckDeleted},
+	{L"GetFilePath", BenchGetFilePath},
+	{L"MakeContext", BenchMakeContext},
+	{L"FindFilesMerge", BenchFindFilesMerge},
+	{L"FindFilesPattern", BenchFindFilesPattern},
+	{L"FindFilesResume", BenchFindFilesResume},
+	{L"FindFilesPages", BenchFindFilesPages},
+	{L"CreateParentDirectories", BenchCreateParentDirectories},
+	{L"InformationByHandle", BenchInformationByHandle},
+	{L"InformationByName", BenchInformationByName},
+	{L"ListThenStat", BenchListThenStat},
+	{L"ListPlusThenStat", BenchListPlusThenStat},
+	{L"LooseStat", BenchLooseStat},
+	{L"ImageStat", BenchImageStat},
+	{L"LooseList", BenchLooseList},
+	{L"ImageList", BenchImageList},
+	{L"LooseRead", BenchLooseRead},
+	{L"ImageRead", BenchImageRead},
+	{L"GrowingWrite", BenchGrowingWrite},
+	{L"PreallocatedWrite", BenchPreallocatedWrite},
+	{L"SmallAppend", BenchSmallAppend},
+	{L"CoalescedSmallAppend", BenchCoalescedSmallAppend},
+	{L"DenseCopyUp", BenchDenseCopyUp},
+	{L"SparseCopyUp", BenchSparseCopyUp},
+	{L"PunchHole", BenchPunchHole},
+	{L"BufferedStream", BenchBufferedStream},
+	{L"DirectStream", BenchDirectStream},
+	{L"SerialResolve", BenchSerialResolve},
+	{L"ParallelResolve", BenchParallelResolve},
+};
+
+static bool CreateFixtureDirectory(LPCWSTR aRoot, size_t aRootLength, LPCWSTR aRelativePath)
+{
+	WCHAR path[MAX_PATHW];
+	if (PatchPath(path, aRoot, aRelativePath, aRootLength, wcslen(aRelativePath) * sizeof(WCHAR)))
+		return true;
+	return !CreateDirectory(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS;
+}
+
+static bool CreateFixtureFile(LPCWSTR aRoot, size_t aRootLength, LPCWSTR aRelativePath)
+{
+	WCHAR path[MAX_PATHW];
+	if (PatchPath(path, aRoot, aRelativePath, aRootLength, wcslen(aRelativePath) * sizeof(WCHAR)))
+		return true;
+	HANDLE handle = CreateFile(path, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, 0, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return true;
+	CloseHandle(handle);
+	return false;
+}
+
+/** Fills the file aRelativePath with UFS_BENCHMARK_DATA_SIZE bytes of text, compressible like source code. */
+static bool CreateFixtureData(LPCWSTR aRoot, size_t aRootLength, LPCWSTR aRelativePath)
+{
+	WCHAR path[MAX_PATHW];
+	if (PatchPath(path, aRoot, aRelativePath, aRootLength, wcslen(aRelativePath) * sizeof(WCHAR)))
+		return true;
+	HANDLE handle = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return true;
+	char line[64];
+	bool failed = false;
+	for (ULONG size = 0, i = 0; !failed && size < UFS_BENCHMARK_DATA_SIZE; size += (ULONG)strlen(line), ++i) {
+		sprintf(line, "\tgSink += Lookup(entries[%u], %u);\r\n", i % 997, i * 31 % 1024);
+		if (strlen(line) > UFS_BENCHMARK_DATA_SIZE - size)
+			line[UFS_BENCHMARK_DATA_SIZE - size] = 0;
+		DWORD written;
+		failed = !WriteFile(handle, line, (DWORD)strlen(line), &written, NULL);
+	}
+	CloseHandle(handle);
+	return failed;
+}
+
+/** Makes the file aRelativePath UFS_BENCHMARK_SPARSE_SIZE bytes long, all holes but a few data chunks. */
+static bool CreateFixtureSparse(LPCWSTR aRoot, size_t aRootLength, LPCWSTR aRelativePath)
+{
+	WCHAR path[MAX_PATHW];
+	if (PatchPath(path, aRoot, aRelativePath, aRootLength, wcslen(aRelativePath) * sizeof(WCHAR)))
+		return true;
+	HANDLE handle = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return true;
+	static BYTE chunk[UFS_BENCHMARK_WRITE_SIZE];
+	memset(chunk, 'x', sizeof(chunk));
+	LARGE_INTEGER position;
+	position.QuadPart = UFS_BENCHMARK_SPARSE_SIZE;
+	bool failed = !SetFilePointerEx(handle, position, NULL, FILE_BEGIN) || !SetEndOfFile(handle) ||
+		ZeroWriteRange(handle, 0, UFS_BENCHMARK_SPARSE_SIZE);
+	for (ULONG i = 0; !failed && i < UFS_BENCHMARK_SPARSE_EXTENTS; ++i) {
+		DWORD written;
+		position.QuadPart = (LONGLONG)i * (UFS_BENCHMARK_SPARSE_SIZE / UFS_BENCHMARK_SPARSE_EXTENTS);
+		failed = !SetFilePointerEx(handle, position, NULL, FILE_BEGIN) || !WriteFile(handle, chunk, sizeof(chunk), &written, NULL);
+	}
+	CloseHandle(handle);
+	return failed;
+}
+
+/** Creates the \UFSBench trees and the whiteouts used by the benchmarks.
+ * @return false on success.
+ */
+static bool CreateFixture()
+{
+	LPCWSTR readRoot = gReadLayer->Root(), writeRoot = gWriteLayer->Root();
+	size_t readRootLength = gReadLayer->RootLength(), writeRootLength = gWriteLayer->RootLength();
+	static LPCWSTR const directories[] = {
+		L"\\UFSBench", L"\\UFSBench\\dir", L"\\UFSBench\\deep", L"\\UFSBench\\deep\\a", L"\\UFSBench\\deep\\a\\b",
+		L"\\UFSBench\\deep\\a\\b\\c", L"\\UFSBench\\deep\\a\\b\\c\\d"
+	};
+	for (size_t i = 0; i < sizeof(directories) / sizeof(*directories); ++i)
+		if (CreateFixtureDirectory(writeRoot, writeRootLength, directories[i]) ||
+			(i < 2 && CreateFixtureDirectory(readRoot, readRootLength, directories[i])))
+			return true;
+	wcscpy(gDeepFile, L"\\UFSBench\\deep\\a\\b\\c\\d\\file");
+	if (CreateFixtureFile(readRoot, readRootLength, gReadOnlyFile))
+		return true;
+	/* Read entries r00.., write entries w00.. and the first read entries shadowed by write entries. */
+	WCHAR name[64];
+	for (ULONG i = 0; i < UFS_BENCHMARK_DIRECTORY_ENTRIES; ++i) {
+		swprintf(name, L"%s\\r%02u", gDirectory, i);
+		if (CreateFixtureFile(readRoot, readRootLength, name) ||
+			(i < UFS_BENCHMARK_SHADOWED_ENTRIES && CreateFixtureFile(writeRoot, writeRootLength, name)))
+			return true;
+		swprintf(name, L"%s\\w%02u", gDirectory, i);
+		if (CreateFixtureFile(writeRoot, writeRootLength, name))
+			return true;
+	}
+	for (ULONG i = 0; i < UFS_BENCHMARK_WHITEOUTS; ++i) {
+		swprintf(name, L"\\UFSBENCH\\GONE\\F%04u", i);
+		MarkDeleted(name);
+		gWhiteoutProbes.push_back(name);
+		swprintf(name, L"\\UFSBENCH\\KEPT\\F%04u", i);
+		gWhiteoutProbes.push_back(name);
+	}
+	/* Every fourth read entry of the merged directory is whited out. */
+	for (ULONG i = UFS_BENCHMARK_SHADOWED_ENTRIES; i < UFS_BENCHMARK_DIRECTORY_ENTRIES; i += 4) {
+		swprintf(name, L"%s\\R%02u", gDirectory, i);
+		wstring whiteout(name);
+		CleanFileName(whiteout);
+		MarkDeleted(whiteout);
+	}
+	/* The image of the read root \UFSBench is kept in the write root, out of the way of the loose files. */
+	WCHAR path[MAX_PATHW];
+	if (CreateFixtureData(readRoot, readRootLength, gDataFile) || CreateFixtureSparse(readRoot, readRootLength, gSparseFile) ||
+		PatchPath(path, readRoot, L"\\UFSBench", readRootLength, 9 * sizeof(WCHAR)))
+		return true;
+	wstring imageSource(path);
+	if (PatchPath(path, writeRoot, gImageFile, writeRootLength, sizeof(gImageFile) - sizeof(WCHAR)) ||
+		WriteImage(imageSource, path, UFS_IMAGE_DEFAULT_BLOCK_SIZE, true, 1))
+		return true;
+	gpImageLayer = new ImageLayer(path, wcslen(path) * sizeof(WCHAR));
+	if (gpImageLayer->Load())
+		return true;
+	if (gReadLayer->MakePath(path, gDataFile, sizeof(gDataFile) - sizeof(WCHAR)))
+		return true;
+	gLooseData = gReadLayer->Open(path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, 0);
+	gpImageLayer->MakePath(path, L"\\data.txt", 9 * sizeof(WCHAR));
+	gImageData = gpImageLayer->Open(path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, 0);
+	return gLooseData == INVALID_HANDLE_VALUE || gImageData == INVALID_HANDLE_VALUE;
+}
+
+/** Removes a fixture file of both roots, clearing its attributes first.
+ * @return false on success, true if the file was left.
+ */
+static bool RemoveFixtureFile(LPCWSTR aRelativePath)
+{
+	UFSLayer* const layers[] = {gReadLayer, gWriteLayer};
+	bool failed = false;
+	for (int i = 0; i < 2; ++i) {
+		WCHAR path[MAX_PATHW];
+		if (layers[i]->MakePath(path, aRelativePath, wcslen(aRelativePath) * sizeof(WCHAR))) {
+			failed = true;
+			continue;
+		}
+		layers[i]->SetAttributes(path, FILE_ATTRIBUTE_NORMAL);
+		failed |= !layers[i]->Unlink(path) && GetLastError() != ERROR_FILE_NOT_FOUND;
+	}
+	return failed;
+}
+
+/** Undoes CreateFixture and what the benchmarks wrote: closes the fixture files, forgets the whiteouts and
+ * removes the \UFSBench trees and the stream and sparse files from both roots.
+ * @return false on success, true if something was left.
+ */
+static bool RemoveFixture()
+{
+	if (gLooseData != INVALID_HANDLE_VALUE)
+		gReadLayer->Close(gLooseData);
+	if (gImageData != INVALID_HANDLE_VALUE)
+		gpImageLayer->Close(gImageData);
+	gLooseData = gImageData = INVALID_HANDLE_VALUE;
+	delete gpImageLayer;
+	gpImageLayer = NULL;
+	for (int i = 0; i < 2; ++i)
+		if (gStreamFiles[i] != INVALID_HANDLE_VALUE) {
+			gReadLayer->Close(gStreamFiles[i]);
+			gStreamFiles[i] = INVALID_HANDLE_VALUE;
+		}
+	for (size_t i = 0; i < gWhiteoutProbes.size(); i += 2)
+		UnmarkDeleted(gWhiteoutProbes[i]);
+	gWhiteoutProbes.clear();
+	WCHAR name[64];
+	for (ULONG i = UFS_BENCHMARK_SHADOWED_ENTRIES; i < UFS_BENCHMARK_DIRECTORY_ENTRIES; i += 4) {
+		swprintf(name, L"%s\\R%02u", gDirectory, i);
+		wstring whiteout(name);
+		CleanFileName(whiteout);
+		UnmarkDeleted(whiteout);
+	}
+	bool failed = RemoveFixtureFile(gSparseFile) | RemoveFixtureFile(gStreamFile);
+	WCHAR path[MAX_PATHW];
+	if (!gReadLayer->MakePath(path, L"\\UFSBench", 9 * sizeof(WCHAR)) && gReadLayer->GetAttributes(path) != INVALID_FILE_ATTRIBUTES)
+		failed |= RemoveTree(gReadLayer, L"\\UFSBench");
+	if (!gWriteLayer->MakePath(path, L"\\UFSBench", 9 * sizeof(WCHAR)) && gWriteLayer->GetAttributes(path) != INVALID_FILE_ATTRIBUTES)
+		failed |= RemoveTree(gWriteLayer, L"\\UFSBench");
+	return failed;
+}
+
+struct BenchmarkResult {
+	double mNanoseconds;
+	double mAllocations;
+};
+
+static BenchmarkResult Measure(const Benchmark& aBenchmark, double aNanosecondsPerTick)
+{
+	LARGE_INTEGER start, end;
+	ULONG iterations = 1;
+	/* Grow the batch until it runs long enough for the timer resolution not to matter. */
+	for (;;) {
+		QueryPerformanceCounter(&start);
+		aBenchmark.mpBody(iterations);
+		QueryPerformanceCounter(&end);
+		if ((double)(end.QuadPart - start.QuadPart) * aNanosecondsPerTick >= UFS_BENCHMARK_BATCH_MICROSECONDS * 1000.0 || iterations >= 0x40000000)
+			break;
+		iterations *= 2;
+	}
+	double batches[UFS_BENCHMARK_BATCHES];
+	for (int batch = 0; batch < UFS_BENCHMARK_BATCHES; ++batch) {
+		QueryPerformanceCounter(&start);
+		aBenchmark.mpBody(iterations);
+		QueryPerformanceCounter(&end);
+		batches[batch] = (double)(end.QuadPart - start.QuadPart) * aNanosecondsPerTick / iterations;
+	}
+	sort(batches, batches + UFS_BENCHMARK_BATCHES);
+	BenchmarkResult result = {batches[UFS_BENCHMARK_BATCHES / 2], -1};
+#ifdef _DEBUG
+	gAllocations = 0;
+	_CRT_ALLOC_HOOK previousHook = _CrtSetAllocHook(CountAllocation);
+	aBenchmark.mpBody(iterations);
+	_CrtSetAllocHook(previousHook);
+	result.mAllocations = (double)gAllocations / iterations;
+#endif
+	return result;
+}
+
+/** Reads the results of an earlier run, skipping lines that are not results. */
+static bool ReadBaseline(LPCWSTR aBaselineFile, map<wstring, BenchmarkResult>& aBaseline)
+{
+	FILE* file = _wfopen(aBaselineFile, L"r");
+	if (!file)
+		return true;
+	WCHAR line[256], name[128];
+	BenchmarkResult result;
+	while (fgetws(line, sizeof(line) / sizeof(*line), file))
+		if (line[0] != L'#' && swscanf(line, L"%127s %lf %lf", name, &result.mNanoseconds, &result.mAllocations) == 3)
+			aBaseline[name] = result;
+	fclose(file);
+	return false;
+}
+
+int RunBenchmarks(LPCWSTR aFilter, LPCWSTR aBaselineFile)
+{
+	if (aFilter && !wcscmp(aFilter, L"*"))
+		aFilter = NULL;
+	map<wstring, BenchmarkResult> baseline;
+	if (aBaselineFile && ReadBaseline(aBaselineFile, baseline)) {
+		fwprintf(stderr, L"Cannot read the baseline %s.\n", aBaselineFile);
+		return 2;
+	}
+	LARGE_INTEGER frequency;
+	if (!QueryPerformanceFrequency(&frequency))
+		return 2;
+	if (CreateFixture()) {
+		fwprintf(stderr, L"Cannot create the benchmark fixture under \\UFSBench. Error: %d.\n", GetLastError());
+		RemoveFixture();
+		return 2;
+	}
+	double nanosecondsPerTick = 1e9 / (double)frequency.QuadPart;
+	SetThreadAffinityMask(GetCurrentThread(), 1);
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+	int returnValue = 0;
+	wprintf(L"# benchmark\tns/op\tallocs/op%s\n", aBaselineFile ? L"\tbaseline ns/op\tchange %" : L"");
+	for (size_t i = 0; i < sizeof(gBenchmarks) / sizeof(*gBenchmarks); ++i) {
+		const Benchmark& benchmark = gBenchmarks[i];
+		if (aFilter && !wcsstr(benchmark.mName, aFilter))
+			continue;
+		BenchmarkResult result = Measure(benchmark, nanosecondsPerTick);
+		wprintf(L"%s\t%.2f\t%.2f", benchmark.mName, result.mNanoseconds, result.mAllocations);
+		map<wstring, BenchmarkResult>::const_iterator base = baseline.find(benchmark.mName);
+		if (base != baseline.end()) {
+			double change = base->second.mNanoseconds > 0 ? (result.mNanoseconds / base->second.mNanoseconds - 1) * 100 : 0;
+			bool regressed = change > UFS_BENCHMARK_TOLERANCE ||
+				(base->second.mAllocations >= 0 && result.mAllocations > base->second.mAllocations);
+			wprintf(L"\t%.2f\t%+.1f%s", base->second.mNanoseconds, change, regressed ? L"\tREGRESSION" : L"");
+			if (regressed)
+				returnValue = 1;
+		}
+		wprintf(L"\n");
+	}
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+	if (RemoveFixture())
+		fwprintf(stderr, L"Cannot remove all of the benchmark fixture under \\UFSBench.\n");
+	return returnValue;
+}
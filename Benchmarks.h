@@ -0,0 +1,39 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Micro-benchmarks of the union hot paths.
+ * Every benchmark is calibrated to run for a few milliseconds per batch, then timed over several batches on
+ * one processor at high priority. One line is printed per benchmark:
+ *	name	nanoseconds per operation (median of the batches)	heap allocations per operation
+ * The allocations are counted in debug builds only, release builds print -1 and skip the allocation check.
+ * Saved output serves as the baseline of a later run, which then reports the change of every benchmark and
+ * flags those more than UFS_BENCHMARK_TOLERANCE percent slower, or allocating more, as regressions.
+ * The benchmarks touching storage use a fixture under \UFSBench in the read and the write roots, which is
+ * removed again when they are done.
+ */
+
+#define UFS_BENCHMARK_TOLERANCE 10
+
+/** Runs the benchmarks whose names contain aFilter, all of them when it is NULL or "*".
+ * @return the process exit code: 0, 1 if a benchmark regressed against aBaselineFile, 2 on setup errors.
+ */
+int RunBenchmarks(LPCWSTR aFilter, LPCWSTR aBaselineFile);
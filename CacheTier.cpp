@@ -0,0 +1,409 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "CacheTier.h"
+
+#define UFS_TIER_PREFIX L"ufstier."
+
+bool gCacheTierEnabled;
+
+struct TierFile {
+	TierFile() : mOpens(0), mId(0), mQueued(false), mChanged(false) {
+		ZeroMemory(&mInformation, sizeof(mInformation));
+	}
+	ULONG mOpens; /* Read-only opens since the file was first seen or lost its copy. */
+	ULONG mId; /* Names the copy in the tier, 0 while there is none. */
+	bool mQueued; /* Waiting for or being copied by the promoter. */
+	bool mChanged; /* Changed while queued, the copy is not to be used. */
+	std::list<std::wstring>::iterator mLru; /* The entry of the copy in gLru, while there is one. */
+	BY_HANDLE_FILE_INFORMATION mInformation; /* Of the read root file when it was copied. */
+};
+/* Keyed by the cleaned read root path. */
+class TierFileMap : public std::map<std::wstring, TierFile>
+{
+public:
+	TierFileMap() : std::map<std::wstring, TierFile>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~TierFileMap() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+/* Guarded by gTierFiles.mLock, like everything below it. */
+static TierFileMap gTierFiles;
+static deque<wstring> gPromotions; /* Read root paths, as opened, waiting for the promoter. */
+/* The keys of the files with a copy, the least recently used first, which is evicted first. */
+static list<wstring> gLru;
+/* The ids and sizes of the copies that could not be deleted, still counted in gTierSize and deleted again
+ * before evicting. */
+static deque<pair<ULONG, ULONGLONG> > gUndeleted;
+static ULONG gNextId;
+static ULONGLONG gTierSize, gTierLimit; /* In bytes, gTierSize counts the copies being made. */
+static ULONG64 gHits, gMisses, gPromoted, gRejected, gInvalidated, gEvicted;
+
+static WCHAR gTierDirectory[MAX_PATHW];
+static ULONG gPromoteOpens;
+static HANDLE gPromoteWork; /* Set when gPromotions gets a path. */
+static HANDLE gStopPromoting;
+static HANDLE gPromoterThread;
+
+static inline void TierPath(LPWSTR aPath, ULONG aId)
+{
+	swprintf(aPath, L"%s\\" UFS_TIER_PREFIX L"%08lx", gTierDirectory, aId);
+}
+
+static inline ULONGLONG SizeOf(const BY_HANDLE_FILE_INFORMATION& aInformation)
+{
+	return ((ULONGLONG)aInformation.nFileSizeHigh << 32) | aInformation.nFileSizeLow;
+}
+
+/* Deletes the copy aId of aSize bytes and takes it out of gTierSize, or keeps it in gUndeleted if it cannot be
+ * deleted. Called with the lock held. */
+static void DeleteCopy(ULONG aId, ULONGLONG aSize)
+{
+	WCHAR path[MAX_PATHW];
+	TierPath(path, aId);
+	/* Open handles on the copy share deletion, they keep reading it until they are closed. */
+	if (DeleteFile(path) || GetLastError() == ERROR_FILE_NOT_FOUND) {
+		gTierSize -= aSize;
+		return;
+	}
+	DbgPrint(L"Cannot remove the cache tier copy %s. Error: %d.\n", path, GetLastError());
+	try {
+		gUndeleted.push_back(make_pair(aId, aSize));
+	} catch (...) {
+		// It stays counted.
+	}
+}
+
+/* Removes the copy of aFile, called with the lock held. */
+static void Drop(TierFile& aFile)
+{
+	DeleteCopy(aFile.mId, SizeOf(aFile.mInformation));
+	gLru.erase(aFile.mLru);
+	aFile.mId = 0;
+	aFile.mOpens = 0;
+}
+
+/* Evicts the least recently used copies until aSize more bytes fit in the tier, called with the lock held. */
+static void MakeRoom(ULONGLONG aSize)
+{
+	for (size_t retries = gUndeleted.size(); retries && gTierSize + aSize > gTierLimit; --retries) {
+		pair<ULONG, ULONGLONG> copy = gUndeleted.front();
+		gUndeleted.pop_front();
+		DeleteCopy(copy.first, copy.second);
+	}
+	/* What is left when gLru is empty is being copied. */
+	while (gTierSize + aSize > gTierLimit && !gLru.empty()) {
+		TierFileMap::iterator oldest = gTierFiles.find(gLru.front());
+		DbgPrint(L"Evicting %s from the cache tier.\n", oldest->first.c_str());
+		Drop(oldest->second);
+		++gEvicted;
+	}
+}
+
+/* Copies the read root file aReadFilePath into the tier and checks that it did not change meanwhile. */
+static void Promote(const wstring& aReadFilePath)
+{
+	BY_HANDLE_FILE_INFORMATION information;
+	WIN32_FILE_ATTRIBUTE_DATA after;
+	WCHAR path[MAX_PATHW];
+	ULONG id = 0;
+	bool copied = false;
+	wstring key;
+	try {
+		key = aReadFilePath;
+		CleanFileName(key);
+	} catch (...) {
+		return;
+	}
+	if (gReadLayer->Stat(aReadFilePath.c_str(), &information) && !(information.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+		SizeOf(information) <= gTierLimit / UFS_TIER_LARGEST_SHARE) {
+		{
+			CriticalSectionLock lock(gTierFiles.mLock);
+			MakeRoom(SizeOf(information));
+			gTierSize += SizeOf(information);
+			id = ++gNextId;
+		}
+		TierPath(path, id);
+		/* The copy gets the attributes of the read root file, a read-only one could not be deleted. */
+		copied = gReadLayer->CopyOut(aReadFilePath.c_str(), path, FALSE) && SetFileAttributes(path, FILE_ATTRIBUTE_NORMAL) &&
+			gReadLayer->GetAttributesEx(aReadFilePath.c_str(), &after) &&
+			after.nFileSizeHigh == information.nFileSizeHigh && after.nFileSizeLow == information.nFileSizeLow &&
+			!CompareFileTime(&after.ftLastWriteTime, &information.ftLastWriteTime) &&
+			GetFileAttributesEx(path, GetFileExInfoStandard, &after) &&
+			after.nFileSizeHigh == information.nFileSizeHigh && after.nFileSizeLow == information.nFileSizeLow;
+	}
+	CriticalSectionLock lock(gTierFiles.mLock);
+	TierFileMap::iterator it = gTierFiles.find(key);
+	bool changed = false;
+	if (it != gTierFiles.end()) {
+		changed = it->second.mChanged;
+		it->second.mQueued = it->second.mChanged = false;
+	}
+	if (copied && !changed && it != gTierFiles.end() && !it->second.mId) {
+		try {
+			it->second.mLru = gLru.insert(gLru.end(), key);
+			it->second.mId = id;
+			it->second.mInformation = information;
+			++gPromoted;
+			DbgPrint(L"Promoted %s to the cache tier.\n", aReadFilePath.c_str());
+			return;
+		} catch (...) {
+		}
+	}
+	/* Too large, gone, or changed while being copied: it is counted again from scratch. */
+	if (id)
+		DeleteCopy(id, SizeOf(information));
+	if (it != gTierFiles.end())
+		it->second.mOpens = 0;
+	++gRejected;
+}
+
+static DWORD WINAPI PromoterThread(LPVOID)
+{
+	HANDLE events[2] = {gStopPromoting, gPromoteWork};
+	while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+		for (;;) {
+			wstring path;
+			{
+				CriticalSectionLock lock(gTierFiles.mLock);
+				if (gPromotions.empty())
+					break;
+				try {
+					path = gPromotions.front();
+				} catch (...) {
+					break;
+				}
+				gPromotions.pop_front();
+			}
+			if (WaitForSingleObject(gStopPromoting, 0) == WAIT_OBJECT_0)
+				return 0;
+			Promote(path);
+		}
+	return 0;
+}
+
+HANDLE OpenFromCacheTier(LPCWSTR aReadFilePath, DWORD aAccessMode, DWORD aShareMode, DWORD aFlagsAndAttributes)
+{
+	wstring key;
+	BY_HANDLE_FILE_INFORMATION information;
+	ULONG id;
+	try {
+		key = aReadFilePath;
+		CleanFileName(key);
+		CriticalSectionLock lock(gTierFiles.mLock);
+		TierFileMap::iterator it = gTierFiles.find(key);
+		if (it == gTierFiles.end()) {
+			if (gTierFiles.size() >= UFS_TIER_CANDIDATES) {
+				/* Forget the counts of the files without a copy, the hot ones are soon counted again. */
+				for (TierFileMap::iterator candidate = gTierFiles.begin(); candidate != gTierFiles.end();)
+					if (candidate->second.mId || candidate->second.mQueued)
+						++candidate;
+					else
+						gTierFiles.erase(candidate++);
+			}
+			it = gTierFiles.insert(TierFileMap::value_type(key, TierFile())).first;
+		}
+		if (!it->second.mId) {
+			++gMisses;
+			if (++it->second.mOpens >= gPromoteOpens && !it->second.mQueued) {
+				gPromotions.push_back(aReadFilePath);
+				it->second.mQueued = true;
+				SetEvent(gPromoteWork);
+			}
+			return INVALID_HANDLE_VALUE;
+		}
+		id = it->second.mId;
+		information = it->second.mInformation;
+	} catch (...) {
+		return INVALID_HANDLE_VALUE;
+	}
+	/* The copy is only good while the read root file keeps the size and time it had when copied. The watcher
+	 * hears of changes some time after they are made, it does not spare this check. */
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	bool valid = gReadLayer->GetAttributesEx(aReadFilePath, &data) &&
+		data.nFileSizeHigh == information.nFileSizeHigh && data.nFileSizeLow == information.nFileSizeLow &&
+		!CompareFileTime(&data.ftLastWriteTime, &information.ftLastWriteTime);
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	if (valid) {
+		WCHAR path[MAX_PATHW];
+		TierPath(path, id);
+		handle = CreateFile(path, aAccessMode, aShareMode | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, aFlagsAndAttributes, NULL);
+	}
+	CriticalSectionLock lock(gTierFiles.mLock);
+	TierFileMap::iterator it = gTierFiles.find(key);
+	if (handle == INVALID_HANDLE_VALUE) {
+		++gMisses;
+		if (!valid && it != gTierFiles.end() && it->second.mId == id) {
+			DbgPrint(L"%s changed, dropping its cache tier copy.\n", aReadFilePath);
+			Drop(it->second);
+			++gInvalidated;
+		}
+		return INVALID_HANDLE_VALUE;
+	}
+	++gHits;
+	if (it != gTierFiles.end() && it->second.mId == id)
+		gLru.splice(gLru.end(), gLru, it->second.mLru);
+	return handle;
+}
+
+bool GetCacheTierInformation(LPCWSTR aReadFilePath, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	try {
+		wstring key = aReadFilePath;
+		CleanFileName(key);
+		CriticalSectionLock lock(gTierFiles.mLock);
+		TierFileMap::iterator it = gTierFiles.find(key);
+		if (it == gTierFiles.end() || !it->second.mId)
+			return true;
+		*apInformation = it->second.mInformation;
+		return false;
+	} catch (...) {
+		return true;
+	}
+}
+
+/* Drops the copy of aFile, or marks the copy being made as stale, called with the lock held. */
+static void Invalidate(TierFile& aFile)
+{
+	if (aFile.mId) {
+		Drop(aFile);
+		++gInvalidated;
+	} else if (aFile.mQueued)
+		aFile.mChanged = true;
+}
+
+void InvalidateCacheTier(LPCWSTR aReadFilePath)
+{
+	try {
+		wstring key = aReadFilePath;
+		CleanFileName(key);
+		CriticalSectionLock lock(gTierFiles.mLock);
+		TierFileMap::iterator it = gTierFiles.find(key);
+		if (it != gTierFiles.end())
+			Invalidate(it->second);
+		key += L'\\';
+		for (it = gTierFiles.lower_bound(key); it != gTierFiles.end() && !it->first.compare(0, key.size(), key); ++it)
+			Invalidate(it->second);
+	} catch (...) {
+		ClearCacheTier();
+	}
+}
+
+void ClearCacheTier()
+{
+	CriticalSectionLock lock(gTierFiles.mLock);
+	for (TierFileMap::iterator it = gTierFiles.begin(); it != gTierFiles.end(); ++it)
+		Invalidate(it->second);
+}
+
+/* Removes the copies found in the tier directory, the ids of those left are not given out again. */
+static void RemoveCopies()
+{
+	WCHAR path[MAX_PATHW];
+	swprintf(path, L"%s\\" UFS_TIER_PREFIX L"*", gTierDirectory);
+	WIN32_FIND_DATAW findData;
+	HANDLE find = FindFirstFile(path, &findData);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		swprintf(path, L"%s\\%s", gTierDirectory, findData.cFileName);
+		SetFileAttributes(path, FILE_ATTRIBUTE_NORMAL);
+		if (!DeleteFile(path)) {
+			ULONG id = wcstoul(findData.cFileName + wcslen(UFS_TIER_PREFIX), NULL, 16);
+			if (id > gNextId)
+				gNextId = id;
+		}
+	} while (FindNextFile(find, &findData));
+	FindClose(find);
+}
+
+bool CacheTierStart(LPCWSTR aDirectory, ULONG aPromoteOpens, ULONG aMegabytes)
+{
+	size_t length = wcslen(aDirectory);
+	if (length >= MAX_PATHW - UFS_COPY_NAME_LENGTH) {
+		SetLastError(ERROR_FILENAME_EXCED_RANGE);
+		return true;
+	}
+	wcscpy(gTierDirectory, aDirectory);
+	if (length && (gTierDirectory[length-1] == L'\\' || gTierDirectory[length-1] == L'/'))
+		gTierDirectory[length-1] = 0;
+	DWORD attributes = GetFileAttributes(gTierDirectory);
+	if (attributes == INVALID_FILE_ATTRIBUTES)
+		return true;
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		SetLastError(ERROR_DIRECTORY);
+		return true;
+	}
+	RemoveCopies();
+	gPromoteOpens = aPromoteOpens ? aPromoteOpens : UFS_TIER_PROMOTE_OPENS;
+	gTierLimit = (ULONGLONG)(aMegabytes ? aMegabytes : UFS_TIER_MEGABYTES) * 1024 * 1024;
+	if (!(gPromoteWork = CreateEvent(NULL, FALSE, FALSE, NULL)))
+		return true;
+	if (!(gStopPromoting = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+		CloseHandle(gPromoteWork);
+		return true;
+	}
+	if (!(gPromoterThread = CreateThread(NULL, 0, PromoterThread, NULL, 0, NULL))) {
+		CloseHandle(gStopPromoting);
+		CloseHandle(gPromoteWork);
+		return true;
+	}
+	DbgPrint(L"Cache tier in %s, promoting after %lu opens, %I64u MB.\n", gTierDirectory, gPromoteOpens, gTierLimit / (1024 * 1024));
+	gCacheTierEnabled = true;
+	return false;
+}
+
+void CacheTierStop()
+{
+	if (!gCacheTierEnabled)
+		return;
+	gCacheTierEnabled = false;
+	SetEvent(gStopPromoting);
+	WaitForSingleObject(gPromoterThread, INFINITE);
+	CloseHandle(gPromoterThread);
+	CloseHandle(gStopPromoting);
+	CloseHandle(gPromoteWork);
+	CriticalSectionLock lock(gTierFiles.mLock);
+	gTierFiles.clear();
+	gLru.clear();
+	gUndeleted.clear();
+	gPromotions.clear();
+	RemoveCopies();
+	if (!gHits && !gMisses)
+		return;
+	fwprintf(stderr, L"Cache tier: %I64u hits, %I64u misses, %.1f%% hit ratio, %I64u MB of %I64u MB held\n",
+		gHits, gMisses, 100.0 * (double)(LONGLONG)gHits / (double)(LONGLONG)(gHits + gMisses),
+		gTierSize / (1024 * 1024), gTierLimit / (1024 * 1024));
+	fwprintf(stderr, L"	%I64u promoted, %I64u rejected, %I64u invalidated, %I64u evicted\n",
+		gPromoted, gRejected, gInvalidated, gEvicted);
+}
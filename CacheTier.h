@@ -0,0 +1,69 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/** Cache tier: copies of hot read root files on fast local storage.
+ * A read root on a slow network share is read over the network on every open. The tier counts the read-only
+ * opens of each read root file, and once a file reaches the promotion threshold a background thread copies
+ * it into the tier directory. Later read-only opens get a handle on the copy while the read root file keeps
+ * the size and last write time it had when copied, and go back to the read root otherwise. The copies are
+ * only a cache: they are never written, writes still copy the read root file up to the write root. The
+ * least recently used copies are evicted to keep the tier under its size limit, and the tier is emptied on
+ * mount and unmount. While the read root is watched, see ChangeWatcher.h, the copies are also dropped when
+ * their file changes, so that they do not take room in the tier until their next open.
+ */
+
+/* A file larger than this share of the tier is never promoted. */
+#define UFS_TIER_LARGEST_SHARE 4
+/* Read root files counted at most, the counts of the files without a copy restart beyond it. */
+#define UFS_TIER_CANDIDATES 16384
+#define UFS_TIER_PROMOTE_OPENS 3
+#define UFS_TIER_MEGABYTES 1024
+
+/* Whether the context of an open file says it was opened from the tier. */
+#define IsInCacheTier(context) ((context) & (((ULONG64)UFS_CACHE_TIER) << 32))
+
+extern bool gCacheTierEnabled;
+
+/** Empties the tier directory aDirectory of earlier copies and starts the thread promoting the read root
+ * files opened read-only aPromoteOpens times, keeping at most aMegabytes in the tier.
+ * @return false on success.
+ */
+bool CacheTierStart(LPCWSTR aDirectory, ULONG aPromoteOpens, ULONG aMegabytes);
+/** Stops the promotions, removes the copies and prints the hit ratio and the promotion counts. */
+void CacheTierStop();
+
+/** Opens the copy of the read root file aReadFilePath for a read-only open, or counts the open toward its
+ * promotion.
+ * @return The handle, INVALID_HANDLE_VALUE when the read root file is to be opened instead.
+ */
+HANDLE OpenFromCacheTier(LPCWSTR aReadFilePath, DWORD aAccessMode, DWORD aShareMode, DWORD aFlagsAndAttributes);
+/** Stores in apInformation what the read root file aReadFilePath looked like when copied into the tier, so
+ * that handles on the copy report the read root file rather than the copy.
+ * @return false on success, true if the file has no copy any more.
+ */
+bool GetCacheTierInformation(LPCWSTR aReadFilePath, LPBY_HANDLE_FILE_INFORMATION apInformation);
+
+/** Drops the copy of the read root file aReadFilePath, or of the files under the directory aReadFilePath, which
+ * changed. A copy being made is dropped once made.
+ */
+void InvalidateCacheTier(LPCWSTR aReadFilePath);
+/** Drops every copy, after changes to the read root went unseen. */
+void ClearCacheTier();
@@ -0,0 +1,156 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "UnionEngine.h"
+#include "CacheTier.h"
+#include "ChangeWatcher.h"
+
+static HANDLE gWatchedRoot = INVALID_HANDLE_VALUE;
+static HANDLE gChangesReady;
+static HANDLE gStopWatching;
+static HANDLE gWatcherThread;
+static DWORD gChanges[UFS_WATCH_BUFFER_SIZE / sizeof(DWORD)]; /* DWORD aligned, as the records must be. */
+static ULONG64 gChangeCount, gOverflowCount;
+
+/* The changes are unknown, drop everything. aChanged tells whether there were some. */
+static void InvalidateAll(bool aChanged)
+{
+	if (aChanged)
+		gReadLayer->RootChanged();
+	InvalidateUnionFileInformation();
+	InvalidateDirectoryListings(NULL);
+	if (gCacheTierEnabled)
+		ClearCacheTier();
+}
+
+static void Invalidate(const FILE_NOTIFY_INFORMATION& aChange)
+{
+	WCHAR relativePath[MAX_PATHW], readFilePath[MAX_PATHW];
+	size_t length = aChange.FileNameLength / sizeof(WCHAR);
+	if (length + 2 > MAX_PATHW) {
+		InvalidateAll(true);
+		return;
+	}
+	relativePath[0] = L'\\';
+	memcpy(relativePath + 1, aChange.FileName, aChange.FileNameLength);
+	relativePath[length + 1] = 0;
+	DbgPrint(L"Read root change %d on %s.\n", aChange.Action, relativePath);
+	++gChangeCount;
+	if (gReadLayer->RootChanged()) {
+		InvalidateUnionFileInformation(); // Everything primed or listed from the snapshot.
+		InvalidateDirectoryListings(NULL);
+	} else {
+		InvalidateReadRootChange(relativePath);
+		InvalidateDirectoryListings(relativePath);
+	}
+	if (gCacheTierEnabled) {
+		if (gReadLayer->MakePath(readFilePath, relativePath, (length + 1) * sizeof(WCHAR)))
+			ClearCacheTier();
+		else
+			InvalidateCacheTier(readFilePath);
+	}
+}
+
+static DWORD WINAPI WatcherThread(LPVOID)
+{
+	OVERLAPPED overlapped;
+	HANDLE events[2] = {gStopWatching, gChangesReady};
+	for (;;) {
+		ZeroMemory(&overlapped, sizeof(overlapped));
+		overlapped.hEvent = gChangesReady;
+		if (!ReadDirectoryChangesW(gWatchedRoot, gChanges, sizeof(gChanges), TRUE, UFS_WATCH_FILTER, NULL, &overlapped, NULL)) {
+			/* From now on the caches ask the read root again. */
+			DbgPrint(L"Cannot watch the read root any more. Error: %d.\n", GetLastError());
+			InvalidateAll(false);
+			return 0;
+		}
+		DWORD length;
+		if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+			CancelIo(gWatchedRoot);
+			GetOverlappedResult(gWatchedRoot, &overlapped, &length, TRUE);
+			return 0;
+		}
+		/* ERROR_NOTIFY_ENUM_DIR or no record: the system buffer overflowed. */
+		if (!GetOverlappedResult(gWatchedRoot, &overlapped, &length, FALSE) || !length) {
+			DbgPrint(L"Read root changes lost. Error: %d.\n", length ? GetLastError() : ERROR_NOTIFY_ENUM_DIR);
+			++gOverflowCount;
+			InvalidateAll(true);
+			continue;
+		}
+		for (LPBYTE record = (LPBYTE)gChanges;; ) {
+			const FILE_NOTIFY_INFORMATION& change = *(FILE_NOTIFY_INFORMATION*)record;
+			Invalidate(change);
+			if (!change.NextEntryOffset)
+				break;
+			record += change.NextEntryOffset;
+		}
+	}
+}
+
+bool ChangeWatcherStart(LPCWSTR aRoot, size_t aRootLength)
+{
+	WCHAR root[MAX_PATHW];
+	if (aRootLength + sizeof(WCHAR) > sizeof(root)) {
+		SetLastError(ERROR_FILENAME_EXCED_RANGE);
+		return true;
+	}
+	memcpy(root, aRoot, aRootLength);
+	root[aRootLength / sizeof(WCHAR)] = 0;
+	gWatchedRoot = CreateFile(root, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+	if (gWatchedRoot == INVALID_HANDLE_VALUE)
+		return true;
+	if (!(gChangesReady = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+		CloseHandle(gWatchedRoot);
+		gWatchedRoot = INVALID_HANDLE_VALUE;
+		return true;
+	}
+	if (!(gStopWatching = CreateEvent(NULL, TRUE, FALSE, NULL)) ||
+		!(gWatcherThread = CreateThread(NULL, 0, WatcherThread, NULL, 0, NULL))) {
+		DWORD error = GetLastError();
+		if (gStopWatching)
+			CloseHandle(gStopWatching);
+		CloseHandle(gChangesReady);
+		CloseHandle(gWatchedRoot);
+		gWatchedRoot = INVALID_HANDLE_VALUE;
+		SetLastError(error);
+		return true;
+	}
+	return false;
+}
+
+void ChangeWatcherStop()
+{
+	if (gWatchedRoot == INVALID_HANDLE_VALUE)
+		return;
+	SetEvent(gStopWatching);
+	WaitForSingleObject(gWatcherThread, INFINITE);
+	CloseHandle(gWatcherThread);
+	CloseHandle(gStopWatching);
+	CloseHandle(gChangesReady);
+	CloseHandle(gWatchedRoot);
+	gWatchedRoot = INVALID_HANDLE_VALUE;
+	if (gChangeCount || gOverflowCount)
+		fwprintf(stderr, L"Read root changes: %I64u seen, %I64u overflows\n", gChangeCount, gOverflowCount);
+}
@@ -0,0 +1,44 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/** Read root change detection.
+ * Whoever updates the read root under a live mount does it behind the back of the union, and the caches fed
+ * from the read root would go on answering from what it held before. A thread keeps a ReadDirectoryChangesW
+ * request outstanding on the whole read root tree and turns every change it reports into the invalidation
+ * of that path: the information primed by listings, see InvalidateReadRootChange, the listings kept between
+ * pages, see InvalidateDirectoryListings, and the cache tier copies, see InvalidateCacheTier. When the system loses track of the changes, its buffer having overflowed,
+ * everything is invalidated instead. The changes are reported some time after they are made, so the caches
+ * keep the checks they make on their own. A read layer answering from a snapshot of the read root, an index,
+ * stops using it at the first change, see UFSLayer::RootChanged. The write root belongs to the mount and is
+ * not watched. Watching is enabled with /3.
+ */
+
+/* Bytes of changes the system keeps between two requests, requests over the network fail beyond 64 KB. */
+#define UFS_WATCH_BUFFER_SIZE 65536
+#define UFS_WATCH_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_ATTRIBUTES | \
+	FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION)
+
+/** Starts watching the read root directory aRoot, aRootLength bytes long.
+ * @return false on success.
+ */
+bool ChangeWatcherStart(LPCWSTR aRoot, size_t aRootLength);
+/** Stops watching and prints how many changes and overflows were seen. */
+void ChangeWatcherStop();
@@ -0,0 +1,268 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <string.h>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "DirectIo.h"
+
+/* Writes to the same file are serialized, a lock per hash of the file identity rather than of the handle,
+ * since the partial sectors at their edges are read, patched and written back whole, and the end of file is
+ * put back from a snapshot of the size: two opens of the file must not interleave there. */
+#define UFS_DIRECT_WRITE_LOCKS 16
+
+bool gDirectIoEnabled;
+static vector<NamePattern> gDirectPatterns;
+static ULONG64 gDirectMinimumSize;
+static DWORD gAlignment = UFS_DIRECT_ALIGNMENT;
+static CRITICAL_SECTION gPoolLock;
+static BYTE* gFreeBuffers[UFS_DIRECT_POOL_BUFFERS];
+static ULONG gFreeBufferCount;
+static CRITICAL_SECTION gWriteLocks[UFS_DIRECT_WRITE_LOCKS];
+
+static BYTE* AcquireBuffer()
+{
+	{
+		CriticalSectionLock lock(gPoolLock);
+		if (gFreeBufferCount)
+			return gFreeBuffers[--gFreeBufferCount];
+	}
+	/* Whole pages, so aligned for any sector size up to the page size. */
+	return (BYTE*)VirtualAlloc(NULL, UFS_DIRECT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static void ReleaseBuffer(BYTE* apBuffer)
+{
+	{
+		CriticalSectionLock lock(gPoolLock);
+		if (gFreeBufferCount < UFS_DIRECT_POOL_BUFFERS) {
+			gFreeBuffers[gFreeBufferCount++] = apBuffer;
+			return;
+		}
+	}
+	VirtualFree(apBuffer, 0, MEM_RELEASE);
+}
+
+/** Raises gAlignment to the sector size of the volume holding aPath. */
+static void AlignFor(LPCWSTR aPath)
+{
+	WCHAR volume[MAX_PATHW];
+	DWORD sectorsPerCluster, bytesPerSector, freeClusters, clusters;
+	if (GetVolumePathName(aPath, volume, MAX_PATHW) &&
+		GetDiskFreeSpace(volume, &sectorsPerCluster, &bytesPerSector, &freeClusters, &clusters) && bytesPerSector > gAlignment)
+		gAlignment = bytesPerSector;
+}
+
+bool DirectIoStart(LPCWSTR aPatterns, ULONG aMinimumMegabytes)
+{
+	try {
+		for (LPCWSTR pattern = aPatterns; pattern && *pattern; ) {
+			LPCWSTR end = wcschr(pattern, L';');
+			wstring text(pattern, end ? end - pattern : wcslen(pattern));
+			if (!text.empty()) {
+				gDirectPatterns.push_back(NamePattern());
+				gDirectPatterns.back().Compile(text.c_str());
+			}
+			pattern = end ? end + 1 : NULL;
+		}
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return true;
+	}
+	gDirectMinimumSize = (ULONG64)aMinimumMegabytes * 1024 * 1024;
+	AlignFor(gReadLayer->Root());
+	AlignFor(gWriteLayer->Root());
+	if (gAlignment > UFS_DIRECT_BUFFER_SIZE) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return true;
+	}
+	InitializeCriticalSection(&gPoolLock);
+	for (int i = 0; i < UFS_DIRECT_WRITE_LOCKS; ++i)
+		InitializeCriticalSection(&gWriteLocks[i]);
+	for (; gFreeBufferCount < UFS_DIRECT_POOL_BUFFERS; ++gFreeBufferCount)
+		if (!(gFreeBuffers[gFreeBufferCount] = (BYTE*)VirtualAlloc(NULL, UFS_DIRECT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE))) {
+			DirectIoStop();
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			return true;
+		}
+	gDirectIoEnabled = true;
+	return false;
+}
+
+void DirectIoStop()
+{
+	if (!gDirectIoEnabled && !gFreeBufferCount)
+		return;
+	gDirectIoEnabled = false;
+	while (gFreeBufferCount)
+		VirtualFree(gFreeBuffers[--gFreeBufferCount], 0, MEM_RELEASE);
+	for (int i = 0; i < UFS_DIRECT_WRITE_LOCKS; ++i)
+		DeleteCriticalSection(&gWriteLocks[i]);
+	DeleteCriticalSection(&gPoolLock);
+}
+
+bool WantsDirectIo(LPCWSTR aFileName, UFSLayer* apLayer, LPCWSTR aFilePath)
+{
+	LPCWSTR name = wcsrchr(aFileName, L'\\');
+	name = name ? name + 1 : aFileName;
+	for (vector<NamePattern>::const_iterator it = gDirectPatterns.begin(); it != gDirectPatterns.end(); ++it)
+		if (it->Match(name))
+			return true;
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	return gDirectMinimumSize && apLayer->GetAttributesEx(aFilePath, &data) &&
+		(((ULONG64)data.nFileSizeHigh << 32) | data.nFileSizeLow) >= gDirectMinimumSize;
+}
+
+bool DirectRead(UFSLayer* apLayer, HANDLE aFile, LPVOID aBuffer, DWORD aLength, LPDWORD apReadLength, LONGLONG aOffset)
+{
+	*apReadLength = 0;
+	DWORD mask = gAlignment - 1;
+	if (!((ULONG_PTR)aBuffer & mask) && !(aOffset & mask) && !(aLength & mask))
+		return !apLayer->Read(aFile, aBuffer, aLength, apReadLength, aOffset);
+	BYTE* buffer = AcquireBuffer();
+	if (!buffer) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return true;
+	}
+	BYTE* dest = (BYTE*)aBuffer;
+	bool failed = false;
+	while (aLength) {
+		LONGLONG start = aOffset & ~(LONGLONG)mask;
+		DWORD skip = (DWORD)(aOffset - start);
+		DWORD span = (skip + aLength + mask) & ~mask;
+		if (span > UFS_DIRECT_BUFFER_SIZE)
+			span = UFS_DIRECT_BUFFER_SIZE;
+		DWORD got;
+		if (!apLayer->Read(aFile, buffer, span, &got, start)) {
+			failed = true;
+			break;
+		}
+		if (got <= skip)
+			break;
+		DWORD length = got - skip < aLength ? got - skip : aLength;
+		memcpy(dest, buffer + skip, length);
+		dest += length;
+		aOffset += length;
+		aLength -= length;
+		*apReadLength += length;
+		if (got < span)
+			break; // The end of the file.
+	}
+	DWORD error = GetLastError();
+	ReleaseBuffer(buffer);
+	SetLastError(error);
+	return failed;
+}
+
+/** Reads the sector at aOffset to apDest, zero filled past aSize, the end of the file. */
+static bool ReadSector(HANDLE aFile, BYTE* apDest, LONGLONG aOffset, LONGLONG aSize)
+{
+	DWORD got = 0;
+	if (aOffset < aSize) {
+		OVERLAPPED overlapped;
+		ZeroMemory(&overlapped, sizeof(overlapped));
+		overlapped.Offset = (DWORD)aOffset;
+		overlapped.OffsetHigh = (DWORD)(aOffset >> 32);
+		if (!ReadFile(aFile, apDest, gAlignment, &got, &overlapped))
+			return true;
+	}
+	memset(apDest + got, 0, gAlignment - got);
+	return false;
+}
+
+bool DirectWrite(HANDLE aFile, LPCVOID aBuffer, DWORD aLength, LPDWORD apWritten, LONGLONG aOffset, bool aAppend)
+{
+	*apWritten = 0;
+	DWORD mask = gAlignment - 1;
+	FileKey key;
+	if (GetFileKey(aFile, key))
+		return true;
+	/* Aligned writes lock too: the partial sectors another write reads back could hold old data over them. */
+	CriticalSectionLock lock(gWriteLocks[(key.first ^ (DWORD)key.second ^ (DWORD)(key.second >> 32)) % UFS_DIRECT_WRITE_LOCKS]);
+	if (!aAppend && !((ULONG_PTR)aBuffer & mask) && !(aOffset & mask) && !(aLength & mask)) {
+		/* Whole sectors from memory the handle can take: no bounce buffer and no end of file to put back. */
+		OVERLAPPED overlapped;
+		ZeroMemory(&overlapped, sizeof(overlapped));
+		overlapped.Offset = (DWORD)aOffset;
+		overlapped.OffsetHigh = (DWORD)(aOffset >> 32);
+		if (!WriteFile(aFile, aBuffer, aLength, apWritten, &overlapped))
+			return true;
+		if (*apWritten != aLength) {
+			SetLastError(ERROR_DISK_FULL);
+			return true;
+		}
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(aFile, &fileSize))
+		return true;
+	LONGLONG size = fileSize.QuadPart;
+	if (aAppend)
+		aOffset = size;
+	BYTE* buffer = AcquireBuffer();
+	if (!buffer) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return true;
+	}
+	const BYTE* source = (const BYTE*)aBuffer;
+	LONGLONG position = aOffset, end = aOffset + aLength, writtenEnd = 0;
+	bool failed = false;
+	while (!failed && position < end) {
+		LONGLONG start = position & ~(LONGLONG)mask;
+		DWORD skip = (DWORD)(position - start);
+		DWORD length = end - position < UFS_DIRECT_BUFFER_SIZE - skip ? (DWORD)(end - position) : UFS_DIRECT_BUFFER_SIZE - skip;
+		DWORD span = (skip + length + mask) & ~mask;
+		/* The partial sectors at the edges keep the bytes around the written ones. */
+		if ((skip && ReadSector(aFile, buffer, start, size)) ||
+			(((skip + length) & mask) && (!skip || span > gAlignment) && ReadSector(aFile, buffer + span - gAlignment, start + span - gAlignment, size))) {
+			failed = true;
+			break;
+		}
+		memcpy(buffer + skip, source, length);
+		OVERLAPPED overlapped;
+		ZeroMemory(&overlapped, sizeof(overlapped));
+		overlapped.Offset = (DWORD)start;
+		overlapped.OffsetHigh = (DWORD)(start >> 32);
+		DWORD written;
+		if (!WriteFile(aFile, buffer, span, &written, &overlapped) || written != span) {
+			failed = true;
+			break;
+		}
+		writtenEnd = start + span;
+		source += length;
+		position += length;
+		*apWritten += length;
+	}
+	DWORD error = GetLastError();
+	ReleaseBuffer(buffer);
+	/* Whole sectors went past the end of the data, put it back. */
+	LARGE_INTEGER newSize;
+	newSize.QuadPart = aOffset + *apWritten > size ? aOffset + *apWritten : size;
+	if (writtenEnd > newSize.QuadPart && (!SetFilePointerEx(aFile, newSize, NULL, FILE_BEGIN) || !SetEndOfFile(aFile)) && !failed) {
+		failed = true;
+		error = GetLastError();
+	}
+	SetLastError(error);
+	return failed;
+}
@@ -0,0 +1,60 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Direct I/O: streaming large files without the system cache.
+ * Files whose names match one of the patterns, or at least as large as the threshold when opened, are
+ * opened with FILE_FLAG_NO_BUFFERING, so streaming them through the mount does not evict the cached data of
+ * every other file. Unbuffered transfers must start, end and sit in memory on sector boundaries, which the
+ * Dokan buffers and offsets need not do: DirectRead and DirectWrite go through aligned bounce buffers from a
+ * pool, a write first reads the partial sectors at its edges, and the end of file that whole sector writes
+ * move past is put back.
+ */
+
+#include "UFSLayer.h"
+
+#define UFS_DIRECT_BUFFER_SIZE (1024 * 1024)
+/* Buffers kept allocated, more are allocated while more transfers run at once. */
+#define UFS_DIRECT_POOL_BUFFERS 8
+/* Transfers are aligned on this or the larger sector size of the roots. */
+#define UFS_DIRECT_ALIGNMENT 4096
+
+/* Whether the context of an open file says it was opened unbuffered. */
+#define IsDirectIo(context) ((context) & (((ULONG64)FILE_FLAG_NO_BUFFERING) << 32))
+
+extern bool gDirectIoEnabled;
+
+/** Fills the buffer pool and enables direct I/O for the files whose names match one of the ; separated
+ * patterns aPatterns, NULL for none, or which hold at least aMinimumMegabytes, 0 for no threshold.
+ * @return false on success.
+ */
+bool DirectIoStart(LPCWSTR aPatterns, ULONG aMinimumMegabytes);
+void DirectIoStop();
+
+/** Whether the file aFileName, found at aFilePath in apLayer, is to be opened unbuffered. */
+bool WantsDirectIo(LPCWSTR aFileName, UFSLayer* apLayer, LPCWSTR aFilePath);
+
+/** Like UFSLayer::Read and WriteFile at aOffset, or at the end of the file if aAppend, for the unbuffered
+ * handle aFile.
+ * @return false on success, GetLastError tells why it failed.
+ */
+bool DirectRead(UFSLayer* apLayer, HANDLE aFile, LPVOID aBuffer, DWORD aLength, LPDWORD apReadLength, LONGLONG aOffset);
+bool DirectWrite(HANDLE aFile, LPCVOID aBuffer, DWORD aLength, LPDWORD apWritten, LONGLONG aOffset, bool aAppend);
@@ -0,0 +1,167 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "LatencyHistogram.h"
+#include "FlushCoordinator.h"
+
+bool gGroupFlushEnabled;
+
+struct FlushBatch {
+	vector<HANDLE> mFiles;
+	HANDLE mDone; /* Set when the batch is durable. */
+	DWORD mError;
+	LONG mWaiters; /* The last one to leave frees the batch. */
+};
+
+static CRITICAL_SECTION gFlushLock;
+static FlushBatch* gOpenBatch; /* The batch new requests join, NULL if none. */
+static bool gFlushing; /* A batch is being flushed. */
+static HANDLE gFlushIdle; /* Set while gFlushing is false. */
+static HANDLE gVolume = INVALID_HANDLE_VALUE;
+/* Guarded by gFlushLock. */
+static ULONG64 gBatchCount;
+static LatencyHistogram gFlushLatency; /* In nanoseconds. */
+static double gNanosecondsPerTick;
+
+static void Run(FlushBatch& aBatch)
+{
+	aBatch.mError = 0;
+	sort(aBatch.mFiles.begin(), aBatch.mFiles.end());
+	vector<HANDLE>::iterator end = unique(aBatch.mFiles.begin(), aBatch.mFiles.end());
+	/* A lone file costs less to flush than the whole volume. */
+	if (gVolume != INVALID_HANDLE_VALUE && end - aBatch.mFiles.begin() > 1) {
+		if (!FlushFileBuffers(gVolume))
+			aBatch.mError = GetLastError();
+		return;
+	}
+	for (vector<HANDLE>::iterator it = aBatch.mFiles.begin(); it != end; ++it)
+		if (!FlushFileBuffers(*it) && !aBatch.mError)
+			aBatch.mError = GetLastError();
+}
+
+bool GroupFlush(HANDLE aFile)
+{
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	FlushBatch* batch;
+	bool leader;
+	{
+		CriticalSectionLock lock(gFlushLock);
+		try {
+			if (!gOpenBatch) {
+				gOpenBatch = new FlushBatch;
+				gOpenBatch->mWaiters = 0;
+				if (!(gOpenBatch->mDone = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+					delete gOpenBatch;
+					gOpenBatch = NULL;
+					return !FlushFileBuffers(aFile);
+				}
+			}
+			gOpenBatch->mFiles.push_back(aFile);
+		} catch (...) {
+			return !FlushFileBuffers(aFile);
+		}
+		batch = gOpenBatch;
+		leader = !batch->mWaiters++;
+	}
+	if (leader) {
+		/* Gather requests while the running batch ends, then close this one and run it. */
+		for (;;) {
+			WaitForSingleObject(gFlushIdle, INFINITE);
+			CriticalSectionLock lock(gFlushLock);
+			if (!gFlushing) {
+				gFlushing = true;
+				ResetEvent(gFlushIdle);
+				gOpenBatch = NULL;
+				++gBatchCount;
+				break;
+			}
+		}
+		Run(*batch);
+		{
+			CriticalSectionLock lock(gFlushLock);
+			gFlushing = false;
+			SetEvent(gFlushIdle);
+		}
+		SetEvent(batch->mDone);
+	} else
+		WaitForSingleObject(batch->mDone, INFINITE);
+	DWORD error = batch->mError;
+	QueryPerformanceCounter(&end);
+	{
+		CriticalSectionLock lock(gFlushLock);
+		gFlushLatency.Record((ULONG64)((double)(end.QuadPart - start.QuadPart) * gNanosecondsPerTick));
+		if (!--batch->mWaiters) {
+			CloseHandle(batch->mDone);
+			delete batch;
+		}
+	}
+	if (error) {
+		SetLastError(error);
+		return true;
+	}
+	return false;
+}
+
+bool FlushCoordinatorStart(LPCWSTR aWriteRoot)
+{
+	LARGE_INTEGER frequency;
+	if (!QueryPerformanceFrequency(&frequency))
+		return true;
+	gNanosecondsPerTick = 1e9 / (double)frequency.QuadPart;
+	if (!(gFlushIdle = CreateEvent(NULL, TRUE, TRUE, NULL)))
+		return true;
+	InitializeCriticalSection(&gFlushLock);
+	/* \\.\C: for a write root on C:\, flushing it flushes every file of the volume. */
+	WCHAR volumePath[MAX_PATHW], volume[MAX_PATHW];
+	if (GetVolumePathName(aWriteRoot, volumePath, MAX_PATHW) && volumePath[0] && volumePath[1] == L':') {
+		swprintf(volume, L"\\\\.\\%c:", volumePath[0]);
+		gVolume = CreateFile(volume, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	}
+	DbgPrint(L"Group flushes %s.\n", gVolume != INVALID_HANDLE_VALUE ? L"flush the volume" : L"flush their files");
+	gGroupFlushEnabled = true;
+	return false;
+}
+
+void FlushCoordinatorStop()
+{
+	if (!gGroupFlushEnabled)
+		return;
+	gGroupFlushEnabled = false;
+	if (gVolume != INVALID_HANDLE_VALUE)
+		CloseHandle(gVolume);
+	CloseHandle(gFlushIdle);
+	DeleteCriticalSection(&gFlushLock);
+	if (!gBatchCount)
+		return;
+	fwprintf(stderr, L"Flushes: %I64u requests in %I64u batches, %.2f per batch, latencies in microseconds\n",
+		gFlushLatency.Count(), gBatchCount, (double)(LONGLONG)gFlushLatency.Count() / (double)(LONGLONG)gBatchCount);
+	fwprintf(stderr, L"	mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n", gFlushLatency.Mean() / 1000,
+		(double)(LONGLONG)gFlushLatency.Percentile(0.5) / 1000, (double)(LONGLONG)gFlushLatency.Percentile(0.9) / 1000,
+		(double)(LONGLONG)gFlushLatency.Percentile(0.99) / 1000, (double)(LONGLONG)gFlushLatency.Max() / 1000);
+}
@@ -0,0 +1,43 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Group flushing.
+ * FlushFileBuffers calls that arrive while another one is running are gathered into one batch, which the
+ * first of them runs as soon as the running one ends: with a single flush of the write root volume when the
+ * volume can be opened, which needs administrator rights, or else with one flush per file of the batch. A
+ * batch of requests for a single handle flushes its file only. Every
+ * caller returns when the batch it joined is durable, and no caller joins a batch that already started, so
+ * everything written before the call is covered.
+ */
+
+extern bool gGroupFlushEnabled;
+
+/** Opens the volume holding aWriteRoot for volume flushes if allowed, and enables group flushing.
+ * @return false on success.
+ */
+bool FlushCoordinatorStart(LPCWSTR aWriteRoot);
+/** Closes the volume and prints how many requests a batch held and the latencies of the requests. */
+void FlushCoordinatorStop();
+/** Makes what was written to the write root file aFile durable, sharing the flush with concurrent callers.
+ * @return false on success, GetLastError tells why it failed.
+ */
+bool GroupFlush(HANDLE aFile);
@@ -0,0 +1,235 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "HotPaths.h"
+
+bool gHotPathsEnabled = false;
+
+/* Counters per summary. */
+#define UFS_HOT_COUNTERS 32
+/* Characters of a path kept by a counter, longer paths keep their tail. */
+#define UFS_HOT_PATH_CHARS 120
+
+enum HotPathKey {
+	UFS_HOT_KEY_PATH = 0,
+	UFS_HOT_KEY_DIRECTORY,
+	UFS_HOT_KEY_COUNT
+};
+
+enum HotPathWeight {
+	UFS_HOT_BY_COUNT = 0,
+	UFS_HOT_BY_TIME,
+	UFS_HOT_WEIGHT_COUNT
+};
+
+struct HotPathCounter {
+	LONGLONG mWeight; /* Space-Saving estimate, an upper bound of the true weight. */
+	ULONG64 mCount; /* Calls seen since the counter was taken over, a lower bound. */
+	LONGLONG mTicks; /* Time spent in those calls. */
+	ULONG mHash;
+	WCHAR mPath[UFS_HOT_PATH_CHARS + 1];
+};
+
+struct HotPathSummary {
+	HotPathCounter mCounters[UFS_HOT_COUNTERS];
+	ULONG mUsed;
+};
+
+/** The summaries of one thread. The lock is only ever contended while the reporter merges. */
+struct HotPathThread {
+	HotPathSummary mSummaries[UFS_HOT_OPERATION_COUNT][UFS_HOT_KEY_COUNT][UFS_HOT_WEIGHT_COUNT];
+	CRITICAL_SECTION mLock;
+	HotPathThread* mNext;
+};
+
+static __declspec(thread) HotPathThread* tHotPaths;
+static HotPathThread* volatile gHotPathThreads;
+static HANDLE gReporterThread;
+static HANDLE gStopReporter;
+static ULONG gReportSeconds, gTopCount;
+static LONGLONG gTicksPerMillisecond;
+
+static const WCHAR* const gOperationNames[UFS_HOT_OPERATION_COUNT] = {
+	L"Resolve", L"ReadRootProbe", L"WhiteoutCheck", L"CreateFile", L"FindFiles", L"CopyUp"
+};
+
+static HotPathThread* GetThreadSummaries()
+{
+	HotPathThread* thread = tHotPaths;
+	if (thread)
+		return thread;
+	thread = (HotPathThread*)VirtualAlloc(NULL, sizeof(HotPathThread), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!thread)
+		return NULL;
+	InitializeCriticalSection(&thread->mLock);
+	do {
+		thread->mNext = gHotPathThreads;
+	} while (InterlockedCompareExchangePointer((PVOID volatile*)&gHotPathThreads, thread, thread->mNext) != thread->mNext);
+	tHotPaths = thread;
+	return thread;
+}
+
+/** Adds aWeight to the counter of aHash, taking over the lightest counter when the summary is full. */
+static void Offer(HotPathSummary& aSummary, ULONG aHash, LPCWSTR aPath, size_t aPathLength, LONGLONG aWeight, ULONG64 aCount, LONGLONG aTicks)
+{
+	HotPathCounter* lightest = aSummary.mCounters;
+	for (HotPathCounter* counter = aSummary.mCounters, *end = counter + aSummary.mUsed; counter < end; ++counter) {
+		if (counter->mHash == aHash) {
+			counter->mWeight += aWeight;
+			counter->mCount += aCount;
+			counter->mTicks += aTicks;
+			return;
+		}
+		if (counter->mWeight < lightest->mWeight)
+			lightest = counter;
+	}
+	if (aSummary.mUsed < UFS_HOT_COUNTERS) {
+		lightest = aSummary.mCounters + aSummary.mUsed++;
+		lightest->mWeight = 0;
+	}
+	lightest->mWeight += aWeight;
+	lightest->mCount = aCount;
+	lightest->mTicks = aTicks;
+	lightest->mHash = aHash;
+	if (aPathLength > UFS_HOT_PATH_CHARS) {
+		lightest->mPath[0] = lightest->mPath[1] = lightest->mPath[2] = L'.';
+		memcpy(lightest->mPath + 3, aPath + aPathLength - (UFS_HOT_PATH_CHARS - 3), (UFS_HOT_PATH_CHARS - 3) * sizeof(WCHAR));
+		aPathLength = UFS_HOT_PATH_CHARS;
+	} else
+		memcpy(lightest->mPath, aPath, aPathLength * sizeof(WCHAR));
+	lightest->mPath[aPathLength] = L'\0';
+}
+
+void HotPathRecord(int aOperation, LPCWSTR aPath, LONGLONG aTicks)
+{
+	HotPathThread* thread = GetThreadSummaries();
+	if (!thread)
+		return;
+	/* FNV-1a over the folded path, the hash of the parent directory is taken on the way. */
+	ULONG hash = 2166136261U, directoryHash = hash;
+	size_t length = 0, directoryLength = 0;
+	for (; aPath[length]; ++length) {
+		if (aPath[length] == L'\\' || aPath[length] == L'/') {
+			directoryHash = hash;
+			directoryLength = length;
+		}
+		hash ^= towupper(aPath[length]);
+		hash *= 16777619U;
+	}
+	if (!directoryLength)
+		directoryLength = 1; // The parent is the root.
+	EnterCriticalSection(&thread->mLock);
+	HotPathSummary* summaries = thread->mSummaries[aOperation][UFS_HOT_KEY_PATH];
+	Offer(summaries[UFS_HOT_BY_COUNT], hash, aPath, length, 1, 1, aTicks);
+	Offer(summaries[UFS_HOT_BY_TIME], hash, aPath, length, aTicks, 1, aTicks);
+	summaries = thread->mSummaries[aOperation][UFS_HOT_KEY_DIRECTORY];
+	Offer(summaries[UFS_HOT_BY_COUNT], directoryHash, aPath, directoryLength, 1, 1, aTicks);
+	Offer(summaries[UFS_HOT_BY_TIME], directoryHash, aPath, directoryLength, aTicks, 1, aTicks);
+	LeaveCriticalSection(&thread->mLock);
+}
+
+static bool HeavierCounter(const HotPathCounter& aLeft, const HotPathCounter& aRight)
+{
+	return aLeft.mWeight > aRight.mWeight;
+}
+
+/** Merges and resets the summaries of all threads, then prints the heaviest entries of each. */
+static void Report()
+{
+	static const WCHAR* const keyNames[UFS_HOT_KEY_COUNT] = {L"paths", L"directories"};
+	static const WCHAR* const weightNames[UFS_HOT_WEIGHT_COUNT] = {L"count", L"time"};
+	HotPathSummary* merged = new HotPathSummary[UFS_HOT_OPERATION_COUNT * UFS_HOT_KEY_COUNT * UFS_HOT_WEIGHT_COUNT];
+	ZeroMemory(merged, sizeof(HotPathSummary) * UFS_HOT_OPERATION_COUNT * UFS_HOT_KEY_COUNT * UFS_HOT_WEIGHT_COUNT);
+	for (HotPathThread* thread = gHotPathThreads; thread; thread = thread->mNext) {
+		EnterCriticalSection(&thread->mLock);
+		HotPathSummary* summary = &thread->mSummaries[0][0][0];
+		for (int i = 0; i < UFS_HOT_OPERATION_COUNT * UFS_HOT_KEY_COUNT * UFS_HOT_WEIGHT_COUNT; ++i) {
+			for (ULONG c = 0; c < summary[i].mUsed; ++c) {
+				const HotPathCounter& counter = summary[i].mCounters[c];
+				Offer(merged[i], counter.mHash, counter.mPath, wcslen(counter.mPath), counter.mWeight, counter.mCount, counter.mTicks);
+			}
+			summary[i].mUsed = 0;
+		}
+		LeaveCriticalSection(&thread->mLock);
+	}
+	fwprintf(stderr, L"Hot paths:\n");
+	for (int operation = 0; operation < UFS_HOT_OPERATION_COUNT; ++operation)
+		for (int key = 0; key < UFS_HOT_KEY_COUNT; ++key)
+			for (int weight = 0; weight < UFS_HOT_WEIGHT_COUNT; ++weight) {
+				HotPathSummary& summary = merged[(operation * UFS_HOT_KEY_COUNT + key) * UFS_HOT_WEIGHT_COUNT + weight];
+				if (!summary.mUsed)
+					continue;
+				sort(summary.mCounters, summary.mCounters + summary.mUsed, HeavierCounter);
+				fwprintf(stderr, L"	%s %s by %s:\n", gOperationNames[operation], keyNames[key], weightNames[weight]);
+				for (ULONG c = 0; c < summary.mUsed && c < gTopCount; ++c) {
+					const HotPathCounter& counter = summary.mCounters[c];
+					fwprintf(stderr, L"		%10I64u %12.3f ms %s\n", counter.mCount,
+						(double)counter.mTicks / gTicksPerMillisecond, counter.mPath);
+				}
+			}
+	delete[] merged;
+}
+
+static DWORD WINAPI ReporterThread(LPVOID)
+{
+	while (WaitForSingleObject(gStopReporter, gReportSeconds * 1000) == WAIT_TIMEOUT)
+		Report();
+	return 0;
+}
+
+bool HotPathsStart(ULONG aReportSeconds, ULONG aTopCount)
+{
+	LARGE_INTEGER frequency;
+	if (!QueryPerformanceFrequency(&frequency))
+		return true;
+	gTicksPerMillisecond = frequency.QuadPart / 1000;
+	if (!gTicksPerMillisecond)
+		gTicksPerMillisecond = 1;
+	gReportSeconds = aReportSeconds ? aReportSeconds : 1;
+	gTopCount = aTopCount;
+	if (!(gStopReporter = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		return true;
+	if (!(gReporterThread = CreateThread(NULL, 0, ReporterThread, NULL, 0, NULL))) {
+		CloseHandle(gStopReporter);
+		return true;
+	}
+	gHotPathsEnabled = true;
+	return false;
+}
+
+void HotPathsStop()
+{
+	if (!gHotPathsEnabled)
+		return;
+	gHotPathsEnabled = false;
+	SetEvent(gStopReporter);
+	WaitForSingleObject(gReporterThread, INFINITE);
+	CloseHandle(gReporterThread);
+	CloseHandle(gStopReporter);
+	Report();
+}
@@ -0,0 +1,72 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Hot path profiler.
+ * Keeps, per thread and per operation, Space-Saving summaries of the paths and parent directories that are
+ * used most often and that take the most time. Summaries have a fixed number of counters, so memory stays
+ * constant however many distinct paths are seen. A reporter thread merges the thread summaries and prints the
+ * hottest paths every report period and on unmount.
+ */
+
+enum HotPathOperation {
+	UFS_HOT_RESOLVE = 0,	/* GetFilePath */
+	UFS_HOT_READ_ROOT_PROBE,	/* GetFileAttributes on the read root */
+	UFS_HOT_WHITEOUT_CHECK,	/* lookup in gDeletedFilesSet */
+	UFS_HOT_CREATE_FILE,
+	UFS_HOT_FIND_FILES,
+	UFS_HOT_COPY_UP,
+	UFS_HOT_OPERATION_COUNT
+};
+
+extern bool gHotPathsEnabled;
+
+/** Starts the reporter thread, printing the aTopCount hottest entries every aReportSeconds to stderr.
+ * @return false on success.
+ */
+bool HotPathsStart(ULONG aReportSeconds, ULONG aTopCount);
+/** Stops the reporter thread and prints the entries collected since the last report. */
+void HotPathsStop();
+/** Accounts one aOperation on aPath taking aTicks performance counter ticks. */
+void HotPathRecord(int aOperation, LPCWSTR aPath, LONGLONG aTicks);
+
+/** Times the enclosing scope and accounts it to aOperation on aPath. Costs a single test when disabled. */
+class HotPathSample
+{
+public:
+	HotPathSample(int aOperation, LPCWSTR aPath) : mpPath(gHotPathsEnabled ? aPath : NULL), mOperation(aOperation)
+	{
+		if (mpPath)
+			QueryPerformanceCounter(&mStart);
+	}
+	~HotPathSample()
+	{
+		if (mpPath) {
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			HotPathRecord(mOperation, mpPath, now.QuadPart - mStart.QuadPart);
+		}
+	}
+private:
+	LPCWSTR mpPath;
+	int mOperation;
+	LARGE_INTEGER mStart;
+};
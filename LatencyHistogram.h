@@ -0,0 +1,101 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Log-linear latency histogram.
+ * Values below UFS_LATENCY_SUB_BUCKETS get a bucket each, larger values share a bucket with the values having
+ * the same highest bit and the same next 4 bits, so every bucket is within 1/16 of the values it holds.
+ * Recording is a few shifts and an increment; histograms of different threads are merged for reporting.
+ */
+#define UFS_LATENCY_SUB_BITS 4
+#define UFS_LATENCY_SUB_BUCKETS (1 << UFS_LATENCY_SUB_BITS)
+#define UFS_LATENCY_BUCKETS ((64 - UFS_LATENCY_SUB_BITS + 1) * UFS_LATENCY_SUB_BUCKETS)
+
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() { Reset(); }
+	void Reset()
+	{
+		ZeroMemory(mBuckets, sizeof(mBuckets));
+		mCount = mMax = 0;
+		mTotal = 0;
+	}
+	void Record(ULONG64 aValue)
+	{
+		++mBuckets[BucketOf(aValue)];
+		++mCount;
+		mTotal += aValue;
+		if (aValue > mMax)
+			mMax = aValue;
+	}
+	void Merge(const LatencyHistogram& aOther)
+	{
+		for (int i = 0; i < UFS_LATENCY_BUCKETS; ++i)
+			mBuckets[i] += aOther.mBuckets[i];
+		mCount += aOther.mCount;
+		mTotal += aOther.mTotal;
+		if (aOther.mMax > mMax)
+			mMax = aOther.mMax;
+	}
+	ULONG64 Count() const { return mCount; }
+	ULONG64 Max() const { return mMax; }
+	double Mean() const { return mCount ? (double)(LONGLONG)mTotal / (double)(LONGLONG)mCount : 0.0; }
+	/** @return the upper bound of the bucket holding the value at aFraction (0.5 for the median) of the recorded
+	 * values, never more than the largest value recorded.
+	 */
+	ULONG64 Percentile(double aFraction) const
+	{
+		if (!mCount)
+			return 0;
+		ULONG64 rank = (ULONG64)(aFraction * (double)(LONGLONG)mCount);
+		if (rank >= mCount)
+			rank = mCount - 1;
+		ULONG64 seen = 0;
+		for (int i = 0; i < UFS_LATENCY_BUCKETS; ++i)
+			if ((seen += mBuckets[i]) > rank) {
+				ULONG64 upper = UpperBound(i);
+				return upper < mMax ? upper : mMax;
+			}
+		return mMax;
+	}
+private:
+	static int BucketOf(ULONG64 aValue)
+	{
+		if (aValue < UFS_LATENCY_SUB_BUCKETS)
+			return (int)aValue;
+		int highBit = UFS_LATENCY_SUB_BITS;
+		while (aValue >> (highBit + 1))
+			++highBit;
+		return (highBit - UFS_LATENCY_SUB_BITS + 1) * UFS_LATENCY_SUB_BUCKETS + (int)((aValue >> (highBit - UFS_LATENCY_SUB_BITS)) & (UFS_LATENCY_SUB_BUCKETS - 1));
+	}
+	static ULONG64 UpperBound(int aBucket)
+	{
+		if (aBucket < UFS_LATENCY_SUB_BUCKETS)
+			return aBucket;
+		int shift = aBucket / UFS_LATENCY_SUB_BUCKETS - 1;
+		ULONG64 low = (ULONG64)(UFS_LATENCY_SUB_BUCKETS + aBucket % UFS_LATENCY_SUB_BUCKETS) << shift;
+		return low + (((ULONG64)1 << shift) - 1);
+	}
+
+	ULONG64 mBuckets[UFS_LATENCY_BUCKETS];
+	ULONG64 mCount, mMax, mTotal;
+};
@@ -0,0 +1,491 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+using namespace std;
+
+#include "dokan.h"
+#include "UnionEngine.h"
+#include "LatencyHistogram.h"
+#include "LoadGenerator.h"
+
+#define UFS_LOAD_DIRECTORIES 16
+#define UFS_LOAD_FILES 64
+#define UFS_LOAD_FILE_BYTES 4096
+#define UFS_LOAD_BIG_FILE_BYTES (8 * 1024 * 1024)
+#define UFS_LOAD_BLOCK_BYTES 65536
+#define UFS_LOAD_RANDOM_FILE_BYTES (1024 * 1024)
+#define UFS_LOAD_RANDOM_WRITE_BYTES 4096
+#define UFS_LOAD_RMRF_FILES 16
+#define UFS_LOAD_COPYUP_FILES 16
+
+enum LoadOperation {
+	UFS_LOAD_OPEN = 0,
+	UFS_LOAD_SEQ,
+	UFS_LOAD_RAND,
+	UFS_LOAD_SCAN,
+	UFS_LOAD_RMRF,
+	UFS_LOAD_COPYUP,
+	UFS_LOAD_OPERATION_COUNT
+};
+
+static const WCHAR* const gLoadOperationNames[UFS_LOAD_OPERATION_COUNT] = {
+	L"open", L"seq", L"rand", L"scan", L"rmrf", L"copyup"
+};
+
+struct LoadThread {
+	LatencyHistogram mLatency[UFS_LOAD_OPERATION_COUNT]; /* In nanoseconds. */
+	ULONG64 mErrors[UFS_LOAD_OPERATION_COUNT];
+	ULONG mIndex;
+	ULONG mRandom;
+	ULONG mSerial; /* Numbers the rmrf directories. */
+	WCHAR mArea[64]; /* The directory private to the thread, relative to the union root. */
+	char mBuffer[UFS_LOAD_BLOCK_BYTES];
+};
+
+static PDOKAN_OPERATIONS gLoadOperations;
+static ULONG gLoadWeights[UFS_LOAD_OPERATION_COUNT], gLoadTotalWeight;
+static HANDLE gLoadStart;
+static LONGLONG gLoadDeadline;
+static double gNanosecondsPerTick;
+
+static ULONG NextRandom(LoadThread& aThread)
+{
+	ULONG x = aThread.mRandom;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return aThread.mRandom = x;
+}
+
+/** Opens aFileName through the callbacks. Like the driver, gives every open an id of its own so the calls
+ * on it can be told apart in a /y recording.
+ */
+static int LoadOpen(LPCWSTR aFileName, DWORD aAccessMode, DWORD aShareMode, DWORD aCreationDisposition, DWORD aFlags, DOKAN_FILE_INFO& aInfo)
+{
+	static volatile LONG openIds;
+	ZeroMemory(&aInfo, sizeof(aInfo));
+	aInfo.DokanContext = (ULONG)InterlockedIncrement(&openIds);
+	return gLoadOperations->CreateFile(aFileName, aAccessMode, aShareMode, aCreationDisposition, aFlags, &aInfo);
+}
+
+static void LoadClose(LPCWSTR aFileName, DOKAN_FILE_INFO& aInfo)
+{
+	gLoadOperations->Cleanup(aFileName, &aInfo);
+	gLoadOperations->CloseFile(aFileName, &aInfo);
+}
+
+/** Collects the listed names into the vector whose address is stored in the context. */
+static int WINAPI CollectFindData(PWIN32_FIND_DATAW apFindData, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	if (apDokanFileInfo->Context)
+		((vector<wstring>*)(ULONG_PTR)apDokanFileInfo->Context)->push_back(apFindData->cFileName);
+	return 0;
+}
+
+static void FixturePath(LPWSTR aDest, ULONG aDirectory, ULONG aFile)
+{
+	swprintf(aDest, L"\\UFSLoad\\d%02u\\f%03u", aDirectory, aFile);
+}
+
+static void CopyUpPath(LPWSTR aDest, ULONG aThread, ULONG aFile)
+{
+	swprintf(aDest, L"\\UFSLoad\\c%02u\\f%03u", aThread, aFile);
+}
+
+static int RunOpen(LoadThread& aThread, LONGLONG&)
+{
+	WCHAR fileName[64];
+	FixturePath(fileName, NextRandom(aThread) % UFS_LOAD_DIRECTORIES, NextRandom(aThread) % UFS_LOAD_FILES);
+	DOKAN_FILE_INFO info;
+	int status = LoadOpen(fileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, 0, info);
+	if (status < 0)
+		return status;
+	BY_HANDLE_FILE_INFORMATION fileInformation;
+	status = gLoadOperations->GetFileInformation(fileName, &fileInformation, &info);
+	LoadClose(fileName, info);
+	return status;
+}
+
+static int RunSeq(LoadThread& aThread, LONGLONG&)
+{
+	static const WCHAR fileName[] = L"\\UFSLoad\\big";
+	DOKAN_FILE_INFO info;
+	int status = LoadOpen(fileName, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, info);
+	if (status < 0)
+		return status;
+	DWORD readLength;
+	for (LONGLONG offset = 0; !(status = gLoadOperations->ReadFile(fileName, aThread.mBuffer, UFS_LOAD_BLOCK_BYTES, &readLength, offset, &info)) && readLength; offset += readLength)
+		;
+	LoadClose(fileName, info);
+	return status;
+}
+
+static int RunRand(LoadThread& aThread, LONGLONG&)
+{
+	WCHAR fileName[96];
+	swprintf(fileName, L"%s\\random", aThread.mArea);
+	DOKAN_FILE_INFO info;
+	int status = LoadOpen(fileName, GENERIC_WRITE, FILE_SHARE_READ, OPEN_EXISTING, 0, info);
+	if (status < 0)
+		return status;
+	DWORD written;
+	LONGLONG offset = (LONGLONG)(NextRandom(aThread) % (UFS_LOAD_RANDOM_FILE_BYTES / UFS_LOAD_RANDOM_WRITE_BYTES)) * UFS_LOAD_RANDOM_WRITE_BYTES;
+	status = gLoadOperations->WriteFile(fileName, aThread.mBuffer, UFS_LOAD_RANDOM_WRITE_BYTES, &written, offset, &info);
+	LoadClose(fileName, info);
+	return status;
+}
+
+static int RunScan(LoadThread& aThread, LONGLONG&)
+{
+	WCHAR directoryName[64];
+	swprintf(directoryName, L"\\UFSLoad\\d%02u", NextRandom(aThread) % UFS_LOAD_DIRECTORIES);
+	DOKAN_FILE_INFO info;
+	ZeroMemory(&info, sizeof(info));
+	info.IsDirectory = TRUE;
+	return gLoadOperations->FindFiles(directoryName, CollectFindData, &info);
+}
+
+/** Writes a directory of files through the callbacks, then deletes it the way Explorer or rm -rf would:
+ * list it, open every entry for deletion and close it, then do the same for the directory itself.
+ * Only the deletion is timed.
+ */
+static int RunRmrf(LoadThread& aThread, LONGLONG& aStart)
+{
+	WCHAR directoryName[96], fileName[128];
+	swprintf(directoryName, L"%s\\r%u", aThread.mArea, aThread.mSerial++);
+	DOKAN_FILE_INFO info;
+	ZeroMemory(&info, sizeof(info));
+	int status = gLoadOperations->CreateDirectory(directoryName, &info);
+	if (status < 0)
+		return status;
+	for (ULONG i = 0; i < UFS_LOAD_RMRF_FILES; ++i) {
+		swprintf(fileName, L"%s\\f%02u", directoryName, i);
+		if ((status = LoadOpen(fileName, GENERIC_WRITE, 0, CREATE_NEW, 0, info)) < 0)
+			return status;
+		DWORD written;
+		status = gLoadOperations->WriteFile(fileName, aThread.mBuffer, UFS_LOAD_FILE_BYTES, &written, 0, &info);
+		LoadClose(fileName, info);
+		if (status < 0)
+			return status;
+	}
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+	aStart = start.QuadPart;
+	vector<wstring> names;
+	ZeroMemory(&info, sizeof(info));
+	info.IsDirectory = TRUE;
+	info.Context = (ULONG64)(ULONG_PTR)&names;
+	if ((status = gLoadOperations->FindFiles(directoryName, CollectFindData, &info)) < 0)
+		return status;
+	for (vector<wstring>::const_iterator it = names.begin(); it != names.end(); ++it) {
+		swprintf(fileName, L"%s\\%s", directoryName, it->c_str());
+		if ((status = LoadOpen(fileName, DELETE, FILE_SHARE_DELETE, OPEN_EXISTING, 0, info)) < 0)
+			return status;
+		if (!(status = gLoadOperations->DeleteFile(fileName, &info)))
+			info.DeleteOnClose = TRUE;
+		LoadClose(fileName, info);
+		if (status < 0)
+			return status;
+	}
+	ZeroMemory(&info, sizeof(info));
+	if ((status = gLoadOperations->OpenDirectory(directoryName, &info)) < 0)
+		return status;
+	info.IsDirectory = TRUE;
+	if (!(status = gLoadOperations->DeleteDirectory(directoryName, &info)))
+		info.DeleteOnClose = TRUE;
+	LoadClose(directoryName, info);
+	return status;
+}
+
+/** Writes to a read root file so it is copied up. The copy left by the previous run of the thread is removed
+ * from the write root before timing starts.
+ */
+static int RunCopyUp(LoadThread& aThread, LONGLONG& aStart)
+{
+	WCHAR fileName[64], writeFilePath[MAX_PATHW];
+	CopyUpPath(fileName, aThread.mIndex, NextRandom(aThread) % UFS_LOAD_COPYUP_FILES);
+	if (!MakeWritePath(writeFilePath, fileName, wcslen(fileName) * sizeof(WCHAR)))
+		gWriteLayer->Unlink(writeFilePath);
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+	aStart = start.QuadPart;
+	DOKAN_FILE_INFO info;
+	int status = LoadOpen(fileName, GENERIC_WRITE, 0, OPEN_EXISTING, 0, info);
+	if (status < 0)
+		return status;
+	DWORD written;
+	status = gLoadOperations->WriteFile(fileName, aThread.mBuffer, 1, &written, 0, &info);
+	LoadClose(fileName, info);
+	return status;
+}
+
+typedef int (*LoadRunner)(LoadThread& aThread, LONGLONG& aStart);
+static const LoadRunner gLoadRunners[UFS_LOAD_OPERATION_COUNT] = {
+	RunOpen, RunSeq, RunRand, RunScan, RunRmrf, RunCopyUp
+};
+
+/** Creates the private area of the thread and the file written by rand, through the callbacks. */
+static int PrepareThread(LoadThread& aThread)
+{
+	DOKAN_FILE_INFO info;
+	ZeroMemory(&info, sizeof(info));
+	int status = gLoadOperations->CreateDirectory(aThread.mArea, &info);
+	if (status < 0)
+		return status;
+	WCHAR fileName[96];
+	swprintf(fileName, L"%s\\random", aThread.mArea);
+	if ((status = LoadOpen(fileName, GENERIC_WRITE, 0, CREATE_ALWAYS, 0, info)) < 0)
+		return status;
+	status = gLoadOperations->SetEndOfFile(fileName, UFS_LOAD_RANDOM_FILE_BYTES, &info);
+	LoadClose(fileName, info);
+	return status;
+}
+
+static DWORD WINAPI LoadThreadMain(LPVOID apThread)
+{
+	LoadThread& thread = *(LoadThread*)apThread;
+	if (PrepareThread(thread) < 0) {
+		fwprintf(stderr, L"Thread %u cannot prepare %s.\n", thread.mIndex, thread.mArea);
+		return 1;
+	}
+	WaitForSingleObject(gLoadStart, INFINITE);
+	LARGE_INTEGER now;
+	for (QueryPerformanceCounter(&now); now.QuadPart < gLoadDeadline;) {
+		ULONG pick = NextRandom(thread) % gLoadTotalWeight;
+		int operation = 0;
+		while (pick >= gLoadWeights[operation])
+			pick -= gLoadWeights[operation++];
+		LONGLONG start = now.QuadPart;
+		if (gLoadRunners[operation](thread, start) < 0)
+			++thread.mErrors[operation];
+		QueryPerformanceCounter(&now);
+		thread.mLatency[operation].Record((ULONG64)((double)(now.QuadPart - start) * gNanosecondsPerTick));
+	}
+	return 0;
+}
+
+/** Creates a file of aBytes bytes in the read root unless it is already there. */
+static bool CreateFixtureFile(LPCWSTR aPath, DWORD aBytes, const char* apBuffer)
+{
+	HANDLE handle = CreateFile(aPath, GENERIC_WRITE, 0, NULL, CREATE_NEW, 0, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return GetLastError() != ERROR_FILE_EXISTS;
+	DWORD written = 0;
+	for (DWORD left = aBytes; left; left -= written) {
+		DWORD block = left < UFS_LOAD_BLOCK_BYTES ? left : UFS_LOAD_BLOCK_BYTES;
+		if (!WriteFile(handle, apBuffer, block, &written, NULL) || !written) {
+			CloseHandle(handle);
+			return true;
+		}
+	}
+	CloseHandle(handle);
+	return false;
+}
+
+static bool CreateFixtureDirectory(LPCWSTR aPath)
+{
+	return !CreateDirectory(aPath, NULL) && GetLastError() != ERROR_ALREADY_EXISTS;
+}
+
+/** Creates the fixture tree directly in the read root, reusing files left by an earlier run.
+ * @return false on success.
+ */
+static bool CreateFixture(ULONG aThreadCount, const char* apBuffer)
+{
+	WCHAR path[MAX_PATHW], relativePath[64];
+	size_t rootLength = gReadLayer->RootLength() / sizeof(WCHAR);
+	memcpy(path, gReadLayer->Root(), gReadLayer->RootLength());
+	LPWSTR relative = path + rootLength;
+	wcscpy(relative, L"\\UFSLoad");
+	if (CreateFixtureDirectory(path))
+		return true;
+	wcscpy(relative, L"\\UFSLoad\\big");
+	if (CreateFixtureFile(path, UFS_LOAD_BIG_FILE_BYTES, apBuffer))
+		return true;
+	for (ULONG directory = 0; directory < UFS_LOAD_DIRECTORIES; ++directory) {
+		swprintf(relative, L"\\UFSLoad\\d%02u", directory);
+		if (CreateFixtureDirectory(path))
+			return true;
+		for (ULONG file = 0; file < UFS_LOAD_FILES; ++file) {
+			FixturePath(relativePath, directory, file);
+			wcscpy(relative, relativePath);
+			if (CreateFixtureFile(path, UFS_LOAD_FILE_BYTES, apBuffer))
+				return true;
+		}
+	}
+	for (ULONG thread = 0; thread < aThreadCount; ++thread) {
+		swprintf(relative, L"\\UFSLoad\\c%02u", thread);
+		if (CreateFixtureDirectory(path))
+			return true;
+		for (ULONG file = 0; file < UFS_LOAD_COPYUP_FILES; ++file) {
+			CopyUpPath(relativePath, thread, file);
+			wcscpy(relative, relativePath);
+			if (CreateFixtureFile(path, UFS_LOAD_FILE_BYTES, apBuffer))
+				return true;
+		}
+	}
+	return false;
+}
+
+/** Removes the fixture tree from the read root and what the run wrote under it from the write root.
+ * @return false on success, true if something was left.
+ */
+static bool RemoveFixture()
+{
+	static const WCHAR fixture[] = L"\\UFSLoad";
+	UFSLayer* const layers[] = {gReadLayer, gWriteLayer};
+	bool failed = false;
+	for (int i = 0; i < 2; ++i) {
+		WCHAR path[MAX_PATHW];
+		if (!layers[i]->MakePath(path, fixture, sizeof(fixture) - sizeof(WCHAR)) &&
+			layers[i]->GetAttributes(path) != INVALID_FILE_ATTRIBUTES)
+			failed |= RemoveTree(layers[i], fixture);
+	}
+	return failed;
+}
+
+/** Sets gLoadWeights from aMix.
+ * @return false on success.
+ */
+static bool ParseMix(LPCWSTR aMix)
+{
+	ZeroMemory(gLoadWeights, sizeof(gLoadWeights));
+	gLoadTotalWeight = 0;
+	while (*aMix) {
+		size_t nameLength = wcscspn(aMix, L":,");
+		int operation = 0;
+		while (operation < UFS_LOAD_OPERATION_COUNT &&
+			(wcslen(gLoadOperationNames[operation]) != nameLength || _wcsnicmp(aMix, gLoadOperationNames[operation], nameLength)))
+			++operation;
+		if (operation == UFS_LOAD_OPERATION_COUNT) {
+			fwprintf(stderr, L"Unknown load operation: %.*s\n", nameLength, aMix);
+			return true;
+		}
+		aMix += nameLength;
+		ULONG weight = 1;
+		if (*aMix == L':')
+			weight = (ULONG)_wtoi(++aMix);
+		aMix += wcscspn(aMix, L",");
+		if (*aMix)
+			++aMix;
+		gLoadWeights[operation] += weight;
+		gLoadTotalWeight += weight;
+	}
+	if (!gLoadTotalWeight) {
+		fwprintf(stderr, L"The load mix is empty.\n");
+		return true;
+	}
+	return false;
+}
+
+int RunLoadGenerator(PDOKAN_OPERATIONS apOperations, LPCWSTR aMix, ULONG aThreadCount, ULONG aSeconds)
+{
+	if (ParseMix(aMix))
+		return 2;
+	if (!aThreadCount)
+		aThreadCount = 1;
+	if (aThreadCount > 99)
+		aThreadCount = 99;
+	LARGE_INTEGER frequency;
+	if (!QueryPerformanceFrequency(&frequency))
+		return 2;
+	gNanosecondsPerTick = 1e9 / (double)frequency.QuadPart;
+	gLoadOperations = apOperations;
+
+	vector<LoadThread*> threads;
+	vector<HANDLE> handles;
+	DWORD runId = GetTickCount();
+	int returnValue = 0;
+	for (ULONG i = 0; i < aThreadCount; ++i) {
+		LoadThread* thread = new LoadThread;
+		ZeroMemory(thread->mErrors, sizeof(thread->mErrors));
+		memset(thread->mBuffer, 'U', sizeof(thread->mBuffer));
+		thread->mIndex = i;
+		thread->mRandom = 2463534242U + i * 2654435761U;
+		thread->mSerial = 0;
+		swprintf(thread->mArea, L"\\UFSLoad\\w%08X-%02u", runId, i);
+		threads.push_back(thread);
+	}
+	if (CreateFixture(aThreadCount, threads[0]->mBuffer)) {
+		fwprintf(stderr, L"Cannot create the load fixture in %s. Error: %d.\n", gReadLayer->Root(), GetLastError());
+		returnValue = 2;
+		goto Done;
+	}
+	if (!(gLoadStart = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+		returnValue = 2;
+		goto Done;
+	}
+	for (ULONG i = 0; i < aThreadCount; ++i) {
+		HANDLE handle = CreateThread(NULL, 0, LoadThreadMain, threads[i], 0, NULL);
+		if (!handle) {
+			fwprintf(stderr, L"Cannot start load thread %u. Error: %d.\n", i, GetLastError());
+			returnValue = 2;
+			break;
+		}
+		handles.push_back(handle);
+	}
+	{
+		LARGE_INTEGER start;
+		QueryPerformanceCounter(&start);
+		gLoadDeadline = returnValue ? start.QuadPart : start.QuadPart + (LONGLONG)aSeconds * frequency.QuadPart;
+		SetEvent(gLoadStart);
+		for (size_t i = 0; i < handles.size(); ++i) {
+			WaitForSingleObject(handles[i], INFINITE);
+			DWORD exitCode;
+			if (GetExitCodeThread(handles[i], &exitCode) && exitCode)
+				returnValue = 2;
+			CloseHandle(handles[i]);
+		}
+		LARGE_INTEGER end;
+		QueryPerformanceCounter(&end);
+		double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+		CloseHandle(gLoadStart);
+
+		wprintf(L"%u threads, %.1f s, latencies in microseconds\n", aThreadCount, seconds);
+		wprintf(L"%-8s %10s %8s %10s %9s %9s %9s %9s %9s %9s\n",
+			L"op", L"count", L"errors", L"ops/s", L"mean", L"p50", L"p90", L"p99", L"p99.9", L"max");
+		for (int operation = 0; operation < UFS_LOAD_OPERATION_COUNT; ++operation) {
+			LatencyHistogram latency;
+			ULONG64 errors = 0;
+			for (ULONG i = 0; i < aThreadCount; ++i) {
+				latency.Merge(threads[i]->mLatency[operation]);
+				errors += threads[i]->mErrors[operation];
+			}
+			if (!latency.Count())
+				continue;
+			wprintf(L"%-8s %10I64u %8I64u %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", gLoadOperationNames[operation],
+				latency.Count(), errors, (double)(LONGLONG)latency.Count() / seconds, latency.Mean() / 1000,
+				(double)(LONGLONG)latency.Percentile(0.5) / 1000, (double)(LONGLONG)latency.Percentile(0.9) / 1000,
+				(double)(LONGLONG)latency.Percentile(0.99) / 1000, (double)(LONGLONG)latency.Percentile(0.999) / 1000,
+				(double)(LONGLONG)latency.Max() / 1000);
+		}
+	}
+Done:
+	for (size_t i = 0; i < threads.size(); ++i)
+		delete threads[i];
+	if (RemoveFixture())
+		fwprintf(stderr, L"Cannot remove all of the load fixture under \\UFSLoad. Error: %d.\n", GetLastError());
+	return returnValue;
+}
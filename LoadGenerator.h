@@ -0,0 +1,43 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** In-process load generator.
+ * Drives the callbacks of a DOKAN_OPERATIONS table directly from a number of threads, without mounting a
+ * drive, so the throughput of the union engine can be measured on the real read and write roots. A fixture
+ * tree is created under \UFSLoad in the read root, every thread then draws operations from a weighted mix
+ * until the run time is over. Throughput and latency percentiles are printed per operation. \UFSLoad is
+ * removed from both roots when the run ends.
+ *
+ * The mix is a comma separated list of operation names each optionally followed by :weight, for example
+ * open:60,scan:20,rand:20. The operations are:
+ *	open	open, query and close a read root file
+ *	seq	read a large read root file sequentially in 64 KB blocks
+ *	rand	write 4 KB at a random offset of a write root file
+ *	scan	list a merged directory
+ *	rmrf	delete a directory of freshly written files through the callbacks
+ *	copyup	write to a read root file, which copies it up
+ */
+
+/** Runs the load generator.
+ * @return the process exit code, 0 on success, 2 for a bad mix or a failed fixture setup.
+ */
+int RunLoadGenerator(PDOKAN_OPERATIONS apOperations, LPCWSTR aMix, ULONG aThreadCount, ULONG aSeconds);
@@ -0,0 +1,202 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <string>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "MetadataLog.h"
+
+struct MetadataLogBatch {
+	wstring mRecords;
+	HANDLE mDone; /* Set when the batch is durable. */
+	DWORD mError;
+	LONG mWaiters; /* Appended records not committed yet, the last commit frees the batch. */
+	bool mLeading; /* The first commit writes the batch. */
+};
+
+class MetadataLogLock
+{
+public:
+	MetadataLogLock() {
+		InitializeCriticalSection(&mLock);
+	}
+	~MetadataLogLock() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+
+static MetadataLogLock gLog;
+static HANDLE gLogFile = INVALID_HANDLE_VALUE;
+static MetadataLogBatch* gOpenBatch; /* The batch new records join, NULL if none. */
+static bool gWriting; /* The log file is being written. */
+static HANDLE gLogIdle; /* Set while gWriting is false. */
+static volatile ULONG64 gLogSize;
+
+/** Writes aText at the end of the log and flushes it, the caller owns the writer role. */
+static DWORD WriteLog(const wstring& aText)
+{
+	DWORD written;
+	DWORD length = (DWORD)(aText.size() * sizeof(WCHAR));
+	if (!WriteFile(gLogFile, aText.data(), length, &written, NULL))
+		return GetLastError();
+	if (written != length)
+		return ERROR_DISK_FULL;
+	if (!FlushFileBuffers(gLogFile))
+		return GetLastError();
+	gLogSize += length;
+	return 0;
+}
+
+/** Waits for the running write to end and takes the writer role. */
+static void BeginWriting()
+{
+	for (;;) {
+		WaitForSingleObject(gLogIdle, INFINITE);
+		CriticalSectionLock lock(gLog.mLock);
+		if (!gWriting) {
+			gWriting = true;
+			ResetEvent(gLogIdle);
+			return;
+		}
+	}
+}
+
+static void EndWriting()
+{
+	CriticalSectionLock lock(gLog.mLock);
+	gWriting = false;
+	SetEvent(gLogIdle);
+}
+
+bool OpenMetadataLog(LPCWSTR aPath, const wstring& aHeader)
+{
+	if (!gLogIdle && !(gLogIdle = CreateEvent(NULL, TRUE, TRUE, NULL)))
+		return true;
+	gLogFile = gWriteLayer->Open(aPath, GENERIC_WRITE, FILE_SHARE_READ, OPEN_ALWAYS, FILE_ATTRIBUTE_HIDDEN);
+	if (gLogFile == INVALID_HANDLE_VALUE)
+		return true;
+	if (!ResetMetadataLog(aHeader))
+		return false;
+	CloseMetadataLog();
+	return true;
+}
+
+void CloseMetadataLog()
+{
+	if (gLogFile == INVALID_HANDLE_VALUE)
+		return;
+	CloseHandle(gLogFile);
+	gLogFile = INVALID_HANDLE_VALUE;
+}
+
+MetadataLogBatch* AppendMetadataLog(const wstring& aRecord)
+{
+	if (gLogFile == INVALID_HANDLE_VALUE)
+		return NULL;
+	CriticalSectionLock lock(gLog.mLock);
+	if (!gOpenBatch) {
+		MetadataLogBatch* batch = new MetadataLogBatch;
+		if (!(batch->mDone = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+			delete batch;
+			throw bad_alloc();
+		}
+		batch->mError = 0;
+		batch->mWaiters = 0;
+		batch->mLeading = false;
+		gOpenBatch = batch;
+	}
+	gOpenBatch->mRecords.append(aRecord);
+	++gOpenBatch->mWaiters;
+	return gOpenBatch;
+}
+
+bool CommitMetadataLog(MetadataLogBatch* apBatch)
+{
+	if (!apBatch)
+		return false;
+	bool leader;
+	{
+		CriticalSectionLock lock(gLog.mLock);
+		leader = !apBatch->mLeading;
+		apBatch->mLeading = true;
+	}
+	if (leader) {
+		BeginWriting();
+		{
+			CriticalSectionLock lock(gLog.mLock);
+			if (gOpenBatch == apBatch)
+				gOpenBatch = NULL;
+		}
+		if (!apBatch->mRecords.empty())
+			apBatch->mError = WriteLog(apBatch->mRecords);
+		EndWriting();
+		SetEvent(apBatch->mDone);
+	} else
+		WaitForSingleObject(apBatch->mDone, INFINITE);
+	DWORD error = apBatch->mError;
+	{
+		CriticalSectionLock lock(gLog.mLock);
+		if (--apBatch->mWaiters)
+			apBatch = NULL;
+	}
+	if (apBatch) {
+		CloseHandle(apBatch->mDone);
+		delete apBatch;
+	}
+	if (error) {
+		SetLastError(error);
+		return true;
+	}
+	return false;
+}
+
+ULONG64 MetadataLogSize()
+{
+	return gLogSize;
+}
+
+bool ResetMetadataLog(const wstring& aHeader)
+{
+	BeginWriting();
+	{
+		/* The records still to write are in the caller's snapshot, their batch only needs to end. */
+		CriticalSectionLock lock(gLog.mLock);
+		if (gOpenBatch) {
+			gOpenBatch->mRecords.erase();
+			gOpenBatch = NULL;
+		}
+	}
+	gLogSize = 0;
+	DWORD error = 0;
+	if (SetFilePointer(gLogFile, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER || !SetEndOfFile(gLogFile))
+		error = GetLastError();
+	else
+		error = WriteLog(aHeader);
+	EndWriting();
+	if (error) {
+		SetLastError(error);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,59 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+
+/** Write-ahead log of the union metadata, see UFS_METADATA_FILE.
+ * Records are lines appended in the order of the AppendMetadataLog calls. CommitMetadataLog returns once
+ * the record and every record before it are durable: the records appended while a write runs form one
+ * batch, which the first of its callers writes and flushes for all of them once the running write ends.
+ */
+
+/* The log in the write root, reserved like the metadata file itself. */
+#define UFS_METADATA_LOG_FILE UFS_METADATA_FILE L".log"
+
+struct MetadataLogBatch;
+
+/** Opens the log file aPath, replacing its content with the line aHeader.
+ * @return false on success.
+ */
+bool OpenMetadataLog(LPCWSTR aPath, const std::wstring& aHeader);
+void CloseMetadataLog();
+
+/** Appends the line aRecord, including its line feed. Throws when memory runs out.
+ * @return The batch to pass to CommitMetadataLog, which every caller must do, or NULL if the log is closed.
+ */
+MetadataLogBatch* AppendMetadataLog(const std::wstring& aRecord);
+
+/** Waits until the batch apBatch is durable.
+ * @return false on success, GetLastError tells why it failed.
+ */
+bool CommitMetadataLog(MetadataLogBatch* apBatch);
+
+/** The number of bytes the log holds. */
+ULONG64 MetadataLogSize();
+
+/** Replaces the content of the log with the line aHeader, dropping the records not written yet. The caller
+ * saved their effect otherwise and keeps new records from being appended meanwhile.
+ * @return false on success.
+ */
+bool ResetMetadataLog(const std::wstring& aHeader);
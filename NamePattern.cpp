@@ -0,0 +1,157 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "NamePattern.h"
+
+#define UFS_DOS_STAR L'<'
+#define UFS_DOS_QM L'>'
+#define UFS_DOS_DOT L'"'
+
+static const WCHAR gWildcards[] = L"*?<>\"";
+
+static inline WCHAR Fold(WCHAR aCharacter)
+{
+	return (WCHAR)towlower(aCharacter);
+}
+
+/* Compares aLength characters of the name with the folded pattern characters. */
+static inline bool SameFolded(LPCWSTR aName, LPCWSTR aFolded, size_t aLength)
+{
+	for (size_t i = 0; i < aLength; ++i)
+		if (Fold(aName[i]) != aFolded[i])
+			return false;
+	return true;
+}
+
+void NamePattern::Compile(LPCWSTR aPattern)
+{
+	mPrefix.erase();
+	mFolded.erase();
+	if (!aPattern || !*aPattern || !wcscmp(aPattern, L"*")) {
+		mKind = UFS_PATTERN_ALL;
+		return;
+	}
+	size_t length = wcslen(aPattern);
+	size_t firstWildcard = wcscspn(aPattern, gWildcards);
+	mPrefix.assign(aPattern, firstWildcard);
+	if (firstWildcard == length) {
+		mKind = UFS_PATTERN_NAME;
+		mFolded.assign(aPattern);
+	} else if (firstWildcard == length - 1 && aPattern[firstWildcard] == L'*') {
+		mKind = UFS_PATTERN_PREFIX;
+		mFolded.assign(aPattern, firstWildcard);
+	} else if (!firstWildcard && aPattern[0] == L'*' && !wcspbrk(aPattern + 1, gWildcards)) {
+		mKind = UFS_PATTERN_SUFFIX;
+		mFolded.assign(aPattern + 1);
+	} else {
+		mKind = UFS_PATTERN_GENERAL;
+		mFolded.assign(aPattern);
+	}
+	for (wstring::iterator it = mFolded.begin(); it != mFolded.end(); ++it)
+		*it = Fold(*it);
+}
+
+bool NamePattern::Match(LPCWSTR aName) const
+{
+	size_t length;
+	switch (mKind) {
+		case UFS_PATTERN_ALL:
+			return true;
+		case UFS_PATTERN_NAME:
+			return wcslen(aName) == mFolded.size() && SameFolded(aName, mFolded.data(), mFolded.size());
+		case UFS_PATTERN_PREFIX:
+			/* Stops at the NUL of a shorter name, which folds to itself and differs from the pattern. */
+			return SameFolded(aName, mFolded.data(), mFolded.size());
+		case UFS_PATTERN_SUFFIX:
+			length = wcslen(aName);
+			return length >= mFolded.size() && SameFolded(aName + length - mFolded.size(), mFolded.data(), mFolded.size());
+	}
+	length = wcslen(aName);
+	if (length < mPrefix.size() || !SameFolded(aName, mFolded.data(), mPrefix.size()))
+		return false;
+	return MatchGeneral(aName, length);
+}
+
+/** Follows every way the pattern can consume the name at once: after each pattern character, reached[i]
+ * tells whether the first i characters of the name can have been consumed.
+ */
+bool NamePattern::MatchGeneral(LPCWSTR aName, size_t aLength) const
+{
+	size_t lastPeriod = aLength;
+	for (size_t i = aLength; i--; )
+		if (aName[i] == L'.') {
+			lastPeriod = i;
+			break;
+		}
+	vector<bool> reached(aLength + 1, false), next(aLength + 1);
+	reached[0] = true;
+	for (wstring::const_iterator it = mFolded.begin(); it != mFolded.end(); ++it) {
+		next.assign(aLength + 1, false);
+		bool any = false;
+		for (size_t i = 0; i <= aLength; ++i) {
+			if (!reached[i])
+				continue;
+			switch (*it) {
+				case L'*':
+					for (size_t j = i; j <= aLength; ++j)
+						next[j] = true;
+					break;
+				case UFS_DOS_STAR: {
+					/* Up to the last period, or anything once past it. */
+					size_t end = i <= lastPeriod && lastPeriod < aLength ? lastPeriod : aLength;
+					for (size_t j = i; j <= end; ++j)
+						next[j] = true;
+					break;
+				}
+				case L'?':
+					if (i < aLength)
+						next[i + 1] = true;
+					break;
+				case UFS_DOS_QM:
+					if (i == aLength || aName[i] == L'.')
+						next[i] = true;
+					else
+						next[i + 1] = true;
+					break;
+				case UFS_DOS_DOT:
+					if (i == aLength)
+						next[i] = true;
+					else if (aName[i] == L'.')
+						next[i + 1] = true;
+					break;
+				default:
+					if (i < aLength && Fold(aName[i]) == *it)
+						next[i + 1] = true;
+			}
+		}
+		reached.swap(next);
+		for (size_t i = 0; i <= aLength && !any; ++i)
+			any = reached[i];
+		if (!any)
+			return false;
+	}
+	return reached[aLength];
+}
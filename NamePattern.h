@@ -0,0 +1,59 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+
+/** A FindFiles search pattern compiled once and matched against many names, case insensitively, with the
+ * semantics of FsRtlIsNameInExpression: * and ? plus the DOS wildcards < (any characters but the last
+ * period), > (any character, or none at a period or the end) and " (a period, or none at the end) that
+ * the Win32 layer produces from *.* style patterns.
+ * The common shapes, a name, a prefix followed by * and * followed by a suffix, are matched without the
+ * general algorithm.
+ */
+class NamePattern
+{
+public:
+	/** A pattern matching every name. */
+	NamePattern() : mKind(UFS_PATTERN_ALL) {}
+	/** Compiles aPattern, NULL or an empty pattern match every name. */
+	void Compile(LPCWSTR aPattern);
+	bool Match(LPCWSTR aName) const;
+	bool MatchesAll() const { return mKind == UFS_PATTERN_ALL; }
+	/** The characters before the first wildcard, which every matching name starts with, in their original case.
+	 * Sorted listings can skip to the names starting with it.
+	 */
+	const std::wstring& Prefix() const { return mPrefix; }
+
+private:
+	enum Kind {
+		UFS_PATTERN_ALL, /* * */
+		UFS_PATTERN_NAME, /* No wildcard. */
+		UFS_PATTERN_PREFIX, /* Characters then *. */
+		UFS_PATTERN_SUFFIX, /* * then characters, like *.obj. */
+		UFS_PATTERN_GENERAL
+	};
+	bool MatchGeneral(LPCWSTR aName, size_t aLength) const;
+
+	Kind mKind;
+	std::wstring mPrefix;
+	std::wstring mFolded; /* The characters of the pattern folded to lower case, without the * of the fast shapes. */
+};
@@ -0,0 +1,231 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "stdafx.h"
+#include <windows.h>
+#include <deque>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "ParallelProbe.h"
+
+bool gParallelProbesEnabled;
+
+struct ProbeState {
+	WCHAR mPath[MAX_PATHW];
+	DWORD mAttributes;
+	DWORD mError;
+	HANDLE mDone; /* Set when the answer is in. */
+	LONG mReferences; /* The probe and the queue, the last one to let go recycles the state. */
+	bool mClaimed; /* By a probe thread, or by the caller that cancels it or probes itself. Guarded by gProbeQueue.mLock. */
+};
+class ProbeStatePool : public std::vector<ProbeState*>
+{
+public:
+	ProbeStatePool() : std::vector<ProbeState*>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~ProbeStatePool() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+static ProbeStatePool gProbeStates;
+class ProbeQueue : public std::deque<ProbeState*>
+{
+public:
+	ProbeQueue() : std::deque<ProbeState*>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~ProbeQueue() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+static ProbeQueue gProbeQueue;
+static volatile LONG gProbesRunning; /* Queued or running. */
+static HANDLE gProbeWork; /* A semaphore counting gProbeQueue. */
+static HANDLE gStopProbing;
+static HANDLE gProbeThreads[UFS_PROBE_THREADS];
+
+static void Release(ProbeState* apState)
+{
+	if (InterlockedDecrement(&apState->mReferences))
+		return;
+	{
+		CriticalSectionLock lock(gProbeStates.mLock);
+		if (gProbeStates.size() < UFS_PROBE_POOL) {
+			try {
+				gProbeStates.push_back(apState);
+				return;
+			} catch (...) {
+			}
+		}
+	}
+	CloseHandle(apState->mDone);
+	delete apState;
+}
+
+/** Claims apState. @return true if it was claimed already. */
+static bool Claim(ProbeState* apState)
+{
+	CriticalSectionLock lock(gProbeQueue.mLock);
+	bool claimed = apState->mClaimed;
+	apState->mClaimed = true;
+	return claimed;
+}
+
+static DWORD WINAPI ProbeThread(LPVOID)
+{
+	HANDLE events[2] = {gStopProbing, gProbeWork};
+	while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		ProbeState* state;
+		bool claimed;
+		{
+			CriticalSectionLock lock(gProbeQueue.mLock);
+			if (gProbeQueue.empty())
+				continue;
+			state = gProbeQueue.front();
+			gProbeQueue.pop_front();
+			claimed = state->mClaimed;
+			state->mClaimed = true;
+		}
+		if (!claimed) {
+			state->mAttributes = GetReadRootAttributes(state->mPath);
+			state->mError = GetLastError();
+			SetEvent(state->mDone);
+		}
+		Release(state);
+		InterlockedDecrement(&gProbesRunning);
+	}
+	return 0;
+}
+
+ReadRootProbe::ReadRootProbe(LPCWSTR aReadFilePath) : mpState(NULL)
+{
+	if (!aReadFilePath || !gParallelProbesEnabled)
+		return;
+	{
+		CriticalSectionLock lock(gProbeStates.mLock);
+		if (!gProbeStates.empty()) {
+			mpState = gProbeStates.back();
+			gProbeStates.pop_back();
+		}
+	}
+	if (mpState)
+		ResetEvent(mpState->mDone);
+	else {
+		try {
+			mpState = new ProbeState;
+		} catch (...) {
+			return;
+		}
+		if (!(mpState->mDone = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+			delete mpState;
+			mpState = NULL;
+			return;
+		}
+	}
+	wcscpy(mpState->mPath, aReadFilePath);
+	mpState->mReferences = 2;
+	mpState->mClaimed = false;
+	InterlockedIncrement(&gProbesRunning);
+	bool queued = false;
+	{
+		CriticalSectionLock lock(gProbeQueue.mLock);
+		try {
+			gProbeQueue.push_back(mpState);
+			queued = true;
+		} catch (...) {
+		}
+		if (queued && !ReleaseSemaphore(gProbeWork, 1, NULL)) {
+			gProbeQueue.pop_back();
+			queued = false;
+		}
+	}
+	if (!queued) {
+		InterlockedDecrement(&gProbesRunning);
+		mpState->mReferences = 1;
+		Release(mpState);
+		mpState = NULL;
+	}
+}
+
+ReadRootProbe::~ReadRootProbe()
+{
+	if (mpState) {
+		Claim(mpState); // Cancels it if no thread took it.
+		Release(mpState);
+	}
+}
+
+DWORD ReadRootProbe::Attributes(LPCWSTR aReadFilePath)
+{
+	if (!mpState || !Claim(mpState))
+		return GetReadRootAttributes(aReadFilePath);
+	WaitForSingleObject(mpState->mDone, INFINITE);
+	DWORD attributes = mpState->mAttributes;
+	SetLastError(mpState->mError);
+	return attributes;
+}
+
+bool ParallelProbesStart()
+{
+	if (!(gProbeWork = CreateSemaphore(NULL, 0, UFS_PROBE_QUEUE, NULL)))
+		return true;
+	if (!(gStopProbing = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+		CloseHandle(gProbeWork);
+		return true;
+	}
+	for (int i = 0; i < UFS_PROBE_THREADS; ++i)
+		if (!(gProbeThreads[i] = CreateThread(NULL, 0, ProbeThread, NULL, 0, NULL))) {
+			DWORD error = GetLastError();
+			SetEvent(gStopProbing);
+			WaitForMultipleObjects(i, gProbeThreads, TRUE, INFINITE);
+			while (i--)
+				CloseHandle(gProbeThreads[i]);
+			CloseHandle(gStopProbing);
+			CloseHandle(gProbeWork);
+			SetLastError(error);
+			return true;
+		}
+	gParallelProbesEnabled = true;
+	return false;
+}
+
+void ParallelProbesWait()
+{
+	while (gProbesRunning)
+		Sleep(10);
+}
+
+void ParallelProbesStop()
+{
+	if (!gParallelProbesEnabled)
+		return;
+	gParallelProbesEnabled = false;
+	ParallelProbesWait();
+	SetEvent(gStopProbing);
+	WaitForMultipleObjects(UFS_PROBE_THREADS, gProbeThreads, TRUE, INFINITE);
+	for (int i = 0; i < UFS_PROBE_THREADS; ++i)
+		CloseHandle(gProbeThreads[i]);
+	CloseHandle(gStopProbing);
+	CloseHandle(gProbeWork);
+}
@@ -0,0 +1,68 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/** Parallel resolution.
+ * UFSCreateFile probes the write root and, on a miss, the read root: with remote roots every miss costs two
+ * round trips. When enabled, the read root probe is queued for one of UFS_PROBE_THREADS threads before the
+ * write root probe, the caller checks the whiteouts while both run, and the answer of the write root wins
+ * when it has the file, the read root answer then being dropped when it comes. Write root hits thus pay a
+ * read root probe nobody waits for, unless no thread took it yet: it is then cancelled. A caller needing
+ * the answer of a probe no thread took yet probes itself rather than wait behind the others.
+ */
+
+/* Probe states kept for reuse. */
+#define UFS_PROBE_POOL 64
+/* The probes run on this many threads, so that their per thread state does not grow with the probes. */
+#define UFS_PROBE_THREADS 16
+/* Probes waiting for a thread at most, more are done by their callers. */
+#define UFS_PROBE_QUEUE 256
+
+extern bool gParallelProbesEnabled;
+
+struct ProbeState;
+
+/** The attributes of a read root path, asked on a pool thread while the caller does something else. */
+class ReadRootProbe
+{
+public:
+	/** Queues the probe of aReadFilePath, unless it is NULL, the probes are not enabled or the queue is full. */
+	ReadRootProbe(LPCWSTR aReadFilePath);
+	/** Drops the answer of a probe nobody waited for. */
+	~ReadRootProbe();
+	bool Running() const {
+		return mpState != NULL;
+	}
+	/** Waits for the answer, or probes aReadFilePath on the calling thread if no probe runs.
+	 * @return Like GetReadRootAttributes, GetLastError tells why it returned INVALID_FILE_ATTRIBUTES.
+	 */
+	DWORD Attributes(LPCWSTR aReadFilePath);
+private:
+	ProbeState* mpState;
+};
+
+/** Starts the probe threads and enables the probes.
+ * @return false on success.
+ */
+bool ParallelProbesStart();
+/** Waits for the dropped probes still running, before the layers they use go away. */
+void ParallelProbesWait();
+/** Waits for the probes still running and stops the threads. */
+void ParallelProbesStop();
@@ -0,0 +1,323 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "Prefetcher.h"
+
+bool gPrefetchEnabled;
+
+struct Successor {
+	wstring mPath;
+	ULONG mCount;
+};
+/* Most seen first. */
+typedef vector<Successor> SuccessorList;
+struct Prefetched {
+	DWORD mTime; /* GetTickCount when queued. */
+	DWORD mBytes; /* Read by the prefetch. */
+};
+
+/* Guarded by gPrefetchLock, all paths are cleaned. */
+static CRITICAL_SECTION gPrefetchLock;
+static map<wstring, SuccessorList> gSuccessors;
+static map<wstring, wstring> gLastInDirectory;
+static wstring gLastOpen;
+static deque<wstring> gPrefetchQueue;
+static map<wstring, Prefetched> gPrefetched; /* Queued or prefetched, and not opened yet. */
+static ULONGLONG gBudget, gBudgetLimit; /* Bytes the prefetches may still read, refilled every second. */
+static DWORD gBudgetTime;
+static ULONG64 gPredicted, gDropped, gWarmed, gFailed, gUseful, gWasted, gWastedBytes;
+
+static HANDLE gPrefetchWork; /* A semaphore counting gPrefetchQueue. */
+static HANDLE gStopPrefetching;
+static HANDLE gPrefetchThreads[UFS_PREFETCH_THREADS];
+static wstring gWarming[UFS_PREFETCH_THREADS]; /* The file each thread is reading, guarded by gPrefetchLock. */
+static HANDLE gWarmingDone[UFS_PREFETCH_THREADS]; /* Set while the thread is not reading. */
+/* The file each thread read last and GetTickCount when it was done, guarded by gPrefetchLock. */
+static wstring gLastWarmed[UFS_PREFETCH_THREADS];
+static DWORD gLastWarmedTime[UFS_PREFETCH_THREADS];
+static BYTE gPrefetchBuffers[UFS_PREFETCH_THREADS][UFS_PREFETCH_BYTES]; /* Only the system cache keeps the data. */
+
+static inline wstring DirectoryOf(const wstring& aPath)
+{
+	size_t end = aPath.rfind(L'\\');
+	return end == wstring::npos ? wstring() : aPath.substr(0, end);
+}
+
+/* Records that aNext was opened after aPath. */
+static void Learn(const wstring& aPath, const wstring& aNext)
+{
+	if (gSuccessors.size() >= UFS_PREFETCH_FILES && gSuccessors.find(aPath) == gSuccessors.end())
+		gSuccessors.clear();
+	SuccessorList& successors = gSuccessors[aPath];
+	size_t i;
+	for (i = 0; i < successors.size() && successors[i].mPath != aNext; ++i)
+		;
+	if (i == successors.size()) {
+		Successor successor;
+		successor.mPath = aNext;
+		successor.mCount = 0;
+		if (successors.size() < UFS_PREFETCH_SUCCESSORS)
+			successors.push_back(successor);
+		else
+			successors[--i] = successor; /* Replaces the least seen. */
+	}
+	if (++successors[i].mCount == 0xFFFF)
+		for (size_t halved = 0; halved < successors.size(); ++halved)
+			successors[halved].mCount /= 2;
+	for (; i && successors[i].mCount > successors[i-1].mCount; --i)
+		swap(successors[i], successors[i-1]);
+}
+
+/* Queues the files predicted to follow aPath. */
+static void Predict(const wstring& aPath)
+{
+	vector<wstring> level(1, aPath), next;
+	ULONG predicted = 0;
+	DWORD now = GetTickCount();
+	for (int depth = 0; depth < UFS_PREFETCH_DEPTH && !level.empty(); ++depth) {
+		next.clear();
+		for (size_t i = 0; i < level.size(); ++i) {
+			map<wstring, SuccessorList>::iterator it = gSuccessors.find(level[i]);
+			if (it == gSuccessors.end())
+				continue;
+			for (SuccessorList::iterator successor = it->second.begin();
+				successor != it->second.end() && successor->mCount >= UFS_PREFETCH_MIN_COUNT; ++successor) {
+				if (predicted == UFS_PREFETCH_PREDICTIONS)
+					return;
+				if (successor->mPath == aPath || gPrefetched.find(successor->mPath) != gPrefetched.end())
+					continue;
+				++predicted;
+				++gPredicted;
+				if (gPrefetchQueue.size() >= UFS_PREFETCH_QUEUE) {
+					++gDropped;
+					continue;
+				}
+				Prefetched prefetched = {now, 0};
+				gPrefetched[successor->mPath] = prefetched;
+				gPrefetchQueue.push_back(successor->mPath);
+				ReleaseSemaphore(gPrefetchWork, 1, NULL);
+				next.push_back(successor->mPath);
+			}
+		}
+		level.swap(next);
+	}
+}
+
+/* Counts the prefetches not opened within UFS_PREFETCH_WINDOW as wasted, called with the lock held. */
+static void Expire()
+{
+	DWORD now = GetTickCount();
+	for (map<wstring, Prefetched>::iterator it = gPrefetched.begin(); it != gPrefetched.end();)
+		if (now - it->second.mTime >= UFS_PREFETCH_WINDOW) {
+			++gWasted;
+			gWastedBytes += it->second.mBytes;
+			gPrefetched.erase(it++);
+		} else
+			++it;
+}
+
+void NotePrefetchOpen(LPCWSTR aFileName)
+{
+	try {
+		wstring path(aFileName);
+		CleanFileName(path);
+		wstring directory = DirectoryOf(path);
+		CriticalSectionLock lock(gPrefetchLock);
+		map<wstring, Prefetched>::iterator prefetched = gPrefetched.find(path);
+		if (prefetched != gPrefetched.end()) {
+			++gUseful;
+			gPrefetched.erase(prefetched);
+		}
+		Expire();
+		if (gLastInDirectory.size() >= UFS_PREFETCH_DIRECTORIES && gLastInDirectory.find(directory) == gLastInDirectory.end())
+			gLastInDirectory.clear();
+		wstring& last = gLastInDirectory[directory];
+		if (!last.empty() && last != path)
+			Learn(last, path);
+		last = path;
+		if (!gLastOpen.empty() && DirectoryOf(gLastOpen) != directory)
+			Learn(gLastOpen, path);
+		gLastOpen = path;
+		Predict(path);
+	} catch (...) {
+		DbgPrint(L"Exception thrown in NotePrefetchOpen.\n");
+	}
+}
+
+/* Resolves aPath and reads its first bytes into aBuffer if the budget allows.
+ * @return The bytes read, or -1 if the file cannot be prefetched.
+ */
+static LONG Warm(const wstring& aPath, LPBYTE aBuffer)
+{
+	WCHAR filePath[MAX_PATHW];
+	int area = GetFilePath(filePath, aPath.c_str());
+	if (area == UFS_FAILED)
+		return -1;
+	if (area == UFS_WRITE_AREA)
+		return 0; /* Only the metadata, see Prefetcher.h. */
+	{
+		CriticalSectionLock lock(gPrefetchLock);
+		DWORD now = GetTickCount();
+		gBudget += (ULONGLONG)(now - gBudgetTime) * gBudgetLimit / 1000;
+		if (gBudget > gBudgetLimit)
+			gBudget = gBudgetLimit;
+		gBudgetTime = now;
+		if (gBudget < UFS_PREFETCH_BYTES)
+			return 0; /* Only the metadata. */
+		gBudget -= UFS_PREFETCH_BYTES;
+	}
+	/* The handle shares everything, yet an open sharing nothing fails while it is open: such opens wait for
+	 * it, see WaitForPrefetch. */
+	HANDLE file = gReadLayer->Open(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN);
+	if (file == INVALID_HANDLE_VALUE)
+		return -1;
+	DWORD read = 0;
+	BOOL success = gReadLayer->Read(file, aBuffer, UFS_PREFETCH_BYTES, &read, 0);
+	gReadLayer->Close(file);
+	return success ? (LONG)read : -1;
+}
+
+bool WaitForPrefetch(LPCWSTR aFileName)
+{
+	HANDLE done = NULL;
+	bool warmed = false;
+	try {
+		wstring path(aFileName);
+		CleanFileName(path);
+		CriticalSectionLock lock(gPrefetchLock);
+		DWORD now = GetTickCount();
+		for (int i = 0; i < UFS_PREFETCH_THREADS; ++i)
+			if (gWarming[i] == path)
+				done = gWarmingDone[i];
+			else if (gLastWarmed[i] == path && now - gLastWarmedTime[i] < UFS_PREFETCH_RETRY_WINDOW)
+				warmed = true; // It may have closed the file between the failed open and now.
+	} catch (...) {
+		return false;
+	}
+	if (done)
+		return WaitForSingleObject(done, INFINITE) == WAIT_OBJECT_0;
+	return warmed;
+}
+
+/* aIndex picks the buffer of the thread. */
+static DWORD WINAPI PrefetchThread(LPVOID aIndex)
+{
+	HANDLE events[2] = {gStopPrefetching, gPrefetchWork};
+	while (WaitForMultipleObjects(2, events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		wstring path;
+		{
+			CriticalSectionLock lock(gPrefetchLock);
+			if (gPrefetchQueue.empty())
+				continue;
+			try {
+				path = gPrefetchQueue.front();
+				gWarming[(size_t)aIndex] = path;
+			} catch (...) {
+				continue;
+			}
+			gPrefetchQueue.pop_front();
+			ResetEvent(gWarmingDone[(size_t)aIndex]);
+		}
+		LONG read = Warm(path, gPrefetchBuffers[(size_t)aIndex]);
+		CriticalSectionLock lock(gPrefetchLock);
+		gLastWarmed[(size_t)aIndex].swap(gWarming[(size_t)aIndex]);
+		gLastWarmedTime[(size_t)aIndex] = GetTickCount();
+		gWarming[(size_t)aIndex].erase();
+		SetEvent(gWarmingDone[(size_t)aIndex]);
+		map<wstring, Prefetched>::iterator it = gPrefetched.find(path);
+		if (read < 0) {
+			++gFailed;
+			if (it != gPrefetched.end())
+				gPrefetched.erase(it);
+		} else {
+			++gWarmed;
+			if (it != gPrefetched.end())
+				it->second.mBytes = (DWORD)read;
+		}
+		Expire();
+	}
+	return 0;
+}
+
+bool PrefetcherStart(ULONG aMegabytesPerSecond)
+{
+	gBudgetLimit = gBudget = (ULONGLONG)aMegabytesPerSecond * 1024 * 1024;
+	gBudgetTime = GetTickCount();
+	if (!(gPrefetchWork = CreateSemaphore(NULL, 0, UFS_PREFETCH_QUEUE, NULL)))
+		return true;
+	if (!(gStopPrefetching = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+		CloseHandle(gPrefetchWork);
+		return true;
+	}
+	InitializeCriticalSection(&gPrefetchLock);
+	for (int i = 0; i < UFS_PREFETCH_THREADS; ++i)
+		if (!(gWarmingDone[i] = CreateEvent(NULL, TRUE, TRUE, NULL)) ||
+			!(gPrefetchThreads[i] = CreateThread(NULL, 0, PrefetchThread, (LPVOID)(size_t)i, 0, NULL))) {
+			DWORD error = GetLastError();
+			SetEvent(gStopPrefetching);
+			WaitForMultipleObjects(i, gPrefetchThreads, TRUE, INFINITE);
+			if (gWarmingDone[i])
+				CloseHandle(gWarmingDone[i]);
+			while (i--) {
+				CloseHandle(gPrefetchThreads[i]);
+				CloseHandle(gWarmingDone[i]);
+			}
+			DeleteCriticalSection(&gPrefetchLock);
+			CloseHandle(gStopPrefetching);
+			CloseHandle(gPrefetchWork);
+			SetLastError(error);
+			return true;
+		}
+	gPrefetchEnabled = true;
+	return false;
+}
+
+void PrefetcherStop()
+{
+	if (!gPrefetchEnabled)
+		return;
+	gPrefetchEnabled = false;
+	SetEvent(gStopPrefetching);
+	WaitForMultipleObjects(UFS_PREFETCH_THREADS, gPrefetchThreads, TRUE, INFINITE);
+	for (int i = 0; i < UFS_PREFETCH_THREADS; ++i) {
+		CloseHandle(gPrefetchThreads[i]);
+		CloseHandle(gWarmingDone[i]);
+	}
+	CloseHandle(gStopPrefetching);
+	CloseHandle(gPrefetchWork);
+	Expire();
+	DeleteCriticalSection(&gPrefetchLock);
+	if (!gPredicted)
+		return;
+	fwprintf(stderr, L"Prefetches: %I64u predicted, %I64u dropped, %I64u warmed, %I64u failed\n",
+		gPredicted, gDropped, gWarmed, gFailed);
+	fwprintf(stderr, L"	%I64u useful, %I64u wasted (%I64u KB read for nothing), %.1f%% accurate\n", gUseful, gWasted,
+		gWastedBytes / 1024, gUseful + gWasted ? 100.0 * (double)(LONGLONG)gUseful / (double)(LONGLONG)(gUseful + gWasted) : 0.0);
+}
@@ -0,0 +1,68 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/** Prefetching of the files predicted to be opened next.
+ * Builds open files in predictable groups: the headers of a directory one after the other, the same chain
+ * of dependencies on every run. Every file opened through UFSCreateFile records which files were opened
+ * after it, in a successor table of at most UFS_PREFETCH_SUCCESSORS entries per file. A successor is
+ * learned from the previous file opened in the same directory, so that the builds of other directories
+ * running meanwhile do not blur the sibling order, and from the previous file opened anywhere when it lies
+ * in another directory, which follows the chains. An open then queues the successors seen at least
+ * UFS_PREFETCH_MIN_COUNT times, and theirs up to UFS_PREFETCH_DEPTH, for UFS_PREFETCH_THREADS threads
+ * that resolve them, warming the layer metadata, and read the first UFS_PREFETCH_BYTES of the read root
+ * ones while the read budget lasts. Write root files are only resolved: the union writes them, often through
+ * handles that share nothing, and wrote their data through the local cache. A prefetched file opened within
+ * UFS_PREFETCH_WINDOW counts as useful, wasted otherwise.
+ */
+
+#define UFS_PREFETCH_SUCCESSORS 4
+#define UFS_PREFETCH_MIN_COUNT 2
+#define UFS_PREFETCH_DEPTH 2
+/* Files queued per open at most. */
+#define UFS_PREFETCH_PREDICTIONS 4
+#define UFS_PREFETCH_THREADS 2
+/* Predictions beyond this many waiting are dropped. */
+#define UFS_PREFETCH_QUEUE 64
+#define UFS_PREFETCH_BYTES 65536
+#define UFS_PREFETCH_WINDOW 10000
+/* An open failing on a file a prefetch read this many milliseconds ago is retried, the prefetch may have held it. */
+#define UFS_PREFETCH_RETRY_WINDOW 1000
+/* Files and directories learned at most, the tables restart beyond it. */
+#define UFS_PREFETCH_FILES 65536
+#define UFS_PREFETCH_DIRECTORIES 4096
+
+extern bool gPrefetchEnabled;
+
+/** Starts the prefetch threads, reading at most aMegabytesPerSecond from the files they prefetch.
+ * @return false on success.
+ */
+bool PrefetcherStart(ULONG aMegabytesPerSecond);
+/** Stops the threads and prints how accurate the predictions were. */
+void PrefetcherStop();
+
+/** Learns from the open of the file aFileName and queues the files predicted to follow it. */
+void NotePrefetchOpen(LPCWSTR aFileName);
+/** Waits until no prefetch is reading the file aFileName, for an open that its handle made fail with
+ * ERROR_SHARING_VIOLATION.
+ * @return true if a prefetch was reading it or read it within UFS_PREFETCH_RETRY_WINDOW, the open may be
+ * retried.
+ */
+bool WaitForPrefetch(LPCWSTR aFileName);
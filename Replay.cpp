@@ -0,0 +1,326 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "dokan.h"
+#include "UFSTraceReader.h"
+#include "LatencyHistogram.h"
+#include "Replay.h"
+
+/** An open file of the recording: the calls from the open to the close of one open id. */
+struct ReplayOpen {
+	DOKAN_FILE_INFO mInfo;
+	ULONG mCallCount; /* Calls on this open, counted while the streams are built. */
+	volatile LONG mDone; /* Calls on this open replayed so far. */
+};
+
+struct ReplayCall {
+	const UFSTraceRecord* mpRecord;
+	ReplayOpen* mpOpen; /* NULL for calls made without an open file. */
+	ULONG mOpenSequence; /* Position of the call among the calls on mpOpen. */
+};
+
+/** The calls of one recorded thread and the results of replaying them. */
+struct ReplayStream {
+	DWORD mThreadId; /* Names the paths of the calls with their path ids. */
+	vector<ReplayCall> mCalls;
+	LatencyHistogram mLatency[UFS_TRACE_EVENT_COUNT]; /* In nanoseconds. */
+	ULONG64 mDiverged[UFS_TRACE_EVENT_COUNT];
+	ULONG64 mSkipped;
+	vector<char> mBuffer;
+};
+
+static PDOKAN_OPERATIONS gReplayOperations;
+static const UFSTraceReader* gReplayTrace;
+static bool gReplayAsFastAsPossible;
+static HANDLE gReplayStart;
+static LONGLONG gReplayStartTime, gRecordStartTime;
+static double gReplayTicksPerRecordTick, gNanosecondsPerTick;
+
+static int WINAPI IgnoreFindData(PWIN32_FIND_DATAW, PDOKAN_FILE_INFO)
+{
+	return 0;
+}
+
+static bool IsOpenEvent(USHORT aEvent)
+{
+	return aEvent == UFS_TRACE_CREATE_FILE || aEvent == UFS_TRACE_OPEN_DIRECTORY || aEvent == UFS_TRACE_CREATE_DIRECTORY;
+}
+
+/** Makes the call aRecord describes.
+ * @return the status of the call, or false in aReplayed when the recording lacks what the call needs.
+ */
+static int ReplayOne(const UFSTraceRecord& aRecord, DWORD aThreadId, DOKAN_FILE_INFO& aInfo, vector<char>& aBuffer, bool& aReplayed)
+{
+	const UFSTraceCall& call = aRecord.mCall;
+	LPCWSTR fileName = NULL;
+	if (aRecord.mPathId) {
+		const wstring* path = gReplayTrace->FindPath(aThreadId, aRecord.mPathId);
+		if (!path) {
+			aReplayed = false;
+			return 0;
+		}
+		fileName = path->c_str();
+	}
+	aReplayed = true;
+	if (aRecord.mFlags & UFS_TRACE_IS_DIRECTORY)
+		aInfo.IsDirectory = TRUE;
+	aInfo.DeleteOnClose = (aRecord.mFlags & UFS_TRACE_DELETE_ON_CLOSE) ? TRUE : FALSE;
+	aInfo.WriteToEndOfFile = (aRecord.mFlags & UFS_TRACE_WRITE_TO_END_OF_FILE) ? TRUE : FALSE;
+	if ((aRecord.mEvent == UFS_TRACE_READ_FILE || aRecord.mEvent == UFS_TRACE_WRITE_FILE) && aBuffer.size() < call.mArg1)
+		aBuffer.resize(call.mArg1);
+	DWORD done;
+	switch (aRecord.mEvent) {
+		case UFS_TRACE_CREATE_FILE:
+			return gReplayOperations->CreateFile(fileName, call.mArg1, call.mArg2 >> 16, call.mArg2 & 0xFFFF, (DWORD)call.mArg0, &aInfo);
+		case UFS_TRACE_OPEN_DIRECTORY:
+			return gReplayOperations->OpenDirectory(fileName, &aInfo);
+		case UFS_TRACE_CREATE_DIRECTORY:
+			return gReplayOperations->CreateDirectory(fileName, &aInfo);
+		case UFS_TRACE_CLEANUP:
+			return gReplayOperations->Cleanup(fileName, &aInfo);
+		case UFS_TRACE_CLOSE_FILE:
+			return gReplayOperations->CloseFile(fileName, &aInfo);
+		case UFS_TRACE_READ_FILE:
+			return gReplayOperations->ReadFile(fileName, aBuffer.empty() ? NULL : &aBuffer[0], call.mArg1, &done, call.mArg0, &aInfo);
+		case UFS_TRACE_WRITE_FILE:
+			return gReplayOperations->WriteFile(fileName, aBuffer.empty() ? NULL : &aBuffer[0], call.mArg1, &done, call.mArg0, &aInfo);
+		case UFS_TRACE_FLUSH_FILE_BUFFERS:
+			return gReplayOperations->FlushFileBuffers(fileName, &aInfo);
+		case UFS_TRACE_GET_FILE_INFORMATION: {
+			BY_HANDLE_FILE_INFORMATION information;
+			return gReplayOperations->GetFileInformation(fileName, &information, &aInfo);
+		}
+		case UFS_TRACE_FIND_FILES: {
+			if (!call.mArg0)
+				return gReplayOperations->FindFiles(fileName, IgnoreFindData, &aInfo);
+			const wstring* pattern = gReplayTrace->FindPath(aThreadId, (ULONG)call.mArg0);
+			if (!pattern) {
+				aReplayed = false;
+				return 0;
+			}
+			return gReplayOperations->FindFilesWithPattern(fileName, pattern->c_str(), IgnoreFindData, &aInfo);
+		}
+		case UFS_TRACE_SET_FILE_ATTRIBUTES:
+			return gReplayOperations->SetFileAttributes(fileName, (DWORD)call.mArg0, &aInfo);
+		case UFS_TRACE_SET_FILE_TIME:
+			/* The times are not recorded, NULL leaves them as they are. */
+			return gReplayOperations->SetFileTime(fileName, NULL, NULL, NULL, &aInfo);
+		case UFS_TRACE_DELETE_FILE:
+			return gReplayOperations->DeleteFile(fileName, &aInfo);
+		case UFS_TRACE_DELETE_DIRECTORY:
+			return gReplayOperations->DeleteDirectory(fileName, &aInfo);
+		case UFS_TRACE_MOVE_FILE: {
+			const wstring* newPath = gReplayTrace->FindPath(aThreadId, (ULONG)call.mArg0);
+			if (!newPath) {
+				aReplayed = false;
+				return 0;
+			}
+			return gReplayOperations->MoveFile(fileName, newPath->c_str(), call.mArg1, &aInfo);
+		}
+		case UFS_TRACE_SET_END_OF_FILE:
+			return gReplayOperations->SetEndOfFile(fileName, call.mArg0, &aInfo);
+		case UFS_TRACE_SET_ALLOCATION_SIZE:
+			return gReplayOperations->SetAllocationSize(fileName, call.mArg0, &aInfo);
+		case UFS_TRACE_LOCK_FILE:
+			return gReplayOperations->LockFile(fileName, call.mArg0, call.mArg1, &aInfo);
+		case UFS_TRACE_UNLOCK_FILE:
+			return gReplayOperations->UnlockFile(fileName, call.mArg0, call.mArg1, &aInfo);
+		case UFS_TRACE_GET_DISK_FREE_SPACE: {
+			ULONGLONG available, total, free;
+			return gReplayOperations->GetDiskFreeSpace(&available, &total, &free, &aInfo);
+		}
+		case UFS_TRACE_GET_VOLUME_INFORMATION: {
+			WCHAR volumeName[MAX_PATH], fileSystemName[MAX_PATH];
+			DWORD serialNumber, maximumComponentLength, fileSystemFlags;
+			return gReplayOperations->GetVolumeInformation(volumeName, MAX_PATH, &serialNumber, &maximumComponentLength,
+				&fileSystemFlags, fileSystemName, MAX_PATH, &aInfo);
+		}
+	}
+	/* Unmount is not replayed, the roots stay in use. */
+	aReplayed = false;
+	return 0;
+}
+
+static DWORD WINAPI ReplayThreadMain(LPVOID apStream)
+{
+	ReplayStream& stream = *(ReplayStream*)apStream;
+	WaitForSingleObject(gReplayStart, INFINITE);
+	for (vector<ReplayCall>::iterator call = stream.mCalls.begin(); call != stream.mCalls.end(); ++call) {
+		const UFSTraceRecord& record = *call->mpRecord;
+		LARGE_INTEGER now;
+		if (!gReplayAsFastAsPossible) {
+			LONGLONG due = gReplayStartTime + (LONGLONG)((double)(record.mTimestamp - gRecordStartTime) * gReplayTicksPerRecordTick);
+			for (QueryPerformanceCounter(&now); now.QuadPart < due; QueryPerformanceCounter(&now))
+				if ((double)(due - now.QuadPart) * gNanosecondsPerTick > 2000000)
+					Sleep(1);
+				else
+					Sleep(0);
+		}
+		if (call->mpOpen)
+			while ((ULONG)call->mpOpen->mDone != call->mOpenSequence)
+				Sleep(0);
+		DOKAN_FILE_INFO localInfo;
+		DOKAN_FILE_INFO* info = call->mpOpen ? &call->mpOpen->mInfo : &localInfo;
+		if (!call->mpOpen || IsOpenEvent(record.mEvent)) {
+			ZeroMemory(info, sizeof(*info));
+			info->DokanContext = record.mOpenId;
+		}
+		bool replayed;
+		LARGE_INTEGER start;
+		QueryPerformanceCounter(&start);
+		int status = ReplayOne(record, stream.mThreadId, *info, stream.mBuffer, replayed);
+		QueryPerformanceCounter(&now);
+		if (call->mpOpen)
+			InterlockedIncrement(&call->mpOpen->mDone);
+		if (!replayed) {
+			++stream.mSkipped;
+			continue;
+		}
+		stream.mLatency[record.mEvent].Record((ULONG64)((double)(now.QuadPart - start.QuadPart) * gNanosecondsPerTick));
+		if ((status < 0) != (record.mCall.mStatus < 0))
+			++stream.mDiverged[record.mEvent];
+	}
+	return 0;
+}
+
+int RunReplay(PDOKAN_OPERATIONS apOperations, LPCWSTR aTraceFile, bool aAsFastAsPossible)
+{
+	UFSTraceReader trace;
+	switch (trace.Load(aTraceFile)) {
+		case UFS_TRACE_READ_FAILED:
+			fwprintf(stderr, L"Cannot read %s. Error: %d.\n", aTraceFile, GetLastError());
+			return 2;
+		case UFS_TRACE_READ_NOT_A_TRACE:
+			fwprintf(stderr, L"%s is not a WinUnionFS trace file.\n", aTraceFile);
+			return 2;
+	}
+	const vector<UFSTraceCallRef>& calls = trace.Calls();
+	if (calls.empty()) {
+		fwprintf(stderr, L"%s holds no calls.\n", aTraceFile);
+		return 2;
+	}
+	if (!(trace.Header().mFlags & UFS_TRACE_FILE_COMPLETE) || trace.DroppedRecords())
+		fwprintf(stderr, L"%s does not hold every call, record it with /y for a faithful replay.\n", aTraceFile);
+	LARGE_INTEGER frequency;
+	if (!QueryPerformanceFrequency(&frequency))
+		return 2;
+	gReplayOperations = apOperations;
+	gReplayTrace = &trace;
+	gReplayAsFastAsPossible = aAsFastAsPossible;
+	gNanosecondsPerTick = 1e9 / (double)frequency.QuadPart;
+	gReplayTicksPerRecordTick = (double)frequency.QuadPart / (double)trace.Header().mFrequency;
+	gRecordStartTime = calls.front().mpRecord->mTimestamp;
+
+	/* Split the calls into per thread streams and chain the calls of every open file. */
+	map<DWORD, ReplayStream*> streams;
+	map<ULONG, ReplayOpen*> currentOpens;
+	vector<ReplayOpen*> opens;
+	for (vector<UFSTraceCallRef>::const_iterator it = calls.begin(); it != calls.end(); ++it) {
+		ReplayStream*& stream = streams[it->mThreadId];
+		if (!stream) {
+			stream = new ReplayStream;
+			stream->mThreadId = it->mThreadId;
+			ZeroMemory(stream->mDiverged, sizeof(stream->mDiverged));
+			stream->mSkipped = 0;
+		}
+		ReplayCall call = {it->mpRecord, NULL, 0};
+		if (it->mpRecord->mOpenId) {
+			ReplayOpen*& open = currentOpens[it->mpRecord->mOpenId];
+			if (!open || IsOpenEvent(it->mpRecord->mEvent)) {
+				open = new ReplayOpen;
+				ZeroMemory(&open->mInfo, sizeof(open->mInfo));
+				open->mInfo.DokanContext = it->mpRecord->mOpenId;
+				open->mCallCount = 0;
+				open->mDone = 0;
+				opens.push_back(open);
+			}
+			call.mpOpen = open;
+			call.mOpenSequence = open->mCallCount++;
+		}
+		stream->mCalls.push_back(call);
+	}
+
+	int returnValue = 0;
+	vector<HANDLE> handles;
+	if (!(gReplayStart = CreateEvent(NULL, TRUE, FALSE, NULL))) {
+		fwprintf(stderr, L"Cannot create the replay start event. Error: %d.\n", GetLastError());
+		return 2;
+	}
+	for (map<DWORD, ReplayStream*>::iterator it = streams.begin(); it != streams.end(); ++it) {
+		HANDLE handle = CreateThread(NULL, 0, ReplayThreadMain, it->second, 0, NULL);
+		if (!handle) {
+			/* The threads started so far wait for the start event until the process exits. */
+			fwprintf(stderr, L"Cannot start a replay thread. Error: %d.\n", GetLastError());
+			return 2;
+		}
+		handles.push_back(handle);
+	}
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	gReplayStartTime = start.QuadPart;
+	SetEvent(gReplayStart);
+	for (size_t i = 0; i < handles.size(); ++i) {
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+	}
+	QueryPerformanceCounter(&end);
+	CloseHandle(gReplayStart);
+
+	double seconds = (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+	double recordedSeconds = (double)(calls.back().mpRecord->mTimestamp - gRecordStartTime) / (double)trace.Header().mFrequency;
+	ULONG64 skipped = 0, diverged = 0;
+	wprintf(L"%u calls in %u threads replayed in %.3f s, recorded in %.3f s, latencies in microseconds\n",
+		(ULONG)calls.size(), (ULONG)streams.size(), seconds, recordedSeconds);
+	wprintf(L"%-20s %10s %8s %9s %9s %9s %9s\n", L"call", L"count", L"diverged", L"mean", L"p50", L"p99", L"max");
+	for (USHORT event = UFS_TRACE_PATH_NAME + 1; event < UFS_TRACE_EVENT_COUNT; ++event) {
+		LatencyHistogram latency;
+		ULONG64 eventDiverged = 0;
+		for (map<DWORD, ReplayStream*>::iterator it = streams.begin(); it != streams.end(); ++it) {
+			latency.Merge(it->second->mLatency[event]);
+			eventDiverged += it->second->mDiverged[event];
+		}
+		if (!latency.Count())
+			continue;
+		diverged += eventDiverged;
+		wprintf(L"%-20S %10I64u %8I64u %9.1f %9.1f %9.1f %9.1f\n", UFSTraceEventName(event), latency.Count(),
+			eventDiverged, latency.Mean() / 1000, (double)(LONGLONG)latency.Percentile(0.5) / 1000,
+			(double)(LONGLONG)latency.Percentile(0.99) / 1000, (double)(LONGLONG)latency.Max() / 1000);
+	}
+	for (map<DWORD, ReplayStream*>::iterator it = streams.begin(); it != streams.end(); ++it) {
+		skipped += it->second->mSkipped;
+		delete it->second;
+	}
+	for (size_t i = 0; i < opens.size(); ++i)
+		delete opens[i];
+	if (skipped)
+		wprintf(L"%I64u calls were skipped, their paths were not recorded or they cannot be replayed.\n", skipped);
+	if (diverged) {
+		wprintf(L"%I64u calls succeeded or failed differently than recorded.\n", diverged);
+		returnValue = 1;
+	}
+	return returnValue;
+}
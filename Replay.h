@@ -0,0 +1,36 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Trace replay.
+ * Plays the calls of a file recorded with "WinUnionFS /y" back through a DOKAN_OPERATIONS table, without
+ * mounting a drive. Every recorded thread is replayed by a thread of its own, in the recorded order, and
+ * calls on the same open file wait for the calls recorded before them on that file, whichever thread made
+ * them. Calls start at their recorded time offsets, or back to back when aAsFastAsPossible is set.
+ * The replay prints the latency of every kind of call and the calls whose success or failure differed
+ * from the recording.
+ */
+
+/** Replays aTraceFile.
+ * @return the process exit code: 0 if every call succeeded or failed as recorded, 1 if some did not and
+ * 2 if the trace could not be replayed.
+ */
+int RunReplay(PDOKAN_OPERATIONS apOperations, LPCWSTR aTraceFile, bool aAsFastAsPossible);
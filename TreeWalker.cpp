@@ -0,0 +1,135 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+using namespace std;
+
+#include "TreeWalker.h"
+
+ParallelTreeWalker::ParallelTreeWalker() : mPending(0), mFailed(0)
+{
+}
+
+ParallelTreeWalker::~ParallelTreeWalker()
+{
+	Clear();
+}
+
+void ParallelTreeWalker::Clear()
+{
+	for (vector<Queue*>::iterator it = mQueues.begin(); it != mQueues.end(); ++it) {
+		DeleteCriticalSection(&(*it)->mLock);
+		delete *it;
+	}
+	mQueues.clear();
+}
+
+bool ParallelTreeWalker::Take(ULONG aIndex, wstring& aPath)
+{
+	ULONG count = (ULONG)mQueues.size();
+	for (ULONG i = 0; i < count; ++i) {
+		Queue* queue = mQueues[(aIndex + i) % count];
+		EnterCriticalSection(&queue->mLock);
+		if (!queue->mPaths.empty()) {
+			if (i) {
+				aPath = queue->mPaths.front();
+				queue->mPaths.pop_front();
+			} else {
+				aPath = queue->mPaths.back();
+				queue->mPaths.pop_back();
+			}
+			LeaveCriticalSection(&queue->mLock);
+			return true;
+		}
+		LeaveCriticalSection(&queue->mLock);
+	}
+	return false;
+}
+
+void ParallelTreeWalker::Work(ULONG aIndex)
+{
+	Queue* queue = mQueues[aIndex];
+	wstring path;
+	vector<wstring> subdirectories;
+	while (mPending) {
+		if (!Take(aIndex, path)) {
+			Sleep(1);
+			continue;
+		}
+		subdirectories.clear();
+		try {
+			Visit(path, subdirectories);
+		} catch (...) {
+			InterlockedExchange(&mFailed, 1);
+		}
+		if (!subdirectories.empty()) {
+			/* Counted before this directory is done, so mPending never drops to 0 early. */
+			InterlockedExchangeAdd(&mPending, (LONG)subdirectories.size());
+			EnterCriticalSection(&queue->mLock);
+			try {
+				queue->mPaths.insert(queue->mPaths.end(), subdirectories.begin(), subdirectories.end());
+			} catch (...) {
+				InterlockedExchange(&mFailed, 1);
+				InterlockedExchangeAdd(&mPending, -(LONG)subdirectories.size());
+			}
+			LeaveCriticalSection(&queue->mLock);
+		}
+		InterlockedDecrement(&mPending);
+	}
+}
+
+DWORD WINAPI ParallelTreeWalker::WorkerThread(LPVOID apWorker)
+{
+	Worker* worker = (Worker*)apWorker;
+	worker->mpWalker->Work(worker->mIndex);
+	return 0;
+}
+
+void ParallelTreeWalker::Run(const wstring& aRoot, ULONG aThreadCount)
+{
+	if (!aThreadCount)
+		aThreadCount = 1;
+	if (aThreadCount > MAXIMUM_WAIT_OBJECTS)
+		aThreadCount = MAXIMUM_WAIT_OBJECTS;
+	Clear();
+	for (ULONG i = 0; i < aThreadCount; ++i) {
+		Queue* queue = new Queue;
+		InitializeCriticalSection(&queue->mLock);
+		mQueues.push_back(queue);
+	}
+	mQueues[0]->mPaths.push_back(aRoot);
+	mPending = 1;
+	mFailed = 0;
+	vector<Worker> workers(aThreadCount);
+	vector<HANDLE> threads;
+	for (ULONG i = 1; i < aThreadCount; ++i) {
+		workers[i].mpWalker = this;
+		workers[i].mIndex = i;
+		HANDLE thread = CreateThread(NULL, 0, WorkerThread, &workers[i], 0, NULL);
+		if (thread)
+			threads.push_back(thread);
+	}
+	Work(0);
+	if (!threads.empty())
+		WaitForMultipleObjects((DWORD)threads.size(), &threads[0], TRUE, INFINITE);
+	for (vector<HANDLE>::iterator it = threads.begin(); it != threads.end(); ++it)
+		CloseHandle(*it);
+}
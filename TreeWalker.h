@@ -0,0 +1,70 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** A parallel walker over a tree of directories.
+ * Every thread owns a queue of directories to visit. A thread takes the directory it queued last, so it
+ * stays deep in the subtree it works on, and when its queue runs dry it steals the directory queued first
+ * by another thread, which roots the largest subtree that thread has not started on. The walk ends when no
+ * directory is queued or being visited.
+ */
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class ParallelTreeWalker
+{
+public:
+	ParallelTreeWalker();
+	virtual ~ParallelTreeWalker();
+
+	/** Visits aRoot and every directory the visits queue on aThreadCount threads, the calling one included.
+	 * Threads that cannot be started leave their share of the work to the others.
+	 */
+	void Run(const std::wstring& aRoot, ULONG aThreadCount);
+	/** Whether a visit threw, the subdirectories it queued before throwing are still visited. */
+	bool Failed() const { return mFailed != 0; }
+
+protected:
+	/** Visits the directory aRelativePath, appending the directories to visit next to aSubdirectories.
+	 * Called concurrently from the walker threads.
+	 */
+	virtual void Visit(const std::wstring& aRelativePath, std::vector<std::wstring>& aSubdirectories) = 0;
+
+private:
+	struct Queue {
+		CRITICAL_SECTION mLock;
+		std::deque<std::wstring> mPaths;
+	};
+	struct Worker {
+		ParallelTreeWalker* mpWalker;
+		ULONG mIndex;
+	};
+	static DWORD WINAPI WorkerThread(LPVOID apWorker);
+	void Work(ULONG aIndex);
+	bool Take(ULONG aIndex, std::wstring& aPath);
+	void Clear();
+
+	std::vector<Queue*> mQueues;
+	volatile LONG mPending; /* Directories queued or being visited. */
+	volatile LONG mFailed;
+};
@@ -0,0 +1,314 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* UFSTool check: checks of the engine run in process against scratch roots in the temp directory, so they
+ * need neither Dokan nor a mount.
+ */
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "MetadataLog.h"
+
+/* Fails the running check, naming aCondition, unless it holds. */
+#define UFS_EXPECT(aCondition) if (!(aCondition)) return Failed(#aCondition, __LINE__)
+
+static bool Failed(const char* apCondition, int aLine)
+{
+	fwprintf(stderr, L"\tline %d: %S does not hold. Last error: %d.\n", aLine, apCondition, GetLastError());
+	return true;
+}
+
+/** Writes aText to the write root file aRelativePath, the way the metadata file and log are stored. */
+static bool WriteText(LPCWSTR aRelativePath, const wstring& aText, DWORD aAttributes)
+{
+	WCHAR path[MAX_PATHW];
+	if (MakeWritePath(path, aRelativePath, wcslen(aRelativePath) * sizeof(WCHAR)))
+		return true;
+	HANDLE handle = gWriteLayer->Open(path, GENERIC_WRITE, 0, CREATE_ALWAYS, aAttributes);
+	if (handle == INVALID_HANDLE_VALUE)
+		return true;
+	DWORD written, length = (DWORD)(aText.size() * sizeof(WCHAR));
+	bool failed = !WriteFile(handle, aText.data(), length, &written, NULL) || written != length;
+	gWriteLayer->Close(handle);
+	return failed;
+}
+
+static bool WriteExists(LPCWSTR aRelativePath)
+{
+	WCHAR path[MAX_PATHW];
+	return !MakeWritePath(path, aRelativePath, wcslen(aRelativePath) * sizeof(WCHAR)) &&
+		gWriteLayer->GetAttributes(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+static bool IsRedirected(LPCWSTR aCleanPath, LPCWSTR aReadPath)
+{
+	CriticalSectionLock lock(gRedirects.mLock);
+	FilePathMap::const_iterator it = gRedirects.find(aCleanPath);
+	return it != gRedirects.end() && it->second == aReadPath;
+}
+
+/* A metadata file of epoch 3 holding a whiteout of \A. */
+static const WCHAR gMetadataText[] = L"UFSMETA 2\nL\t3\nW\t\\A\n";
+
+/** The log of the epoch of the metadata file is replayed over it. */
+static bool CheckLogReplay()
+{
+	UFS_EXPECT(!WriteText(UFS_METADATA_FILE, gMetadataText, 0));
+	UFS_EXPECT(!WriteText(UFS_METADATA_LOG_FILE, L"UFSMETALOG 1\t3\nW\t\\B\nR\t\\C\t\\D\nU\t\\A\n", 0));
+	UFS_EXPECT(!LoadMetadata());
+	UFS_EXPECT(!CheckDeleted(L"\\A"));
+	UFS_EXPECT(CheckDeleted(L"\\B"));
+	UFS_EXPECT(IsRedirected(L"\\C", L"\\D"));
+	return false;
+}
+
+/** The log of an older epoch is already in the metadata file and is skipped. */
+static bool CheckStaleLog()
+{
+	UFS_EXPECT(!WriteText(UFS_METADATA_FILE, gMetadataText, 0));
+	UFS_EXPECT(!WriteText(UFS_METADATA_LOG_FILE, L"UFSMETALOG 1\t2\nW\t\\B\nU\t\\A\n", 0));
+	UFS_EXPECT(!LoadMetadata());
+	UFS_EXPECT(CheckDeleted(L"\\A"));
+	UFS_EXPECT(!CheckDeleted(L"\\B"));
+	return false;
+}
+
+/** The replay stops at the record a crash cut short, and at a malformed one. */
+static bool CheckTruncatedLog()
+{
+	UFS_EXPECT(!WriteText(UFS_METADATA_FILE, gMetadataText, 0));
+	UFS_EXPECT(!WriteText(UFS_METADATA_LOG_FILE, L"UFSMETALOG 1\t3\nW\t\\B\nW\t\\C", 0));
+	UFS_EXPECT(!LoadMetadata());
+	UFS_EXPECT(CheckDeleted(L"\\B"));
+	UFS_EXPECT(!CheckDeleted(L"\\C"));
+	ClearMetadata();
+	UFS_EXPECT(!WriteText(UFS_METADATA_LOG_FILE, L"UFSMETALOG 1\t3\nW\t\\B\nX\t\\D\nW\t\\C\n", 0));
+	UFS_EXPECT(!LoadMetadata());
+	UFS_EXPECT(CheckDeleted(L"\\B"));
+	UFS_EXPECT(!CheckDeleted(L"\\C"));
+	return false;
+}
+
+/** A rename begun and not ended is made if the write root shows it done and dropped otherwise: a rename with
+ * a source is done once the source is gone, one without once its new name exists. An ended rename is left
+ * alone, its changes were logged with its end.
+ */
+static bool CheckRenameSettle()
+{
+	UFS_EXPECT(!WriteText(L"\\SRC2", L"", 0));
+	UFS_EXPECT(!WriteText(L"\\NEW3", L"", 0));
+	UFS_EXPECT(!WriteText(UFS_METADATA_FILE, L"UFSMETA 2\nL\t3\nW\t\\OLD7\\X\n", 0));
+	UFS_EXPECT(!WriteText(UFS_METADATA_LOG_FILE, L"UFSMETALOG 1\t3\n"
+		L"P\t1\t-W\t\\OLD1\t\\NEW1\t\\SRC1\t\\READ1\n"
+		L"P\t2\t-W\t\\OLD2\t\\NEW2\t\\SRC2\t\n"
+		L"P\t3\t-W\t\\OLD3\t\\NEW3\t\t\n"
+		L"P\t4\t-W\t\\OLD4\t\\NEW4\t\t\n"
+		L"P\t5\t-W\t\\OLD5\t\\NEW5\t\\SRC5\t\n"
+		L"E\t5\n"
+		L"P\t7\tM-\t\\OLD7\t\\NEW7\t\\SRC7\t\n", 0));
+	UFS_EXPECT(!LoadMetadata());
+	UFS_EXPECT(CheckDeleted(L"\\OLD1"));
+	UFS_EXPECT(IsRedirected(L"\\NEW1", L"\\READ1"));
+	UFS_EXPECT(!CheckDeleted(L"\\OLD2"));
+	UFS_EXPECT(CheckDeleted(L"\\OLD3"));
+	UFS_EXPECT(!CheckDeleted(L"\\OLD4"));
+	UFS_EXPECT(!CheckDeleted(L"\\OLD5"));
+	UFS_EXPECT(CheckDeleted(L"\\NEW7\\X"));
+	UFS_EXPECT(!CheckDeleted(L"\\OLD7\\X"));
+	return false;
+}
+
+/** The records the engine logs load back after a restart, settling the renames it did not end. */
+static bool CheckLogRoundTrip()
+{
+	UFS_EXPECT(!StartMetadataLog());
+	UnionRename done, interrupted, undone;
+	done.mOld = L"\\OLD1";
+	done.mNew = L"\\NEW1";
+	done.mSource = L"\\SRC1";
+	done.mMoveBelow = false;
+	done.mWhiteout = true;
+	interrupted = done;
+	interrupted.mOld = L"\\OLD2";
+	interrupted.mSource = L"\\SRC2";
+	undone = done;
+	undone.mOld = L"\\OLD3";
+	undone.mSource = L"\\SRC3";
+	UFS_EXPECT(!WriteText(L"\\SRC3", L"", 0));
+	MarkDeleted(L"\\GONE");
+	EndRename(BeginRename(done), done, true);
+	BeginRename(interrupted);
+	BeginRename(undone);
+	StopMetadataLog();
+	ClearMetadata();
+	UFS_EXPECT(!LoadMetadata());
+	UFS_EXPECT(CheckDeleted(L"\\GONE"));
+	UFS_EXPECT(CheckDeleted(L"\\OLD1"));
+	UFS_EXPECT(CheckDeleted(L"\\OLD2"));
+	UFS_EXPECT(!CheckDeleted(L"\\OLD3"));
+	return false;
+}
+
+/** Read-only copies left by a crash neither fail the copies of the next mount nor stay. */
+static bool CheckLeftCopies()
+{
+	UFS_EXPECT(!WriteText(UFS_METADATA_COPY_FILE L"1", L"", FILE_ATTRIBUTE_READONLY));
+	UFS_EXPECT(!WriteText(UFS_METADATA_COPY_FILE L"7", L"", FILE_ATTRIBUTE_READONLY));
+	UFS_EXPECT(!LoadMetadata());
+	WCHAR copyName[UFS_COPY_NAME_LENGTH];
+	UFS_EXPECT(!MakeCopyName(copyName, true));
+	UFS_EXPECT(wcstoul(copyName + wcslen(UFS_METADATA_COPY_FILE), NULL, 10) > 7);
+	RemoveCopy(copyName);
+	UFS_EXPECT(!WriteExists(copyName));
+	UFS_EXPECT(!StartMetadataLog());
+	StopMetadataLog();
+	UFS_EXPECT(!WriteExists(UFS_METADATA_COPY_FILE L"1"));
+	UFS_EXPECT(!WriteExists(UFS_METADATA_COPY_FILE L"7"));
+	return false;
+}
+
+/** Whether aStat, from a path, reports what aHandle, from a handle, does. The last access time is left out,
+ * the open for the handle may change it. */
+static bool IsSameInformation(const BY_HANDLE_FILE_INFORMATION& aStat, const BY_HANDLE_FILE_INFORMATION& aHandle)
+{
+	return aStat.dwFileAttributes == aHandle.dwFileAttributes && !CompareFileTime(&aStat.ftCreationTime, &aHandle.ftCreationTime) &&
+		!CompareFileTime(&aStat.ftLastWriteTime, &aHandle.ftLastWriteTime) && aStat.dwVolumeSerialNumber == aHandle.dwVolumeSerialNumber &&
+		aStat.nFileSizeHigh == aHandle.nFileSizeHigh && aStat.nFileSizeLow == aHandle.nFileSizeLow &&
+		aStat.nNumberOfLinks == aHandle.nNumberOfLinks && aStat.nFileIndexHigh == aHandle.nFileIndexHigh &&
+		aStat.nFileIndexLow == aHandle.nFileIndexLow;
+}
+
+/** Stat and the listing report what a handle of the file does, file index and link count included. */
+static bool CheckStat()
+{
+	static const LPCWSTR names[] = {L"\\FILE", L"\\LINK", L"\\DIR"};
+	WCHAR path[MAX_PATHW], linkPath[MAX_PATHW];
+	UFS_EXPECT(!WriteText(names[0], L"data", 0));
+	UFS_EXPECT(!MakeWritePath(path, names[0], wcslen(names[0]) * sizeof(WCHAR)));
+	UFS_EXPECT(!MakeWritePath(linkPath, names[1], wcslen(names[1]) * sizeof(WCHAR)));
+	UFS_EXPECT(CreateHardLink(linkPath, path, NULL));
+	UFS_EXPECT(!MakeWritePath(path, names[2], wcslen(names[2]) * sizeof(WCHAR)));
+	UFS_EXPECT(gWriteLayer->MakeDirectory(path));
+	BY_HANDLE_FILE_INFORMATION handleInformation[3], information;
+	for (int i = 0; i < 3; ++i) {
+		UFS_EXPECT(!MakeWritePath(path, names[i], wcslen(names[i]) * sizeof(WCHAR)));
+		HANDLE handle = gWriteLayer->Open(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS);
+		UFS_EXPECT(handle != INVALID_HANDLE_VALUE);
+		BOOL known = gWriteLayer->GetInformation(handle, &handleInformation[i]);
+		gWriteLayer->Close(handle);
+		UFS_EXPECT(known);
+		UFS_EXPECT(gWriteLayer->Stat(path, &information));
+		UFS_EXPECT(IsSameInformation(information, handleInformation[i]));
+	}
+	UFS_EXPECT(handleInformation[0].nNumberOfLinks == 2);
+	UFS_EXPECT(!MakeWritePath(path, L"\\*", 2 * sizeof(WCHAR)));
+	WIN32_FIND_DATAW findData;
+	HANDLE find = gWriteLayer->FindFirst(path, &findData);
+	UFS_EXPECT(find != INVALID_HANDLE_VALUE);
+	int listedSame = 0;
+	do {
+		for (int i = 0; i < 3; ++i) {
+			if (_wcsicmp(findData.cFileName, names[i] + 1))
+				continue;
+			gWriteLayer->FindInformation(find, findData, &information);
+			if (IsSameInformation(information, handleInformation[i]))
+				++listedSame;
+		}
+	} while (gWriteLayer->FindNext(find, &findData));
+	gWriteLayer->FindEnd(find);
+	UFS_EXPECT(listedSame == 3);
+	return false;
+}
+
+struct UFSCheckCase {
+	LPCWSTR mName;
+	bool (*mpRun)();
+};
+
+static const UFSCheckCase gChecks[] = {
+	{L"MetadataLogReplay", CheckLogReplay},
+	{L"MetadataStaleLog", CheckStaleLog},
+	{L"MetadataTruncatedLog", CheckTruncatedLog},
+	{L"MetadataRenameSettle", CheckRenameSettle},
+	{L"MetadataLogRoundTrip", CheckLogRoundTrip},
+	{L"MetadataLeftCopies", CheckLeftCopies},
+	{L"LayerStat", CheckStat},
+};
+
+/** Implements "UFSTool check [<Filter>]".
+ * Runs the checks whose names contain the filter, each on empty read and write roots made below a scratch
+ * directory in the temp directory, which is removed afterwards. Prints one line per check.
+ * @return 0 if every check passed, 1 if one failed, 2 on setup errors.
+ */
+int UFSCheck(int argc, LPWSTR argv[])
+{
+	if (argc > 1) {
+		fwprintf(stderr, L"UFSTool check [<Filter>]\n");
+		return 2;
+	}
+	LPCWSTR filter = argc && wcscmp(argv[0], L"*") ? argv[0] : NULL;
+	WCHAR temp[MAX_PATHW], scratch[MAX_PATHW], readRoot[MAX_PATHW], writeRoot[MAX_PATHW];
+	DWORD tempLength = GetTempPath(MAX_PATHW, temp);
+	if (!tempLength || tempLength >= MAX_PATHW) {
+		fwprintf(stderr, L"Cannot find the temp directory. Error: %d.\n", GetLastError());
+		return 2;
+	}
+	if (temp[tempLength - 1] == L'\\')
+		temp[--tempLength] = L'\0';
+	swprintf(scratch, L"\\UFSCheck.%lu", GetCurrentProcessId());
+	swprintf(readRoot, L"%s%s\\read", temp, scratch);
+	swprintf(writeRoot, L"%s%s\\write", temp, scratch);
+	Win32Layer tempLayer(temp, tempLength * sizeof(WCHAR));
+	Win32Layer readLayer(readRoot, wcslen(readRoot) * sizeof(WCHAR));
+	Win32Layer writeLayer(writeRoot, wcslen(writeRoot) * sizeof(WCHAR));
+	gReadLayer = &readLayer;
+	gWriteLayer = &writeLayer;
+	int exitCode = 0;
+	for (size_t i = 0; i < sizeof(gChecks) / sizeof(*gChecks); ++i) {
+		if (filter && !wcsstr(gChecks[i].mName, filter))
+			continue;
+		ClearMetadata();
+		RemoveTree(&tempLayer, scratch);
+		WCHAR scratchPath[MAX_PATHW];
+		if (tempLayer.MakePath(scratchPath, scratch, wcslen(scratch) * sizeof(WCHAR)) || !tempLayer.MakeDirectory(scratchPath) ||
+			!readLayer.MakeDirectory(readRoot) || !writeLayer.MakeDirectory(writeRoot)) {
+			fwprintf(stderr, L"Cannot create the scratch roots in %s%s. Error: %d.\n", temp, scratch, GetLastError());
+			exitCode = 2;
+			break;
+		}
+		bool failed = gChecks[i].mpRun();
+		wprintf(L"%s\t%s\n", gChecks[i].mName, failed ? L"FAILED" : L"ok");
+		if (failed)
+			exitCode = 1;
+	}
+	StopMetadataLog();
+	ClearMetadata();
+	RemoveTree(&tempLayer, scratch);
+	gReadLayer = NULL;
+	gWriteLayer = NULL;
+	return exitCode;
+}
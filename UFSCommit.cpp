@@ -0,0 +1,196 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0500 /* CreateHardLink */
+#endif
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "TreeWalker.h"
+
+/** Writes the union view of a read root and a write root to a new read root.
+ * Directories are created, write root files are copied and read root files are hard linked, or copied when
+ * linking fails or is disabled. Whiteouts and redirects apply since the walk goes through the engine.
+ */
+class UnionCommitter : public ParallelTreeWalker
+{
+public:
+	UnionCommitter(UFSLayer& aNewLayer, bool aLink) : mDirectories(0), mLinked(0), mCopied(0), mBytesCopied(0),
+		mErrors(0), mNewLayer(aNewLayer), mLink(aLink)
+	{
+		InitializeCriticalSection(&mLock);
+	}
+	~UnionCommitter()
+	{
+		DeleteCriticalSection(&mLock);
+	}
+
+	ULONG64 mDirectories, mLinked, mCopied, mBytesCopied, mErrors;
+
+protected:
+	virtual void Visit(const wstring& aRelativePath, vector<wstring>& aSubdirectories);
+
+private:
+	static bool Report(LPCWSTR aWhat, LPCWSTR aPath, DWORD aError)
+	{
+		fwprintf(stderr, L"%s %s. Error: %d.\n", aWhat, aPath, aError);
+		return true;
+	}
+
+	UFSLayer& mNewLayer;
+	bool mLink;
+	CRITICAL_SECTION mLock;
+};
+
+void UnionCommitter::Visit(const wstring& aRelativePath, vector<wstring>& aSubdirectories)
+{
+	ULONG64 directories = 0, linked = 0, copied = 0, bytesCopied = 0, errors = 0;
+	WCHAR newPath[MAX_PATHW], sourcePath[MAX_PATHW];
+	UnionDirEnumerator enumerator;
+	WIN32_FIND_DATAW findData;
+	wstring path;
+	int status = enumerator.Open(aRelativePath.c_str());
+	while (!status && (status = enumerator.Next(&findData)) > 0) {
+		status = 0;
+		path.assign(aRelativePath);
+		if (path[path.size() - 1] != L'\\')
+			path.append(1, L'\\');
+		path.append(findData.cFileName);
+		size_t pathLengthB = path.size() * sizeof(WCHAR);
+		if (mNewLayer.MakePath(newPath, path.c_str(), pathLengthB)) {
+			errors += Report(L"Path too long:", path.c_str(), ERROR_FILENAME_EXCED_RANGE);
+			continue;
+		}
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if (!mNewLayer.MakeDirectory(newPath) || !mNewLayer.SetAttributes(newPath, findData.dwFileAttributes)) {
+				errors += Report(L"Cannot create", newPath, GetLastError());
+				continue;
+			}
+			++directories;
+			aSubdirectories.push_back(path);
+			continue;
+		}
+		if (MakeWritePath(sourcePath, path.c_str(), pathLengthB)) {
+			errors += Report(L"Path too long:", path.c_str(), ERROR_FILENAME_EXCED_RANGE);
+			continue;
+		}
+		UFSLayer* layer = gWriteLayer;
+		if (gWriteLayer->GetAttributes(sourcePath) == INVALID_FILE_ATTRIBUTES) {
+			layer = gReadLayer;
+			if (MakeReadPath(sourcePath, path.c_str(), pathLengthB)) {
+				errors += Report(L"Path too long:", path.c_str(), ERROR_FILENAME_EXCED_RANGE);
+				continue;
+			}
+			if (mLink && CreateHardLink(newPath, sourcePath, NULL)) {
+				++linked;
+				continue;
+			}
+		}
+		if (!layer->CopyOut(sourcePath, newPath, TRUE)) {
+			errors += Report(L"Cannot copy", sourcePath, GetLastError());
+			continue;
+		}
+		++copied;
+		bytesCopied += ((ULONG64)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+	}
+	if (status < 0)
+		errors += Report(L"Cannot list", aRelativePath.c_str(), -status);
+	CriticalSectionLock lock(mLock);
+	mDirectories += directories;
+	mLinked += linked;
+	mCopied += copied;
+	mBytesCopied += bytesCopied;
+	mErrors += errors;
+}
+
+/* The length in bytes of a root given on the command line, without a trailing separator. */
+static size_t RootLength(LPCWSTR aRoot)
+{
+	size_t length = wcslen(aRoot);
+	if (length > 1 && (aRoot[length - 1] == L'\\' || aRoot[length - 1] == L'/'))
+		--length;
+	return length * sizeof(WCHAR);
+}
+
+/** Implements "UFSTool commit <ReadRoot> <WriteRoot> <NewReadRoot> [/t <Threads>] [/c]".
+ * Folds the write root and the whiteouts and redirects saved in its metadata file into a new read root, which
+ * must not exist yet. The file system must not be mounted on these roots meanwhile.
+ */
+int UFSCommit(int argc, LPWSTR argv[])
+{
+	ULONG threadCount = 0;
+	bool link = true;
+	for (int i = 3; i < argc; ++i)
+		switch (towupper(argv[i][1])) {
+			case 'T':
+				if (++i == argc || !(threadCount = wcstoul(argv[i], NULL, 10)))
+					argc = 0;
+				break;
+			case 'C':
+				link = false;
+				break;
+			default:
+				argc = 0;
+		}
+	if (argc < 3) {
+		fwprintf(stderr, L"UFSTool commit <ReadRoot> <WriteRoot> <NewReadRoot> [/t <Threads>] [/c]\n");
+		return 2;
+	}
+	if (!threadCount) {
+		/* Twice the processors, so the walk keeps going while threads wait for the disks. */
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		threadCount = systemInfo.dwNumberOfProcessors * 2;
+	}
+	Win32Layer readLayer(argv[0], RootLength(argv[0]));
+	Win32Layer writeLayer(argv[1], RootLength(argv[1]));
+	Win32Layer newLayer(argv[2], RootLength(argv[2]));
+	gReadLayer = &readLayer;
+	gWriteLayer = &writeLayer;
+	if (LoadMetadata()) {
+		fwprintf(stderr, L"Cannot load the metadata file %s%s. Error: %d.\n", writeLayer.Root(), UFS_METADATA_FILE, GetLastError());
+		return 1;
+	}
+	if (!newLayer.MakeDirectory(newLayer.Root())) {
+		fwprintf(stderr, L"Cannot create %s, the new read root must not exist. Error: %d.\n", newLayer.Root(), GetLastError());
+		return 1;
+	}
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	UnionCommitter committer(newLayer, link);
+	committer.Run(L"\\", threadCount);
+	QueryPerformanceCounter(&end);
+	double seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+	wprintf(L"%I64u directories, %I64u files linked, %I64u files copied (%I64u bytes) in %.1f s on %u threads.\n",
+		committer.mDirectories, committer.mLinked, committer.mCopied, committer.mBytesCopied, seconds, threadCount);
+	if (committer.mErrors || committer.Failed()) {
+		fwprintf(stderr, L"%I64u errors, %s is incomplete.\n", committer.mErrors, newLayer.Root());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <string.h>
+
+#include "UFSCompress.h"
+
+#define UFS_LZ_MIN_MATCH 4
+#define UFS_LZ_MAX_OFFSET 0xFFFF
+#define UFS_LZ_HASH_BITS 12
+
+static inline DWORD Read32(const BYTE* ap)
+{
+	DWORD value;
+	memcpy(&value, ap, sizeof(value));
+	return value;
+}
+
+static inline ULONG Hash(DWORD aValue)
+{
+	return (DWORD)(aValue * 2654435761U) >> (32 - UFS_LZ_HASH_BITS);
+}
+
+/* Appends the extension bytes of a length whose nibble is 15. */
+static inline bool PutLength(BYTE*& aOut, BYTE* aOutEnd, size_t aLength)
+{
+	for (; aLength >= 255; aLength -= 255) {
+		if (aOut == aOutEnd)
+			return true;
+		*aOut++ = 255;
+	}
+	if (aOut == aOutEnd)
+		return true;
+	*aOut++ = (BYTE)aLength;
+	return false;
+}
+
+static inline bool GetLength(const BYTE*& aIn, const BYTE* aInEnd, size_t& aLength)
+{
+	BYTE byte;
+	do {
+		if (aIn == aInEnd)
+			return true;
+		byte = *aIn++;
+		aLength += byte;
+	} while (byte == 255);
+	return false;
+}
+
+/* Appends a sequence, without a match if aMatchLength is 0. */
+static bool PutSequence(BYTE*& aOut, BYTE* aOutEnd, const BYTE* aLiterals, size_t aLiteralLength, size_t aOffset, size_t aMatchLength)
+{
+	if (aOut == aOutEnd)
+		return true;
+	BYTE* token = aOut++;
+	*token = (BYTE)((aLiteralLength < 15 ? aLiteralLength : 15) << 4);
+	if (aLiteralLength >= 15 && PutLength(aOut, aOutEnd, aLiteralLength - 15))
+		return true;
+	if ((size_t)(aOutEnd - aOut) < aLiteralLength)
+		return true;
+	memcpy(aOut, aLiterals, aLiteralLength);
+	aOut += aLiteralLength;
+	if (!aMatchLength)
+		return false;
+	if (aOutEnd - aOut < 2)
+		return true;
+	*aOut++ = (BYTE)aOffset;
+	*aOut++ = (BYTE)(aOffset >> 8);
+	aMatchLength -= UFS_LZ_MIN_MATCH;
+	*token |= (BYTE)(aMatchLength < 15 ? aMatchLength : 15);
+	return aMatchLength >= 15 && PutLength(aOut, aOutEnd, aMatchLength - 15);
+}
+
+size_t UFSCompress(const BYTE* apSource, size_t aLength, BYTE* apDest, size_t aCapacity)
+{
+	const BYTE* table[1 << UFS_LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const BYTE* end = apSource + aLength;
+	const BYTE* anchor = apSource;
+	BYTE* out = apDest;
+	BYTE* outEnd = apDest + aCapacity;
+	for (const BYTE* in = apSource; end - in >= UFS_LZ_MIN_MATCH; ) {
+		DWORD value = Read32(in);
+		const BYTE*& slot = table[Hash(value)];
+		const BYTE* match = slot;
+		slot = in;
+		if (!match || in - match > UFS_LZ_MAX_OFFSET || Read32(match) != value) {
+			++in;
+			continue;
+		}
+		size_t offset = in - match;
+		const BYTE* matchEnd = in + UFS_LZ_MIN_MATCH;
+		for (match += UFS_LZ_MIN_MATCH; matchEnd < end && *matchEnd == *match; ++matchEnd)
+			++match;
+		if (PutSequence(out, outEnd, anchor, in - anchor, offset, matchEnd - in))
+			return 0;
+		in = anchor = matchEnd;
+	}
+	if (PutSequence(out, outEnd, anchor, end - anchor, 0, 0) || out == outEnd)
+		return 0;
+	return out - apDest;
+}
+
+bool UFSDecompress(const BYTE* apSource, size_t aLength, BYTE* apDest, size_t aExpectedLength)
+{
+	const BYTE* in = apSource;
+	const BYTE* inEnd = apSource + aLength;
+	BYTE* out = apDest;
+	BYTE* outEnd = apDest + aExpectedLength;
+	while (in < inEnd) {
+		BYTE token = *in++;
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && GetLength(in, inEnd, literalLength))
+			return true;
+		if ((size_t)(inEnd - in) < literalLength || (size_t)(outEnd - out) < literalLength)
+			return true;
+		memcpy(out, in, literalLength);
+		out += literalLength;
+		in += literalLength;
+		if (in == inEnd)
+			break;
+		if (inEnd - in < 2)
+			return true;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && GetLength(in, inEnd, matchLength))
+			return true;
+		matchLength += UFS_LZ_MIN_MATCH;
+		if (!offset || offset > (size_t)(out - apDest) || (size_t)(outEnd - out) < matchLength)
+			return true;
+		/* Byte by byte, the match may overlap the bytes it produces. */
+		for (const BYTE* match = out - offset; matchLength; --matchLength)
+			*out++ = *match++;
+	}
+	return out != outEnd;
+}
@@ -0,0 +1,38 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** A small LZ77 block compressor for the read root images, in the spirit of the LZ4 block format.
+ * A block is a run of sequences. Each sequence starts with a token whose high nibble is the literal count
+ * and whose low nibble is the match length minus 4. A nibble of 15 is followed by bytes that add to it
+ * until one is below 255. The literals come next, then the little endian 16 bit offset of the match and
+ * its length bytes. The last sequence has literals only.
+ */
+
+/** Compresses aLength bytes of apSource into apDest.
+ * @return the compressed length, or 0 if it would not be shorter than aCapacity.
+ */
+size_t UFSCompress(const BYTE* apSource, size_t aLength, BYTE* apDest, size_t aCapacity);
+
+/** Decompresses aLength bytes of apSource into apDest, which receives exactly aExpectedLength bytes.
+ * @return false on success, true if the block is corrupt.
+ */
+bool UFSDecompress(const BYTE* apSource, size_t aLength, BYTE* apDest, size_t aExpectedLength);
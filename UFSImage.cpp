@@ -0,0 +1,425 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <map>
+#include <string>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "UFSCompress.h"
+#include "UFSImage.h"
+
+ImageLayer::ImageLayer(LPCWSTR aRoot, size_t aRootLength) : UFSLayer(aRoot, aRootLength),
+	mFile(INVALID_HANDLE_VALUE), mMapping(NULL), mpView(NULL)
+{
+	InitializeCriticalSection(&mLock);
+}
+
+ImageLayer::~ImageLayer()
+{
+	for (map<HANDLE, ImageOpen*>::iterator it = mOpens.begin(); it != mOpens.end(); ++it) {
+		CloseHandle(it->first);
+		delete it->second;
+	}
+	Unload();
+	DeleteCriticalSection(&mLock);
+}
+
+void ImageLayer::Unload()
+{
+	if (mpView)
+		UnmapViewOfFile(mpView);
+	if (mMapping)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+	mFile = INVALID_HANDLE_VALUE;
+	mMapping = NULL;
+	mpView = NULL;
+}
+
+bool ImageLayer::Fail(DWORD aError)
+{
+	Unload();
+	SetLastError(aError);
+	return true;
+}
+
+bool ImageLayer::Load()
+{
+	Unload();
+	mFile = CreateFile(mRoot, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return true;
+	BY_HANDLE_FILE_INFORMATION information;
+	if (!GetFileInformationByHandle(mFile, &information))
+		return Fail(GetLastError());
+	mVolumeSerialNumber = information.dwVolumeSerialNumber;
+	mSize = ((ULONG64)information.nFileSizeHigh << 32) | information.nFileSizeLow;
+	if (mSize < sizeof(UFSImageHeader) || mSize != (SIZE_T)mSize)
+		return Fail(ERROR_BAD_FORMAT);
+	mMapping = CreateFileMapping(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mMapping || !(mpView = (const BYTE*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0)))
+		return Fail(GetLastError());
+	/* The tables are checked to lie in the image, the blocks are checked as reads reach them. */
+	mpHeader = (const UFSImageHeader*)mpView;
+	if (mpHeader->mMagic != UFS_IMAGE_MAGIC || mpHeader->mVersion != UFS_IMAGE_VERSION || !mpHeader->mBlockSize ||
+		mpHeader->mIndexOffset > mSize || mpHeader->mIndexSize > mSize - mpHeader->mIndexOffset ||
+		mIndex.Attach(mpView + mpHeader->mIndexOffset, (size_t)mpHeader->mIndexSize) ||
+		mpHeader->mFilesOffset > mSize || mIndex.EntryCount() > (mSize - mpHeader->mFilesOffset) / sizeof(UFSImageFile) ||
+		mpHeader->mBlocksOffset > mSize || mpHeader->mBlockCount > (mSize - mpHeader->mBlocksOffset) / sizeof(UFSImageBlock))
+		return Fail(ERROR_BAD_FORMAT);
+	mpFiles = (const UFSImageFile*)(mpView + mpHeader->mFilesOffset);
+	mpBlocks = (const UFSImageBlock*)(mpView + mpHeader->mBlocksOffset);
+	return false;
+}
+
+DWORD ImageLayer::GetAttributes(LPCWSTR aPath)
+{
+	LONG index = Lookup(aPath);
+	return index < 0 ? INVALID_FILE_ATTRIBUTES : mIndex.Entry(index).mAttributes;
+}
+
+BOOL ImageLayer::GetAttributesEx(LPCWSTR aPath, LPWIN32_FILE_ATTRIBUTE_DATA apData)
+{
+	LONG index = Lookup(aPath);
+	if (index < 0)
+		return FALSE;
+	mIndex.Fill(mIndex.Entry(index), apData);
+	return TRUE;
+}
+
+HANDLE ImageLayer::FindFirst(LPCWSTR aPattern, LPWIN32_FIND_DATAW apFindData)
+{
+	return Find(aPattern, NULL, 0, apFindData, NULL);
+}
+
+HANDLE ImageLayer::FindFirstAt(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition)
+{
+	return Find(aPattern, aName, aPosition, apFindData, apPosition);
+}
+
+HANDLE ImageLayer::Find(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition)
+{
+	ImageFind* find;
+	try {
+		find = new ImageFind;
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return INVALID_HANDLE_VALUE;
+	}
+	int found = mIndex.FindRange(AdvanceBytes(aPattern, mRootLength), find->mNext, find->mEnd);
+	if (!found)
+		SetLastError(ERROR_INVALID_PARAMETER);
+	if (found > 0 && aName) {
+		ULONG first = find->mNext;
+		if ((find->mNext = mIndex.Seek(first, find->mEnd, aName)) == find->mEnd) {
+			SetLastError(ERROR_FILE_NOT_FOUND);
+			found = -1;
+		}
+		*apPosition = find->mNext - first;
+	}
+	if (found <= 0 || !FindNext((HANDLE)find, apFindData)) {
+		DWORD error = GetLastError();
+		delete find;
+		SetLastError(error);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)find;
+}
+
+BOOL ImageLayer::FindNext(HANDLE aFind, LPWIN32_FIND_DATAW apFindData)
+{
+	ImageFind* find = (ImageFind*)aFind;
+	if (find->mNext == find->mEnd) {
+		SetLastError(ERROR_NO_MORE_FILES);
+		return FALSE;
+	}
+	mIndex.Fill(mIndex.Entry(find->mNext++), apFindData);
+	return TRUE;
+}
+
+void ImageLayer::FindInformation(HANDLE aFind, const WIN32_FIND_DATAW&, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	FillInformation(((ImageFind*)aFind)->mNext - 1, apInformation);
+}
+
+void ImageLayer::FindEnd(HANDLE aFind)
+{
+	delete (ImageFind*)aFind;
+}
+
+HANDLE ImageLayer::Open(LPCWSTR aPath, DWORD, DWORD, DWORD aCreationDisposition, DWORD aFlagsAndAttributes)
+{
+	LONG index = Lookup(aPath);
+	if (index < 0)
+		return INVALID_HANDLE_VALUE;
+	if (aCreationDisposition == CREATE_NEW) {
+		SetLastError(ERROR_FILE_EXISTS);
+		return INVALID_HANDLE_VALUE;
+	}
+	if ((aCreationDisposition != OPEN_EXISTING && aCreationDisposition != OPEN_ALWAYS) ||
+		((mIndex.Entry(index).mAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(aFlagsAndAttributes & FILE_FLAG_BACKUP_SEMANTICS))) {
+		SetLastError(ERROR_ACCESS_DENIED);
+		return INVALID_HANDLE_VALUE;
+	}
+	HANDLE handle;
+	if (!DuplicateHandle(GetCurrentProcess(), mFile, GetCurrentProcess(), &handle, 0, FALSE, DUPLICATE_SAME_ACCESS))
+		return INVALID_HANDLE_VALUE;
+	try {
+		ImageOpen* open = new ImageOpen(index);
+		CriticalSectionLock lock(mLock);
+		mOpens[handle] = open;
+	} catch (...) {
+		CloseHandle(handle);
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return INVALID_HANDLE_VALUE;
+	}
+	SetLastError(aCreationDisposition == OPEN_ALWAYS ? ERROR_ALREADY_EXISTS : NO_ERROR);
+	return handle;
+}
+
+ImageLayer::ImageOpen* ImageLayer::FindOpen(HANDLE aFile)
+{
+	CriticalSectionLock lock(mLock);
+	map<HANDLE, ImageOpen*>::const_iterator it = mOpens.find(aFile);
+	if (it == mOpens.end()) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return NULL;
+	}
+	return it->second;
+}
+
+bool ImageLayer::ReadData(ImageOpen& aOpen, ULONG64 aOffset, BYTE* apBuffer, ULONG aLength)
+{
+	const UFSImageFile& file = mpFiles[aOpen.mEntry];
+	ULONG64 size = mIndex.Entry(aOpen.mEntry).mSize;
+	ULONG blockSize = mpHeader->mBlockSize;
+	while (aLength) {
+		ULONG blockNumber = (ULONG)(aOffset / blockSize);
+		ULONG blockOffset = (ULONG)(aOffset % blockSize);
+		ULONG blockLength = (ULONG)(size - (ULONG64)blockNumber * blockSize < blockSize ? size - (ULONG64)blockNumber * blockSize : blockSize);
+		ULONG count = blockLength - blockOffset < aLength ? blockLength - blockOffset : aLength;
+		if (blockNumber >= file.mBlockCount || file.mFirstBlock + blockNumber >= mpHeader->mBlockCount) {
+			SetLastError(ERROR_FILE_CORRUPT);
+			return true;
+		}
+		ULONG blockIndex = file.mFirstBlock + blockNumber;
+		const UFSImageBlock& block = mpBlocks[blockIndex];
+		if (block.mOffset > mSize || block.mStoredSize > mSize - block.mOffset ||
+			(!(block.mFlags & UFS_IMAGE_BLOCK_COMPRESSED) && block.mStoredSize != blockLength)) {
+			SetLastError(ERROR_FILE_CORRUPT);
+			return true;
+		}
+		if (!(block.mFlags & UFS_IMAGE_BLOCK_COMPRESSED))
+			memcpy(apBuffer, mpView + block.mOffset + blockOffset, count);
+		else {
+			/* Sequential reads are usually smaller than a block, so the open keeps the last block decoded. */
+			CriticalSectionLock lock(aOpen.mLock);
+			if (aOpen.mCachedBlock != blockIndex) {
+				if (!aOpen.mpCache) {
+					try {
+						aOpen.mpCache = new BYTE[blockSize];
+					} catch (...) {
+						SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+						return true;
+					}
+				}
+				aOpen.mCachedBlock = (ULONG)-1;
+				if (UFSDecompress(mpView + block.mOffset, block.mStoredSize, aOpen.mpCache, blockLength)) {
+					SetLastError(ERROR_FILE_CORRUPT);
+					return true;
+				}
+				aOpen.mCachedBlock = blockIndex;
+			}
+			memcpy(apBuffer, aOpen.mpCache + blockOffset, count);
+		}
+		apBuffer += count;
+		aOffset += count;
+		aLength -= count;
+	}
+	return false;
+}
+
+BOOL ImageLayer::Read(HANDLE aFile, LPVOID aBuffer, DWORD aLength, LPDWORD apReadLength, LONGLONG aOffset)
+{
+	*apReadLength = 0;
+	ImageOpen* open = FindOpen(aFile);
+	if (!open)
+		return FALSE;
+	const UFSIndexEntry& entry = mIndex.Entry(open->mEntry);
+	if (entry.mAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		SetLastError(ERROR_INVALID_FUNCTION);
+		return FALSE;
+	}
+	if (aOffset < 0) {
+		SetLastError(ERROR_NEGATIVE_SEEK);
+		return FALSE;
+	}
+	if ((ULONG64)aOffset >= entry.mSize)
+		return TRUE;
+	if (aLength > entry.mSize - aOffset)
+		aLength = (DWORD)(entry.mSize - aOffset);
+	if (ReadData(*open, aOffset, (BYTE*)aBuffer, aLength))
+		return FALSE;
+	*apReadLength = aLength;
+	return TRUE;
+}
+
+void ImageLayer::FillInformation(ULONG aEntry, LPBY_HANDLE_FILE_INFORMATION apInformation) const
+{
+	const UFSIndexEntry& entry = mIndex.Entry(aEntry);
+	apInformation->dwFileAttributes = entry.mAttributes;
+	apInformation->ftCreationTime = entry.mCreationTime;
+	apInformation->ftLastAccessTime = entry.mLastAccessTime;
+	apInformation->ftLastWriteTime = entry.mLastWriteTime;
+	apInformation->dwVolumeSerialNumber = mVolumeSerialNumber;
+	apInformation->nFileSizeHigh = (DWORD)(entry.mSize >> 32);
+	apInformation->nFileSizeLow = (DWORD)entry.mSize;
+	apInformation->nNumberOfLinks = 1;
+	/* The entry number identifies the file within the image. */
+	apInformation->nFileIndexHigh = 0;
+	apInformation->nFileIndexLow = aEntry;
+}
+
+BOOL ImageLayer::GetInformation(HANDLE aFile, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	ImageOpen* open = FindOpen(aFile);
+	if (!open)
+		return FALSE;
+	FillInformation(open->mEntry, apInformation);
+	return TRUE;
+}
+
+BOOL ImageLayer::Stat(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	LONG index = Lookup(aPath);
+	if (index < 0)
+		return FALSE;
+	FillInformation(index, apInformation);
+	return TRUE;
+}
+
+BOOL ImageLayer::Lock(HANDLE aFile, LONGLONG, LONGLONG)
+{
+	/* Nothing can write to the image, so locks have nothing to protect. */
+	return FindOpen(aFile) != NULL;
+}
+
+BOOL ImageLayer::Unlock(HANDLE aFile, LONGLONG, LONGLONG)
+{
+	return FindOpen(aFile) != NULL;
+}
+
+BOOL ImageLayer::Close(HANDLE aFile)
+{
+	ImageOpen* open;
+	{
+		CriticalSectionLock lock(mLock);
+		map<HANDLE, ImageOpen*>::iterator it = mOpens.find(aFile);
+		if (it == mOpens.end()) {
+			SetLastError(ERROR_INVALID_HANDLE);
+			return FALSE;
+		}
+		open = it->second;
+		mOpens.erase(it);
+	}
+	delete open;
+	return CloseHandle(aFile);
+}
+
+BOOL ImageLayer::CopyOut(LPCWSTR aPath, LPCWSTR aDestination, BOOL aFailIfExists)
+{
+	LONG index = Lookup(aPath);
+	if (index < 0)
+		return FALSE;
+	const UFSIndexEntry& entry = mIndex.Entry(index);
+	if (entry.mAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		SetLastError(ERROR_ACCESS_DENIED);
+		return FALSE;
+	}
+	HANDLE destination = CreateFile(aDestination, GENERIC_WRITE, 0, NULL, aFailIfExists ? CREATE_NEW : CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (destination == INVALID_HANDLE_VALUE)
+		return FALSE;
+	ImageOpen open(index);
+	bool failed = false;
+	BYTE* buffer = NULL;
+	try {
+		buffer = new BYTE[mpHeader->mBlockSize];
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		failed = true;
+	}
+	for (ULONG64 offset = 0; !failed && offset < entry.mSize; ) {
+		ULONG length = (ULONG)(entry.mSize - offset < mpHeader->mBlockSize ? entry.mSize - offset : mpHeader->mBlockSize);
+		DWORD written;
+		failed = ReadData(open, offset, buffer, length) || !WriteFile(destination, buffer, length, &written, NULL);
+		offset += length;
+	}
+	delete[] buffer;
+	if (!failed)
+		failed = !SetFileTime(destination, &entry.mCreationTime, &entry.mLastAccessTime, &entry.mLastWriteTime);
+	DWORD error = GetLastError();
+	CloseHandle(destination);
+	if (!failed)
+		failed = !SetFileAttributes(aDestination, entry.mAttributes);
+	else
+		SetLastError(error);
+	if (failed) {
+		error = GetLastError();
+		DeleteFile(aDestination);
+		SetLastError(error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL ImageLayer::SetAttributes(LPCWSTR, DWORD)
+{
+	SetLastError(ERROR_WRITE_PROTECT);
+	return FALSE;
+}
+
+BOOL ImageLayer::MakeDirectory(LPCWSTR)
+{
+	SetLastError(ERROR_WRITE_PROTECT);
+	return FALSE;
+}
+
+BOOL ImageLayer::DeleteDirectory(LPCWSTR)
+{
+	SetLastError(ERROR_WRITE_PROTECT);
+	return FALSE;
+}
+
+BOOL ImageLayer::Unlink(LPCWSTR)
+{
+	SetLastError(ERROR_WRITE_PROTECT);
+	return FALSE;
+}
+
+BOOL ImageLayer::Rename(LPCWSTR, LPCWSTR, BOOL)
+{
+	SetLastError(ERROR_WRITE_PROTECT);
+	return FALSE;
+}
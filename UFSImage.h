@@ -0,0 +1,146 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** The read root image: a read root packed into one file by "UFSTool image", which "WinUnionFS /r" mounts
+ * in place of a directory when given a file.
+ *
+ * The file holds a UFSImageHeader, then the index of the read root as written by "UFSTool index" padded to a
+ * multiple of 8 bytes, then a UFSImageFile per index entry, a UFSImageBlock per block and the block data.
+ * The data of a file is cut in blocks of mBlockSize bytes, the last one shorter, each stored as is or
+ * compressed with UFSCompress when that makes it smaller, so a read only decodes the blocks it covers.
+ * The whole image is mapped, so it must fit in the address space.
+ */
+
+#include <map>
+
+#include "UFSIndex.h"
+
+#define UFS_IMAGE_MAGIC 0x474D4955 /* "UIMG" */
+#define UFS_IMAGE_VERSION 1
+/* UFSImageBlock::mFlags */
+#define UFS_IMAGE_BLOCK_COMPRESSED 1
+
+struct UFSImageHeader {
+	DWORD mMagic;
+	DWORD mVersion;
+	ULONG mBlockSize;
+	ULONG mBlockCount;
+	ULONG64 mIndexOffset;
+	ULONG64 mIndexSize;
+	ULONG64 mFilesOffset;
+	ULONG64 mBlocksOffset;
+};
+
+/* The blocks of the index entry of the same number, none for directories. */
+struct UFSImageFile {
+	ULONG mFirstBlock;
+	ULONG mBlockCount;
+};
+
+struct UFSImageBlock {
+	ULONG64 mOffset; /* From the start of the image. */
+	ULONG mStoredSize;
+	ULONG mFlags;
+};
+
+/** A read only layer backed by an image, whose root is the path of the image file.
+ * Patterns with wildcards other than a final \* are not supported. The handles returned by Open are
+ * duplicates of the image file handle, so they are unique and harmless if passed to the Win32 functions.
+ */
+class ImageLayer : public UFSLayer
+{
+public:
+	ImageLayer(LPCWSTR aRoot, size_t aRootLength);
+	virtual ~ImageLayer();
+	/** Maps and checks the image.
+	 * @return false on success, GetLastError tells why it failed.
+	 */
+	bool Load();
+
+	virtual DWORD GetAttributes(LPCWSTR aPath);
+	virtual BOOL GetAttributesEx(LPCWSTR aPath, LPWIN32_FILE_ATTRIBUTE_DATA apData);
+	virtual BOOL Stat(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	virtual BOOL SetAttributes(LPCWSTR aPath, DWORD aAttributes);
+	virtual HANDLE FindFirst(LPCWSTR aPattern, LPWIN32_FIND_DATAW apFindData);
+	virtual BOOL FindNext(HANDLE aFind, LPWIN32_FIND_DATAW apFindData);
+	virtual void FindEnd(HANDLE aFind);
+	virtual HANDLE FindFirstAt(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition);
+	virtual void FindInformation(HANDLE aFind, const WIN32_FIND_DATAW& aFindData, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	virtual HANDLE Open(LPCWSTR aPath, DWORD aAccessMode, DWORD aShareMode, DWORD aCreationDisposition, DWORD aFlagsAndAttributes);
+	virtual BOOL MakeDirectory(LPCWSTR aPath);
+	virtual BOOL DeleteDirectory(LPCWSTR aPath);
+	virtual BOOL Unlink(LPCWSTR aPath);
+	virtual BOOL Rename(LPCWSTR aPath, LPCWSTR aNewPath, BOOL aReplaceIfExisting);
+	virtual BOOL CopyOut(LPCWSTR aPath, LPCWSTR aDestination, BOOL aFailIfExists);
+	virtual BOOL Read(HANDLE aFile, LPVOID aBuffer, DWORD aLength, LPDWORD apReadLength, LONGLONG aOffset);
+	virtual BOOL GetInformation(HANDLE aFile, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	virtual BOOL Lock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength);
+	virtual BOOL Unlock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength);
+	virtual BOOL Close(HANDLE aFile);
+
+private:
+	/* An open file, with the last block it decompressed. */
+	struct ImageOpen {
+		ImageOpen(ULONG aEntry) : mEntry(aEntry), mCachedBlock((ULONG)-1), mpCache(NULL)
+		{
+			InitializeCriticalSection(&mLock);
+		}
+		~ImageOpen()
+		{
+			delete[] mpCache;
+			DeleteCriticalSection(&mLock);
+		}
+		ULONG mEntry;
+		CRITICAL_SECTION mLock; /* Guards mCachedBlock and mpCache. */
+		ULONG mCachedBlock;
+		BYTE* mpCache;
+	};
+	struct ImageFind {
+		ULONG mNext, mEnd;
+	};
+	/* FindFirst and FindFirstAt, aName is NULL for the former. */
+	HANDLE Find(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition);
+	LONG Lookup(LPCWSTR aPath) const
+	{
+		LPCWSTR relativePath = AdvanceBytes(aPath, mRootLength);
+		return mIndex.Lookup(relativePath, wcslen(relativePath));
+	}
+	ImageOpen* FindOpen(HANDLE aFile);
+	void FillInformation(ULONG aEntry, LPBY_HANDLE_FILE_INFORMATION apInformation) const;
+	/** Copies aLength bytes at aOffset of the file of aOpen, which must be within the file.
+	 * @return false on success.
+	 */
+	bool ReadData(ImageOpen& aOpen, ULONG64 aOffset, BYTE* apBuffer, ULONG aLength);
+	bool Fail(DWORD aError);
+	void Unload();
+
+	UFSIndex mIndex;
+	HANDLE mFile, mMapping;
+	const BYTE* mpView;
+	ULONG64 mSize;
+	DWORD mVolumeSerialNumber;
+	const UFSImageHeader* mpHeader;
+	const UFSImageFile* mpFiles;
+	const UFSImageBlock* mpBlocks;
+	CRITICAL_SECTION mLock; /* Guards mOpens. */
+	std::map<HANDLE, ImageOpen*> mOpens;
+};
@@ -0,0 +1,196 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "UFSCompress.h"
+#include "UFSImage.h"
+#include "UFSImageBuild.h"
+#include "UFSIndexBuild.h"
+
+static bool Seek(HANDLE aFile, ULONG64 aOffset)
+{
+	LONG offsetHigh = (LONG)(aOffset >> 32);
+	return SetFilePointer(aFile, (LONG)aOffset, &offsetHigh, FILE_BEGIN) == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR;
+}
+
+/** Appends the data of the file aPath to aImage as aFile.mBlockCount blocks, filling aBlocks from aFile.mFirstBlock.
+ * @return false on success, errors are printed to stderr.
+ */
+static bool WriteData(HANDLE aImage, LPCWSTR aPath, ULONG64 aSize, const UFSImageFile& aFile, vector<UFSImageBlock>& aBlocks,
+	ULONG aBlockSize, bool aCompress, ULONG64& aOffset, vector<BYTE>& aBuffer, vector<BYTE>& aCompressed)
+{
+	HANDLE file = CreateFile(aPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		fwprintf(stderr, L"Cannot open %s. Error: %d.\n", aPath, GetLastError());
+		return true;
+	}
+	bool failed = false;
+	for (ULONG block = 0; !failed && block < aFile.mBlockCount; ++block) {
+		ULONG64 left = aSize - (ULONG64)block * aBlockSize;
+		ULONG length = (ULONG)(left < aBlockSize ? left : aBlockSize);
+		DWORD read;
+		if (!ReadFile(file, &aBuffer[0], length, &read, NULL) || read != length) {
+			fwprintf(stderr, L"Cannot read %s, or it changed while it was imaged. Error: %d.\n", aPath, GetLastError());
+			failed = true;
+			break;
+		}
+		UFSImageBlock& imageBlock = aBlocks[aFile.mFirstBlock + block];
+		imageBlock.mOffset = aOffset;
+		imageBlock.mStoredSize = length;
+		imageBlock.mFlags = 0;
+		const BYTE* data = &aBuffer[0];
+		size_t compressedLength;
+		if (aCompress && (compressedLength = UFSCompress(data, length, &aCompressed[0], length))) {
+			imageBlock.mStoredSize = (ULONG)compressedLength;
+			imageBlock.mFlags = UFS_IMAGE_BLOCK_COMPRESSED;
+			data = &aCompressed[0];
+		}
+		DWORD written;
+		if (!WriteFile(aImage, data, imageBlock.mStoredSize, &written, NULL)) {
+			fwprintf(stderr, L"Cannot write the image. Error: %d.\n", GetLastError());
+			failed = true;
+		}
+		aOffset += imageBlock.mStoredSize;
+	}
+	CloseHandle(file);
+	return failed;
+}
+
+bool WriteImage(const wstring& aRoot, LPCWSTR aImageFile, ULONG aBlockSize, bool aCompress, ULONG aThreadCount)
+{
+	vector<UFSIndexEntry> entries;
+	wstring names;
+	vector<wstring> paths;
+	if (BuildIndex(aRoot, aThreadCount, entries, names, &paths))
+		return true;
+
+	/* Everything but the data is known from the listing, so the data goes straight to its final place and
+	 * the tables are written last. */
+	UFSImageHeader header;
+	header.mMagic = UFS_IMAGE_MAGIC;
+	header.mVersion = UFS_IMAGE_VERSION;
+	header.mBlockSize = aBlockSize;
+	header.mIndexOffset = sizeof(header);
+	header.mIndexSize = sizeof(UFSIndexHeader) + entries.size() * sizeof(UFSIndexEntry) + names.size() * sizeof(WCHAR);
+	header.mFilesOffset = (header.mIndexOffset + header.mIndexSize + 7) & ~(ULONG64)7;
+	header.mBlocksOffset = header.mFilesOffset + entries.size() * sizeof(UFSImageFile);
+	vector<UFSImageFile> files(entries.size());
+	ULONG64 blockCount = 0;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		files[i].mFirstBlock = (ULONG)blockCount;
+		files[i].mBlockCount = entries[i].mAttributes & FILE_ATTRIBUTE_DIRECTORY ? 0 :
+			(ULONG)((entries[i].mSize + aBlockSize - 1) / aBlockSize);
+		blockCount += files[i].mBlockCount;
+	}
+	if (blockCount > 0xFFFFFFFF) {
+		fwprintf(stderr, L"The read root has too many blocks, use larger ones.\n");
+		return true;
+	}
+	header.mBlockCount = (ULONG)blockCount;
+	vector<UFSImageBlock> blocks(header.mBlockCount);
+
+	HANDLE image = CreateFile(aImageFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (image == INVALID_HANDLE_VALUE) {
+		fwprintf(stderr, L"Cannot create %s. Error: %d.\n", aImageFile, GetLastError());
+		return true;
+	}
+	ULONG64 offset = header.mBlocksOffset + blocks.size() * sizeof(UFSImageBlock);
+	bool failed = Seek(image, offset);
+	if (!failed) {
+		vector<BYTE> buffer(aBlockSize), compressed(aBlockSize);
+		for (size_t i = 0; !failed && i < entries.size(); ++i)
+			if (files[i].mBlockCount)
+				failed = WriteData(image, (aRoot + paths[i]).c_str(), entries[i].mSize, files[i], blocks, aBlockSize, aCompress,
+					offset, buffer, compressed);
+	}
+	if (!failed) {
+		static const BYTE padding[8] = {0};
+		DWORD written;
+		failed = Seek(image, 0) || !WriteFile(image, &header, sizeof(header), &written, NULL) || WriteIndex(image, entries, names) ||
+			!WriteFile(image, padding, (DWORD)(header.mFilesOffset - header.mIndexOffset - header.mIndexSize), &written, NULL) ||
+			!WriteFile(image, &files[0], (DWORD)(files.size() * sizeof(UFSImageFile)), &written, NULL) ||
+			(!blocks.empty() && !WriteFile(image, &blocks[0], (DWORD)(blocks.size() * sizeof(UFSImageBlock)), &written, NULL));
+		if (failed)
+			fwprintf(stderr, L"Cannot write the image. Error: %d.\n", GetLastError());
+	}
+	CloseHandle(image);
+	if (failed) {
+		DeleteFile(aImageFile);
+		return true;
+	}
+	return false;
+}
+
+/** Implements "UFSTool image <ReadRoot> <ImageFile> [/z] [/b <BlockKB>] [/t <Threads>]".
+ * Packs the read root into an image that WinUnionFS mounts with /r, /z compresses its blocks.
+ */
+int UFSImageBuild(int argc, LPWSTR argv[])
+{
+	ULONG threadCount = 0;
+	ULONG blockSize = UFS_IMAGE_DEFAULT_BLOCK_SIZE;
+	bool compress = false;
+	for (int i = 2; i < argc; ++i)
+		switch (towupper(argv[i][1])) {
+			case 'T':
+				if (++i == argc || !(threadCount = wcstoul(argv[i], NULL, 10)))
+					argc = 0;
+				break;
+			case 'B':
+				if (++i == argc || !(blockSize = wcstoul(argv[i], NULL, 10) * 1024) || blockSize > 16 * 1024 * 1024)
+					argc = 0;
+				break;
+			case 'Z':
+				compress = true;
+				break;
+			default:
+				argc = 0;
+		}
+	if (argc < 2) {
+		fwprintf(stderr, L"UFSTool image <ReadRoot> <ImageFile> [/z] [/b <BlockKB>] [/t <Threads>]\n");
+		return 2;
+	}
+	if (!threadCount)
+		threadCount = DefaultThreadCount();
+	wstring root(argv[0]);
+	if (root.size() > 1 && (root[root.size() - 1] == L'\\' || root[root.size() - 1] == L'/'))
+		root.erase(root.size() - 1);
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	if (WriteImage(root, argv[1], blockSize, compress, threadCount)) {
+		fwprintf(stderr, L"No image written.\n");
+		return 1;
+	}
+	QueryPerformanceCounter(&end);
+	WIN32_FILE_ATTRIBUTE_DATA imageData;
+	ULONG64 imageSize = 0;
+	if (GetFileAttributesEx(argv[1], GetFileExInfoStandard, &imageData))
+		imageSize = ((ULONG64)imageData.nFileSizeHigh << 32) | imageData.nFileSizeLow;
+	wprintf(L"%s written, %I64u bytes, in %.1f s.\n", argv[1], imageSize, (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart);
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/* Builds read root images, see UFSImage.h. */
+
+#include <string>
+
+#define UFS_IMAGE_DEFAULT_BLOCK_SIZE 65536
+
+/** Packs the directory aRoot into the image file aImageFile, listing it on aThreadCount threads. The data is
+ * cut in blocks of aBlockSize bytes, compressed if aCompress is true.
+ * @return false on success, errors are printed to stderr and no image is left behind.
+ */
+bool WriteImage(const std::wstring& aRoot, LPCWSTR aImageFile, ULONG aBlockSize, bool aCompress, ULONG aThreadCount);
@@ -0,0 +1,359 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+
+#include "UFSIndex.h"
+
+UFSIndex::UFSIndex() : mFile(INVALID_HANDLE_VALUE), mMapping(NULL), mpView(NULL)
+{
+}
+
+UFSIndex::~UFSIndex()
+{
+	Unload();
+}
+
+void UFSIndex::Unload()
+{
+	if (mpView)
+		UnmapViewOfFile(mpView);
+	if (mMapping)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+	mFile = INVALID_HANDLE_VALUE;
+	mMapping = NULL;
+	mpView = NULL;
+}
+
+bool UFSIndex::Load(LPCWSTR aFileName)
+{
+	Unload();
+	mFile = CreateFile(aFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return true;
+	DWORD sizeHigh;
+	DWORD size = GetFileSize(mFile, &sizeHigh);
+	if (!size || sizeHigh) {
+		Unload();
+		SetLastError(ERROR_BAD_FORMAT);
+		return true;
+	}
+	mMapping = CreateFileMapping(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mMapping || !(mpView = MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0))) {
+		DWORD error = GetLastError();
+		Unload();
+		SetLastError(error);
+		return true;
+	}
+	if (Attach(mpView, size)) {
+		Unload();
+		SetLastError(ERROR_BAD_FORMAT);
+		return true;
+	}
+	return false;
+}
+
+bool UFSIndex::Attach(LPCVOID apView, size_t aSize)
+{
+	/* The entries are checked once here, so that lookups can follow their names and children blindly. */
+	mpHeader = (const UFSIndexHeader*)apView;
+	mpEntries = (const UFSIndexEntry*)(mpHeader + 1);
+	mpNames = (LPCWSTR)(mpEntries + mpHeader->mEntryCount);
+	if (aSize < sizeof(UFSIndexHeader) || mpHeader->mMagic != UFS_INDEX_MAGIC || mpHeader->mVersion != UFS_INDEX_VERSION ||
+		!mpHeader->mEntryCount || mpHeader->mEntryCount > (aSize - sizeof(UFSIndexHeader)) / sizeof(UFSIndexEntry) ||
+		mpHeader->mNameLength != (aSize - sizeof(UFSIndexHeader) - mpHeader->mEntryCount * sizeof(UFSIndexEntry)) / sizeof(WCHAR)) {
+		SetLastError(ERROR_BAD_FORMAT);
+		return true;
+	}
+	for (ULONG i = 0; i < mpHeader->mEntryCount; ++i) {
+		const UFSIndexEntry& entry = mpEntries[i];
+		if (entry.mNameOffset > mpHeader->mNameLength || entry.mNameLength > mpHeader->mNameLength - entry.mNameOffset ||
+			entry.mNameLength >= MAX_PATH || ((entry.mAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			(entry.mFirstChild > mpHeader->mEntryCount || entry.mChildCount > mpHeader->mEntryCount - entry.mFirstChild))) {
+			SetLastError(ERROR_BAD_FORMAT);
+			return true;
+		}
+	}
+	return false;
+}
+
+LONG UFSIndex::Lookup(LPCWSTR aPath, size_t aPathLength) const
+{
+	ULONG current = 0;
+	LPCWSTR end = aPath + aPathLength;
+	for (LPCWSTR component = aPath; component < end; ) {
+		if (*component == L'\\' || *component == L'/') {
+			++component;
+			continue;
+		}
+		LPCWSTR componentEnd = component;
+		while (componentEnd < end && *componentEnd != L'\\' && *componentEnd != L'/')
+			++componentEnd;
+		const UFSIndexEntry& directory = mpEntries[current];
+		if (!(directory.mAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			SetLastError(ERROR_PATH_NOT_FOUND);
+			return -1;
+		}
+		ULONG low = directory.mFirstChild, high = directory.mFirstChild + directory.mChildCount;
+		while (low < high) {
+			ULONG middle = low + (high - low) / 2;
+			const UFSIndexEntry& entry = mpEntries[middle];
+			int result = UFSIndexCompareNames(Name(entry), entry.mNameLength, component, componentEnd - component);
+			if (!result) {
+				low = middle;
+				break;
+			}
+			if (result < 0)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		if (low == directory.mFirstChild + directory.mChildCount || UFSIndexCompareNames(Name(mpEntries[low]),
+			mpEntries[low].mNameLength, component, componentEnd - component)) {
+			SetLastError(componentEnd == end ? ERROR_FILE_NOT_FOUND : ERROR_PATH_NOT_FOUND);
+			return -1;
+		}
+		current = low;
+		component = componentEnd;
+	}
+	return (LONG)current;
+}
+
+int UFSIndex::FindRange(LPCWSTR aPattern, ULONG& aFirst, ULONG& aEnd) const
+{
+	size_t length = wcslen(aPattern);
+	LPCWSTR name = aPattern + length;
+	while (name > aPattern && name[-1] != L'\\' && name[-1] != L'/')
+		--name;
+	LONG index;
+	LPCWSTR wildcard = wcspbrk(name, L"*?<>\"");
+	if (!wildcard) {
+		if ((index = Lookup(aPattern, length)) < 0)
+			return -1;
+		aFirst = index;
+		aEnd = index + 1;
+		return 1;
+	}
+	if (*wildcard != L'*' || wildcard[1])
+		return 0;
+	if ((index = Lookup(aPattern, name - aPattern)) < 0)
+		return -1;
+	if (!(mpEntries[index].mAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		SetLastError(ERROR_DIRECTORY);
+		return -1;
+	}
+	/* The children whose names start with the prefix are consecutive, they compare equal once cut to its
+	 * length. Find the first one, then the first one past them. */
+	size_t prefixLength = wildcard - name;
+	ULONG bounds[2];
+	for (int upper = 0; upper < 2; ++upper) {
+		ULONG low = mpEntries[index].mFirstChild, high = low + mpEntries[index].mChildCount;
+		while (low < high) {
+			ULONG middle = low + (high - low) / 2;
+			const UFSIndexEntry& entry = mpEntries[middle];
+			int result = UFSIndexCompareNames(Name(entry), entry.mNameLength < prefixLength ? entry.mNameLength : prefixLength,
+				name, prefixLength);
+			if (result < 0 || (upper && !result))
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		bounds[upper] = low;
+	}
+	aFirst = bounds[0];
+	aEnd = bounds[1];
+	if (aFirst == aEnd) {
+		SetLastError(ERROR_FILE_NOT_FOUND);
+		return -1;
+	}
+	return 1;
+}
+
+ULONG UFSIndex::Seek(ULONG aFirst, ULONG aEnd, LPCWSTR aName) const
+{
+	size_t length = wcslen(aName);
+	while (aFirst < aEnd) {
+		ULONG middle = aFirst + (aEnd - aFirst) / 2;
+		const UFSIndexEntry& entry = mpEntries[middle];
+		if (UFSIndexCompareNames(Name(entry), entry.mNameLength, aName, length) < 0)
+			aFirst = middle + 1;
+		else
+			aEnd = middle;
+	}
+	return aFirst;
+}
+
+void UFSIndex::Fill(const UFSIndexEntry& aEntry, LPWIN32_FIND_DATAW apFindData) const
+{
+	ZeroMemory(apFindData, sizeof(*apFindData));
+	apFindData->dwFileAttributes = aEntry.mAttributes;
+	apFindData->ftCreationTime = aEntry.mCreationTime;
+	apFindData->ftLastAccessTime = aEntry.mLastAccessTime;
+	apFindData->ftLastWriteTime = aEntry.mLastWriteTime;
+	apFindData->nFileSizeHigh = (DWORD)(aEntry.mSize >> 32);
+	apFindData->nFileSizeLow = (DWORD)aEntry.mSize;
+	memcpy(apFindData->cFileName, Name(aEntry), aEntry.mNameLength * sizeof(WCHAR));
+}
+
+void UFSIndex::Fill(const UFSIndexEntry& aEntry, LPWIN32_FILE_ATTRIBUTE_DATA apData) const
+{
+	apData->dwFileAttributes = aEntry.mAttributes;
+	apData->ftCreationTime = aEntry.mCreationTime;
+	apData->ftLastAccessTime = aEntry.mLastAccessTime;
+	apData->ftLastWriteTime = aEntry.mLastWriteTime;
+	apData->nFileSizeHigh = (DWORD)(aEntry.mSize >> 32);
+	apData->nFileSizeLow = (DWORD)aEntry.mSize;
+}
+
+DWORD IndexLayer::GetAttributes(LPCWSTR aPath)
+{
+	if (mStale)
+		return Win32Layer::GetAttributes(aPath);
+	LONG index = Lookup(aPath);
+	return index < 0 ? INVALID_FILE_ATTRIBUTES : mIndex.Entry(index).mAttributes;
+}
+
+BOOL IndexLayer::GetAttributesEx(LPCWSTR aPath, LPWIN32_FILE_ATTRIBUTE_DATA apData)
+{
+	if (mStale)
+		return Win32Layer::GetAttributesEx(aPath, apData);
+	LONG index = Lookup(aPath);
+	if (index < 0)
+		return FALSE;
+	mIndex.Fill(mIndex.Entry(index), apData);
+	return TRUE;
+}
+
+BOOL IndexLayer::Stat(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	if (mStale)
+		return Win32Layer::Stat(aPath, apInformation);
+	LONG index = Lookup(aPath);
+	if (index < 0)
+		return FALSE;
+	FillInformation(index, apInformation);
+	return TRUE;
+}
+
+void IndexLayer::FillInformation(ULONG aEntry, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	/* The index keeps the file ids but not the link counts. */
+	const UFSIndexEntry& entry = mIndex.Entry(aEntry);
+	apInformation->dwFileAttributes = entry.mAttributes;
+	apInformation->ftCreationTime = entry.mCreationTime;
+	apInformation->ftLastAccessTime = entry.mLastAccessTime;
+	apInformation->ftLastWriteTime = entry.mLastWriteTime;
+	apInformation->dwVolumeSerialNumber = VolumeSerialNumber();
+	apInformation->nFileSizeHigh = (DWORD)(entry.mSize >> 32);
+	apInformation->nFileSizeLow = (DWORD)entry.mSize;
+	apInformation->nNumberOfLinks = 1;
+	apInformation->nFileIndexHigh = (DWORD)(entry.mFileId >> 32);
+	apInformation->nFileIndexLow = (DWORD)entry.mFileId;
+}
+
+HANDLE IndexLayer::FindFirst(LPCWSTR aPattern, LPWIN32_FIND_DATAW apFindData)
+{
+	return Find(aPattern, NULL, 0, apFindData, NULL);
+}
+
+HANDLE IndexLayer::FindFirstAt(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition)
+{
+	return Find(aPattern, aName, aPosition, apFindData, apPosition);
+}
+
+HANDLE IndexLayer::Find(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition)
+{
+	IndexFind* find;
+	try {
+		find = new IndexFind;
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return INVALID_HANDLE_VALUE;
+	}
+	find->mDiskFind = INVALID_HANDLE_VALUE;
+	int found = mStale ? 0 : mIndex.FindRange(AdvanceBytes(aPattern, mRootLength), find->mNext, find->mEnd);
+	if (!found && aName) {
+		/* The disk is not listed in index order, read through it. Its FindFirst comes back here without a name. */
+		delete find;
+		return UFSLayer::FindFirstAt(aPattern, aName, aPosition, apFindData, apPosition);
+	}
+	if (!found) {
+		find->mDiskFind = Win32Layer::FindFirst(aPattern, apFindData);
+		if (find->mDiskFind != INVALID_HANDLE_VALUE)
+			return (HANDLE)find;
+	}
+	if (found > 0 && aName) {
+		ULONG first = find->mNext;
+		if ((find->mNext = mIndex.Seek(first, find->mEnd, aName)) == find->mEnd) {
+			SetLastError(ERROR_FILE_NOT_FOUND);
+			found = -1;
+		}
+		*apPosition = find->mNext - first;
+	}
+	if (found <= 0 || !FindNext((HANDLE)find, apFindData)) {
+		DWORD error = GetLastError();
+		delete find;
+		SetLastError(error);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)find;
+}
+
+BOOL IndexLayer::FindNext(HANDLE aFind, LPWIN32_FIND_DATAW apFindData)
+{
+	IndexFind* find = (IndexFind*)aFind;
+	if (find->mDiskFind != INVALID_HANDLE_VALUE)
+		return Win32Layer::FindNext(find->mDiskFind, apFindData);
+	if (find->mNext == find->mEnd) {
+		SetLastError(ERROR_NO_MORE_FILES);
+		return FALSE;
+	}
+	mIndex.Fill(mIndex.Entry(find->mNext++), apFindData);
+	return TRUE;
+}
+
+void IndexLayer::FindInformation(HANDLE aFind, const WIN32_FIND_DATAW& aFindData, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	IndexFind* find = (IndexFind*)aFind;
+	if (find->mDiskFind != INVALID_HANDLE_VALUE)
+		Win32Layer::FindInformation(find->mDiskFind, aFindData, apInformation);
+	else
+		FillInformation(find->mNext - 1, apInformation);
+}
+
+bool IndexLayer::RootChanged()
+{
+	if (InterlockedExchange(&mStale, 1))
+		return false;
+	fwprintf(stderr, L"The read root changed since it was indexed, the index is not used any more.\n");
+	return true;
+}
+
+void IndexLayer::FindEnd(HANDLE aFind)
+{
+	IndexFind* find = (IndexFind*)aFind;
+	if (find->mDiskFind != INVALID_HANDLE_VALUE)
+		Win32Layer::FindEnd(find->mDiskFind);
+	delete find;
+}
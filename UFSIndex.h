@@ -0,0 +1,149 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** The read root index: a sorted snapshot of the read root metadata, written by "UFSTool index" and mapped
+ * by "WinUnionFS /i" so that read root probes and listings never reach the disk.
+ *
+ * The file holds a UFSIndexHeader, then mEntryCount UFSIndexEntry records, then the names. Entry 0 is the
+ * root. The children of a directory are consecutive entries sorted by UFSIndexCompareNames, the order the
+ * union merges listings in, so a lookup is a binary search per path component and a listing is a range.
+ * The read root must not change while an index built from it is in use.
+ */
+
+#include "UFSLayer.h"
+
+#define UFS_INDEX_MAGIC 0x58444955 /* "UIDX" */
+#define UFS_INDEX_VERSION 1
+
+struct UFSIndexHeader {
+	DWORD mMagic;
+	DWORD mVersion;
+	ULONG mEntryCount;
+	ULONG mNameLength; /* In WCHARs. */
+};
+
+struct UFSIndexEntry {
+	ULONG mNameOffset; /* In WCHARs from the start of the names, which are not NUL terminated. */
+	USHORT mNameLength; /* In WCHARs. */
+	USHORT mReserved;
+	ULONG mParent;
+	ULONG mFirstChild;
+	ULONG mChildCount;
+	DWORD mAttributes;
+	FILETIME mCreationTime;
+	FILETIME mLastAccessTime;
+	FILETIME mLastWriteTime;
+	ULONG64 mSize;
+	ULONG64 mFileId; /* nFileIndexHigh and nFileIndexLow of GetFileInformationByHandle, 0 if unknown. */
+};
+
+/** Compares names case insensitively, like _wcsicmp on the NUL terminated names. */
+inline int UFSIndexCompareNames(LPCWSTR aLeft, size_t aLeftLength, LPCWSTR aRight, size_t aRightLength)
+{
+	int result = _wcsnicmp(aLeft, aRight, aLeftLength < aRightLength ? aLeftLength : aRightLength);
+	if (result)
+		return result;
+	return aLeftLength < aRightLength ? -1 : aLeftLength > aRightLength;
+}
+
+/** A read only view of a mapped index file. */
+class UFSIndex
+{
+public:
+	UFSIndex();
+	~UFSIndex();
+	/** Maps and checks aFileName.
+	 * @return false on success, GetLastError tells why it failed.
+	 */
+	bool Load(LPCWSTR aFileName);
+	/** Checks and uses the index of aSize bytes at apView, which must stay mapped while the index is in use.
+	 * Every name must lie within the names and fit in cFileName, every child range within the entries.
+	 * @return false on success, true with the last error set to ERROR_BAD_FORMAT.
+	 */
+	bool Attach(LPCVOID apView, size_t aSize);
+	ULONG EntryCount() const { return mpHeader->mEntryCount; }
+	const UFSIndexEntry& Entry(ULONG aIndex) const { return mpEntries[aIndex]; }
+	LPCWSTR Name(const UFSIndexEntry& aEntry) const { return mpNames + aEntry.mNameOffset; }
+	/** Finds the entry of the relative path aPath, of aPathLength WCHARs.
+	 * @return the entry index, or -1 with the last error set to ERROR_FILE_NOT_FOUND or ERROR_PATH_NOT_FOUND.
+	 */
+	LONG Lookup(LPCWSTR aPath, size_t aPathLength) const;
+	/** Finds the entries matching the relative pattern aPattern: a path, or a directory followed by a name
+	 * prefix and *, so that a pattern pushed down as a prefix only reads the names starting with it.
+	 * @return 1 and the range [aFirst, aEnd) of matching entries, 0 if the pattern has other wildcards, or -1
+	 * with the last error set.
+	 */
+	int FindRange(LPCWSTR aPattern, ULONG& aFirst, ULONG& aEnd) const;
+	/** @return the first entry of the sorted range [aFirst, aEnd) whose name does not compare less than aName, aEnd if none. */
+	ULONG Seek(ULONG aFirst, ULONG aEnd, LPCWSTR aName) const;
+	/** Stores aEntry the way FindFirstFile and GetFileAttributesEx would. */
+	void Fill(const UFSIndexEntry& aEntry, LPWIN32_FIND_DATAW apFindData) const;
+	void Fill(const UFSIndexEntry& aEntry, LPWIN32_FILE_ATTRIBUTE_DATA apData) const;
+
+private:
+	void Unload();
+
+	HANDLE mFile, mMapping;
+	LPCVOID mpView;
+	const UFSIndexHeader* mpHeader;
+	const UFSIndexEntry* mpEntries;
+	LPCWSTR mpNames;
+};
+
+/** A read root layer that answers attribute probes and listings from an index and everything else from the
+ * disk. Patterns with wildcards other than a final \* are listed from the disk too.
+ */
+class IndexLayer : public Win32Layer
+{
+public:
+	IndexLayer(LPCWSTR aRoot, size_t aRootLength) : Win32Layer(aRoot, aRootLength), mStale(0) {}
+	/** @return false on success, see UFSIndex::Load. */
+	bool Load(LPCWSTR aIndexFile) { return mIndex.Load(aIndexFile); }
+
+	virtual DWORD GetAttributes(LPCWSTR aPath);
+	virtual BOOL GetAttributesEx(LPCWSTR aPath, LPWIN32_FILE_ATTRIBUTE_DATA apData);
+	virtual BOOL Stat(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	virtual HANDLE FindFirst(LPCWSTR aPattern, LPWIN32_FIND_DATAW apFindData);
+	virtual BOOL FindNext(HANDLE aFind, LPWIN32_FIND_DATAW apFindData);
+	virtual void FindEnd(HANDLE aFind);
+	virtual HANDLE FindFirstAt(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition);
+	virtual void FindInformation(HANDLE aFind, const WIN32_FIND_DATAW& aFindData, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	/* The root no longer matches the index, every query goes to the disk from now on. */
+	virtual bool RootChanged();
+
+private:
+	struct IndexFind {
+		HANDLE mDiskFind; /* INVALID_HANDLE_VALUE when listing from the index. */
+		ULONG mNext, mEnd;
+	};
+	/* FindFirst and FindFirstAt, aName is NULL for the former. */
+	HANDLE Find(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition);
+	LONG Lookup(LPCWSTR aPath) const
+	{
+		LPCWSTR relativePath = AdvanceBytes(aPath, mRootLength);
+		return mIndex.Lookup(relativePath, wcslen(relativePath));
+	}
+	void FillInformation(ULONG aEntry, LPBY_HANDLE_FILE_INFORMATION apInformation);
+
+	UFSIndex mIndex;
+	volatile LONG mStale; /* Set once the root changed, see RootChanged. */
+};
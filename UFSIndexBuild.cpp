@@ -0,0 +1,257 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "UFSIndex.h"
+#include "UFSIndexBuild.h"
+#include "TreeWalker.h"
+
+struct IndexedEntry {
+	wstring mName;
+	DWORD mAttributes;
+	FILETIME mCreationTime, mLastAccessTime, mLastWriteTime;
+	ULONG64 mSize;
+	ULONG64 mFileId;
+};
+
+static bool IndexedBefore(const IndexedEntry& aLeft, const IndexedEntry& aRight)
+{
+	return UFSIndexCompareNames(aLeft.mName.c_str(), aLeft.mName.size(), aRight.mName.c_str(), aRight.mName.size()) < 0;
+}
+
+/* The file id of aPath, 0 if it cannot be opened. */
+static ULONG64 GetFileId(LPCWSTR aPath)
+{
+	HANDLE handle = CreateFile(aPath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return 0;
+	BY_HANDLE_FILE_INFORMATION information;
+	ULONG64 fileId = 0;
+	if (GetFileInformationByHandle(handle, &information))
+		fileId = ((ULONG64)information.nFileIndexHigh << 32) | information.nFileIndexLow;
+	CloseHandle(handle);
+	return fileId;
+}
+
+/** Lists every directory of the read root in parallel, keeping the sorted children of each. */
+class IndexBuilder : public ParallelTreeWalker
+{
+public:
+	IndexBuilder(const wstring& aRoot) : mRoot(aRoot), mErrors(0)
+	{
+		InitializeCriticalSection(&mLock);
+	}
+	~IndexBuilder()
+	{
+		DeleteCriticalSection(&mLock);
+	}
+
+	/* The children of each directory by relative path, the root is "". */
+	map<wstring, vector<IndexedEntry> > mDirectories;
+	ULONG64 mErrors;
+
+protected:
+	virtual void Visit(const wstring& aRelativePath, vector<wstring>& aSubdirectories);
+
+private:
+	wstring mRoot;
+	CRITICAL_SECTION mLock;
+};
+
+void IndexBuilder::Visit(const wstring& aRelativePath, vector<wstring>& aSubdirectories)
+{
+	wstring path(mRoot + aRelativePath);
+	path.append(L"\\*");
+	vector<IndexedEntry> children;
+	WIN32_FIND_DATAW findData;
+	HANDLE find = FindFirstFile(path.c_str(), &findData);
+	if (find == INVALID_HANDLE_VALUE) {
+		fwprintf(stderr, L"Cannot list %s. Error: %d.\n", path.c_str(), GetLastError());
+		CriticalSectionLock lock(mLock);
+		++mErrors;
+		return;
+	}
+	do {
+		if (findData.cFileName[0] == L'.' && (!findData.cFileName[1] ||
+			(findData.cFileName[1] == L'.' && !findData.cFileName[2])))
+			continue;
+		IndexedEntry entry;
+		entry.mName = findData.cFileName;
+		entry.mAttributes = findData.dwFileAttributes;
+		entry.mCreationTime = findData.ftCreationTime;
+		entry.mLastAccessTime = findData.ftLastAccessTime;
+		entry.mLastWriteTime = findData.ftLastWriteTime;
+		entry.mSize = ((ULONG64)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+		path.assign(mRoot).append(aRelativePath).append(1, L'\\').append(entry.mName);
+		entry.mFileId = GetFileId(path.c_str());
+		children.push_back(entry);
+		if (entry.mAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			aSubdirectories.push_back(path.substr(mRoot.size()));
+	} while (FindNextFile(find, &findData));
+	DWORD error = GetLastError();
+	FindClose(find);
+	sort(children.begin(), children.end(), IndexedBefore);
+	CriticalSectionLock lock(mLock);
+	if (error != ERROR_NO_MORE_FILES) {
+		fwprintf(stderr, L"Cannot list %s%s. Error: %d.\n", mRoot.c_str(), aRelativePath.c_str(), error);
+		++mErrors;
+	}
+	mDirectories[aRelativePath].swap(children);
+}
+
+static void MakeEntry(UFSIndexEntry& aEntry, const IndexedEntry& aIndexed, ULONG aParent, wstring& aNames)
+{
+	ZeroMemory(&aEntry, sizeof(aEntry));
+	aEntry.mNameOffset = (ULONG)aNames.size();
+	aEntry.mNameLength = (USHORT)aIndexed.mName.size();
+	aEntry.mParent = aParent;
+	aEntry.mAttributes = aIndexed.mAttributes;
+	aEntry.mCreationTime = aIndexed.mCreationTime;
+	aEntry.mLastAccessTime = aIndexed.mLastAccessTime;
+	aEntry.mLastWriteTime = aIndexed.mLastWriteTime;
+	aEntry.mSize = aIndexed.mSize;
+	aEntry.mFileId = aIndexed.mFileId;
+	aNames.append(aIndexed.mName);
+}
+
+bool BuildIndex(const wstring& aRoot, ULONG aThreadCount, vector<UFSIndexEntry>& aEntries, wstring& aNames, vector<wstring>* apPaths)
+{
+	IndexedEntry rootEntry;
+	WIN32_FILE_ATTRIBUTE_DATA rootData;
+	if (!GetFileAttributesEx(aRoot.c_str(), GetFileExInfoStandard, &rootData) || !(rootData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		fwprintf(stderr, L"%s is not a directory.\n", aRoot.c_str());
+		return true;
+	}
+	rootEntry.mAttributes = rootData.dwFileAttributes;
+	rootEntry.mCreationTime = rootData.ftCreationTime;
+	rootEntry.mLastAccessTime = rootData.ftLastAccessTime;
+	rootEntry.mLastWriteTime = rootData.ftLastWriteTime;
+	rootEntry.mSize = 0;
+	rootEntry.mFileId = GetFileId(aRoot.c_str());
+
+	IndexBuilder builder(aRoot);
+	builder.Run(wstring(), aThreadCount);
+	if (builder.mErrors || builder.Failed()) {
+		fwprintf(stderr, L"The read root could not be listed completely.\n");
+		return true;
+	}
+
+	aEntries.assign(1, UFSIndexEntry());
+	aNames.erase();
+	if (apPaths)
+		apPaths->assign(1, wstring());
+	MakeEntry(aEntries[0], rootEntry, 0, aNames);
+	deque<pair<ULONG, wstring> > pending;
+	pending.push_back(make_pair(0UL, wstring()));
+	while (!pending.empty()) {
+		ULONG directory = pending.front().first;
+		wstring relativePath(pending.front().second);
+		pending.pop_front();
+		const vector<IndexedEntry>& children = builder.mDirectories[relativePath];
+		aEntries[directory].mFirstChild = (ULONG)aEntries.size();
+		aEntries[directory].mChildCount = (ULONG)children.size();
+		for (vector<IndexedEntry>::const_iterator child = children.begin(); child != children.end(); ++child) {
+			aEntries.push_back(UFSIndexEntry());
+			MakeEntry(aEntries.back(), *child, directory, aNames);
+			if (apPaths)
+				apPaths->push_back(relativePath + L"\\" + child->mName);
+			if (child->mAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				pending.push_back(make_pair((ULONG)aEntries.size() - 1, relativePath + L"\\" + child->mName));
+		}
+	}
+	return false;
+}
+
+bool WriteIndex(HANDLE aFile, const vector<UFSIndexEntry>& aEntries, const wstring& aNames)
+{
+	UFSIndexHeader header;
+	header.mMagic = UFS_INDEX_MAGIC;
+	header.mVersion = UFS_INDEX_VERSION;
+	header.mEntryCount = (ULONG)aEntries.size();
+	header.mNameLength = (ULONG)aNames.size();
+	DWORD written;
+	return !WriteFile(aFile, &header, sizeof(header), &written, NULL) ||
+		!WriteFile(aFile, &aEntries[0], (DWORD)(aEntries.size() * sizeof(UFSIndexEntry)), &written, NULL) ||
+		(!aNames.empty() && !WriteFile(aFile, aNames.data(), (DWORD)(aNames.size() * sizeof(WCHAR)), &written, NULL));
+}
+
+ULONG DefaultThreadCount()
+{
+	/* Twice the processors, so the walk keeps going while threads wait for the disks. */
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	return systemInfo.dwNumberOfProcessors * 2;
+}
+
+/** Implements "UFSTool index <ReadRoot> <IndexFile> [/t <Threads>]".
+ * Lists the read root on parallel threads, then lays the entries out breadth first so that the children of
+ * every directory are consecutive.
+ */
+int UFSIndexBuild(int argc, LPWSTR argv[])
+{
+	ULONG threadCount = 0;
+	for (int i = 2; i < argc; ++i)
+		if (towupper(argv[i][1]) != L'T' || ++i == argc || !(threadCount = wcstoul(argv[i], NULL, 10)))
+			argc = 0;
+	if (argc < 2) {
+		fwprintf(stderr, L"UFSTool index <ReadRoot> <IndexFile> [/t <Threads>]\n");
+		return 2;
+	}
+	if (!threadCount)
+		threadCount = DefaultThreadCount();
+	wstring root(argv[0]);
+	if (root.size() > 1 && (root[root.size() - 1] == L'\\' || root[root.size() - 1] == L'/'))
+		root.erase(root.size() - 1);
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	vector<UFSIndexEntry> entries;
+	wstring names;
+	if (BuildIndex(root, threadCount, entries, names, NULL)) {
+		fwprintf(stderr, L"No index written.\n");
+		return 1;
+	}
+	HANDLE file = CreateFile(argv[1], GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	bool failed = file == INVALID_HANDLE_VALUE || WriteIndex(file, entries, names);
+	DWORD error = GetLastError();
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	if (failed) {
+		fwprintf(stderr, L"Cannot write %s. Error: %d.\n", argv[1], error);
+		return 1;
+	}
+	QueryPerformanceCounter(&end);
+	wprintf(L"%u entries indexed in %.1f s on %u threads.\n", (ULONG)entries.size(),
+		(double)(end.QuadPart - start.QuadPart) / frequency.QuadPart, threadCount);
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/* Builds read root indexes, see UFSIndex.h. */
+
+#include <string>
+#include <vector>
+
+#include "UFSIndex.h"
+
+/** Lists the directory aRoot on aThreadCount threads and lays its entries out as an index, breadth first so
+ * that the children of every directory are consecutive. apPaths, unless NULL, receives the relative path of
+ * every entry, "" for the root.
+ * @return false on success, errors are printed to stderr.
+ */
+bool BuildIndex(const std::wstring& aRoot, ULONG aThreadCount, std::vector<UFSIndexEntry>& aEntries, std::wstring& aNames,
+	std::vector<std::wstring>* apPaths);
+/** Writes the index of aEntries and aNames at the current position of aFile.
+ * @return false on success, GetLastError tells why it failed.
+ */
+bool WriteIndex(HANDLE aFile, const std::vector<UFSIndexEntry>& aEntries, const std::wstring& aNames);
+/** The number of threads a walk of the read root uses by default. */
+ULONG DefaultThreadCount();
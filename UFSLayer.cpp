@@ -0,0 +1,352 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <winioctl.h>
+#include <string>
+#include "UFSLayer.h"
+
+/* The chunk sparse copies move at a time. */
+#define UFS_COPY_CHUNK_SIZE 65536
+
+/* A listing of a Win32Layer, with the directory it lists so that FindInformation can reach its entries. */
+struct Win32Find {
+	HANDLE mFind;
+	std::wstring mDirectory; /* Ends with a backslash. */
+};
+
+UFSLayer::UFSLayer(LPCWSTR aRoot, size_t aRootLength) : mRootLength(aRootLength)
+{
+	if (mRootLength >= MAX_PATHB)
+		mRootLength = 0;
+	memcpy(mRoot, aRoot, mRootLength);
+	*AdvanceBytes(mRoot, mRootLength) = L'\0';
+}
+
+HANDLE UFSLayer::FindFirstAt(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition)
+{
+	/* The first pass looks for the name, the second one, if the name is gone, counts to its position. */
+	for (int pass = 0; pass < 2; ++pass) {
+		HANDLE find = FindFirst(aPattern, apFindData);
+		if (find == INVALID_HANDLE_VALUE)
+			return find;
+		ULONG position = 0;
+		while (pass ? position < aPosition : _wcsicmp(apFindData->cFileName, aName) != 0) {
+			if (!FindNext(find, apFindData)) {
+				DWORD error = GetLastError();
+				FindEnd(find);
+				if (error != ERROR_NO_MORE_FILES) {
+					SetLastError(error);
+					return INVALID_HANDLE_VALUE;
+				}
+				find = INVALID_HANDLE_VALUE;
+				break;
+			}
+			++position;
+		}
+		if (find != INVALID_HANDLE_VALUE) {
+			*apPosition = position;
+			return find;
+		}
+	}
+	SetLastError(ERROR_FILE_NOT_FOUND);
+	return INVALID_HANDLE_VALUE;
+}
+
+DWORD Win32Layer::GetAttributes(LPCWSTR aPath)
+{
+	return GetFileAttributes(aPath);
+}
+
+BOOL Win32Layer::GetAttributesEx(LPCWSTR aPath, LPWIN32_FILE_ATTRIBUTE_DATA apData)
+{
+	return GetFileAttributesEx(aPath, GetFileExInfoStandard, apData);
+}
+
+DWORD Win32Layer::VolumeSerialNumber()
+{
+	if (!mVolumeSerialNumberKnown) {
+		/* Threads racing here store the same value. */
+		BY_HANDLE_FILE_INFORMATION information;
+		HANDLE root = CreateFile(mRoot, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		if (root == INVALID_HANDLE_VALUE)
+			return 0;
+		BOOL known = GetFileInformationByHandle(root, &information);
+		CloseHandle(root);
+		if (!known)
+			return 0;
+		mVolumeSerialNumber = information.dwVolumeSerialNumber;
+		InterlockedExchange(&mVolumeSerialNumberKnown, 1);
+	}
+	return mVolumeSerialNumber;
+}
+
+/** Stores the information of aPath from a handle opened without access rights, which reads no data and
+ * conflicts with no sharing mode, and tells the file index and the link count as the handles of the union do.
+ */
+static BOOL GetInformationByPath(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	HANDLE file = CreateFile(aPath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BOOL known = GetFileInformationByHandle(file, apInformation);
+	DWORD error = GetLastError();
+	CloseHandle(file);
+	SetLastError(error);
+	return known;
+}
+
+BOOL Win32Layer::Stat(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	if (GetInformationByPath(aPath, apInformation))
+		return TRUE;
+	DWORD error = GetLastError();
+	if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND)
+		return FALSE;
+	/* Some files cannot be opened even without access rights, the paging file for one. */
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesEx(aPath, GetFileExInfoStandard, &data))
+		return FALSE;
+	apInformation->dwFileAttributes = data.dwFileAttributes;
+	apInformation->ftCreationTime = data.ftCreationTime;
+	apInformation->ftLastAccessTime = data.ftLastAccessTime;
+	apInformation->ftLastWriteTime = data.ftLastWriteTime;
+	apInformation->dwVolumeSerialNumber = VolumeSerialNumber();
+	apInformation->nFileSizeHigh = data.nFileSizeHigh;
+	apInformation->nFileSizeLow = data.nFileSizeLow;
+	apInformation->nNumberOfLinks = 1;
+	apInformation->nFileIndexHigh = 0;
+	apInformation->nFileIndexLow = 0;
+	return TRUE;
+}
+
+void Win32Layer::FindInformation(HANDLE aFind, const WIN32_FIND_DATAW& aFindData, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	try {
+		std::wstring path(((Win32Find*)aFind)->mDirectory);
+		path.append(aFindData.cFileName);
+		if (GetInformationByPath(path.c_str(), apInformation))
+			return;
+	} catch (...) {
+	}
+	/* Gone or denied since listed: the listing holds all but the file index and the link count. */
+	apInformation->dwFileAttributes = aFindData.dwFileAttributes;
+	apInformation->ftCreationTime = aFindData.ftCreationTime;
+	apInformation->ftLastAccessTime = aFindData.ftLastAccessTime;
+	apInformation->ftLastWriteTime = aFindData.ftLastWriteTime;
+	apInformation->dwVolumeSerialNumber = VolumeSerialNumber();
+	apInformation->nFileSizeHigh = aFindData.nFileSizeHigh;
+	apInformation->nFileSizeLow = aFindData.nFileSizeLow;
+	apInformation->nNumberOfLinks = 1;
+	apInformation->nFileIndexHigh = 0;
+	apInformation->nFileIndexLow = 0;
+}
+
+BOOL Win32Layer::SetAttributes(LPCWSTR aPath, DWORD aAttributes)
+{
+	return SetFileAttributes(aPath, aAttributes);
+}
+
+HANDLE Win32Layer::FindFirst(LPCWSTR aPattern, LPWIN32_FIND_DATAW apFindData)
+{
+	Win32Find* find = NULL;
+	try {
+		find = new Win32Find;
+		LPCWSTR name = wcsrchr(aPattern, L'\\');
+		find->mDirectory.assign(aPattern, name ? name + 1 - aPattern : 0);
+	} catch (...) {
+		delete find;
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return INVALID_HANDLE_VALUE;
+	}
+	if ((find->mFind = FindFirstFile(aPattern, apFindData)) == INVALID_HANDLE_VALUE) {
+		DWORD error = GetLastError();
+		delete find;
+		SetLastError(error);
+		return INVALID_HANDLE_VALUE;
+	}
+	return (HANDLE)find;
+}
+
+BOOL Win32Layer::FindNext(HANDLE aFind, LPWIN32_FIND_DATAW apFindData)
+{
+	return FindNextFile(((Win32Find*)aFind)->mFind, apFindData);
+}
+
+void Win32Layer::FindEnd(HANDLE aFind)
+{
+	Win32Find* find = (Win32Find*)aFind;
+	FindClose(find->mFind);
+	delete find;
+}
+
+HANDLE Win32Layer::Open(LPCWSTR aPath, DWORD aAccessMode, DWORD aShareMode, DWORD aCreationDisposition, DWORD aFlagsAndAttributes)
+{
+	return CreateFile(aPath, aAccessMode, aShareMode, NULL, aCreationDisposition, aFlagsAndAttributes, NULL);
+}
+
+BOOL Win32Layer::MakeDirectory(LPCWSTR aPath)
+{
+	return CreateDirectory(aPath, NULL);
+}
+
+BOOL Win32Layer::DeleteDirectory(LPCWSTR aPath)
+{
+	return RemoveDirectory(aPath);
+}
+
+BOOL Win32Layer::Unlink(LPCWSTR aPath)
+{
+	return DeleteFile(aPath);
+}
+
+BOOL Win32Layer::Rename(LPCWSTR aPath, LPCWSTR aNewPath, BOOL aReplaceIfExisting)
+{
+	return aReplaceIfExisting ? MoveFileEx(aPath, aNewPath, MOVEFILE_REPLACE_EXISTING) : MoveFile(aPath, aNewPath);
+}
+
+/** Copies the allocated ranges of aSource to aDestination, which is made sparse and as long as aSource.
+ * @return false on success.
+ */
+static bool CopyAllocatedRanges(HANDLE aSource, HANDLE aDestination, LONGLONG aSize)
+{
+	DWORD bytes;
+	if (!DeviceIoControl(aDestination, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL))
+		return true;
+	LARGE_INTEGER position;
+	position.QuadPart = aSize;
+	if (!SetFilePointerEx(aDestination, position, NULL, FILE_BEGIN) || !SetEndOfFile(aDestination))
+		return true;
+	BYTE* buffer;
+	try {
+		buffer = new BYTE[UFS_COPY_CHUNK_SIZE];
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return true;
+	}
+	FILE_ALLOCATED_RANGE_BUFFER query, ranges[64];
+	query.FileOffset.QuadPart = 0;
+	query.Length.QuadPart = aSize;
+	bool failed = false, more = aSize > 0;
+	while (!failed && more) {
+		more = !DeviceIoControl(aSource, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &bytes, NULL);
+		if (more && GetLastError() != ERROR_MORE_DATA) {
+			failed = true;
+			break;
+		}
+		DWORD count = bytes / sizeof(*ranges);
+		if (!count)
+			break;
+		for (DWORD i = 0; !failed && i < count; ++i) {
+			LONGLONG offset = ranges[i].FileOffset.QuadPart, end = offset + ranges[i].Length.QuadPart;
+			position.QuadPart = offset;
+			failed = !SetFilePointerEx(aSource, position, NULL, FILE_BEGIN) || !SetFilePointerEx(aDestination, position, NULL, FILE_BEGIN);
+			while (!failed && offset < end) {
+				DWORD length = (DWORD)(end - offset < UFS_COPY_CHUNK_SIZE ? end - offset : UFS_COPY_CHUNK_SIZE), read, written;
+				failed = !ReadFile(aSource, buffer, length, &read, NULL) || !WriteFile(aDestination, buffer, read, &written, NULL);
+				if (!failed && !read) {
+					SetLastError(ERROR_HANDLE_EOF); // The file shrank meanwhile.
+					failed = true;
+				}
+				offset += read;
+			}
+		}
+		/* The next query starts after the last range returned. */
+		LONGLONG next = ranges[count - 1].FileOffset.QuadPart + ranges[count - 1].Length.QuadPart;
+		query.Length.QuadPart = aSize - next;
+		query.FileOffset.QuadPart = next;
+		more = more && query.Length.QuadPart > 0;
+	}
+	delete[] buffer;
+	return failed;
+}
+
+BOOL Win32Layer::CopyOut(LPCWSTR aPath, LPCWSTR aDestination, BOOL aFailIfExists)
+{
+	/* CopyFile writes the holes of sparse files as zeros, copy only what is allocated instead. */
+	DWORD attributes = GetFileAttributes(aPath);
+	if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_SPARSE_FILE) || (attributes & FILE_ATTRIBUTE_DIRECTORY))
+		return CopyFile(aPath, aDestination, aFailIfExists);
+	HANDLE source = CreateFile(aPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (source == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BY_HANDLE_FILE_INFORMATION information;
+	if (!GetFileInformationByHandle(source, &information)) {
+		DWORD error = GetLastError();
+		CloseHandle(source);
+		SetLastError(error);
+		return FALSE;
+	}
+	HANDLE destination = CreateFile(aDestination, GENERIC_WRITE, 0, NULL, aFailIfExists ? CREATE_NEW : CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (destination == INVALID_HANDLE_VALUE) {
+		DWORD error = GetLastError();
+		CloseHandle(source);
+		SetLastError(error);
+		return FALSE;
+	}
+	bool failed = CopyAllocatedRanges(source, destination, ((LONGLONG)information.nFileSizeHigh << 32) | information.nFileSizeLow) ||
+		!SetFileTime(destination, &information.ftCreationTime, &information.ftLastAccessTime, &information.ftLastWriteTime);
+	DWORD error = GetLastError();
+	CloseHandle(source);
+	CloseHandle(destination);
+	/* The sparse attribute itself cannot be set this way, the destination already has it. */
+	if (!failed)
+		failed = !SetFileAttributes(aDestination, information.dwFileAttributes);
+	else
+		SetLastError(error);
+	if (failed) {
+		error = GetLastError();
+		DeleteFile(aDestination);
+		SetLastError(error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL Win32Layer::Read(HANDLE aFile, LPVOID aBuffer, DWORD aLength, LPDWORD apReadLength, LONGLONG aOffset)
+{
+	if (SetFilePointer(aFile, (LONG)aOffset, ((LONG*)&aOffset) + 1, FILE_BEGIN) == INVALID_SET_FILE_POINTER && GetLastError() != NO_ERROR)
+		return FALSE;
+	return ReadFile(aFile, aBuffer, aLength, apReadLength, NULL);
+}
+
+BOOL Win32Layer::GetInformation(HANDLE aFile, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	return GetFileInformationByHandle(aFile, apInformation);
+}
+
+BOOL Win32Layer::Lock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength)
+{
+	return LockFile(aFile, (DWORD)aOffset, (DWORD)(aOffset >> 32), (DWORD)aLength, (DWORD)(aLength >> 32));
+}
+
+BOOL Win32Layer::Unlock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength)
+{
+	return UnlockFile(aFile, (DWORD)aOffset, (DWORD)(aOffset >> 32), (DWORD)aLength, (DWORD)(aLength >> 32));
+}
+
+BOOL Win32Layer::Close(HANDLE aFile)
+{
+	return CloseHandle(aFile);
+}
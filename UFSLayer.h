@@ -0,0 +1,164 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/* The length of buffers used to store file paths */
+#define MAX_PATHW 32768
+#define MAX_PATHB (MAX_PATHW*sizeof(WCHAR))
+#define AdvanceBytes(pointer, bytes) ((WCHAR*)((char*)pointer + bytes))
+
+extern bool gDebugMode;
+#ifdef DEBUG
+#define DbgPrint(...) 
+#else
+/* Prints to stderr when debug output is enabled with /d. */
+void DbgPrint(LPCWSTR aFormat, ...);
+#endif
+
+/** This function concatenates aRootPath with aRelativePath and puts the result in aDest.
+ * It is assumed that aDest is at least MAX_PATHB bytes long.
+ * If the concatenated size of string would be too big for the minimum size buffer to hold, a NUL is put at the begining of the buffer
+ * and true is returned.
+ * aRootPathLength and aRelativepathLength are in bytes and do not include the terminating NUL, hence either aRootPath nor aRelativepath
+ * need to be NUL terminated.
+ * aDest is going to be NUL terminated.
+ */
+inline bool PatchPath(LPWSTR aDest, LPCWSTR aRootPath, LPCWSTR aRelativePath, size_t aRootPathLength, size_t aRelativePathLength)
+{
+	if (aRelativePathLength + aRootPathLength >= MAX_PATHB) {
+		DbgPrint(L"Path too long: %s.\n", aRelativePath);
+		/* Force an error*/
+		*aDest = 0;
+		return true;
+	}
+	memcpy(aDest, aRootPath, aRootPathLength);
+	aDest = AdvanceBytes(aDest, aRootPathLength);
+	memcpy(aDest, aRelativePath, aRelativePathLength);
+	*(AdvanceBytes(aDest, aRelativePathLength)) = L'\0';
+	return false;
+}
+
+/** A storage layer holding one root of the union, the read root or the write root.
+ * The union engine reaches the underlying storage only through this interface, so a layer can be backed by
+ * something other than a Win32 directory. Paths passed to the layer are native paths built by MakePath.
+ * Failures are reported the Win32 way: the function fails and the error is available from GetLastError.
+ */
+class UFSLayer
+{
+public:
+	UFSLayer(LPCWSTR aRoot, size_t aRootLength);
+	virtual ~UFSLayer() {}
+
+	/** The root path, NUL terminated. */
+	LPCWSTR Root() const { return mRoot; }
+	/** The length of the root path in bytes without the terminating NUL. */
+	size_t RootLength() const { return mRootLength; }
+	/** Builds the native path of aRelativePath in this layer, see PatchPath.
+	 * @return false on success.
+	 */
+	bool MakePath(LPWSTR aDest, LPCWSTR aRelativePath, size_t aRelativePathLength) const
+	{
+		return PatchPath(aDest, mRoot, aRelativePath, mRootLength, aRelativePathLength);
+	}
+
+	/* See the Win32 function of the same name. */
+	virtual DWORD GetAttributes(LPCWSTR aPath) = 0;
+	virtual BOOL GetAttributesEx(LPCWSTR aPath, LPWIN32_FILE_ATTRIBUTE_DATA apData) = 0;
+	/* Stores what GetInformation would for a handle of aPath, without opening it for access. A layer that
+	 * cannot tell the link count or the file index reports 1 link and a file index of 0. */
+	virtual BOOL Stat(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation) = 0;
+	virtual BOOL SetAttributes(LPCWSTR aPath, DWORD aAttributes) = 0;
+	/* See FindFirstFile, FindNextFile and FindClose. */
+	virtual HANDLE FindFirst(LPCWSTR aPattern, LPWIN32_FIND_DATAW apFindData) = 0;
+	virtual BOOL FindNext(HANDLE aFind, LPWIN32_FIND_DATAW apFindData) = 0;
+	virtual void FindEnd(HANDLE aFind) = 0;
+	/* Like FindFirst, but starts at the entry named aName, compared case insensitively, and stores in
+	 * apPosition how many entries the listing holds before it. If the entry is gone, starts at the entry at
+	 * aPosition instead, failing with ERROR_FILE_NOT_FOUND if there is none. Only an exact match positions the
+	 * listing, whatever order the layer lists in. This default reads through the entries before it, sorted
+	 * layers seek to it. */
+	virtual HANDLE FindFirstAt(LPCWSTR aPattern, LPCWSTR aName, ULONG aPosition, LPWIN32_FIND_DATAW apFindData, PULONG apPosition);
+	/* Stores what Stat would for the entry aFind last stored in aFindData. Layers whose listings lack the file
+	 * index and the link count ask the storage for them. */
+	virtual void FindInformation(HANDLE aFind, const WIN32_FIND_DATAW& aFindData, LPBY_HANDLE_FILE_INFORMATION apInformation) = 0;
+	/* See CreateFile. The handle is passed to the operations on handles below. Only the write root handles are
+	 * also used with the Win32 file functions, to write. */
+	virtual HANDLE Open(LPCWSTR aPath, DWORD aAccessMode, DWORD aShareMode, DWORD aCreationDisposition, DWORD aFlagsAndAttributes) = 0;
+	/* See CreateDirectory, RemoveDirectory and DeleteFile. */
+	virtual BOOL MakeDirectory(LPCWSTR aPath) = 0;
+	virtual BOOL DeleteDirectory(LPCWSTR aPath) = 0;
+	virtual BOOL Unlink(LPCWSTR aPath) = 0;
+	/* See MoveFileEx. Both paths are in this layer. */
+	virtual BOOL Rename(LPCWSTR aPath, LPCWSTR aNewPath, BOOL aReplaceIfExisting) = 0;
+	/* See CopyFile. aDestination is a native path that may belong to another layer. */
+	virtual BOOL CopyOut(LPCWSTR aPath, LPCWSTR aDestination, BOOL aFailIfExists) = 0;
+	/* Tells the layer that its root changed behind the back of the union. A layer answering from a snapshot of
+	 * the root stops doing so.
+	 * @return true if it just stopped, what it answered before may be stale. */
+	virtual bool RootChanged() { return false; }
+
+	/* Operations on handles returned by Open, which need not be Win32 file handles. Read reads at aOffset,
+	 * see SetFilePointer and ReadFile. See GetFileInformationByHandle, LockFile, UnlockFile and CloseHandle. */
+	virtual BOOL Read(HANDLE aFile, LPVOID aBuffer, DWORD aLength, LPDWORD apReadLength, LONGLONG aOffset) = 0;
+	virtual BOOL GetInformation(HANDLE aFile, LPBY_HANDLE_FILE_INFORMATION apInformation) = 0;
+	virtual BOOL Lock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength) = 0;
+	virtual BOOL Unlock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength) = 0;
+	virtual BOOL Close(HANDLE aFile) = 0;
+
+protected:
+	WCHAR mRoot[MAX_PATHW];
+	size_t mRootLength;
+};
+
+/** A layer backed by a directory accessed through the Win32 file API. */
+class Win32Layer : public UFSLayer
+{
+public:
+	Win32Layer(LPCWSTR aRoot, size_t aRootLength) : UFSLayer(aRoot, aRootLength), mVolumeSerialNumberKnown(0) {}
+
+	virtual DWORD GetAttributes(LPCWSTR aPath);
+	virtual BOOL GetAttributesEx(LPCWSTR aPath, LPWIN32_FILE_ATTRIBUTE_DATA apData);
+	virtual BOOL Stat(LPCWSTR aPath, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	virtual BOOL SetAttributes(LPCWSTR aPath, DWORD aAttributes);
+	virtual HANDLE FindFirst(LPCWSTR aPattern, LPWIN32_FIND_DATAW apFindData);
+	virtual BOOL FindNext(HANDLE aFind, LPWIN32_FIND_DATAW apFindData);
+	virtual void FindEnd(HANDLE aFind);
+	virtual void FindInformation(HANDLE aFind, const WIN32_FIND_DATAW& aFindData, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	virtual HANDLE Open(LPCWSTR aPath, DWORD aAccessMode, DWORD aShareMode, DWORD aCreationDisposition, DWORD aFlagsAndAttributes);
+	virtual BOOL MakeDirectory(LPCWSTR aPath);
+	virtual BOOL DeleteDirectory(LPCWSTR aPath);
+	virtual BOOL Unlink(LPCWSTR aPath);
+	virtual BOOL Rename(LPCWSTR aPath, LPCWSTR aNewPath, BOOL aReplaceIfExisting);
+	virtual BOOL CopyOut(LPCWSTR aPath, LPCWSTR aDestination, BOOL aFailIfExists);
+	virtual BOOL Read(HANDLE aFile, LPVOID aBuffer, DWORD aLength, LPDWORD apReadLength, LONGLONG aOffset);
+	virtual BOOL GetInformation(HANDLE aFile, LPBY_HANDLE_FILE_INFORMATION apInformation);
+	virtual BOOL Lock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength);
+	virtual BOOL Unlock(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength);
+	virtual BOOL Close(HANDLE aFile);
+
+protected:
+	/** The serial number of the volume holding the root, looked up once. */
+	DWORD VolumeSerialNumber();
+
+private:
+	DWORD mVolumeSerialNumber;
+	volatile LONG mVolumeSerialNumberKnown;
+};
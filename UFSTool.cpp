@@ -0,0 +1,61 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* UFSTool: offline utilities for WinUnionFS roots and trace files.
+ */
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+
+int UFSTraceDecode(int argc, LPWSTR argv[]);
+int UFSCommit(int argc, LPWSTR argv[]);
+int UFSIndexBuild(int argc, LPWSTR argv[]);
+int UFSImageBuild(int argc, LPWSTR argv[]);
+int UFSCheck(int argc, LPWSTR argv[]);
+
+struct UFSToolCommand {
+	LPCWSTR mName;
+	int (*mpMain)(int argc, LPWSTR argv[]);
+	LPCWSTR mUsage;
+};
+
+static const UFSToolCommand gCommands[] = {
+	{L"decode", UFSTraceDecode, L"decode <TraceFile> [/j]    print a trace recorded with WinUnionFS /x or /y, /j prints Chrome trace JSON"},
+	{L"commit", UFSCommit, L"commit <ReadRoot> <WriteRoot> <NewReadRoot> [/t <Threads>] [/c]    merge the write root into a new read root,\n"
+		L"		hard linking the read root files, /c copies them instead"},
+	{L"index", UFSIndexBuild, L"index <ReadRoot> <IndexFile> [/t <Threads>]    index the read root metadata for WinUnionFS /i"},
+	{L"image", UFSImageBuild, L"image <ReadRoot> <ImageFile> [/z] [/b <BlockKB>] [/t <Threads>]    pack the read root into one file for\n"
+		L"		WinUnionFS /r, /z compresses it in blocks of 64 KB or BlockKB"},
+	{L"check", UFSCheck, L"check [<Filter>]    run the engine checks whose names contain the filter on scratch roots in the\n"
+		L"		temp directory"},
+};
+
+int wmain(int argc, LPWSTR argv[])
+{
+	if (argc > 1)
+		for (size_t i = 0; i < sizeof(gCommands) / sizeof(*gCommands); ++i)
+			if (!_wcsicmp(argv[1], gCommands[i].mName))
+				return gCommands[i].mpMain(argc - 2, argv + 2);
+	fwprintf(stderr, L"%s <command> [<arguments>]\n", *argv);
+	for (size_t i = 0; i < sizeof(gCommands) / sizeof(*gCommands); ++i)
+		fwprintf(stderr, L"	%s\n", gCommands[i].mUsage);
+	return 2;
+}
@@ -0,0 +1,265 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include "dokan.h"
+#include "UFSTrace.h"
+
+bool gTraceEnabled = false;
+
+/* Number of path ids a ring remembers as already named. Must be a power of 2. */
+#define UFS_TRACE_KNOWN_PATHS 256
+
+struct UFSTraceKnownPath {
+	ULONG mHash;
+	ULONG mPathId; /* 0 if the entry is unused. */
+	ULONG mAt; /* Value of mHead after the name was recorded. */
+	ULONG mChunks; /* The UFS_TRACE_PATH_NAME records right before mAt holding the name. */
+};
+
+/** The ring of one thread. Only the owning thread writes records, so no locking is needed.
+ * Rings are never freed, the Dokan thread pool is fixed for the life of the mount.
+ */
+struct UFSTraceRing {
+	UFSTraceRecord mRecords[UFS_TRACE_RING_RECORDS];
+	UFSTraceKnownPath mKnownPaths[UFS_TRACE_KNOWN_PATHS];
+	ULONG mHead; /* Number of records ever written. */
+	ULONG mWritten; /* Value of mHead when the ring was last written to the file. */
+	ULONG mAnomalyAt; /* Value of mHead after the oldest anomaly not yet written, valid if mHasAnomaly. */
+	ULONG mLastPathId; /* The path ids of the ring are handed out in order, the decoder tells rings apart by thread. */
+	bool mHasAnomaly;
+	DWORD mThreadId;
+	UFSTraceRing* mNext;
+};
+
+static __declspec(thread) UFSTraceRing* tRing;
+static UFSTraceRing* volatile gRings;
+static HANDLE gTraceFile = INVALID_HANDLE_VALUE;
+static CRITICAL_SECTION gTraceFileLock;
+static LONGLONG gSlowCallTicks;
+static bool gRecordAll;
+
+bool UFSTraceOpen(LPCWSTR aTraceFile, ULONG aSlowCallMicroseconds, bool aRecordAll)
+{
+	LARGE_INTEGER frequency, now;
+	if (!QueryPerformanceFrequency(&frequency) || !QueryPerformanceCounter(&now))
+		return true;
+	gTraceFile = CreateFile(aTraceFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (gTraceFile == INVALID_HANDLE_VALUE)
+		return true;
+	UFSTraceFileHeader header;
+	ZeroMemory(&header, sizeof(header));
+	header.mMagic = UFS_TRACE_MAGIC;
+	header.mVersion = UFS_TRACE_VERSION;
+	header.mFrequency = frequency.QuadPart;
+	header.mStartTime = now.QuadPart;
+	header.mRecordSize = sizeof(UFSTraceRecord);
+	header.mFlags = aRecordAll ? UFS_TRACE_FILE_COMPLETE : 0;
+	DWORD written;
+	if (!WriteFile(gTraceFile, &header, sizeof(header), &written, NULL)) {
+		CloseHandle(gTraceFile);
+		gTraceFile = INVALID_HANDLE_VALUE;
+		return true;
+	}
+	InitializeCriticalSection(&gTraceFileLock);
+	gSlowCallTicks = frequency.QuadPart * aSlowCallMicroseconds / 1000000;
+	gRecordAll = aRecordAll;
+	gTraceEnabled = true;
+	return false;
+}
+
+/** Appends the records of aRing not yet in the file.
+ * Must be called by the owner of the ring, or when the owner is known not to be recording.
+ */
+static void WriteRing(UFSTraceRing* apRing)
+{
+	ULONG head = apRing->mHead;
+	if (head == apRing->mWritten)
+		return;
+	ULONG first = head - apRing->mWritten > UFS_TRACE_RING_RECORDS ? head - UFS_TRACE_RING_RECORDS : apRing->mWritten;
+	UFSTraceBlockHeader block;
+	block.mMagic = UFS_TRACE_BLOCK_MAGIC;
+	block.mThreadId = apRing->mThreadId;
+	block.mRecordCount = head - first;
+	block.mDroppedRecords = first - apRing->mWritten;
+	ULONG start = first & (UFS_TRACE_RING_RECORDS - 1);
+	ULONG count = head - first;
+	ULONG tail = start + count > UFS_TRACE_RING_RECORDS ? start + count - UFS_TRACE_RING_RECORDS : 0;
+	DWORD written;
+	EnterCriticalSection(&gTraceFileLock);
+	WriteFile(gTraceFile, &block, sizeof(block), &written, NULL);
+	WriteFile(gTraceFile, apRing->mRecords + start, (count - tail) * sizeof(UFSTraceRecord), &written, NULL);
+	if (tail)
+		WriteFile(gTraceFile, apRing->mRecords, tail * sizeof(UFSTraceRecord), &written, NULL);
+	LeaveCriticalSection(&gTraceFileLock);
+	apRing->mWritten = head;
+	apRing->mHasAnomaly = false;
+}
+
+void UFSTraceClose()
+{
+	if (!gTraceEnabled)
+		return;
+	gTraceEnabled = false;
+	for (UFSTraceRing* ring = gRings; ring; ring = ring->mNext)
+		WriteRing(ring);
+	CloseHandle(gTraceFile);
+	gTraceFile = INVALID_HANDLE_VALUE;
+	DeleteCriticalSection(&gTraceFileLock);
+}
+
+static UFSTraceRing* GetRing()
+{
+	UFSTraceRing* ring = tRing;
+	if (ring)
+		return ring;
+	ring = (UFSTraceRing*)VirtualAlloc(NULL, sizeof(UFSTraceRing), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!ring)
+		return NULL;
+	ring->mThreadId = GetCurrentThreadId();
+	/* Push without locking, other threads only ever walk the list. */
+	do {
+		ring->mNext = gRings;
+	} while (InterlockedCompareExchangePointer((PVOID volatile*)&gRings, ring, ring->mNext) != ring->mNext);
+	tRing = ring;
+	return ring;
+}
+
+/** @return the FNV-1a hash of aPath, which picks its known path entry. */
+static ULONG HashPath(LPCWSTR aPath)
+{
+	ULONG hash = 2166136261U;
+	for (; *aPath; ++aPath) {
+		hash ^= *aPath;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static inline UFSTraceRecord* NextRecord(UFSTraceRing* apRing)
+{
+	if (apRing->mHasAnomaly && apRing->mHead - apRing->mAnomalyAt >= UFS_TRACE_RING_RECORDS / 2)
+		WriteRing(apRing); // Keep as much context after the anomaly as before it.
+	else if (gRecordAll && apRing->mHead - apRing->mWritten >= UFS_TRACE_RING_RECORDS / 2)
+		WriteRing(apRing);
+	return apRing->mRecords + (apRing->mHead++ & (UFS_TRACE_RING_RECORDS - 1));
+}
+
+/** Whether the name records of aKnown, still in the ring, spell aPath. */
+static bool IsRecordedName(const UFSTraceRing* apRing, const UFSTraceKnownPath& aKnown, LPCWSTR aPath)
+{
+	for (ULONG at = aKnown.mAt - aKnown.mChunks; at != aKnown.mAt; ++at) {
+		const WCHAR* name = apRing->mRecords[at & (UFS_TRACE_RING_RECORDS - 1)].mName;
+		for (int i = 0; i < UFS_TRACE_NAME_CHARS; ++i, ++aPath) {
+			if (name[i] != *aPath)
+				return false;
+			if (!*aPath)
+				return true;
+		}
+	}
+	return !*aPath;
+}
+
+/** Records the name of aPath under a new id unless the ring recorded it less than half a ring ago. The known
+ * paths of the ring remember where, the name itself is compared with the records.
+ * @return the id of aPath in the ring, 0 if there is no path.
+ */
+static ULONG RecordPathName(UFSTraceRing* apRing, LPCWSTR aPath, LONGLONG aTimestamp)
+{
+	if (!aPath)
+		return 0;
+	ULONG hash = HashPath(aPath);
+	UFSTraceKnownPath& known = apRing->mKnownPaths[hash & (UFS_TRACE_KNOWN_PATHS - 1)];
+	if (known.mPathId && known.mHash == hash && apRing->mHead - known.mAt < UFS_TRACE_RING_RECORDS / 2 &&
+		IsRecordedName(apRing, known, aPath))
+		return known.mPathId;
+	if (!++apRing->mLastPathId)
+		++apRing->mLastPathId;
+	ULONG pathId = apRing->mLastPathId;
+	size_t length = wcslen(aPath);
+	USHORT chunk = 0;
+	do {
+		UFSTraceRecord* record = NextRecord(apRing);
+		size_t chunkLength = length > UFS_TRACE_NAME_CHARS ? UFS_TRACE_NAME_CHARS : length;
+		ZeroMemory(record->mName, sizeof(record->mName));
+		memcpy(record->mName, aPath, chunkLength * sizeof(WCHAR));
+		aPath += chunkLength;
+		length -= chunkLength;
+		record->mTimestamp = aTimestamp;
+		record->mPathId = pathId;
+		record->mEvent = UFS_TRACE_PATH_NAME;
+		record->mFlags = chunk++ | (length ? 0 : UFS_TRACE_LAST_NAME_CHUNK);
+		record->mOpenId = 0;
+		record->mReserved = 0;
+	} while (length);
+	known.mHash = hash;
+	known.mPathId = pathId;
+	known.mAt = apRing->mHead;
+	known.mChunks = chunk;
+	return pathId;
+}
+
+UFSTraceScope::UFSTraceScope(USHORT aEvent, const _DOKAN_FILE_INFO* apDokanFileInfo, LPCWSTR aPath, ULONG64 aArg0, ULONG aArg1, ULONG aArg2)
+	: mpDokanFileInfo(apDokanFileInfo), mPath(aPath), mpSecondPath(NULL), mArg0(aArg0), mArg1(aArg1), mArg2(aArg2), mEvent(aEvent)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	mStart = now.QuadPart;
+}
+
+int UFSTraceScope::End(int aStatus)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	UFSTraceRing* ring;
+	if (!gTraceEnabled || !(ring = GetRing()))
+		return aStatus;
+	LONGLONG duration = now.QuadPart - mStart;
+	ULONG pathId = RecordPathName(ring, mPath, mStart);
+	if (mpSecondPath)
+		mArg0 = RecordPathName(ring, mpSecondPath, mStart);
+	UFSTraceRecord* record = NextRecord(ring);
+	record->mTimestamp = mStart;
+	record->mCall.mArg0 = mArg0;
+	record->mCall.mArg1 = mArg1;
+	record->mCall.mArg2 = mArg2;
+	record->mCall.mStatus = aStatus;
+	record->mCall.mDuration = duration > 0xFFFFFFFF ? 0xFFFFFFFF : (ULONG)duration;
+	record->mPathId = pathId;
+	record->mEvent = mEvent;
+	record->mFlags = 0;
+	record->mOpenId = 0;
+	record->mReserved = 0;
+	if (mpDokanFileInfo) {
+		record->mOpenId = (ULONG)mpDokanFileInfo->DokanContext;
+		if (mpDokanFileInfo->IsDirectory)
+			record->mFlags |= UFS_TRACE_IS_DIRECTORY;
+		if (mpDokanFileInfo->DeleteOnClose)
+			record->mFlags |= UFS_TRACE_DELETE_ON_CLOSE;
+		if (mpDokanFileInfo->WriteToEndOfFile)
+			record->mFlags |= UFS_TRACE_WRITE_TO_END_OF_FILE;
+	}
+	if ((aStatus < 0 || duration > gSlowCallTicks) && !ring->mHasAnomaly) {
+		ring->mHasAnomaly = true;
+		ring->mAnomalyAt = ring->mHead;
+	}
+	return aStatus;
+}
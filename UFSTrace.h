@@ -0,0 +1,192 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Binary callback tracer.
+ * Traced callbacks append a fixed size record to a ring owned by the calling thread, so recording a call
+ * costs two performance counter reads and a 48 byte copy, with no locks and no formatting.
+ * A ring is written to the trace file only when it holds an anomaly (an error status or a call slower than
+ * the configured threshold) followed by half a ring of further records, and when the file system is unmounted.
+ * In record mode every ring is written each time it fills up by half, so the file holds every call and
+ * "WinUnionFS /e" can replay it.
+ * "UFSTool decode" turns a trace file into text or Chrome trace JSON.
+ */
+
+#define UFS_TRACE_MAGIC 0x54534655 /* "UFST" */
+#define UFS_TRACE_BLOCK_MAGIC 0x4B4C4255 /* "UBLK" */
+#define UFS_TRACE_VERSION 3
+/* Records per thread ring. Must be a power of 2. */
+#define UFS_TRACE_RING_RECORDS 4096
+/* Characters of a path carried by one UFS_TRACE_PATH_NAME record. */
+#define UFS_TRACE_NAME_CHARS 12
+/* Set in mFlags of the last UFS_TRACE_PATH_NAME record of a path, the low bits hold the chunk index. */
+#define UFS_TRACE_LAST_NAME_CHUNK 0x8000
+/* mFlags of call records, copied from DOKAN_FILE_INFO when the call returns. */
+#define UFS_TRACE_IS_DIRECTORY 0x0001
+#define UFS_TRACE_DELETE_ON_CLOSE 0x0002
+#define UFS_TRACE_WRITE_TO_END_OF_FILE 0x0004
+/* mFlags of the file header: the file was recorded in record mode and holds every call. */
+#define UFS_TRACE_FILE_COMPLETE 0x0001
+
+enum UFSTraceEvent {
+	UFS_TRACE_PATH_NAME = 0,
+	UFS_TRACE_CREATE_FILE,
+	UFS_TRACE_OPEN_DIRECTORY,
+	UFS_TRACE_CREATE_DIRECTORY,
+	UFS_TRACE_CLEANUP,
+	UFS_TRACE_CLOSE_FILE,
+	UFS_TRACE_READ_FILE,
+	UFS_TRACE_WRITE_FILE,
+	UFS_TRACE_FLUSH_FILE_BUFFERS,
+	UFS_TRACE_GET_FILE_INFORMATION,
+	UFS_TRACE_FIND_FILES,
+	UFS_TRACE_SET_FILE_ATTRIBUTES,
+	UFS_TRACE_SET_FILE_TIME,
+	UFS_TRACE_DELETE_FILE,
+	UFS_TRACE_DELETE_DIRECTORY,
+	UFS_TRACE_MOVE_FILE,
+	UFS_TRACE_SET_END_OF_FILE,
+	UFS_TRACE_SET_ALLOCATION_SIZE,
+	UFS_TRACE_LOCK_FILE,
+	UFS_TRACE_UNLOCK_FILE,
+	UFS_TRACE_GET_DISK_FREE_SPACE,
+	UFS_TRACE_GET_VOLUME_INFORMATION,
+	UFS_TRACE_UNMOUNT,
+	UFS_TRACE_EVENT_COUNT
+};
+
+struct UFSTraceCall {
+	ULONG64 mArg0;
+	ULONG mArg1;
+	ULONG mArg2;
+	LONG mStatus;
+	ULONG mDuration; /* In performance counter ticks, saturated at 0xFFFFFFFF. */
+};
+
+/** One trace record. For UFS_TRACE_PATH_NAME records mName holds a chunk of the path whose id is mPathId,
+ * for all other events mCall holds the call arguments and result.
+ */
+struct UFSTraceRecord {
+	LONGLONG mTimestamp; /* Performance counter value at the start of the call. */
+	union {
+		UFSTraceCall mCall;
+		WCHAR mName[UFS_TRACE_NAME_CHARS];
+	};
+	ULONG mPathId; /* 0 for no path. Each thread hands out its ids in order, with its thread id one names one path. */
+	USHORT mEvent;
+	USHORT mFlags;
+	ULONG mOpenId; /* Identifies the open file the call was made on, 0 for none. */
+	ULONG mReserved;
+};
+
+struct UFSTraceFileHeader {
+	ULONG mMagic;
+	ULONG mVersion;
+	LONGLONG mFrequency;
+	LONGLONG mStartTime;
+	ULONG mRecordSize;
+	ULONG mFlags;
+};
+
+/* A block holds consecutive records of one thread, it is followed by mRecordCount records. */
+struct UFSTraceBlockHeader {
+	ULONG mMagic;
+	ULONG mThreadId;
+	ULONG mRecordCount;
+	ULONG mDroppedRecords; /* Records overwritten in the ring since the previous block of this thread. */
+};
+
+static inline const char* UFSTraceEventName(USHORT aEvent)
+{
+	static const char* const names[UFS_TRACE_EVENT_COUNT] = {
+		"PathName", "CreateFile", "OpenDirectory", "CreateDirectory", "Cleanup", "CloseFile", "ReadFile",
+		"WriteFile", "FlushFileBuffers", "GetFileInformation", "FindFiles", "SetFileAttributes", "SetFileTime",
+		"DeleteFile", "DeleteDirectory", "MoveFile", "SetEndOfFile", "SetAllocationSize", "LockFile",
+		"UnlockFile", "GetDiskFreeSpace", "GetVolumeInformation", "Unmount"
+	};
+	return aEvent < UFS_TRACE_EVENT_COUNT ? names[aEvent] : "Unknown";
+}
+
+/** Returns the names of the three call arguments recorded for aEvent, NULL for the unused ones. */
+static inline const char* const* UFSTraceArgNames(USHORT aEvent)
+{
+	static const char* const none[3] = {NULL, NULL, NULL};
+	static const char* const create[3] = {"flags", "access", "share|disposition"};
+	static const char* const io[3] = {"offset", "length", "done"};
+	static const char* const size[3] = {"size", NULL, NULL};
+	static const char* const attributes[3] = {"attributes", NULL, NULL};
+	static const char* const move[3] = {"newpath", "replace", NULL};
+	static const char* const find[3] = {"pattern", NULL, NULL};
+	static const char* const lock[3] = {"offset", "length", NULL};
+	switch (aEvent) {
+		case UFS_TRACE_CREATE_FILE:
+			return create;
+		case UFS_TRACE_READ_FILE:
+		case UFS_TRACE_WRITE_FILE:
+			return io;
+		case UFS_TRACE_SET_END_OF_FILE:
+		case UFS_TRACE_SET_ALLOCATION_SIZE:
+			return size;
+		case UFS_TRACE_SET_FILE_ATTRIBUTES:
+			return attributes;
+		case UFS_TRACE_MOVE_FILE:
+			return move;
+		case UFS_TRACE_FIND_FILES:
+			return find;
+		case UFS_TRACE_LOCK_FILE:
+		case UFS_TRACE_UNLOCK_FILE:
+			return lock;
+	}
+	return none;
+}
+
+extern bool gTraceEnabled;
+
+struct _DOKAN_FILE_INFO;
+
+/** Opens aTraceFile and starts tracing. Calls slower than aSlowCallMicroseconds and calls returning an error
+ * cause the ring of their thread to be written to the file. With aRecordAll every call is written.
+ * @return false on success.
+ */
+bool UFSTraceOpen(LPCWSTR aTraceFile, ULONG aSlowCallMicroseconds, bool aRecordAll);
+/** Writes all rings holding unwritten records and closes the trace file. */
+void UFSTraceClose();
+/** Records one call. Construct it before the call and pass the call result through End.
+ */
+class UFSTraceScope
+{
+public:
+	/* apDokanFileInfo, if any, supplies the open file id and the call flags. */
+	UFSTraceScope(USHORT aEvent, const _DOKAN_FILE_INFO* apDokanFileInfo, LPCWSTR aPath, ULONG64 aArg0 = 0, ULONG aArg1 = 0, ULONG aArg2 = 0);
+	int End(int aStatus);
+	void SetArg2(ULONG aArg2) { mArg2 = aArg2; }
+	/* Records the name of aPath and stores its id in the first argument. */
+	void SetSecondPath(LPCWSTR aPath) { mpSecondPath = aPath; }
+private:
+	const _DOKAN_FILE_INFO* mpDokanFileInfo;
+	LPCWSTR mPath;
+	LPCWSTR mpSecondPath;
+	ULONG64 mArg0;
+	ULONG mArg1;
+	ULONG mArg2;
+	LONGLONG mStart;
+	USHORT mEvent;
+};
@@ -0,0 +1,125 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+using namespace std;
+
+#include "UFSTraceReader.h"
+
+/* Converts aText to UTF-8 and escapes it for use inside a JSON string. */
+static string JsonString(const wstring& aText)
+{
+	string utf8, escaped;
+	int length = WideCharToMultiByte(CP_UTF8, 0, aText.c_str(), (int)aText.size(), NULL, 0, NULL, NULL);
+	if (length > 0) {
+		utf8.resize(length);
+		WideCharToMultiByte(CP_UTF8, 0, aText.c_str(), (int)aText.size(), &utf8[0], length, NULL, NULL);
+	}
+	for (string::const_iterator it = utf8.begin(); it != utf8.end(); ++it)
+		switch (*it) {
+			case '\\':
+				escaped += "\\\\";
+				break;
+			case '"':
+				escaped += "\\\"";
+				break;
+			default:
+				escaped += *it;
+		}
+	return escaped;
+}
+
+/** Implements "UFSTool decode <TraceFile> [/j]".
+ * Prints the calls of a trace file ordered by start time, or as Chrome trace JSON with /j.
+ */
+int UFSTraceDecode(int argc, LPWSTR argv[])
+{
+	if (argc < 1) {
+		fwprintf(stderr, L"UFSTool decode <TraceFile> [/j]\n");
+		return 2;
+	}
+	bool json = argc > 1 && towupper(argv[1][1]) == L'J';
+	UFSTraceReader trace;
+	switch (trace.Load(argv[0])) {
+		case UFS_TRACE_READ_FAILED:
+			fwprintf(stderr, L"Cannot read %s. Error: %d.\n", argv[0], GetLastError());
+			return 1;
+		case UFS_TRACE_READ_NOT_A_TRACE:
+			fwprintf(stderr, L"%s is not a WinUnionFS trace file.\n", argv[0]);
+			return 1;
+	}
+	const UFSTraceFileHeader* header = &trace.Header();
+	const vector<UFSTraceCallRef>& calls = trace.Calls();
+	double microsecondsPerTick = 1000000.0 / header->mFrequency;
+	if (json)
+		printf("{\"traceEvents\":[\n");
+	for (vector<UFSTraceCallRef>::const_iterator it = calls.begin(); it != calls.end(); ++it) {
+		const UFSTraceRecord* record = it->mpRecord;
+		double start = (record->mTimestamp - header->mStartTime) * microsecondsPerTick;
+		double duration = record->mCall.mDuration * microsecondsPerTick;
+		const char* const* argNames = UFSTraceArgNames(record->mEvent);
+		ULONG64 args[3] = {record->mCall.mArg0, record->mCall.mArg1, record->mCall.mArg2};
+		if (json) {
+			printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"status\":%d",
+				it == calls.begin() ? "" : ",\n", UFSTraceEventName(record->mEvent), it->mThreadId, start, duration,
+				record->mCall.mStatus);
+			if (record->mOpenId)
+				printf(",\"open\":%u", record->mOpenId);
+			if (record->mFlags)
+				printf(",\"flags\":%u", record->mFlags);
+			if (record->mPathId)
+				printf(",\"path\":\"%s\"", JsonString(trace.PathName(it->mThreadId, record->mPathId)).c_str());
+			for (int arg = 0; arg < 3; ++arg)
+				if (!argNames[arg] || (!strcmp(argNames[arg], "pattern") && !args[arg]))
+					continue;
+				else if (!strcmp(argNames[arg], "newpath") || !strcmp(argNames[arg], "pattern"))
+					printf(",\"%s\":\"%s\"", argNames[arg], JsonString(trace.PathName(it->mThreadId, (ULONG)args[arg])).c_str());
+				else
+					printf(",\"%s\":%I64u", argNames[arg], args[arg]);
+			printf("}}");
+		} else {
+			printf("%14.3f %6u %-20s %10.3f %6d", start, it->mThreadId, UFSTraceEventName(record->mEvent), duration,
+				record->mCall.mStatus);
+			if (record->mOpenId)
+				printf(" open=%u", record->mOpenId);
+			if (record->mFlags)
+				printf(" flags=%u", record->mFlags);
+			for (int arg = 0; arg < 3; ++arg)
+				if (!argNames[arg] || (!strcmp(argNames[arg], "pattern") && !args[arg]))
+					continue;
+				else if (!strcmp(argNames[arg], "newpath") || !strcmp(argNames[arg], "pattern"))
+					wprintf(L" %S=%s", argNames[arg], trace.PathName(it->mThreadId, (ULONG)args[arg]).c_str());
+				else
+					printf(" %s=%I64u", argNames[arg], args[arg]);
+			if (record->mPathId)
+				wprintf(L" %s", trace.PathName(it->mThreadId, record->mPathId).c_str());
+			printf("\n");
+		}
+	}
+	if (json)
+		printf("\n]}\n");
+	if (trace.DroppedRecords())
+		fwprintf(stderr, L"%I64u records were overwritten before they could be saved.\n", trace.DroppedRecords());
+	return 0;
+}
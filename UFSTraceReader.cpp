@@ -0,0 +1,98 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <stdio.h>
+#include <algorithm>
+using namespace std;
+
+#include "UFSTraceReader.h"
+
+static bool EarlierCall(const UFSTraceCallRef& aLeft, const UFSTraceCallRef& aRight)
+{
+	return aLeft.mpRecord->mTimestamp < aRight.mpRecord->mTimestamp;
+}
+
+static bool ReadWholeFile(LPCWSTR aFileName, vector<char>& aContent)
+{
+	HANDLE handle = CreateFile(aFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return true;
+	LARGE_INTEGER size;
+	DWORD read = 0;
+	bool failed = !GetFileSizeEx(handle, &size) || size.HighPart;
+	if (!failed) {
+		aContent.resize(size.LowPart);
+		failed = size.LowPart && (!ReadFile(handle, &aContent[0], size.LowPart, &read, NULL) || read != size.LowPart);
+	}
+	CloseHandle(handle);
+	return failed;
+}
+
+UFSTraceReadResult UFSTraceReader::Load(LPCWSTR aFileName)
+{
+	mPaths.clear();
+	mCalls.clear();
+	mDroppedRecords = 0;
+	if (ReadWholeFile(aFileName, mContent))
+		return UFS_TRACE_READ_FAILED;
+	if (mContent.size() < sizeof(UFSTraceFileHeader) || Header().mMagic != UFS_TRACE_MAGIC ||
+		Header().mVersion != UFS_TRACE_VERSION || Header().mRecordSize != sizeof(UFSTraceRecord))
+		return UFS_TRACE_READ_NOT_A_TRACE;
+	size_t position = sizeof(UFSTraceFileHeader);
+	while (position + sizeof(UFSTraceBlockHeader) <= mContent.size()) {
+		const UFSTraceBlockHeader* block = (const UFSTraceBlockHeader*)&mContent[position];
+		position += sizeof(UFSTraceBlockHeader);
+		if (block->mMagic != UFS_TRACE_BLOCK_MAGIC || (mContent.size() - position) / sizeof(UFSTraceRecord) < block->mRecordCount) {
+			fwprintf(stderr, L"Truncated or corrupt block at offset %u, ignoring the rest of the file.\n", (ULONG)position);
+			break;
+		}
+		mDroppedRecords += block->mDroppedRecords;
+		const UFSTraceRecord* record = (const UFSTraceRecord*)&mContent[position];
+		position += block->mRecordCount * sizeof(UFSTraceRecord);
+		for (const UFSTraceRecord* end = record + block->mRecordCount; record < end; ++record) {
+			if (record->mEvent == UFS_TRACE_PATH_NAME) {
+				wstring& path = mPaths[make_pair(block->mThreadId, record->mPathId)];
+				if (!(record->mFlags & ~UFS_TRACE_LAST_NAME_CHUNK))
+					path.erase();
+				size_t length = 0;
+				while (length < UFS_TRACE_NAME_CHARS && record->mName[length])
+					++length;
+				path.append(record->mName, length);
+			} else {
+				UFSTraceCallRef call = {record, block->mThreadId};
+				mCalls.push_back(call);
+			}
+		}
+	}
+	stable_sort(mCalls.begin(), mCalls.end(), EarlierCall);
+	return UFS_TRACE_READ_OK;
+}
+
+wstring UFSTraceReader::PathName(DWORD aThreadId, ULONG aPathId) const
+{
+	const wstring* path = FindPath(aThreadId, aPathId);
+	if (path)
+		return *path;
+	WCHAR id[12];
+	_snwprintf(id, sizeof(id) / sizeof(*id), L"?%08X", aPathId);
+	return id;
+}
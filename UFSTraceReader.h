@@ -0,0 +1,66 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include "UFSTrace.h"
+
+struct UFSTraceCallRef {
+	const UFSTraceRecord* mpRecord;
+	DWORD mThreadId;
+};
+
+enum UFSTraceReadResult {
+	UFS_TRACE_READ_OK = 0,
+	UFS_TRACE_READ_FAILED,	/* GetLastError tells why. */
+	UFS_TRACE_READ_NOT_A_TRACE
+};
+
+/** Loads a trace file written by UFSTrace, reassembles the recorded path names and orders the calls of all
+ * threads by start time. Used by "UFSTool decode" and by the replay of "WinUnionFS /e".
+ */
+class UFSTraceReader
+{
+public:
+	UFSTraceReader() : mDroppedRecords(0) {}
+	/** Reads aFileName. A truncated or corrupt tail is reported on stderr and ignored. */
+	UFSTraceReadResult Load(LPCWSTR aFileName);
+	const UFSTraceFileHeader& Header() const { return *(const UFSTraceFileHeader*)&mContent[0]; }
+	const std::vector<UFSTraceCallRef>& Calls() const { return mCalls; }
+	/** Records overwritten in the rings before they could be saved. */
+	ULONG64 DroppedRecords() const { return mDroppedRecords; }
+	/** @return the path the thread aThreadId recorded under aPathId, or NULL if its name was overwritten before
+	 * being saved. Every thread hands out its own path ids. */
+	const std::wstring* FindPath(DWORD aThreadId, ULONG aPathId) const
+	{
+		std::map<std::pair<DWORD, ULONG>, std::wstring>::const_iterator path = mPaths.find(std::make_pair(aThreadId, aPathId));
+		return path == mPaths.end() ? NULL : &path->second;
+	}
+	/** @return the path the thread aThreadId recorded under aPathId, or its id if the name is not known. */
+	std::wstring PathName(DWORD aThreadId, ULONG aPathId) const;
+private:
+	std::vector<char> mContent;
+	std::map<std::pair<DWORD, ULONG>, std::wstring> mPaths;
+	std::vector<UFSTraceCallRef> mCalls;
+	ULONG64 mDroppedRecords;
+};
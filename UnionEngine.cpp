@@ -0,0 +1,1692 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "MetadataLog.h"
+#include "ParallelProbe.h"
+
+bool gDebugMode = false;
+UFSLayer* gReadLayer;
+UFSLayer* gWriteLayer;
+FilePathSet gDeletedFilesSet;
+FilePathMap gRedirects;
+volatile LONG gRedirectCount;
+/* Cleaned relative paths of the write root directories known to exist. */
+static FilePathSet gKnownWriteDirectories;
+/* The renames begun and not ended, by identifier. Its lock orders the metadata changes: each is made and
+ * appended to the metadata log under it, so the log holds them in the order they were made. */
+class RenameMap : public std::map<ULONG64, UnionRename>
+{
+public:
+	RenameMap() : std::map<ULONG64, UnionRename>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~RenameMap() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+static RenameMap gRenames;
+static ULONG64 gNextRename = 1;
+/* Incremented by every save of the metadata file. */
+static ULONG gMetadataEpoch;
+static volatile LONG gCopyCount;
+
+/* Union information primed by listings, by cleaned relative path. The whole map belongs to the generation
+ * it was primed in, InvalidateUnionFileInformation starts a new one. */
+struct PrimedInformation {
+	BY_HANDLE_FILE_INFORMATION mInformation;
+	DWORD mTime; /* GetTickCount when primed. */
+};
+class PrimedInformationMap : public std::map<std::wstring, PrimedInformation>
+{
+public:
+	PrimedInformationMap() : std::map<std::wstring, PrimedInformation>(), mGeneration(0) {
+		InitializeCriticalSection(&mLock);
+	}
+	~PrimedInformationMap() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+	LONG mGeneration;
+};
+static PrimedInformationMap gPrimedInformation;
+static volatile LONG gPrimedGeneration;
+
+#ifndef DEBUG
+void DbgPrint(LPCWSTR aFormat, ...)
+{
+	if (gDebugMode) {
+		va_list argp;
+		va_start(argp, aFormat);
+		vfwprintf(stderr, aFormat, argp);
+		va_end(argp);
+	}
+}
+#endif
+
+static inline const wstring& PathOf(const wstring& aPath)
+{
+	return aPath;
+}
+static inline const wstring& PathOf(const FilePathMap::value_type& aEntry)
+{
+	return aEntry.first;
+}
+
+/** Erases the entries of aPaths that start with aPrefix, they sort right after it.
+ */
+template <class Paths> static void EraseBelow(Paths& aPaths, const wstring& aPrefix)
+{
+	typename Paths::iterator it = aPaths.lower_bound(aPrefix);
+	while (it != aPaths.end() && !PathOf(*it).compare(0, aPrefix.size(), aPrefix))
+		aPaths.erase(it++);
+}
+
+bool CheckDeletedClean(const wstring& aRelativePath)
+{
+	HotPathSample sample(UFS_HOT_WHITEOUT_CHECK, aRelativePath.c_str());
+	CriticalSectionLock lock(gDeletedFilesSet.mLock);
+	if (gDeletedFilesSet.empty())
+		return false;
+	if (gDeletedFilesSet.find(aRelativePath) != gDeletedFilesSet.end())
+		return true;
+	wstring parent;
+	for (size_t end = aRelativePath.rfind(L'\\'); end && end != wstring::npos; end = aRelativePath.rfind(L'\\', end - 1)) {
+		parent.assign(aRelativePath, 0, end);
+		if (gDeletedFilesSet.find(parent) != gDeletedFilesSet.end())
+			return true;
+	}
+	return false;
+}
+
+static void CheckpointMetadata();
+
+/** Waits until the metadata log holds the records of apBatch, then saves the metadata file if the log grew
+ * beyond UFS_METADATA_LOG_LIMIT.
+ */
+static void CommitMetadata(MetadataLogBatch* apBatch)
+{
+	if (!apBatch)
+		return;
+	if (CommitMetadataLog(apBatch))
+		DbgPrint(L"Cannot write the metadata log. Error: %d.\n", GetLastError());
+	if (MetadataLogSize() > UFS_METADATA_LOG_LIMIT)
+		CheckpointMetadata();
+}
+
+static wstring& AppendNumber(wstring& aText, ULONG64 aNumber)
+{
+	WCHAR number[24];
+	swprintf(number, L"%I64u", aNumber);
+	return aText.append(number);
+}
+
+/* The changes below append their log records to aRecords, the caller holds gRenames.mLock. */
+static void Whiteout(const wstring& aRelativePath, wstring& aRecords)
+{
+	{
+		CriticalSectionLock lock(gDeletedFilesSet.mLock);
+		gDeletedFilesSet.insert(aRelativePath);
+	}
+	aRecords.append(L"W\t").append(aRelativePath).append(1, L'\n');
+}
+
+static void Unwhiteout(const wstring& aRelativePath, wstring& aRecords)
+{
+	{
+		CriticalSectionLock lock(gDeletedFilesSet.mLock);
+		gDeletedFilesSet.erase(aRelativePath);
+	}
+	aRecords.append(L"U\t").append(aRelativePath).append(1, L'\n');
+}
+
+static void Redirect(const wstring& aCleanPath, const wstring& aReadPath, wstring& aRecords)
+{
+	wstring below(aCleanPath);
+	below.append(1, L'\\');
+	{
+		CriticalSectionLock lock(gDeletedFilesSet.mLock);
+		gDeletedFilesSet.erase(aCleanPath);
+		EraseBelow(gDeletedFilesSet, below);
+	}
+	{
+		CriticalSectionLock lock(gRedirects.mLock);
+		EraseBelow(gRedirects, below);
+		gRedirects[aCleanPath] = aReadPath;
+		gRedirectCount = (LONG)gRedirects.size();
+	}
+	aRecords.append(L"R\t").append(aCleanPath).append(1, L'\t').append(aReadPath).append(1, L'\n');
+}
+
+static void MoveBelow(const wstring& aCleanPath, const wstring& aNewCleanPath, wstring& aRecords)
+{
+	wstring below(aCleanPath);
+	below.append(1, L'\\');
+	{
+		CriticalSectionLock lock(gDeletedFilesSet.mLock);
+		vector<wstring> moved;
+		FilePathSet::iterator it = gDeletedFilesSet.lower_bound(below);
+		for (; it != gDeletedFilesSet.end() && !it->compare(0, below.size(), below); ++it)
+			moved.push_back(aNewCleanPath + it->substr(aCleanPath.size()));
+		EraseBelow(gDeletedFilesSet, below);
+		gDeletedFilesSet.insert(moved.begin(), moved.end());
+	}
+	{
+		CriticalSectionLock lock(gRedirects.mLock);
+		vector<pair<wstring, wstring> > moved;
+		FilePathMap::iterator it = gRedirects.find(aCleanPath);
+		if (it != gRedirects.end()) {
+			moved.push_back(make_pair(aNewCleanPath, it->second));
+			gRedirects.erase(it);
+		}
+		for (it = gRedirects.lower_bound(below); it != gRedirects.end() && !it->first.compare(0, below.size(), below); ++it)
+			moved.push_back(make_pair(aNewCleanPath + it->first.substr(aCleanPath.size()), it->second));
+		EraseBelow(gRedirects, below);
+		gRedirects.insert(moved.begin(), moved.end());
+		gRedirectCount = (LONG)gRedirects.size();
+	}
+	aRecords.append(L"M\t").append(aCleanPath).append(1, L'\t').append(aNewCleanPath).append(1, L'\n');
+}
+
+static void ApplyRename(const UnionRename& aRename, wstring& aRecords)
+{
+	if (!aRename.mRedirect.empty())
+		Redirect(aRename.mNew, aRename.mRedirect, aRecords);
+	if (aRename.mMoveBelow)
+		MoveBelow(aRename.mOld, aRename.mNew, aRecords);
+	if (aRename.mWhiteout)
+		Whiteout(aRename.mOld, aRecords);
+}
+
+static void FormatRename(ULONG64 aId, const UnionRename& aRename, wstring& aText)
+{
+	AppendNumber(aText.append(L"P\t"), aId).append(1, L'\t');
+	aText.append(1, aRename.mMoveBelow ? L'M' : L'-').append(1, aRename.mWhiteout ? L'W' : L'-').append(1, L'\t');
+	aText.append(aRename.mOld).append(1, L'\t').append(aRename.mNew).append(1, L'\t');
+	aText.append(aRename.mSource).append(1, L'\t').append(aRename.mRedirect).append(1, L'\n');
+}
+
+void MarkDeleted(const wstring& aRelativePath)
+{
+	MetadataLogBatch* batch;
+	{
+		CriticalSectionLock lock(gRenames.mLock);
+		wstring records;
+		Whiteout(aRelativePath, records);
+		batch = AppendMetadataLog(records);
+	}
+	CommitMetadata(batch);
+}
+
+void UnmarkDeleted(const wstring& aRelativePath)
+{
+	MetadataLogBatch* batch;
+	{
+		CriticalSectionLock lock(gRenames.mLock);
+		wstring records;
+		Unwhiteout(aRelativePath, records);
+		batch = AppendMetadataLog(records);
+	}
+	CommitMetadata(batch);
+}
+
+void AddRedirect(const wstring& aCleanPath, const wstring& aReadPath)
+{
+	MetadataLogBatch* batch;
+	{
+		CriticalSectionLock lock(gRenames.mLock);
+		wstring records;
+		Redirect(aCleanPath, aReadPath, records);
+		batch = AppendMetadataLog(records);
+	}
+	CommitMetadata(batch);
+}
+
+void MoveRedirectsAndWhiteouts(const wstring& aCleanPath, const wstring& aNewCleanPath)
+{
+	MetadataLogBatch* batch;
+	{
+		CriticalSectionLock lock(gRenames.mLock);
+		wstring records;
+		MoveBelow(aCleanPath, aNewCleanPath, records);
+		batch = AppendMetadataLog(records);
+	}
+	CommitMetadata(batch);
+}
+
+ULONG64 BeginRename(const UnionRename& aRename)
+{
+	ULONG64 id;
+	MetadataLogBatch* batch;
+	{
+		CriticalSectionLock lock(gRenames.mLock);
+		wstring record;
+		FormatRename(gNextRename, aRename, record);
+		gRenames[gNextRename] = aRename;
+		id = gNextRename++;
+		batch = AppendMetadataLog(record);
+	}
+	CommitMetadata(batch);
+	return id;
+}
+
+void EndRename(ULONG64 aId, const UnionRename& aRename, bool aDone)
+{
+	MetadataLogBatch* batch;
+	{
+		/* The changes and the end share one append, so the log never holds half of them. */
+		CriticalSectionLock lock(gRenames.mLock);
+		wstring records;
+		if (aDone)
+			ApplyRename(aRename, records);
+		gRenames.erase(aId);
+		AppendNumber(records.append(L"E\t"), aId).append(1, L'\n');
+		batch = AppendMetadataLog(records);
+	}
+	CommitMetadata(batch);
+}
+
+bool MakeRedirectedReadPath(LPWSTR aDest, LPCWSTR aFileName, size_t aFileNameLength)
+{
+	size_t fileNameLength = aFileNameLength / sizeof(WCHAR);
+	try {
+		wstring path(aFileName, fileNameLength);
+		CleanFileName(path);
+		wstring readPath;
+		{
+			CriticalSectionLock lock(gRedirects.mLock);
+			/* The deepest redirected parent wins, redirects may nest. */
+			for (size_t end = path.size(); end && end != wstring::npos; end = path.rfind(L'\\', end - 1)) {
+				path.erase(end);
+				FilePathMap::const_iterator it = gRedirects.find(path);
+				if (it != gRedirects.end()) {
+					readPath.assign(it->second).append(aFileName + end, fileNameLength - end);
+					break;
+				}
+			}
+		}
+		if (!readPath.empty())
+			return gReadLayer->MakePath(aDest, readPath.c_str(), readPath.size() * sizeof(WCHAR));
+	} catch (...) {
+		DbgPrint(L"Exception thrown in MakeRedirectedReadPath.\n");
+		return true;
+	}
+	return gReadLayer->MakePath(aDest, aFileName, aFileNameLength);
+}
+
+bool IsMetadataPath(LPCWSTR aFileName)
+{
+	static const size_t metadataLength = sizeof(UFS_METADATA_FILE) / sizeof(WCHAR) - 2;
+	return (*aFileName == L'\\' || *aFileName == L'/') && !_wcsnicmp(aFileName + 1, UFS_METADATA_FILE + 1, metadataLength);
+}
+
+/* The metadata file and the log are UTF-16 text: a version line, then a line per record whose fields are
+ * separated by tabs. Control characters never occur in file names, so tabs and line feeds can separate the
+ * fields. The records are W for a whiteout, U for a removed whiteout, R for a redirect, M for the redirects
+ * and whiteouts moved by a directory rename, P for a rename begun, E for a rename ended and L for the epoch
+ * of the metadata file. The log header holds the epoch of the metadata file it continues. */
+#define UFS_METADATA_VERSION L"UFSMETA 2"
+#define UFS_METADATA_VERSION_1 L"UFSMETA 1"
+#define UFS_METADATA_LOG_VERSION L"UFSMETALOG 1"
+
+static wstring LogHeader()
+{
+	wstring header(UFS_METADATA_LOG_VERSION L"\t");
+	return AppendNumber(header, gMetadataEpoch).append(1, L'\n');
+}
+
+/** Reads the write root file aFilePath into aText.
+ * @return false on success, a missing file reads as empty.
+ */
+static bool ReadText(LPCWSTR aFilePath, wstring& aText)
+{
+	HANDLE handle = gWriteLayer->Open(aFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING, 0);
+	if (handle == INVALID_HANDLE_VALUE)
+		return GetLastError() != ERROR_FILE_NOT_FOUND;
+	WCHAR buffer[4096];
+	DWORD bytesRead;
+	BOOL status;
+	try {
+		while ((status = ReadFile(handle, buffer, sizeof(buffer), &bytesRead, NULL)) && bytesRead)
+			aText.append(buffer, bytesRead / sizeof(WCHAR));
+	} catch (...) {
+		CloseHandle(handle);
+		throw;
+	}
+	CloseHandle(handle);
+	return !status;
+}
+
+/** Applies the record aLine, without logging it since the log is not started while loading.
+ * @return false on success, true for a malformed record.
+ */
+static bool ApplyRecord(const wstring& aLine)
+{
+	vector<wstring> fields;
+	for (size_t start = 0, end = 0; end != wstring::npos; start = end + 1) {
+		end = aLine.find(L'\t', start);
+		fields.push_back(aLine.substr(start, end == wstring::npos ? wstring::npos : end - start));
+	}
+	if (fields[0].size() != 1)
+		return true;
+	switch (fields[0][0]) {
+	case L'W':
+		if (fields.size() != 2)
+			return true;
+		MarkDeleted(fields[1]);
+		break;
+	case L'U':
+		if (fields.size() != 2)
+			return true;
+		UnmarkDeleted(fields[1]);
+		break;
+	case L'R':
+		if (fields.size() != 3)
+			return true;
+		AddRedirect(fields[1], fields[2]);
+		break;
+	case L'M':
+		if (fields.size() != 3)
+			return true;
+		MoveRedirectsAndWhiteouts(fields[1], fields[2]);
+		break;
+	case L'P': {
+		if (fields.size() != 7 || fields[2].size() != 2)
+			return true;
+		UnionRename& rename = gRenames[(ULONG64)_wtoi64(fields[1].c_str())];
+		rename.mMoveBelow = fields[2][0] == L'M';
+		rename.mWhiteout = fields[2][1] == L'W';
+		rename.mOld = fields[3];
+		rename.mNew = fields[4];
+		rename.mSource = fields[5];
+		rename.mRedirect = fields[6];
+		break;
+	}
+	case L'E':
+		if (fields.size() != 2)
+			return true;
+		gRenames.erase((ULONG64)_wtoi64(fields[1].c_str()));
+		break;
+	case L'L':
+		if (fields.size() != 2)
+			return true;
+		gMetadataEpoch = wcstoul(fields[1].c_str(), NULL, 10);
+		break;
+	default:
+		return true;
+	}
+	return false;
+}
+
+/** Settles the renames a crash interrupted: their changes are made if the write root shows them done, so
+ * a moved file neither shows twice nor comes back, and dropped otherwise.
+ */
+static void SettleRenames()
+{
+	WCHAR filePath[MAX_PATHW];
+	wstring records;
+	for (RenameMap::const_iterator it = gRenames.begin(); it != gRenames.end(); ++it) {
+		const UnionRename& rename = it->second;
+		const wstring& path = rename.mSource.empty() ? rename.mNew : rename.mSource;
+		if (!MakeWritePath(filePath, path.c_str(), path.size() * sizeof(WCHAR)) &&
+			(gWriteLayer->GetAttributes(filePath) == INVALID_FILE_ATTRIBUTES) == !rename.mSource.empty())
+			ApplyRename(rename, records);
+	}
+	gRenames.clear();
+}
+
+/** Numbers the copies of this mount past those left in the write root, so that none is copied onto one of
+ * them, which may be read-only.
+ */
+static void SkipLeftCopies()
+{
+	static const WCHAR copies[] = UFS_METADATA_COPY_FILE L"*";
+	WCHAR filePath[MAX_PATHW];
+	if (MakeWritePath(filePath, copies, sizeof(copies) - sizeof(WCHAR)))
+		return;
+	WIN32_FIND_DATAW findData;
+	HANDLE find = gWriteLayer->FindFirst(filePath, &findData);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		/* The found names lack the leading backslash. */
+		LONG number = (LONG)wcstoul(findData.cFileName + (sizeof(UFS_METADATA_COPY_FILE) / sizeof(WCHAR) - 2), NULL, 10);
+		if (number > gCopyCount)
+			gCopyCount = number;
+	} while (gWriteLayer->FindNext(find, &findData));
+	gWriteLayer->FindEnd(find);
+}
+
+void ClearMetadata()
+{
+	CriticalSectionLock lock(gRenames.mLock);
+	gRenames.clear();
+	gMetadataEpoch = 0;
+	{
+		CriticalSectionLock lock(gRedirects.mLock);
+		gRedirects.clear();
+		gRedirectCount = 0;
+	}
+	CriticalSectionLock deletedLock(gDeletedFilesSet.mLock);
+	gDeletedFilesSet.clear();
+}
+
+bool LoadMetadata()
+{
+	WCHAR filePath[MAX_PATHW], logPath[MAX_PATHW];
+	if (MakeWritePath(filePath, UFS_METADATA_FILE, sizeof(UFS_METADATA_FILE) - sizeof(WCHAR)) ||
+		MakeWritePath(logPath, UFS_METADATA_LOG_FILE, sizeof(UFS_METADATA_LOG_FILE) - sizeof(WCHAR)))
+		return true;
+	SkipLeftCopies();
+	try {
+		CriticalSectionLock lock(gRenames.mLock);
+		wstring text;
+		if (ReadText(filePath, text))
+			return true;
+		if (!text.empty()) {
+			size_t end = text.find(L'\n');
+			if (end == wstring::npos || (text.compare(0, end, UFS_METADATA_VERSION) && text.compare(0, end, UFS_METADATA_VERSION_1)))
+				return true;
+			for (size_t start = end + 1; start < text.size(); start = end + 1) {
+				end = text.find(L'\n', start);
+				if (end == wstring::npos || ApplyRecord(text.substr(start, end - start)))
+					return true;
+			}
+		}
+		/* The log continues the metadata file of its epoch only. It ends at its first incomplete record,
+		 * which a crash cut short. */
+		text.erase();
+		if (ReadText(logPath, text))
+			return true;
+		wstring header(LogHeader());
+		if (!text.compare(0, header.size(), header))
+			for (size_t start = header.size(), end; (end = text.find(L'\n', start)) != wstring::npos; start = end + 1)
+				if (ApplyRecord(text.substr(start, end - start)))
+					break;
+		SettleRenames();
+	} catch (...) {
+		DbgPrint(L"Exception thrown in LoadMetadata.\n");
+		return true;
+	}
+	return false;
+}
+
+bool SaveMetadata()
+{
+	WCHAR filePath[MAX_PATHW], newFilePath[MAX_PATHW];
+	static const WCHAR newFileName[] = UFS_METADATA_FILE L".new";
+	if (MakeWritePath(filePath, UFS_METADATA_FILE, sizeof(UFS_METADATA_FILE) - sizeof(WCHAR)) ||
+		MakeWritePath(newFilePath, newFileName, sizeof(newFileName) - sizeof(WCHAR)))
+		return true;
+	/* No change is made while saving, so the log of the next epoch starts right after the saved state. */
+	CriticalSectionLock renamesLock(gRenames.mLock);
+	wstring text(UFS_METADATA_VERSION L"\n");
+	try {
+		AppendNumber(text.append(L"L\t"), gMetadataEpoch + 1).append(1, L'\n');
+		for (RenameMap::const_iterator it = gRenames.begin(); it != gRenames.end(); ++it)
+			FormatRename(it->first, it->second, text);
+		/* Redirects come first since loading one drops the whiteouts below it. */
+		{
+			CriticalSectionLock lock(gRedirects.mLock);
+			for (FilePathMap::const_iterator it = gRedirects.begin(); it != gRedirects.end(); ++it)
+				text.append(L"R\t").append(it->first).append(1, L'\t').append(it->second).append(1, L'\n');
+		}
+		CriticalSectionLock lock(gDeletedFilesSet.mLock);
+		for (FilePathSet::const_iterator it = gDeletedFilesSet.begin(); it != gDeletedFilesSet.end(); ++it)
+			text.append(L"W\t").append(*it).append(1, L'\n');
+	} catch (...) {
+		DbgPrint(L"Exception thrown in SaveMetadata.\n");
+		return true;
+	}
+	HANDLE handle = gWriteLayer->Open(newFilePath, GENERIC_WRITE, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_HIDDEN);
+	if (handle == INVALID_HANDLE_VALUE)
+		return true;
+	DWORD written;
+	DWORD length = (DWORD)(text.size() * sizeof(WCHAR));
+	bool failed = !WriteFile(handle, text.data(), length, &written, NULL) || written != length || !FlushFileBuffers(handle);
+	CloseHandle(handle);
+	if (failed || !gWriteLayer->Rename(newFilePath, filePath, TRUE))
+		return true;
+	++gMetadataEpoch;
+	return false;
+}
+
+static void CheckpointMetadata()
+{
+	CriticalSectionLock lock(gRenames.mLock);
+	if (MetadataLogSize() <= UFS_METADATA_LOG_LIMIT)
+		return;
+	if (SaveMetadata()) {
+		DbgPrint(L"Cannot save the metadata file. Error: %d.\n", GetLastError());
+		return;
+	}
+	if (ResetMetadataLog(LogHeader())) {
+		/* The log continues the previous epoch, which no load replays any more. The metadata file is saved
+		 * on unmount. */
+		DbgPrint(L"Cannot restart the metadata log, logging stops. Error: %d.\n", GetLastError());
+		CloseMetadataLog();
+	}
+}
+
+bool StartMetadataLog()
+{
+	static const WCHAR copies[] = UFS_METADATA_COPY_FILE L"*";
+	WCHAR filePath[MAX_PATHW];
+	if (MakeWritePath(filePath, copies, sizeof(copies) - sizeof(WCHAR)))
+		return true;
+	try {
+		WIN32_FIND_DATAW findData;
+		HANDLE find = gWriteLayer->FindFirst(filePath, &findData);
+		if (find != INVALID_HANDLE_VALUE) {
+			do {
+				wstring copyName(L"\\");
+				RemoveCopy(copyName.append(findData.cFileName).c_str());
+			} while (gWriteLayer->FindNext(find, &findData));
+			gWriteLayer->FindEnd(find);
+		}
+		if (SaveMetadata() || MakeWritePath(filePath, UFS_METADATA_LOG_FILE, sizeof(UFS_METADATA_LOG_FILE) - sizeof(WCHAR)))
+			return true;
+		return OpenMetadataLog(filePath, LogHeader());
+	} catch (...) {
+		DbgPrint(L"Exception thrown in StartMetadataLog.\n");
+		return true;
+	}
+}
+
+void StopMetadataLog()
+{
+	CloseMetadataLog();
+}
+
+bool MakeCopyName(LPWSTR aDest, bool aCreate)
+{
+	swprintf(aDest, L"%s%lu", UFS_METADATA_COPY_FILE, (ULONG)InterlockedIncrement(&gCopyCount));
+	if (!aCreate)
+		return false;
+	WCHAR copyPath[MAX_PATHW];
+	if (MakeWritePath(copyPath, aDest, wcslen(aDest) * sizeof(WCHAR)))
+		return true;
+	HANDLE handle = gWriteLayer->Open(copyPath, GENERIC_WRITE, 0, CREATE_ALWAYS, 0);
+	if (handle == INVALID_HANDLE_VALUE)
+		return true;
+	gWriteLayer->Close(handle);
+	return false;
+}
+
+BOOL CopyOutThrough(LPCWSTR aReadFilePath, LPCWSTR aCopyName, LPCWSTR aWriteFilePath, BOOL aFailIfExists)
+{
+	WCHAR copyPath[MAX_PATHW];
+	if (MakeWritePath(copyPath, aCopyName, wcslen(aCopyName) * sizeof(WCHAR))) {
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return FALSE;
+	}
+	return gReadLayer->CopyOut(aReadFilePath, copyPath, FALSE) && gWriteLayer->Rename(copyPath, aWriteFilePath, !aFailIfExists);
+}
+
+void RemoveCopy(LPCWSTR aCopyName)
+{
+	WCHAR copyPath[MAX_PATHW];
+	if (MakeWritePath(copyPath, aCopyName, wcslen(aCopyName) * sizeof(WCHAR)))
+		return;
+	/* Copies keep the attributes of their source, a read-only one cannot be unlinked. */
+	gWriteLayer->SetAttributes(copyPath, FILE_ATTRIBUTE_NORMAL);
+	gWriteLayer->Unlink(copyPath);
+}
+
+static bool IsKnownWriteDirectory(const wstring& aCleanPath)
+{
+	CriticalSectionLock lock(gKnownWriteDirectories.mLock);
+	return gKnownWriteDirectories.find(aCleanPath) != gKnownWriteDirectories.end();
+}
+
+static void RememberCleanWriteDirectory(const wstring& aCleanPath)
+{
+	CriticalSectionLock lock(gKnownWriteDirectories.mLock);
+	gKnownWriteDirectories.insert(aCleanPath);
+}
+
+void RememberWriteDirectory(LPCWSTR aRelativePath)
+{
+	wstring cleanPath(aRelativePath);
+	CleanFileName(cleanPath);
+	while (cleanPath.size() > 1 && cleanPath[cleanPath.size() - 1] == L'\\')
+		cleanPath.erase(cleanPath.size() - 1);
+	RememberCleanWriteDirectory(cleanPath);
+}
+
+void ForgetWriteDirectory(LPCWSTR aRelativePath)
+{
+	wstring cleanPath(aRelativePath);
+	CleanFileName(cleanPath);
+	while (cleanPath.size() > 1 && cleanPath[cleanPath.size() - 1] == L'\\')
+		cleanPath.erase(cleanPath.size() - 1);
+	CriticalSectionLock lock(gKnownWriteDirectories.mLock);
+	gKnownWriteDirectories.erase(cleanPath);
+	cleanPath.append(1, L'\\');
+	EraseBelow(gKnownWriteDirectories, cleanPath);
+}
+
+int GetFilePath(PWCHAR aFilepath, LPCWSTR aFileName)
+{
+	HotPathSample sample(UFS_HOT_RESOLVE, aFileName);
+	size_t filenameLength = wcslen(aFileName)*sizeof(WCHAR);
+	if (MakeWritePath(aFilepath, aFileName, filenameLength))
+		return UFS_FAILED;
+	if (gWriteLayer->GetAttributes(aFilepath) != INVALID_FILE_ATTRIBUTES)
+		return UFS_WRITE_AREA;
+	try {
+		if (CheckDeleted(aFileName))
+			return UFS_WRITE_AREA;
+	} catch (...) {
+		DbgPrint(L"Exception thrown in UFSGetFilepath.");
+		return UFS_FAILED;
+	}
+	if (MakeReadPath(aFilepath, aFileName, filenameLength))
+		return UFS_FAILED;
+	return UFS_READ_AREA;
+}
+
+void InvalidateUnionFileInformation()
+{
+	InterlockedIncrement(&gPrimedGeneration);
+}
+
+void ForgetUnionFileInformation(LPCWSTR aFileName)
+{
+	if (gPrimedInformation.mGeneration != gPrimedGeneration)
+		return; // Nothing primed since the last invalidation.
+	try {
+		wstring cleanPath(aFileName);
+		CleanFileName(cleanPath);
+		CriticalSectionLock lock(gPrimedInformation.mLock);
+		gPrimedInformation.erase(cleanPath);
+	} catch (...) {
+		InvalidateUnionFileInformation();
+	}
+}
+
+void InvalidateReadRootChange(LPCWSTR aRelativePath)
+{
+	if (gRedirectCount) {
+		InvalidateUnionFileInformation();
+		return;
+	}
+	try {
+		wstring cleanPath(aRelativePath);
+		CleanFileName(cleanPath);
+		CriticalSectionLock lock(gPrimedInformation.mLock);
+		gPrimedInformation.erase(cleanPath);
+		cleanPath += L'\\';
+		PrimedInformationMap::iterator it = gPrimedInformation.lower_bound(cleanPath);
+		while (it != gPrimedInformation.end() && !it->first.compare(0, cleanPath.size(), cleanPath))
+			gPrimedInformation.erase(it++);
+	} catch (...) {
+		InvalidateUnionFileInformation();
+	}
+}
+
+/** Remembers the information listed for aCleanPath, unless something was invalidated since the listing
+ * started in aGeneration.
+ */
+static void PrimeUnionFileInformation(const wstring& aCleanPath, const BY_HANDLE_FILE_INFORMATION& aInformation, LONG aGeneration)
+{
+	CriticalSectionLock lock(gPrimedInformation.mLock);
+	if (aGeneration != gPrimedGeneration)
+		return;
+	if (gPrimedInformation.mGeneration != aGeneration || gPrimedInformation.size() >= UFS_PRIMED_INFORMATION_LIMIT) {
+		gPrimedInformation.clear();
+		gPrimedInformation.mGeneration = aGeneration;
+	}
+	PrimedInformation& primed = gPrimedInformation[aCleanPath];
+	primed.mInformation = aInformation;
+	primed.mTime = GetTickCount();
+}
+
+/** @return true if aFileName was primed recently enough, its information is then stored in apInformation. */
+static bool FindPrimedInformation(LPCWSTR aFileName, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	if (gPrimedInformation.mGeneration != gPrimedGeneration)
+		return false; // Nothing primed since the last invalidation, skip the lock.
+	wstring cleanPath(aFileName);
+	CleanFileName(cleanPath);
+	CriticalSectionLock lock(gPrimedInformation.mLock);
+	if (gPrimedInformation.mGeneration != gPrimedGeneration)
+		return false;
+	PrimedInformationMap::iterator it = gPrimedInformation.find(cleanPath);
+	if (it == gPrimedInformation.end())
+		return false;
+	if (GetTickCount() - it->second.mTime > UFS_PRIMED_INFORMATION_TTL) {
+		gPrimedInformation.erase(it);
+		return false;
+	}
+	*apInformation = it->second.mInformation;
+	return true;
+}
+
+int GetUnionFileInformation(LPCWSTR aFileName, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	HotPathSample sample(UFS_HOT_RESOLVE, aFileName);
+	if (IsMetadataPath(aFileName))
+		return -ERROR_ACCESS_DENIED;
+	try {
+		if (FindPrimedInformation(aFileName, apInformation))
+			return 0;
+	} catch (...) {
+		DbgPrint(L"Exception thrown in GetUnionFileInformation.");
+		return -1;
+	}
+	WCHAR filePath[MAX_PATHW];
+	size_t filenameLength = wcslen(aFileName)*sizeof(WCHAR);
+	if (MakeWritePath(filePath, aFileName, filenameLength))
+		return -ERROR_NOT_SUPPORTED;
+	if (gWriteLayer->Stat(filePath, apInformation))
+		return 0;
+	DWORD error = GetLastError();
+	if (error != ERROR_FILE_NOT_FOUND && error != ERROR_PATH_NOT_FOUND)
+		return -(LONG)error;
+	try {
+		if (CheckDeleted(aFileName))
+			return -ERROR_FILE_NOT_FOUND;
+	} catch (...) {
+		DbgPrint(L"Exception thrown in GetUnionFileInformation.");
+		return -1;
+	}
+	if (MakeReadPath(filePath, aFileName, filenameLength))
+		return -ERROR_NOT_SUPPORTED;
+	if (gReadLayer->Stat(filePath, apInformation))
+		return 0;
+	return -(LONG)GetLastError();
+}
+
+bool CreateParentDirectories(LPWSTR aFileName)
+{
+	DbgPrint(L"CreateParentDirectories called with %s.\n", aFileName);
+	LPWSTR relativePath = AdvanceBytes(aFileName, gWriteLayer->RootLength());
+	try {
+		wstring cleanPath(relativePath);
+		CleanFileName(cleanPath);
+		size_t end = cleanPath.size();
+		while (end > 1 && cleanPath[end - 1] == L'\\')
+			--end;
+		/* Walk up to the deepest parent known or found to exist, the root always does. */
+		vector<size_t> missing;
+		for (size_t parent = cleanPath.rfind(L'\\', end - 1); parent && parent != wstring::npos; parent = cleanPath.rfind(L'\\', parent - 1)) {
+			cleanPath.erase(parent);
+			if (IsKnownWriteDirectory(cleanPath))
+				break;
+			WCHAR separator = relativePath[parent];
+			relativePath[parent] = L'\0';
+			DbgPrint(L"Checking %s.\n", aFileName);
+			DWORD attributes = gWriteLayer->GetAttributes(aFileName);
+			relativePath[parent] = separator;
+			if (attributes != INVALID_FILE_ATTRIBUTES) {
+				RememberCleanWriteDirectory(cleanPath);
+				break;
+			}
+			missing.push_back(parent);
+		}
+		/* Create the missing suffix top down. */
+		for (vector<size_t>::reverse_iterator parent = missing.rbegin(); parent != missing.rend(); ++parent) {
+			WCHAR separator = relativePath[*parent];
+			relativePath[*parent] = L'\0';
+			DbgPrint(L"Creating %s.\n", aFileName);
+			bool failed = !gWriteLayer->MakeDirectory(aFileName) && GetLastError() != ERROR_ALREADY_EXISTS;
+			if (!failed)
+				RememberWriteDirectory(relativePath);
+			relativePath[*parent] = separator;
+			if (failed) {
+				DbgPrint(L"Failed. Returning true.\n");
+				return true;
+			}
+		}
+	} catch (...) {
+		DbgPrint(L"Exception thrown in CreateParentDirectories.\n");
+		return true;
+	}
+	return false;
+}
+
+/* NtSetInformationFile with FileAllocationInformation, see the DDK: the Win32 API of Windows 2000 and XP
+ * cannot allocate without moving the end of the file. */
+struct UFSIoStatusBlock {
+	LONG mStatus;
+	ULONG_PTR mInformation;
+};
+typedef LONG (WINAPI *NtSetInformationFileFunction)(HANDLE, UFSIoStatusBlock*, PVOID, ULONG, int);
+typedef ULONG (WINAPI *RtlNtStatusToDosErrorFunction)(LONG);
+#define UFS_FILE_ALLOCATION_INFORMATION 19
+
+bool SetWriteAllocation(HANDLE aFile, LONGLONG aSize)
+{
+	/* Threads racing here store the same values. */
+	static NtSetInformationFileFunction setInformationFile;
+	static RtlNtStatusToDosErrorFunction statusToError;
+	if (!setInformationFile) {
+		HMODULE ntdll = GetModuleHandle(L"ntdll.dll");
+		statusToError = ntdll ? (RtlNtStatusToDosErrorFunction)GetProcAddress(ntdll, "RtlNtStatusToDosError") : NULL;
+		setInformationFile = ntdll && statusToError ? (NtSetInformationFileFunction)GetProcAddress(ntdll, "NtSetInformationFile") : NULL;
+		if (!setInformationFile) {
+			SetLastError(ERROR_NOT_SUPPORTED);
+			return true;
+		}
+	}
+	UFSIoStatusBlock ioStatus;
+	LARGE_INTEGER allocationSize;
+	allocationSize.QuadPart = aSize;
+	LONG status = setInformationFile(aFile, &ioStatus, &allocationSize, sizeof(allocationSize), UFS_FILE_ALLOCATION_INFORMATION);
+	if (status < 0) {
+		SetLastError(statusToError(status));
+		return true;
+	}
+	return false;
+}
+
+bool ZeroWriteRange(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength)
+{
+	DWORD bytes;
+	FILE_ZERO_DATA_INFORMATION zero;
+	zero.FileOffset.QuadPart = aOffset;
+	zero.BeyondFinalZero.QuadPart = aOffset + aLength;
+	/* Without the sparse attribute NTFS writes the zeros instead of releasing the range. */
+	return !DeviceIoControl(aFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL) ||
+		!DeviceIoControl(aFile, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &bytes, NULL);
+}
+
+/* The remembered file identities, by handle, each map under its own lock. */
+class FileKeyMap : public std::map<HANDLE, FileKey>
+{
+public:
+	FileKeyMap() : std::map<HANDLE, FileKey>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~FileKeyMap() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+static FileKeyMap gFileKeys[UFS_FILE_KEY_LOCKS];
+
+static inline FileKeyMap& FileKeysOf(HANDLE aFile)
+{
+	/* Handle values are multiples of 4. */
+	return gFileKeys[((ULONG_PTR)aFile >> 2) % UFS_FILE_KEY_LOCKS];
+}
+
+static bool AskFileKey(HANDLE aFile, FileKey& aKey)
+{
+	BY_HANDLE_FILE_INFORMATION information;
+	if (!GetFileInformationByHandle(aFile, &information))
+		return true;
+	aKey = FileKey(information.dwVolumeSerialNumber, (((ULONG64)information.nFileIndexHigh) << 32) | information.nFileIndexLow);
+	return false;
+}
+
+bool RememberFileKey(HANDLE aFile)
+{
+	FileKey key;
+	if (AskFileKey(aFile, key))
+		return true;
+	FileKeyMap& keys = FileKeysOf(aFile);
+	CriticalSectionLock lock(keys.mLock);
+	try {
+		keys[aFile] = key;
+	} catch (...) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return true;
+	}
+	return false;
+}
+
+bool GetFileKey(HANDLE aFile, FileKey& aKey)
+{
+	{
+		FileKeyMap& keys = FileKeysOf(aFile);
+		CriticalSectionLock lock(keys.mLock);
+		FileKeyMap::const_iterator it = keys.find(aFile);
+		if (it != keys.end()) {
+			aKey = it->second;
+			return false;
+		}
+	}
+	return AskFileKey(aFile, aKey);
+}
+
+void ForgetFileKey(HANDLE aFile)
+{
+	FileKeyMap& keys = FileKeysOf(aFile);
+	CriticalSectionLock lock(keys.mLock);
+	keys.erase(aFile);
+}
+
+bool RemoveTree(UFSLayer* apLayer, LPCWSTR aRelativePath)
+{
+	WCHAR path[MAX_PATHW];
+	bool failed = false;
+	try {
+		wstring pattern(aRelativePath);
+		pattern.append(L"\\*");
+		if (apLayer->MakePath(path, pattern.c_str(), pattern.size() * sizeof(WCHAR)))
+			return true;
+		WIN32_FIND_DATAW findData;
+		HANDLE find = apLayer->FindFirst(path, &findData);
+		if (find != INVALID_HANDLE_VALUE) {
+			do {
+				if (!wcscmp(findData.cFileName, L".") || !wcscmp(findData.cFileName, L".."))
+					continue;
+				wstring child(aRelativePath);
+				child.append(1, L'\\').append(findData.cFileName);
+				if ((findData.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) == FILE_ATTRIBUTE_DIRECTORY) {
+					failed |= RemoveTree(apLayer, child.c_str());
+					continue;
+				}
+				if (apLayer->MakePath(path, child.c_str(), child.size() * sizeof(WCHAR))) {
+					failed = true;
+					continue;
+				}
+				apLayer->SetAttributes(path, FILE_ATTRIBUTE_NORMAL);
+				if (!((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? apLayer->DeleteDirectory(path) : apLayer->Unlink(path)))
+					failed = true;
+			} while (apLayer->FindNext(find, &findData));
+			apLayer->FindEnd(find);
+		}
+	} catch (...) {
+		return true;
+	}
+	if (apLayer->MakePath(path, aRelativePath, wcslen(aRelativePath) * sizeof(WCHAR)))
+		return true;
+	apLayer->SetAttributes(path, FILE_ATTRIBUTE_NORMAL);
+	return !apLayer->DeleteDirectory(path) || failed;
+}
+
+bool CheckAndCreateParentDirectories(LPWSTR aWriteFilepath, size_t aFilenameLengthB)
+{
+	DbgPrint(L"CheckAndCreateParentDirectories called with %s, %d.\n\n", aWriteFilepath, aFilenameLengthB);
+	LPWSTR lpRelPathStart = AdvanceBytes(aWriteFilepath, gWriteLayer->RootLength());
+	for(LPWSTR lpRevBackslash = AdvanceBytes(lpRelPathStart, aFilenameLengthB-2); lpRevBackslash >lpRelPathStart; --lpRevBackslash)
+		switch(*lpRevBackslash) {
+			case L'\\':
+			case L'/': {
+				WCHAR separator = *lpRevBackslash;
+				*lpRevBackslash=L'\0';
+				try {
+					wstring parent(lpRelPathStart);
+					CleanFileName(parent);
+					if (IsKnownWriteDirectory(parent)) {
+						*lpRevBackslash = separator;
+						return false;
+					}
+					WCHAR readFilePath[MAX_PATHW];
+					if (MakeReadPath(readFilePath, lpRelPathStart, parent.size() * sizeof(WCHAR))) {
+						*lpRevBackslash = separator;
+						return true;
+					}
+					DbgPrint(L"Checking %s.\n", readFilePath);
+					if (GetReadRootAttributes(readFilePath) == INVALID_FILE_ATTRIBUTES) {
+						*lpRevBackslash = separator;
+						return false; //Shall Fail because of no parents.
+					}
+					DbgPrint(L"Checking %s for deletion.\n", readFilePath);
+					if (CheckDeletedClean(parent)) {
+						*lpRevBackslash = separator;
+						return false;
+					}
+				} catch (...) {
+					DbgPrint(L"Exception thrown in CheckAndCreateParentDirectories.\n\n");
+					*lpRevBackslash = separator;
+					return true;
+				}
+				*lpRevBackslash = separator;
+				return CreateParentDirectories(aWriteFilepath);
+			}
+		}
+	DbgPrint(L"Returning false.\n\n");
+	return false;
+}
+
+UnionDirEnumerator::UnionDirEnumerator() : mReadFind(INVALID_HANDLE_VALUE), mWriteFind(INVALID_HANDLE_VALUE)
+{
+}
+
+UnionDirEnumerator::~UnionDirEnumerator()
+{
+	Close();
+}
+
+void UnionDirEnumerator::Close()
+{
+	if (mReadFind != INVALID_HANDLE_VALUE)
+		gReadLayer->FindEnd(mReadFind);
+	if (mWriteFind != INVALID_HANDLE_VALUE)
+		gWriteLayer->FindEnd(mWriteFind);
+	mReadFind = mWriteFind = INVALID_HANDLE_VALUE;
+}
+
+/** Moves aFind to its next entry other than . and .. that matches the pattern, closing it at the end of the directory.
+ * If aFirst aFindData already holds an entry that has not been checked.
+ * @return 0 or a negated Win32 error code.
+ */
+int UnionDirEnumerator::Fetch(UFSLayer* apLayer, HANDLE& aFind, WIN32_FIND_DATAW& aFindData, ULONG& aPosition, bool aFirst)
+{
+	for (;;) {
+		if (!aFirst) {
+			if (!apLayer->FindNext(aFind, &aFindData)) {
+				int error = GetLastError();
+				apLayer->FindEnd(aFind);
+				aFind = INVALID_HANDLE_VALUE;
+				if (error != ERROR_NO_MORE_FILES) {
+					DbgPrint(L"\tFindNextFile error. Error is %u\n\n", error);
+					return -error;
+				}
+				return 0;
+			}
+			++aPosition;
+		}
+		aFirst = false;
+		if ((aFindData.cFileName[0] != L'.' || (aFindData.cFileName[1] &&
+			(aFindData.cFileName[1] != L'.' || aFindData.cFileName[2]))) && mPattern.Match(aFindData.cFileName))
+			return 0;
+	}
+}
+
+int UnionDirEnumerator::Open(LPCWSTR aFileName, LPCWSTR aPattern, const UnionDirCursor* apResume)
+{
+	Close();
+	mReadPosition = mWritePosition = 0;
+	mGeneration = gPrimedGeneration;
+	mPattern.Compile(aPattern);
+	mRelativePath = aFileName;
+	CleanFileName(mRelativePath);
+	bool opaque = CheckDeletedClean(mRelativePath);
+	if (opaque)
+		DbgPrint(L"\tDirectory deleted, listing the write root only.\n");
+	if (mRelativePath.empty() || mRelativePath[mRelativePath.size() - 1] != L'\\')
+		mRelativePath.append(1, L'\\');
+	/* Both layers list the names starting with the literal prefix of the pattern, Fetch matches the rest. */
+	size_t prefixLength = mPattern.Prefix().size();
+	WCHAR pattern[MAX_PATHW + 2]; //This is done to avoid buffer overruns.
+	size_t relativePathLenB = mRelativePath.size() * sizeof(WCHAR);
+	if (MakeReadPath(pattern, mRelativePath.c_str(), relativePathLenB)) {
+		DbgPrint(L"\tName too long read.\n");
+		return -ERROR_NOT_SUPPORTED;
+	}
+	LPWSTR p = pattern + wcslen(pattern);
+	if (p + prefixLength + 1 >= pattern + MAX_PATHW + 2) {
+		DbgPrint(L"\tPattern too long read.\n");
+		return -ERROR_NOT_SUPPORTED;
+	}
+	p = wmemcpy(p, mPattern.Prefix().data(), prefixLength) + prefixLength;
+	*(p++) = L'*';
+	*p = L'\0';
+	/* ERROR_FILE_NOT_FOUND means that the directory exists but has no entry starting with the prefix. */
+	bool listed = apResume && apResume->mReadDone;
+	if (!opaque && !listed && !(listed = (mReadFind = apResume ? gReadLayer->FindFirstAt(pattern, apResume->mReadName.c_str(),
+		apResume->mReadPosition, &mReadData, &mReadPosition) : gReadLayer->FindFirst(pattern, &mReadData)) != INVALID_HANDLE_VALUE)) {
+		listed = GetLastError() == ERROR_FILE_NOT_FOUND;
+		DbgPrint(L"\tNot found in read.\n");
+	}
+	if (MakeWritePath(pattern, mRelativePath.c_str(), relativePathLenB)) {
+		DbgPrint(L"\tName too long write.\n");
+		return -ERROR_NOT_SUPPORTED;
+	}
+	p = AdvanceBytes(pattern, gWriteLayer->RootLength() + relativePathLenB);
+	if (p + prefixLength + 1 >= pattern + MAX_PATHW + 2) {
+		DbgPrint(L"\tPattern too long write.\n");
+		return -ERROR_NOT_SUPPORTED;
+	}
+	p = wmemcpy(p, mPattern.Prefix().data(), prefixLength) + prefixLength;
+	*(p++) = L'*';
+	*p = L'\0';
+	if (apResume && apResume->mWriteDone)
+		; // The write root listing was over.
+	else if ((mWriteFind = apResume ? gWriteLayer->FindFirstAt(pattern, apResume->mWriteName.c_str(), apResume->mWritePosition,
+		&mWriteData, &mWritePosition) : gWriteLayer->FindFirst(pattern, &mWriteData)) == INVALID_HANDLE_VALUE) {
+		int returnValue = GetLastError();
+		if (!listed && returnValue != ERROR_FILE_NOT_FOUND) {
+			DbgPrint(L"\tinvalid file handle. Error is %u\n\n", returnValue);
+			return -returnValue;
+		}
+		DbgPrint(L"\tDir not found write.\n");
+	}
+	int status = 0;
+	if (mReadFind != INVALID_HANDLE_VALUE)
+		status = Fetch(gReadLayer, mReadFind, mReadData, mReadPosition, true);
+	if (!status && mWriteFind != INVALID_HANDLE_VALUE)
+		status = Fetch(gWriteLayer, mWriteFind, mWriteData, mWritePosition, true);
+	return status;
+}
+
+void UnionDirEnumerator::Save(UnionDirCursor& aCursor) const
+{
+	if (!(aCursor.mReadDone = mReadFind == INVALID_HANDLE_VALUE)) {
+		aCursor.mReadName = mReadData.cFileName;
+		aCursor.mReadPosition = mReadPosition;
+	}
+	if (!(aCursor.mWriteDone = mWriteFind == INVALID_HANDLE_VALUE)) {
+		aCursor.mWriteName = mWriteData.cFileName;
+		aCursor.mWritePosition = mWritePosition;
+	}
+}
+
+int UnionDirEnumerator::Next(LPWIN32_FIND_DATAW apFindData, LPBY_HANDLE_FILE_INFORMATION apInformation)
+{
+	for (;;) {
+		int compareResult;
+		if (mReadFind == INVALID_HANDLE_VALUE)
+			compareResult = 1;
+		else if (mWriteFind == INVALID_HANDLE_VALUE)
+			compareResult = -1;
+		else
+			compareResult = _wcsicmp(mReadData.cFileName, mWriteData.cFileName);
+		int status;
+		if (compareResult < 0) {
+			*apFindData = mReadData;
+			if (apInformation)
+				gReadLayer->FindInformation(mReadFind, mReadData, apInformation);
+			if ((status = Fetch(gReadLayer, mReadFind, mReadData, mReadPosition, false)))
+				return status;
+			mEntryPath.assign(mRelativePath).append(apFindData->cFileName);
+			if (CheckDeleted(mEntryPath)) {
+				DbgPrint(L"\tFile Deleted %s.\n", apFindData->cFileName);
+				continue;
+			}
+			DbgPrint(L"\tread returning %s.\n", apFindData->cFileName);
+			if (apInformation) // CheckDeleted cleaned mEntryPath.
+				PrimeUnionFileInformation(mEntryPath, *apInformation, mGeneration);
+			return 1;
+		}
+		if (mWriteFind == INVALID_HANDLE_VALUE)
+			return 0;
+		*apFindData = mWriteData;
+		if (apInformation)
+			gWriteLayer->FindInformation(mWriteFind, mWriteData, apInformation);
+		if ((status = Fetch(gWriteLayer, mWriteFind, mWriteData, mWritePosition, false)))
+			return status;
+		if (!compareResult && (status = Fetch(gReadLayer, mReadFind, mReadData, mReadPosition, false)))
+			return status; // The write root entry shadows the read root one.
+		if (mRelativePath.size() == 1 && IsMetadataPath(mEntryPath.assign(mRelativePath).append(apFindData->cFileName).c_str()))
+			continue; // The metadata file is not part of the union.
+		DbgPrint(L"\twrite returning %s.\n", apFindData->cFileName);
+		if (apInformation) {
+			mEntryPath.assign(mRelativePath).append(apFindData->cFileName);
+			CleanFileName(mEntryPath);
+			PrimeUnionFileInformation(mEntryPath, *apInformation, mGeneration);
+		}
+		return 1;
+	}
+}
+
+int CheckDirectoryEmpty(LPCWSTR aFileName)
+{
+	UnionDirEnumerator enumerator;
+	WIN32_FIND_DATAW findData;
+	int status = enumerator.Open(aFileName);
+	if (!status)
+		status = enumerator.Next(&findData);
+	return status > 0 ? -ERROR_DIR_NOT_EMPTY : status;
+}
+
+/** The listing of a directory open in the front end, see ListDirectory. */
+struct DirectoryListing
+{
+	wstring mFileName, mPattern;
+	UnionDirEnumerator mEnumerator;
+	bool mLive; /* Whether mEnumerator is open, else mCursor tells where it stood. */
+	UnionDirCursor mCursor;
+	ULONG64 mLastUse;
+};
+class DirectoryListingMap : public std::map<ULONG64, DirectoryListing*>
+{
+public:
+	DirectoryListingMap() : std::map<ULONG64, DirectoryListing*>(), mLive(0), mClock(0) {
+		InitializeCriticalSection(&mLock);
+	}
+	~DirectoryListingMap() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+	ULONG mLive; /* Listings in the map with mLive set. */
+	ULONG64 mClock;
+};
+static DirectoryListingMap gDirectoryListings;
+
+/** Closes the layer listings of apListing, which keeps its cursor, or deletes it if the cursor cannot be stored.
+ * @return false if apListing is kept.
+ */
+static bool CloseDirectoryListing(DirectoryListing* apListing)
+{
+	try {
+		apListing->mEnumerator.Save(apListing->mCursor);
+	} catch (...) {
+		delete apListing;
+		return true;
+	}
+	apListing->mEnumerator.Close();
+	apListing->mLive = false;
+	return false;
+}
+
+/** Takes the listing of aOpen out of gDirectoryListings. @return it, or NULL if there is none. */
+static DirectoryListing* TakeDirectoryListing(ULONG64 aOpen)
+{
+	CriticalSectionLock lock(gDirectoryListings.mLock);
+	DirectoryListingMap::iterator it = gDirectoryListings.find(aOpen);
+	if (it == gDirectoryListings.end())
+		return NULL;
+	DirectoryListing* listing = it->second;
+	gDirectoryListings.erase(it);
+	if (listing->mLive)
+		--gDirectoryListings.mLive;
+	return listing;
+}
+
+int ListDirectory(ULONG64 aOpen, LPCWSTR aFileName, LPCWSTR aPattern, bool aRestart, ULONG aMaxEntries, UnionDirFill apFill, void* apArgument)
+{
+	/* Listed outside of the lock, a concurrent call for the same open starts over. */
+	DirectoryListing* listing = aOpen ? TakeDirectoryListing(aOpen) : NULL;
+	if (listing && (aRestart || listing->mFileName != aFileName || listing->mPattern != (aPattern ? aPattern : L""))) {
+		delete listing;
+		listing = NULL;
+	}
+	int status = 0;
+	bool started = !listing;
+	try {
+		if (started) {
+			listing = new DirectoryListing;
+			listing->mFileName = aFileName;
+			listing->mPattern = aPattern ? aPattern : L"";
+			status = listing->mEnumerator.Open(aFileName, aPattern);
+		} else if (!listing->mLive) {
+			DbgPrint(L"\tReopening the listing of %s.\n", aFileName);
+			status = listing->mEnumerator.Open(aFileName, aPattern, &listing->mCursor);
+		}
+		listing->mLive = !status;
+		WIN32_FIND_DATAW findData;
+		BY_HANDLE_FILE_INFORMATION information; // Primes GetUnionFileInformation for the stats following the listing.
+		ULONG count = 0;
+		while (!status && count < aMaxEntries && (status = listing->mEnumerator.Next(&findData, &information)) > 0) {
+			apFill(findData, apArgument);
+			++count;
+			status = 0;
+		}
+		if (!status && count == aMaxEntries)
+			status = 1;
+	} catch (...) {
+		delete listing;
+		throw;
+	}
+	/* A listing read to its end by the call that started it, the way the front end lists, is not kept. */
+	if (status < 0 || !aOpen || (!status && started)) {
+		delete listing;
+		return status;
+	}
+	/* A listing that ended keeps a cursor past both layers, so that a next page is empty. */
+	if (!status && CloseDirectoryListing(listing))
+		return status;
+	CriticalSectionLock lock(gDirectoryListings.mLock);
+	listing->mLastUse = ++gDirectoryListings.mClock;
+	DirectoryListingMap::iterator it;
+	try {
+		it = gDirectoryListings.insert(DirectoryListingMap::value_type(aOpen, NULL)).first;
+	} catch (...) {
+		delete listing;
+		throw;
+	}
+	DirectoryListing*& entry = it->second;
+	if (entry) {
+		if (entry->mLive)
+			--gDirectoryListings.mLive;
+		delete entry;
+	}
+	entry = listing;
+	if (listing->mLive && ++gDirectoryListings.mLive > UFS_LIVE_DIRECTORY_LISTINGS) {
+		/* Closes the least recently used live listing, the scan only runs once that many are live. */
+		DirectoryListingMap::iterator oldest = gDirectoryListings.end();
+		for (it = gDirectoryListings.begin(); it != gDirectoryListings.end(); ++it)
+			if (it->second->mLive && (oldest == gDirectoryListings.end() || it->second->mLastUse < oldest->second->mLastUse))
+				oldest = it;
+		--gDirectoryListings.mLive;
+		if (CloseDirectoryListing(oldest->second))
+			gDirectoryListings.erase(oldest);
+	}
+	return status;
+}
+
+void ForgetDirectoryListing(ULONG64 aOpen)
+{
+	delete TakeDirectoryListing(aOpen);
+}
+
+void InvalidateDirectoryListings(LPCWSTR aRelativePath)
+{
+	try {
+		wstring changed, listed;
+		size_t parent = 0;
+		if (aRelativePath) {
+			changed = aRelativePath;
+			CleanFileName(changed);
+			parent = changed.rfind(L'\\');
+		}
+		CriticalSectionLock lock(gDirectoryListings.mLock);
+		for (DirectoryListingMap::iterator it = gDirectoryListings.begin(); it != gDirectoryListings.end();) {
+			DirectoryListing* listing = it->second;
+			if (!listing->mLive) {
+				++it;
+				continue;
+			}
+			if (aRelativePath) {
+				listed = listing->mFileName;
+				CleanFileName(listed);
+				while (!listed.empty() && listed[listed.size() - 1] == L'\\')
+					listed.erase(listed.size() - 1);
+				/* The change shows in the listing of its parent and, for a directory, in the listings under it. */
+				if (!(parent != wstring::npos && listed.size() == parent && !changed.compare(0, parent, listed)) &&
+					!(listed.size() > changed.size() && !listed.compare(0, changed.size(), changed) && listed[changed.size()] == L'\\')) {
+					++it;
+					continue;
+				}
+			}
+			--gDirectoryListings.mLive;
+			if (CloseDirectoryListing(listing))
+				gDirectoryListings.erase(it++);
+			else
+				++it;
+		}
+	} catch (...) {
+		if (aRelativePath)
+			InvalidateDirectoryListings(NULL);
+	}
+}
+
+int ResolveUnionOpen(LPCWSTR aFileName, LPWSTR aWriteFilePath, LPWSTR aReadFilePath, LPWSTR* apFilePath, LPDWORD apAttributes,
+	LPDWORD apCreationDisposition, LPDWORD apFlagsAndAttributes, wstring& aUndelete)
+{
+	size_t filenameLengthB = wcslen(aFileName)*sizeof(WCHAR);
+	if (MakeWritePath(aWriteFilePath, aFileName, filenameLengthB)) {
+		DbgPrint(L"Path too long write.\n");
+		return -ERROR_NOT_SUPPORTED;
+	}
+	wstring	cleanedFilename;
+	bool readPathMade = gParallelProbesEnabled && !MakeReadPath(aReadFilePath, aFileName, filenameLengthB);
+	ReadRootProbe readProbe(readPathMade ? aReadFilePath : NULL);
+	DWORD fileAttributes = *apAttributes = gWriteLayer->GetAttributes(aWriteFilePath);
+	if (fileAttributes != INVALID_FILE_ATTRIBUTES) {
+		*apFilePath = aWriteFilePath;
+		if (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			*apFlagsAndAttributes |= FILE_FLAG_BACKUP_SEMANTICS;
+		return 0;
+	}
+	if (!readPathMade && MakeReadPath(aReadFilePath, aFileName, filenameLengthB)) {
+		DbgPrint(L"Path too long read.\n");
+		return -ERROR_NOT_SUPPORTED;
+	}
+	bool deleted = false, checkedDeleted = readProbe.Running();
+	if (checkedDeleted)
+		try	{
+			/* While the read root answers. */
+			cleanedFilename	= aFileName;
+			CleanFileName(cleanedFilename);
+			deleted = CheckDeletedClean(cleanedFilename);
+		} catch	(...) {
+			DbgPrint(L"Exception thrown in ResolveUnionOpen.");
+			return -1;
+		}
+	if ((fileAttributes = *apAttributes = readProbe.Attributes(aReadFilePath)) != INVALID_FILE_ATTRIBUTES) {
+		if (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			*apFlagsAndAttributes |= FILE_FLAG_BACKUP_SEMANTICS;
+		try	{
+			if (!checkedDeleted) {
+				cleanedFilename	= aFileName;
+				CleanFileName(cleanedFilename);
+				deleted = CheckDeletedClean(cleanedFilename);
+			}
+			if (deleted) {
+				*apFilePath = aWriteFilePath;
+				aUndelete = cleanedFilename;
+			} else
+				switch (*apCreationDisposition) {
+					case TRUNCATE_EXISTING:
+						*apCreationDisposition = CREATE_NEW;
+					case CREATE_ALWAYS:
+						if(CreateParentDirectories(aWriteFilePath)) {
+							DbgPrint(L"CreateParentDirectoriesFailed.\n");
+							return -ERROR_NOT_ENOUGH_QUOTA;
+						}
+						*apFilePath = aWriteFilePath;
+						break;
+					default:
+						*apFilePath = aReadFilePath;
+				}
+		} catch	(...) {
+			DbgPrint(L"Exception thrown in ResolveUnionOpen.");
+			return -1;
+		}
+	} else
+		switch (*apCreationDisposition) {
+			case CREATE_ALWAYS:
+			case OPEN_ALWAYS:
+			case CREATE_NEW:
+				if(CheckAndCreateParentDirectories(aWriteFilePath, filenameLengthB)) {
+					DbgPrint(L"CheckAndCreateParentDirectoriesFailed.\n");
+					return -ERROR_NOT_ENOUGH_QUOTA;
+				}
+				*apFilePath = aWriteFilePath;
+				break;
+			default:
+				*apFilePath = aReadFilePath;
+		}
+	return 0;
+}
+
+int CopyUpUnionFile(LPCWSTR aFileName, LPWSTR aWriteFilePath)
+{
+	WCHAR readFilepath[MAX_PATHW];
+	size_t filenameLength=wcslen(aFileName)*sizeof(WCHAR);
+	if (MakeWritePath(aWriteFilePath, aFileName, filenameLength))
+		return -ERROR_NOT_SUPPORTED;
+	if (gWriteLayer->GetAttributes(aWriteFilePath) != INVALID_FILE_ATTRIBUTES)
+		return 0;
+	UnionFileChange copyUp;
+	try	{
+		if (CheckDeleted(aFileName))
+			return -ERROR_FILE_NOT_FOUND;
+	} catch	(...) {
+		DbgPrint(L"Exception thrown in CopyUpUnionFile.");
+		return -1;
+	}
+	if (MakeReadPath(readFilepath, aFileName, filenameLength))
+		return -ERROR_NOT_SUPPORTED;
+	if (GetReadRootAttributes(readFilepath) == INVALID_FILE_ATTRIBUTES)
+		return -ERROR_FILE_NOT_FOUND;
+	if (!CopyUp(aFileName, readFilepath, aWriteFilePath, TRUE))
+		return -ERROR_NOT_ENOUGH_QUOTA;
+	return 0;
+}
+
+int CopyUpOpenFile(LPCWSTR aFileName, HANDLE* apHandle, DWORD aAccessMode, DWORD aShareMode, DWORD aFlags, bool* apInWriteArea)
+{
+	WCHAR writeFilepath[MAX_PATHW], readFilepath[MAX_PATHW];
+	size_t filenameLength=wcslen(aFileName)*sizeof(WCHAR);
+	*apInWriteArea = false;
+	if (MakeWritePath(writeFilepath, aFileName, filenameLength))
+		return -ERROR_NOT_SUPPORTED;
+	MakeReadPath(readFilepath, aFileName, filenameLength); // This must succeed since the file was open.
+	UnionFileChange copyUp;
+	gReadLayer->Close(*apHandle);
+	if (!CopyUp(aFileName, readFilepath, writeFilepath, TRUE)) {
+		*apHandle = gReadLayer->Open(readFilepath, aAccessMode, aShareMode, OPEN_EXISTING, aFlags);
+		return -ERROR_NOT_ENOUGH_QUOTA;
+	}
+	*apInWriteArea = true;
+	*apHandle = gWriteLayer->Open(writeFilepath, aAccessMode, aShareMode, OPEN_EXISTING, aFlags);
+	if (*apHandle == INVALID_HANDLE_VALUE)
+		return -(LONG)GetLastError();
+	return 0;
+}
+
+int DeleteUnionFile(LPCWSTR aFileName, bool aDirectory, bool aInWriteArea)
+{
+	WCHAR	filePath[MAX_PATHW];
+	size_t fileNameLengthB = wcslen(aFileName)*sizeof(WCHAR);
+	if (aDirectory) {
+		DbgPrint(L"\tDeleteDirectory ");
+		if (MakeWritePath(filePath, aFileName, fileNameLengthB))
+			return -1;
+		aInWriteArea = gWriteLayer->GetAttributes(filePath) != INVALID_FILE_ATTRIBUTES;
+		if (aInWriteArea && !gWriteLayer->DeleteDirectory(filePath)) {
+			int	error =	(int)GetLastError();
+			DbgPrint(L"\tFailed to remove directory %s. Error: %d.\n", filePath, error);
+			return -error;
+		}
+		if (aInWriteArea)
+			try	{
+				ForgetWriteDirectory(aFileName);
+			} catch(...) {
+				return -1;
+			}
+	} else {
+		DbgPrint(L"\tDeleting File %s.", aFileName);
+		if (aInWriteArea) {
+			if (MakeWritePath(filePath, aFileName, fileNameLengthB))
+				return -ERROR_NOT_SUPPORTED;
+			if (!gWriteLayer->Unlink(filePath)) {
+				int	error =	(int)GetLastError();
+				DbgPrint(L"Failed to delete file %s. Error %d.\n", filePath, error);
+				return -error;
+			}
+		}
+	}
+	if (MakeReadPath(filePath, aFileName, fileNameLengthB))
+		return -ERROR_NOT_SUPPORTED;
+	if (GetReadRootAttributes(filePath) == INVALID_FILE_ATTRIBUTES)
+		return aInWriteArea ? 0 : -ERROR_FILE_NOT_FOUND;
+	try	{
+		wstring	filename(aFileName);
+		CleanFileName(filename);
+		MarkDeleted(filename);
+	} catch(...) {
+		return -1;
+	}
+	return 0;
+}
+
+int MoveUnionFile(LPCWSTR aFileName, LPCWSTR aNewFileName, BOOL aReplaceIfExisting, UnionReleaseOpen apRelease, void* apArgument)
+{
+	WCHAR filePath[MAX_PATHW], newFilePath[MAX_PATHW];
+	size_t relativeFilePathLengthB = wcslen(aFileName) * sizeof(WCHAR);
+	if (MakeWritePath(filePath, aFileName, relativeFilePathLengthB))
+		return -ERROR_NOT_SUPPORTED;
+	size_t relativeNewFilePathLengthB =	wcslen(aNewFileName) * sizeof(WCHAR);
+	if (MakeWritePath(newFilePath, aNewFileName, relativeNewFilePathLengthB))
+		return -ERROR_NOT_SUPPORTED;
+	wstring	cleanFilename(aFileName);
+	CleanFileName(cleanFilename);
+	wstring	cleanNewFilename(aNewFileName);
+	CleanFileName(cleanNewFilename);
+	WCHAR readFilePath[MAX_PATHW];
+	if (MakeReadPath(readFilePath, aNewFileName, relativeNewFilePathLengthB))
+		return -ERROR_NOT_SUPPORTED;
+	if ((GetReadRootAttributes(readFilePath) !=	INVALID_FILE_ATTRIBUTES) &&	!CheckDeletedClean(cleanNewFilename) &&	!aReplaceIfExisting)
+		return -ERROR_FILE_EXISTS;
+	if (CheckAndCreateParentDirectories(newFilePath, relativeNewFilePathLengthB))
+		return -ERROR_PATH_NOT_FOUND;
+	int releaseError = apRelease ? apRelease(apArgument) : 0;
+	if (releaseError)
+		return releaseError;
+	if (MakeReadPath(readFilePath, aFileName, relativeFilePathLengthB))
+		return -ERROR_NOT_SUPPORTED;
+	DWORD readAttributes = GetReadRootAttributes(readFilePath);
+	DWORD attributes = gWriteLayer->GetAttributes(filePath);
+	if (attributes == INVALID_FILE_ATTRIBUTES && !cleanFilename.compare(cleanNewFilename))
+		return -ERROR_CANNOT_COPY;
+	/* The metadata changes are logged before the write root changes, so a crash in between settles them
+	 * by what the write root shows on the next mount, see BeginRename. */
+	UnionRename rename;
+	ULONG64 renameId = 0;
+	WCHAR copyName[UFS_COPY_NAME_LENGTH];
+	try	{
+		rename.mOld = cleanFilename;
+		rename.mNew = cleanNewFilename;
+		rename.mMoveBelow = false;
+		rename.mWhiteout = readAttributes != INVALID_FILE_ATTRIBUTES;
+		if (attributes != INVALID_FILE_ATTRIBUTES) {
+			rename.mSource = aFileName;
+			if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+				/* The read root part of a merged directory follows it under the new name. */
+				if (readAttributes != INVALID_FILE_ATTRIBUTES && (readAttributes & FILE_ATTRIBUTE_DIRECTORY) && !CheckDeletedClean(cleanFilename))
+					rename.mRedirect = AdvanceBytes(readFilePath, gReadLayer->RootLength());
+				rename.mMoveBelow = true;
+			}
+		} else if (readAttributes != INVALID_FILE_ATTRIBUTES && (readAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			/* Read root directories are renamed by a redirect, whatever their size. The empty write root
+			 * directory puts the new name in the listing of its parent. */
+			rename.mRedirect = AdvanceBytes(readFilePath, gReadLayer->RootLength());
+		else {
+			/* The empty copy exists until the copy is renamed into place. */
+			if (MakeCopyName(copyName, rename.mWhiteout))
+				return -(int)GetLastError();
+			rename.mSource = copyName;
+		}
+		if (rename.mWhiteout || rename.mMoveBelow || !rename.mRedirect.empty())
+			renameId = BeginRename(rename);
+	} catch	(...) {
+		DbgPrint(L"Exception thrown in MoveUnionFile.");
+		return -1;
+	}
+	BOOL status;
+	if (attributes != INVALID_FILE_ATTRIBUTES) {
+		DbgPrint(L"MoveFile(Ex) called with %s, %s\n", filePath, newFilePath);
+		status = gWriteLayer->Rename(filePath, newFilePath, aReplaceIfExisting);
+	} else if (!rename.mRedirect.empty()) {
+		DbgPrint(L"Redirecting %s to %s\n", newFilePath, readFilePath);
+		status = gWriteLayer->MakeDirectory(newFilePath);
+	} else {
+		DbgPrint(L"CopyFile called with %s, %s\n", readFilePath, newFilePath);
+		status = CopyOutThrough(readFilePath, copyName, newFilePath, ! aReplaceIfExisting);
+	}
+	DWORD error	= GetLastError();
+	try	{
+		if (renameId)
+			EndRename(renameId, rename, status != FALSE);
+		if (status && attributes != INVALID_FILE_ATTRIBUTES)
+			ForgetWriteDirectory(aFileName);
+		else if (status && !rename.mRedirect.empty())
+			RememberWriteDirectory(aNewFileName);
+	} catch	(...) {
+		DbgPrint(L"Exception thrown in MoveUnionFile.");
+		return -1;
+	}
+	if (status == FALSE) {
+		/* The copy goes once the rename ended, it marks the rename done while it is missing. */
+		if (attributes == INVALID_FILE_ATTRIBUTES && rename.mRedirect.empty())
+			RemoveCopy(copyName);
+		DbgPrint(L"\tMoveFile failed status = %d, code = %d\n", status, error);
+		return -(int)error;
+	}
+	return 0;
+}
@@ -0,0 +1,515 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** The union engine: layer resolution, whiteouts, parent directory creation and directory merging, and the
+ * opens, copy-ups, deletes and renames the front end callbacks are built on. The engine reaches storage
+ * only through gReadLayer and gWriteLayer, it knows nothing about Dokan, so it can be driven by any front
+ * end and backed by any UFSLayer.
+ */
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "UFSLayer.h"
+#include "HotPaths.h"
+#include "NamePattern.h"
+
+extern UFSLayer* gReadLayer;
+extern UFSLayer* gWriteLayer;
+
+class CriticalSectionLock
+{
+public:
+	CriticalSectionLock(CRITICAL_SECTION& aLock) : mLock(aLock)
+	{
+		EnterCriticalSection(&mLock);
+	}
+	~CriticalSectionLock() {
+		LeaveCriticalSection(&mLock);
+	}
+private:
+	CRITICAL_SECTION& mLock;
+};
+class FilePathSet : public std::set<std::wstring>
+{
+public:
+	FilePathSet() : std::set<std::wstring>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~FilePathSet() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+class FilePathMap : public std::map<std::wstring, std::wstring>
+{
+public:
+	FilePathMap() : std::map<std::wstring, std::wstring>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~FilePathMap() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+/* Whiteouts: the cleaned relative paths of read root entries deleted from the union, a whiteout hides the
+ * whole subtree below it. */
+extern FilePathSet gDeletedFilesSet;
+/* Redirects: the cleaned relative paths of renamed read root directories, mapped to the relative path the
+ * directory still has in the read root. */
+extern FilePathMap gRedirects;
+/* The size of gRedirects, read without the lock so that lookups skip it while there are no redirects. */
+extern volatile LONG gRedirectCount;
+
+/* The metadata file in the write root holding the whiteouts and redirects between mounts. Every write
+ * root name starting with it is reserved and hidden from the union. */
+#define UFS_METADATA_FILE L"\\.ufsmeta"
+/* Files copied into the write root are copied to a name starting with this first, then renamed into place,
+ * so a crash never leaves a partial copy in the union. The copies left by a crash are removed on mount. */
+#define UFS_METADATA_COPY_FILE UFS_METADATA_FILE L".copy."
+#define UFS_COPY_NAME_LENGTH 32
+/* The metadata log is saved to the metadata file once it grows beyond this many bytes. */
+#define UFS_METADATA_LOG_LIMIT (4 * 1024 * 1024)
+
+/** Constants used by GetFiepath to indicate where a file is mapped from.
+ */
+#define UFS_FAILED -1
+#define UFS_READ_AREA 0
+#define UFS_WRITE_AREA FILE_ATTRIBUTE_ARCHIVE
+#define UFS_OPENED_FOR_READING FILE_ATTRIBUTE_ENCRYPTED
+#define UFS_OPENED_FOR_WRITING FILE_ATTRIBUTE_HIDDEN
+#define UFS_SHARE_READ FILE_ATTRIBUTE_NOT_CONTENT_INDEXED
+#define UFS_SHARE_WRITE FILE_ATTRIBUTE_OFFLINE
+#define UFS_SHARE_DELETE FILE_ATTRIBUTE_READONLY
+/* Storage was reserved beyond the end of the file, see SetWriteAllocation. */
+#define UFS_PREALLOCATED FILE_ATTRIBUTE_DEVICE
+/* The read root file was opened from its copy in the cache tier, see CacheTier.h. */
+#define UFS_CACHE_TIER FILE_ATTRIBUTE_SPARSE_FILE
+#define UFS_UNSAVED_FLAGS (~(UFS_WRITE_AREA | UFS_OPENED_FOR_READING |UFS_OPENED_FOR_WRITING | UFS_SHARE_READ | UFS_SHARE_WRITE | UFS_SHARE_DELETE | UFS_PREALLOCATED | \
+	UFS_CACHE_TIER))
+
+/** Checks whether the cleaned relative path aRelativePath or one of its parents is whited out.
+ * Like CheckDeleted it throws when memory runs out.
+ */
+bool CheckDeletedClean(const std::wstring& aRelativePath);
+
+inline void CleanFileName(std::wstring& aRelativePath) {
+	std::wstring::iterator end = aRelativePath.end();
+	for (std::wstring::iterator it = aRelativePath.begin(); it != end; ++it)
+		if (*it == L'/')
+			*it=L'\\';
+		else
+			*it = towupper(*it);
+}
+
+inline bool CheckDeleted(std::wstring& aRelativePath) {
+	CleanFileName(aRelativePath);
+	return CheckDeletedClean(aRelativePath);
+}
+
+inline bool CheckDeleted(LPCWSTR aRelativePath) {
+	std::wstring relativePath(aRelativePath);
+	return CheckDeleted(relativePath);
+}
+
+/** Records a whiteout for, or removes the whiteout of, the cleaned relative path aRelativePath.
+ * Like CheckDeleted these throw when memory runs out. Like the other metadata changes below they return once
+ * the metadata log holds the change, if the log is started.
+ */
+void MarkDeleted(const std::wstring& aRelativePath);
+void UnmarkDeleted(const std::wstring& aRelativePath);
+
+/** Redirects the cleaned relative path aCleanPath to the read root relative path aReadPath, dropping the
+ * whiteouts and redirects below aCleanPath, which the redirect supersedes. Throws when memory runs out.
+ */
+void AddRedirect(const std::wstring& aCleanPath, const std::wstring& aReadPath);
+
+/** Moves the redirects of aCleanPath and below it, and the whiteouts below it, to aNewCleanPath after the
+ * front end renamed the write root directory aCleanPath. Throws when memory runs out.
+ */
+void MoveRedirectsAndWhiteouts(const std::wstring& aCleanPath, const std::wstring& aNewCleanPath);
+
+/** The metadata changes of a rename in the union, see BeginRename.
+ */
+struct UnionRename {
+	std::wstring mOld; /* The cleaned relative paths. */
+	std::wstring mNew;
+	std::wstring mRedirect; /* The read root relative path mNew is redirected to, empty for none. */
+	std::wstring mSource; /* The write root relative path gone once renamed, if empty mNew appears instead. */
+	bool mMoveBelow; /* Move the redirects and whiteouts of mOld, see MoveRedirectsAndWhiteouts. */
+	bool mWhiteout; /* Hide mOld in the read root. */
+};
+
+/** Logs aRename before the front end renames or copies in the write root, so that a crash before EndRename
+ * is settled when the metadata is loaded: the metadata changes are made if the write root shows the rename
+ * done, and dropped otherwise. Throws when memory runs out.
+ * @return The identifier of the rename for EndRename.
+ */
+ULONG64 BeginRename(const UnionRename& aRename);
+/** Makes the metadata changes of aRename if aDone, then ends the rename aId. Throws when memory runs out.
+ */
+void EndRename(ULONG64 aId, const UnionRename& aRename, bool aDone);
+
+/** Checks whether aFileName is reserved for the metadata file, see UFS_METADATA_FILE.
+ */
+bool IsMetadataPath(LPCWSTR aFileName);
+
+/** Loads the whiteouts and redirects from the metadata file, or saves them to it.
+ * Saving writes a new file then replaces the old one, so a crash never leaves a partial file behind.
+ * Loading replays the metadata log written since the last save, see StartMetadataLog.
+ * @return false on success, a missing metadata file loads as empty.
+ */
+bool LoadMetadata();
+bool SaveMetadata();
+/** Forgets every whiteout, redirect and pending rename, as before LoadMetadata. */
+void ClearMetadata();
+
+/** Starts logging every metadata change to the metadata log before the change returns, so that a crash
+ * loses none of them, see MetadataLog.h. Removes the copies left by a crash, see UFS_METADATA_COPY_FILE.
+ * @return false on success.
+ */
+bool StartMetadataLog();
+void StopMetadataLog();
+
+/** Stores in aDest, UFS_COPY_NAME_LENGTH characters long, a new write root relative path for a copy, see
+ * UFS_METADATA_COPY_FILE, numbered past the copies LoadMetadata found. If aCreate it also creates the empty file.
+ * @return false on success.
+ */
+bool MakeCopyName(LPWSTR aDest, bool aCreate);
+/** Copies the read root file aReadFilePath to the write root copy aCopyName, then renames the copy to
+ * aWriteFilePath. The caller removes the copy on failure with RemoveCopy.
+ */
+BOOL CopyOutThrough(LPCWSTR aReadFilePath, LPCWSTR aCopyName, LPCWSTR aWriteFilePath, BOOL aFailIfExists);
+void RemoveCopy(LPCWSTR aCopyName);
+
+bool MakeRedirectedReadPath(LPWSTR aDest, LPCWSTR aFileName, size_t aFileNameLength);
+
+/** Builds the native path of the relative path aFileName in the read or the write root, see PatchPath.
+ * aFileNameLength is in bytes. The read path follows the redirects, so its length may differ.
+ * @return false on success.
+ */
+inline bool MakeReadPath(LPWSTR aDest, LPCWSTR aFileName, size_t aFileNameLength)
+{
+	if (gRedirectCount)
+		return MakeRedirectedReadPath(aDest, aFileName, aFileNameLength);
+	return gReadLayer->MakePath(aDest, aFileName, aFileNameLength);
+}
+inline bool MakeWritePath(LPWSTR aDest, LPCWSTR aFileName, size_t aFileNameLength)
+{
+	return gWriteLayer->MakePath(aDest, aFileName, aFileNameLength);
+}
+
+/** The attributes of a path under the read root, accounted as a read root probe by the hot path profiler.
+ */
+inline DWORD GetReadRootAttributes(LPCWSTR aReadFilePath)
+{
+	HotPathSample sample(UFS_HOT_READ_ROOT_PROBE, AdvanceBytes(aReadFilePath, gReadLayer->RootLength()));
+	return gReadLayer->GetAttributes(aReadFilePath);
+}
+
+/** Copies the read root file aReadFilePath of aFileName to aWriteFilePath through a copy, see CopyFile and
+ * UFS_METADATA_COPY_FILE.
+ */
+inline BOOL CopyUp(LPCWSTR aFileName, LPCWSTR aReadFilePath, LPCWSTR aWriteFilePath, BOOL aFailIfExists)
+{
+	HotPathSample sample(UFS_HOT_COPY_UP, aFileName);
+	WCHAR copyName[UFS_COPY_NAME_LENGTH];
+	MakeCopyName(copyName, false);
+	if (CopyOutThrough(aReadFilePath, copyName, aWriteFilePath, aFailIfExists))
+		return TRUE;
+	DWORD error = GetLastError();
+	RemoveCopy(copyName);
+	SetLastError(error);
+	return FALSE;
+}
+
+/* This function returns the target file path from a source file path
+ * @params:
+ * aFilepath - Pointer to a destination buffer, at least MAX_PATH bytes long.
+ * aFileName - Pointer to the source file path excluding the drive letter in the mounted file system.
+ * In case of an error a 0 length path is returned in the output buffer.
+ * @return If the function is successful it returns UFS_READ_AREA or UFS_WRITE_AREA, depending on where the file is found.
+ * otherwise it return s UFS_FAILED.
+ */
+int GetFilePath(PWCHAR aFilepath, LPCWSTR aFileName);
+
+/** Stores what GetFileInformationByHandle would for aFileName without opening it: the layer holding it is
+ * resolved like GetFilePath does and answers from one attribute query, see UFSLayer::Stat.
+ * @return 0 on success, or a negated Win32 error code like the Dokan callbacks.
+ */
+int GetUnionFileInformation(LPCWSTR aFileName, LPBY_HANDLE_FILE_INFORMATION apInformation);
+
+/* How long GetUnionFileInformation answers from the information primed by a listing, in milliseconds, and
+ * how many entries are kept. Changes made behind the back of the union stay unseen this long at most. */
+#define UFS_PRIMED_INFORMATION_TTL 1000
+#define UFS_PRIMED_INFORMATION_LIMIT 8192
+
+/** Drops the information primed by listings, see UnionDirEnumerator::Next. The front end calls it, through
+ * UnionFileChange, around any operation that may change what GetUnionFileInformation reports.
+ */
+void InvalidateUnionFileInformation();
+/** Drops the information primed for aFileName only, after a write to the file. A listing running meanwhile
+ * may prime what it saw before the write, for UFS_PRIMED_INFORMATION_TTL at most.
+ */
+void ForgetUnionFileInformation(LPCWSTR aFileName);
+
+/** Drops the information primed by listings before and after an operation that may change the union, so
+ * that a listing running meanwhile cannot keep what it saw before the change. Does nothing unless aChanges.
+ */
+class UnionFileChange
+{
+public:
+	UnionFileChange(bool aChanges = true) : mpFileName(NULL), mChanges(aChanges) {
+		if (mChanges)
+			InvalidateUnionFileInformation();
+	}
+	/** Around a write to aFileName, which changes only its own information. */
+	explicit UnionFileChange(LPCWSTR aFileName) : mpFileName(aFileName), mChanges(true) {}
+	~UnionFileChange() {
+		if (!mChanges)
+			return;
+		if (mpFileName)
+			ForgetUnionFileInformation(mpFileName);
+		else
+			InvalidateUnionFileInformation();
+	}
+private:
+	LPCWSTR mpFileName;
+	bool mChanges;
+};
+/** Drops the information primed for the read root path aRelativePath, changed behind the back of the union,
+ * and for the entries under it. With redirects a read root path may show under other names, everything is
+ * then dropped, see ChangeWatcher.h.
+ */
+void InvalidateReadRootChange(LPCWSTR aRelativePath);
+
+/** This function creates the parent directories for aFileName.
+ * aFileName must be under the write root. Parents are looked up in the known directory cache first, then
+ * probed bottom up until one exists, and the missing ones are created top down and remembered.
+ * @return false on success.
+ */
+bool CreateParentDirectories(LPWSTR aFileName);
+
+/** Record that the write root directory aRelativePath exists, or that it and everything below it may not.
+ * The front end must call ForgetWriteDirectory whenever it removes or renames a write root directory.
+ */
+void RememberWriteDirectory(LPCWSTR aRelativePath);
+void ForgetWriteDirectory(LPCWSTR aRelativePath);
+
+/** This function creates the parent directories for aWriteFilePath if its parent exists in the union.
+ * aFilenameLengthB must be the length in bytes of the path to the file or directory whose parents to create relative to
+ * the root of the virtual fs root.
+ * @return false on success.
+ */
+bool CheckAndCreateParentDirectories(LPWSTR aWriteFilepath, size_t aFilenameLengthB);
+
+/** Removes the directory aRelativePath of apLayer and everything below it, read-only entries included.
+ * Directory links are removed, not followed.
+ * @return false on success, true if something was left.
+ */
+bool RemoveTree(UFSLayer* apLayer, LPCWSTR aRelativePath);
+
+/** Sets the storage allocated to the write root file aFile to aSize bytes without moving its end, so that a
+ * file announced to grow gets few large extents. Setting it to the size of the file trims what was reserved.
+ * @return false on success, GetLastError tells why it failed.
+ */
+bool SetWriteAllocation(HANDLE aFile, LONGLONG aSize);
+
+/** Punches a hole of aLength bytes at aOffset in the write root file aFile: the range reads as zeros and its
+ * storage is released. The file is made sparse first if it is not.
+ * @return false on success, GetLastError tells why it failed.
+ */
+bool ZeroWriteRange(HANDLE aFile, LONGLONG aOffset, LONGLONG aLength);
+
+/* The volume serial number and the index of a file, the same for every open of the file. */
+typedef std::pair<DWORD, ULONG64> FileKey;
+/* Handles whose file identities are remembered are spread over this many locks. */
+#define UFS_FILE_KEY_LOCKS 16
+
+/** Remembers the identity of the file of aFile when it is opened, so that the modules keeping state per file
+ * do not ask the file system for it on every call. ForgetFileKey must be called before aFile is closed.
+ * @return false on success.
+ */
+bool RememberFileKey(HANDLE aFile);
+/** Gets the identity of the file of aFile, remembered or asked for.
+ * @return false on success, GetLastError tells why it failed.
+ */
+bool GetFileKey(HANDLE aFile, FileKey& aKey);
+void ForgetFileKey(HANDLE aFile);
+
+inline ULONG64 MakeContext(HANDLE aHandle, bool aIsInWriteArea, DWORD aAccessMode, DWORD aShareMode, DWORD aFlags)
+{
+	aFlags &= UFS_UNSAVED_FLAGS;
+	if (aIsInWriteArea)
+		aFlags |= UFS_WRITE_AREA;
+	if (aAccessMode & FILE_WRITE_DATA)
+		aFlags |= UFS_OPENED_FOR_WRITING;
+	if (aAccessMode & FILE_READ_DATA)
+		aFlags |= UFS_OPENED_FOR_READING;
+	if (aShareMode & FILE_SHARE_DELETE)
+		aFlags |= UFS_SHARE_DELETE;
+	if (aShareMode & FILE_SHARE_READ)
+		aFlags |= UFS_SHARE_READ;
+	if (aShareMode & FILE_SHARE_WRITE)
+		aFlags |= UFS_SHARE_WRITE;
+	return ((((ULONG64)aFlags)<<32)|((ULONG64)aHandle));
+}
+
+inline void GetCreateDataFromContext(ULONG64 context, DWORD* apAccessMode, DWORD* apShareMode, DWORD* apFlags)
+{
+	*apAccessMode = (context & (((ULONG64)UFS_OPENED_FOR_WRITING) << 32)) ? GENERIC_WRITE : 0;
+	if (context & (((ULONG64)UFS_OPENED_FOR_READING) << 32))
+		*apAccessMode |= GENERIC_READ;
+	*apShareMode = (context & (((ULONG64)UFS_SHARE_READ) << 32)) ? FILE_SHARE_READ : 0;
+	if (context & (((ULONG64)UFS_SHARE_DELETE) << 32))
+		*apShareMode |= FILE_SHARE_DELETE;
+	if (context & (((ULONG64)UFS_SHARE_WRITE) << 32))
+		*apShareMode |= FILE_SHARE_WRITE;
+	*apFlags = (DWORD)((context >> 32) & UFS_UNSAVED_FLAGS);
+}
+#define IsInWriteArea(context) (context & (((ULONG64)UFS_WRITE_AREA)<<32))
+#define GetHandle(context) ((HANDLE)(context & 0xFFFFFFFF))
+/* The layer that opened the handle of context. */
+#define GetLayer(context) (IsInWriteArea(context) ? gWriteLayer : gReadLayer)
+/* Whether the file of context was opened to write through to the disk. */
+#define IsWriteThrough(context) ((context) & (((ULONG64)FILE_FLAG_WRITE_THROUGH) << 32))
+
+/** Where a listing of the union view of a directory stands, see UnionDirEnumerator::Save. For each layer, the
+ * entry it lists next and how many entries it listed before it, or that it has nothing left to list.
+ */
+struct UnionDirCursor
+{
+	std::wstring mReadName, mWriteName;
+	ULONG mReadPosition, mWritePosition;
+	bool mReadDone, mWriteDone;
+};
+
+/** Enumerates the union view of a directory: the write root entries merged with the read root entries that
+ * are neither shadowed by a write root entry nor whited out. Both layers list entries in case insensitive
+ * order, so the merge holds one entry per layer at a time. The read root listing follows the redirects, and
+ * a whited out directory recreated in the write root lists only its write root entries.
+ */
+class UnionDirEnumerator
+{
+public:
+	UnionDirEnumerator();
+	~UnionDirEnumerator();
+	/** Starts enumerating the entries of the directory aFileName that match aPattern, all of them if it is NULL.
+	 * The layers are asked for the names starting with the literal prefix of the pattern and their entries
+	 * are matched before they are merged, so entries that do not match never reach the whiteout checks.
+	 * If apResume is not NULL the listing continues where the enumerator it was saved from stood, see
+	 * UFSLayer::FindFirstAt: at the entries it was about to list, or at their positions if they were deleted
+	 * meanwhile. Sorted layers seek to them instead of listing the entries before them again.
+	 * @return 0 on success or a negated Win32 error code.
+	 */
+	int Open(LPCWSTR aFileName, LPCWSTR aPattern = NULL, const UnionDirCursor* apResume = NULL);
+	/** Stores the next entry in apFindData. If apInformation is not NULL, also stores what
+	 * GetUnionFileInformation would report for the entry, taken from the listing, and primes the cache
+	 * GetUnionFileInformation answers from, so that the query following a listing needs no layer.
+	 * @return 1 if an entry was stored, 0 at the end of the directory or a negated Win32 error code.
+	 */
+	int Next(LPWIN32_FIND_DATAW apFindData, LPBY_HANDLE_FILE_INFORMATION apInformation = NULL);
+	/** Stores in aCursor where the listing stands after a successful Open, so that Open can continue it once
+	 * this enumerator is gone. Throws if the names cannot be stored.
+	 */
+	void Save(UnionDirCursor& aCursor) const;
+	void Close();
+private:
+	int Fetch(UFSLayer* apLayer, HANDLE& aFind, WIN32_FIND_DATAW& aFindData, ULONG& aPosition, bool aFirst);
+
+	std::wstring mRelativePath; /* Cleaned, with a trailing backslash. */
+	std::wstring mEntryPath; /* Scratch buffer for whiteout checks. */
+	NamePattern mPattern;
+	LONG mGeneration; /* Of the primed information when Open started. */
+	HANDLE mReadFind, mWriteFind;
+	WIN32_FIND_DATAW mReadData, mWriteData;
+	ULONG mReadPosition, mWritePosition; /* Of the entries in mReadData and mWriteData in their listings. */
+};
+
+/* How many directory listings keep their layer listings open between pages, the others keep a
+ * UnionDirCursor and reopen them, see ListDirectory. */
+#define UFS_LIVE_DIRECTORY_LISTINGS 64
+
+typedef void (*UnionDirFill)(const WIN32_FIND_DATAW& aFindData, void* apArgument);
+
+/** Lists through apFill up to aMaxEntries entries of the union view of the directory aFileName that match
+ * aPattern, for the open aOpen of the front end. Unless aRestart is set the listing continues where the
+ * previous call for aOpen stopped: the open keeps its enumerator, so the next page costs no layer call
+ * beyond its entries, or, once UFS_LIVE_DIRECTORY_LISTINGS other listings were used since, a cursor to reopen
+ * it from. A listing that ends in the call that started it is not kept, the next call starts over. The front
+ * end must call ForgetDirectoryListing when aOpen is closed.
+ * @return 1 if entries are left, 0 at the end of the directory or a negated Win32 error code.
+ */
+int ListDirectory(ULONG64 aOpen, LPCWSTR aFileName, LPCWSTR aPattern, bool aRestart, ULONG aMaxEntries, UnionDirFill apFill, void* apArgument);
+void ForgetDirectoryListing(ULONG64 aOpen);
+/** Closes the layer listings kept by the listings that show the read root path aRelativePath, changed behind
+ * the back of the union, or by every listing if aRelativePath is NULL. Their next page reopens them from
+ * their cursor and sees the change, see ChangeWatcher.h.
+ */
+void InvalidateDirectoryListings(LPCWSTR aRelativePath);
+
+/** Checks whether the union view of the directory aFileName is empty.
+ * @return 0 if it is, -ERROR_DIR_NOT_EMPTY if it is not or another negated Win32 error code.
+ */
+int CheckDirectoryEmpty(LPCWSTR aFileName);
+
+/** Resolves which root an open of aFileName with *apCreationDisposition goes to. A write root file is opened
+ * there. A read root file is opened there too, unless it is whited out, then the open goes to the write root
+ * and aUndelete is set to its clean name, to unmark once the open succeeded, or unless the open truncates it,
+ * then it goes to the write root as a new file. A missing file is created in the write root, under the parents
+ * it has in the union. aWriteFilePath and aReadFilePath receive the native paths, *apFilePath the one to open
+ * and *apAttributes the attributes of the file found, INVALID_FILE_ATTRIBUTES if none. Directories add
+ * FILE_FLAG_BACKUP_SEMANTICS to *apFlagsAndAttributes. aReadFilePath is only set when the write root misses.
+ * @return 0 on success, or a negated Win32 error code like the Dokan callbacks.
+ */
+int ResolveUnionOpen(LPCWSTR aFileName, LPWSTR aWriteFilePath, LPWSTR aReadFilePath, LPWSTR* apFilePath, LPDWORD apAttributes,
+	LPDWORD apCreationDisposition, LPDWORD apFlagsAndAttributes, std::wstring& aUndelete);
+/** Copies up the read root file aFileName unless the write root has it, for a write through no open handle.
+ * aWriteFilePath receives the native write root path.
+ * @return 0 on success, or a negated Win32 error code like the Dokan callbacks.
+ */
+int CopyUpUnionFile(LPCWSTR aFileName, LPWSTR aWriteFilePath);
+/** Moves an open of the read root file aFileName to the write root before its first write: closes the read
+ * root handle *apHandle, copies the file up and opens the copy with aAccessMode, aShareMode and aFlags into
+ * *apHandle, setting *apInWriteArea. If the copy-up fails the read root file is opened again instead, if the
+ * native paths cannot be made *apHandle stays open.
+ * @return 0 on success, or a negated Win32 error code like the Dokan callbacks.
+ */
+int CopyUpOpenFile(LPCWSTR aFileName, HANDLE* apHandle, DWORD aAccessMode, DWORD aShareMode, DWORD aFlags, bool* apInWriteArea);
+/** Deletes aFileName from the union once its last handle is closed: removes it from the write root, where
+ * aInWriteArea says a file is and where a directory is looked up, and whites out what the read root has.
+ * @return 0 on success, or a negated Win32 error code like the Dokan callbacks.
+ */
+int DeleteUnionFile(LPCWSTR aFileName, bool aDirectory, bool aInWriteArea);
+
+/** Closes the front end handle of a file about to be moved, see MoveUnionFile.
+ * @return 0 on success, or a negated Win32 error code like the Dokan callbacks.
+ */
+typedef int (*UnionReleaseOpen)(void* apArgument);
+
+/** Renames aFileName to aNewFileName in the union: a write root file or directory is renamed there, a read
+ * root directory gets a redirect and a read root file is copied up under the new name, whiting out the old
+ * one. apRelease, unless NULL, is called with apArgument once the new name is checked, before anything moves.
+ * @return 0 on success, or a negated Win32 error code like the Dokan callbacks.
+ */
+int MoveUnionFile(LPCWSTR aFileName, LPCWSTR aNewFileName, BOOL aReplaceIfExisting, UnionReleaseOpen apRelease, void* apArgument);
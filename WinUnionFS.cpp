@@ -29,346 +29,147 @@
 using namespace	std;
 
 #include "dokan.h"
+#include "UFSTrace.h"
+#include "UnionEngine.h"
+#include "LoadGenerator.h"
+#include "Replay.h"
+#include "Benchmarks.h"
+#include "UFSIndex.h"
+#include "UFSImage.h"
+#include "WriteCoalescer.h"
+#include "FlushCoordinator.h"
+#include "MetadataLog.h"
+#include "DirectIo.h"
+#include "CacheTier.h"
+#include "Prefetcher.h"
+#include "ParallelProbe.h"
+#include "ChangeWatcher.h"
 
-bool gDebugMode	= false;
-
-class MutexLock
-{
-public:
-	MutexLock(HANDLE mutex)	: mHandle(mutex)
-	{
-		if (WaitForSingleObject(mutex, INFINITE) !=	WAIT_OBJECT_0)
-			throw 1;
-	}
-	~MutexLock() {
-		ReleaseMutex(mHandle);
-	}
-private:
-	HANDLE mHandle;
-};
-class FilePathSet :	public set<wstring>
-{
-public:
-	FilePathSet() :	set<wstring>() {
-		if (!(mhMutex =	CreateMutex(NULL,FALSE,NULL)))
-			throw 2;
-	}
-	~FilePathSet() {
-		CloseHandle(mhMutex);
-	}
-	HANDLE mhMutex;
-};
-FilePathSet	gDeletedFilesSet;
-
-#ifdef DEBUG
-#define DbgPrint(...) 
-#else
-static void	DbgPrint(LPCWSTR aFormat, ...)
-{
-	if (gDebugMode)	{
-		va_list	argp;
-		va_start(argp, aFormat);
-		vfwprintf(stderr, aFormat, argp);
-		va_end(argp);
-	}
-}
-#endif
-/* The length of buffers used to store file	paths */
-#define	MAX_PATHW 32768
-#define	MAX_PATHB (MAX_PATHW*sizeof(WCHAR))
 static WCHAR gReadRootDirectory[MAX_PATHW] = L"C:\\ReadRoot";
 static WCHAR gWriteRootDirectory[MAX_PATHW]	= L"C:\\WriteRoot";
 size_t gReadRootDirectoryLength, gWriteRootDirectoryLength;
-#define	AdvanceBytes(pointer, bytes) ((WCHAR*)((char*)pointer +	bytes))
-/**	This function concatenates aRootPath with aRelativePath	and	puts the result	in aDest.
- * It is assumed that aDest	is at least	MAX_PATHB bytes	long.
- * If the concatenated size	of string would	be too big for the minimum size	buffer to hold,	a NUL is put at	the	begining of	the	buffer
- * and true	is returned.
- * aRootPathLength and aRelativepathLength are in bytes	and	do not include the terminating NUL,	hence either aRootPath nor aRelativepath
- * need	to be NUL terminated.
- * aDest is	going to be	NUL	terminated.
- */
-static bool	PatchPath(LPWSTR aDest,	LPCWSTR	aRootPath, LPCWSTR aRelativePath, size_t aRootPathLength, size_t aRelativePathLength)
-{
-	if (aRelativePathLength	+ aRootPathLength >= MAX_PATHB)	{
-		DbgPrint(L"Path	too	long: %s.\n", aRelativePath);
-		/* Force an	error*/
-		*aDest = 0;
-		return true;
-	}
-	memcpy(aDest, aRootPath, aRootPathLength);
-	aDest =	AdvanceBytes(aDest,	aRootPathLength);
-	memcpy(aDest, aRelativePath, aRelativePathLength);
-	*(AdvanceBytes(aDest, aRelativePathLength))	= L'\0';
-	return false;
-}
 
-/**	Constants used by GetFiepath to	indicate where a file is mapped	from.
- */
-#define	UFS_FAILED -1
-#define	UFS_READ_AREA 0
-#define	UFS_WRITE_AREA FILE_ATTRIBUTE_ARCHIVE
-#define	UFS_OPENED_FOR_READING FILE_ATTRIBUTE_ENCRYPTED
-#define	UFS_OPENED_FOR_WRITING FILE_ATTRIBUTE_HIDDEN
-#define	UFS_SHARE_READ FILE_ATTRIBUTE_NOT_CONTENT_INDEXED
-#define	UFS_SHARE_WRITE	FILE_ATTRIBUTE_OFFLINE
-#define	UFS_SHARE_DELETE FILE_ATTRIBUTE_READONLY
-#define	UFS_UNSAVED_FLAGS (~(UFS_WRITE_AREA	| UFS_OPENED_FOR_READING |UFS_OPENED_FOR_WRITING | UFS_SHARE_READ |	UFS_SHARE_WRITE	| UFS_SHARE_DELETE))
-
-static inline bool CheckDeletedClean(const wstring&	aRelativePath)
-{
-	MutexLock(gDeletedFilesSet.mhMutex);
-	return gDeletedFilesSet.find(aRelativePath)	!= gDeletedFilesSet.end();
-}
-
-static inline void CleanFileName(wstring& aRelativePath) {
-	wstring::iterator end =	aRelativePath.end();
-	for	(wstring::iterator it =	aRelativePath.begin(); it != end; ++it)
-		if (*it	== L'/')
-			*it=L'\\';
-		else
-			*it	= towupper(*it);
-}
+/* Opens asking for none of these rights transfer no data, direct I/O leaves them alone. */
+#define UFS_DATA_ACCESS (GENERIC_READ | GENERIC_WRITE | FILE_READ_DATA | FILE_WRITE_DATA | FILE_APPEND_DATA)
 
-static inline bool CheckDeleted(wstring& aRelativePath)	{
-	CleanFileName(aRelativePath);
-	return CheckDeletedClean(aRelativePath);
-}
+/* Opens asking only for these rights change nothing, so they keep the information primed by listings. */
+#define UFS_READ_ONLY_ACCESS (GENERIC_READ | GENERIC_EXECUTE | FILE_READ_DATA | FILE_READ_ATTRIBUTES | FILE_READ_EA | \
+	FILE_EXECUTE | READ_CONTROL | SYNCHRONIZE)
 
-static inline bool CheckDeleted(LPCWSTR	aRelativePath) {
-	wstring	relativePath(aRelativePath);
-	return CheckDeleted(relativePath);
-}
-/* This	function returns the target	file path from a source	file path
- * @params:
- * aFilepath - Pointer to a	destination	buffer,	at least MAX_PATH bytes	long.
- * aFileName - Pointer to the source file path excluding the drive letter in the mounted file system.
- * N/A aReadOnly - true	if the file	is opened in ReadOnly mode
- * In case of an error a 0 length path is returned in the output buffer.
- * @return If the function is successful it	returns	UFS_READ_AREA or UFS_WRITE_AREA, depending on where	the	file is	found.
- * otherwise it	return s UFS_FAILED.
+/* Writes what the coalescer holds for the write root handle of apDokanFileInfo, before an operation that must
+ * see it.
+ * @return 0 or a negated Win32 error code.
  */
-static int GetFilePath(PWCHAR aFilepath, LPCWSTR aFileName/*, bool aReadOnly*/)
+static int FlushPendingWrites(PDOKAN_FILE_INFO apDokanFileInfo)
 {
-	size_t filenameLength =	wcslen(aFileName)*sizeof(WCHAR);
-	if(PatchPath(aFilepath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, filenameLength))
-		return UFS_FAILED;
-	if (GetFileAttributes(aFilepath) !=	INVALID_FILE_ATTRIBUTES)
-		return UFS_WRITE_AREA;
-	try	{
-		if (CheckDeleted(aFileName))
-			return UFS_WRITE_AREA;
-	} catch	(...) {
-		DbgPrint(L"Exception thrown	in UFSGetFilepath.");
-		return UFS_FAILED;
-	}
-	if (PatchPath(aFilepath, gReadRootDirectory, aFileName,	gReadRootDirectoryLength, filenameLength))
-		return UFS_FAILED;
-	return UFS_READ_AREA;
-}
-
-
-static inline ULONG64 MakeContext(HANDLE aHandle, bool aIsInWriteArea, DWORD aAccessMode, DWORD	aShareMode,	DWORD aFlags)
-{
-	aFlags &= UFS_UNSAVED_FLAGS;
-	if (aIsInWriteArea)
-		aFlags |= UFS_WRITE_AREA;
-	if (aAccessMode	& FILE_WRITE_DATA)
-		aFlags |= UFS_OPENED_FOR_WRITING;
-	if (aAccessMode	& FILE_READ_DATA)
-		aFlags |= UFS_OPENED_FOR_READING;
-	if (aShareMode & FILE_SHARE_DELETE)
-		aFlags |= UFS_SHARE_DELETE;
-	if (aShareMode & FILE_SHARE_READ)
-		aFlags |= UFS_SHARE_READ;
-	if (aShareMode & FILE_SHARE_WRITE)
-		aFlags |= UFS_SHARE_WRITE;
-	return ((((ULONG64)aFlags)<<32)|((ULONG64)aHandle));
+	if (!gWriteCoalescingEnabled || !IsInWriteArea(apDokanFileInfo->Context))
+		return 0;
+	return FlushCoalescedWrites(GetHandle(apDokanFileInfo->Context)) ? -(int)GetLastError() : 0;
 }
 
-static inline void GetCreateDataFromContext(ULONG64	context, DWORD*	apAccessMode, DWORD* apShareMode, DWORD* apFlags)
+/* Remembers the file identity of a new write root handle for the coalescer and direct writes, which keep
+ * their state per file. The handles they are not told about are asked for it. */
+static void RememberWriteHandle(HANDLE aHandle)
 {
-	*apAccessMode =	(context & (((ULONG64)UFS_OPENED_FOR_WRITING) << 32)) ?	GENERIC_WRITE :	0;
-	if (context	& (((ULONG64)UFS_OPENED_FOR_READING) <<	32))
-		*apAccessMode |= GENERIC_READ;
-	*apShareMode = (context	& (((ULONG64)UFS_SHARE_READ) <<	32)) ? FILE_SHARE_READ : 0;
-	if (context	& (((ULONG64)UFS_SHARE_DELETE) << 32))
-		*apShareMode |=	FILE_SHARE_DELETE;
-	if (context	& (((ULONG64)UFS_SHARE_WRITE) << 32))
-		*apShareMode |=	FILE_SHARE_WRITE;
-	*apFlags = (DWORD)((context	>> 32) & UFS_UNSAVED_FLAGS);
+	if ((gWriteCoalescingEnabled || gDirectIoEnabled) && aHandle != INVALID_HANDLE_VALUE)
+		RememberFileKey(aHandle);
 }
-#define	IsInWriteArea(context) (context	& (((ULONG64)UFS_WRITE_AREA)<<32))
-#define	GetHandle(context) ((HANDLE)(context & 0xFFFFFFFF))
 
-static bool	CreateParentDirectories(LPWSTR aFileNamePlusRoot, LPWSTR aFileNameEnd)
-{
-  DbgPrint(L"CreateParentDirectories called	with  %s, %s.\n", aFileNamePlusRoot, aFileNameEnd);
-	for	(LPWSTR	lpBackSlash=aFileNameEnd;lpBackSlash>aFileNamePlusRoot;	--lpBackSlash)
-		switch (*lpBackSlash) {
-			case L'\\':
-			case L'/':
-				*lpBackSlash=L'\0';
-				DbgPrint(L"Checking	%s.\n",	AdvanceBytes(aFileNamePlusRoot,	-gWriteRootDirectoryLength));
-				if (GetFileAttributes(AdvanceBytes(aFileNamePlusRoot, -gWriteRootDirectoryLength)) != INVALID_FILE_ATTRIBUTES) {
-					*lpBackSlash = L'\\';
-					return false;
-				}
-				if (CreateParentDirectories(aFileNamePlusRoot, lpBackSlash-2))
-					return true;
-				DbgPrint(L"Creating	%s.\n",	AdvanceBytes(aFileNamePlusRoot,	-gWriteRootDirectoryLength));
-				if (!CreateDirectory(AdvanceBytes(aFileNamePlusRoot, -gWriteRootDirectoryLength), NULL)) {
-					DbgPrint(L"Failed. Returning true.\n");
-					return true;
-				}
-				*lpBackSlash = L'\\';
-				DbgPrint(L"Succeeded returning false.\n");
-				return false;
-		}
-	DbgPrint(L"Ended returning false.\n");
-	return false;
-}
-/**	This function creates the parent directories for aFileName.
- * aFileName must be under gWriteRootPath
- * @return false on	success.
- */
-static bool	CreateParentDirectories(LPWSTR aFileName)
+/* Forgets it before the handle is closed. */
+static void ForgetWriteHandle(ULONG64 aContext)
 {
-	aFileName =	AdvanceBytes(aFileName,	gWriteRootDirectoryLength);
-	return CreateParentDirectories(aFileName, wcschr(aFileName,	L'\0')-2);
+	if ((gWriteCoalescingEnabled || gDirectIoEnabled) && IsInWriteArea(aContext))
+		ForgetFileKey(GetHandle(aContext));
 }
 
-/**	This function creates the parent directories for aWriteFilePath.
- * aFilenameLengthB	must be	the	length in bytes	of the path	to the file	or directory whose parents to create relative to
- * the root	of the virtual fs root.
- * @return false on	success.
- */
-static bool	CheckAndCreateParentDirectories(LPWSTR aWriteFilepath, LPWSTR aReadFilePath, size_t	aFilenameLengthB)
-{
-	DbgPrint(L"CheckAndCreateParentDirectories called with %s, %s, %d.\n\n", aWriteFilepath, aReadFilePath,	aFilenameLengthB);
-	LPWSTR lpRelPathStart =	AdvanceBytes(aReadFilePath,	gReadRootDirectoryLength);
-	for(LPWSTR lpRevBackslash =	AdvanceBytes(lpRelPathStart, aFilenameLengthB-2); lpRevBackslash >lpRelPathStart; --lpRevBackslash)
-		switch(*lpRevBackslash)	{
-			case L'\\':
-			case L'/':
-				*lpRevBackslash=L'\0';
-				DbgPrint(L"Checking	%s.\n",	aReadFilePath);
-				if (GetFileAttributes(aReadFilePath) ==	INVALID_FILE_ATTRIBUTES)
-					return false; //Shall Fail because of no parents.
-				DbgPrint(L"Checking	%s for deletion.\n", aReadFilePath);
-				try	{
-					if (CheckDeleted(AdvanceBytes(aReadFilePath, gReadRootDirectoryLength)))
-						return false;
-				} catch	(...) {
-					DbgPrint(L"Exception thrown	in CheckAndCreateParentDirectories.\n\n");
-					return true;
-				}
-				return CreateParentDirectories(aWriteFilepath);
-		}
-	DbgPrint(L"Returning false.\n\n");
-	return false;
-}
 static bool	gShouldSendStartNotification = true;
 static const WCHAR gStartNotification[]	= L"FS Started OK!\n";
 static int DOKAN_CALLBACK UFSCreateFile(LPCWSTR	aFileName, DWORD aAccessMode,DWORD aShareMode, DWORD aCreationDisposition, DWORD aFlagsAndAttributes, PDOKAN_FILE_INFO apDokanFileInfo)
 {
 	DbgPrint(L"CreateFile called with %s, %d, %d, %d, %d, %p.\n\n",	aFileName, aAccessMode,	aShareMode,	aCreationDisposition, aFlagsAndAttributes, apDokanFileInfo);
+	HotPathSample sample(UFS_HOT_CREATE_FILE, aFileName);
 	if (gShouldSendStartNotification) {
 		fwrite(gStartNotification, sizeof(gStartNotification)-sizeof(*gStartNotification),1, stdout);
 		fflush(stdout);
 		gShouldSendStartNotification = false;
 	}
+	if (IsMetadataPath(aFileName))
+		return -ERROR_ACCESS_DENIED;
+	// It may create, truncate or copy up the file.
+	UnionFileChange change(aCreationDisposition != OPEN_EXISTING || (aAccessMode & ~UFS_READ_ONLY_ACCESS));
 	WCHAR writeFilepath[MAX_PATHW],	readFilepath[MAX_PATHW], *filePath;
-	size_t filenameLengthB = wcslen(aFileName)*sizeof(WCHAR);
-	if(PatchPath(writeFilepath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, filenameLengthB)) {
-		DbgPrint(L"Path	too	long write.\n");
-		return -ERROR_NOT_SUPPORTED;
-	}
-	bool shouldUndelete	= false;
-	wstring	cleanedFilename;
-	DWORD fileAttributes = GetFileAttributes(writeFilepath);
-	if (fileAttributes != INVALID_FILE_ATTRIBUTES) {
-		filePath = writeFilepath;
-		if (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			aFlagsAndAttributes	|= FILE_FLAG_BACKUP_SEMANTICS;
-	} else {
-		if (PatchPath(readFilepath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, filenameLengthB)) {
-			DbgPrint(L"Path	too	long read.\n");
-			return -ERROR_NOT_SUPPORTED;
-		}
-		if ((fileAttributes	= GetFileAttributes(readFilepath)) != INVALID_FILE_ATTRIBUTES) {
-			if (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-				aFlagsAndAttributes	|= FILE_FLAG_BACKUP_SEMANTICS;
-			try	{
-				cleanedFilename	= aFileName;
-				CleanFileName(cleanedFilename);
-				if (CheckDeletedClean(cleanedFilename))	{
-					filePath = writeFilepath;
-					shouldUndelete = true;
-				} else
-					switch (aCreationDisposition) {
-						case TRUNCATE_EXISTING:
-							aCreationDisposition = CREATE_NEW;
-						case CREATE_ALWAYS:
-							if(CreateParentDirectories(writeFilepath)) {
-								DbgPrint(L"CreateParentDirectoriesFailed.\n");
-								return -ERROR_NOT_ENOUGH_QUOTA;
-							}
-							filePath = writeFilepath;
-							break;
-						default:
-							filePath = readFilepath;
-					}
-			} catch	(...) {
-				DbgPrint(L"Exception thrown	in UFSCreateFile.");
-				return -1;
-			}
-		} else {
-			switch (aCreationDisposition) {
-				case CREATE_ALWAYS:
-				case OPEN_ALWAYS:
-				case CREATE_NEW:
-				  if(CheckAndCreateParentDirectories(writeFilepath,	readFilepath, filenameLengthB))	{
-						DbgPrint(L"CheckAndCreateParentDirectoriesFailed.\n");
-						return -ERROR_NOT_ENOUGH_QUOTA;
-					}
-					filePath = writeFilepath;
-					break;
-				default:
-				  filePath = readFilepath;
-			}
-		}
-	}
+	DWORD fileAttributes;
+	wstring	undelete;
+	int returnValue = ResolveUnionOpen(aFileName, writeFilepath, readFilepath, &filePath, &fileAttributes, &aCreationDisposition,
+		&aFlagsAndAttributes, undelete);
+	if (returnValue)
+		return returnValue;
 	HANDLE handle;
 	DbgPrint(L"Creating	file at	%s.", filePath);
 //	  if (((aAccessMode	& GENERIC_WRITE) ==	GENERIC_WRITE) && (aCreationDisposition	== OPEN_EXISTING))
 //		aCreationDisposition = OPEN_ALWAYS;
 	if (aAccessMode & FILE_EXECUTE)
 		aAccessMode |= FILE_READ_DATA;
-	handle = CreateFile(
-		filePath,
-		aAccessMode,//GENERIC_READ|GENERIC_WRITE|GENERIC_EXECUTE,
-		aShareMode,
-		NULL, // security attribute
-		aCreationDisposition,
-		aFlagsAndAttributes,// |FILE_FLAG_NO_BUFFERING,
-		NULL); // template file	handle
+	UFSLayer* layer = filePath == writeFilepath ? gWriteLayer : gReadLayer;
+	/* Read-only opens of hot read root files are served from their local copy. */
+	bool cached = gCacheTierEnabled && filePath == readFilepath && fileAttributes != INVALID_FILE_ATTRIBUTES &&
+		!(fileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (aCreationDisposition == OPEN_EXISTING || aCreationDisposition == OPEN_ALWAYS) &&
+		!(aAccessMode & ~UFS_READ_ONLY_ACCESS) && (aAccessMode & UFS_DATA_ACCESS) &&
+		(handle = OpenFromCacheTier(readFilepath, aAccessMode, aShareMode, aFlagsAndAttributes)) != INVALID_HANDLE_VALUE;
+	bool directIo = !cached && gDirectIoEnabled && !(aFlagsAndAttributes & (FILE_FLAG_NO_BUFFERING | FILE_FLAG_BACKUP_SEMANTICS)) &&
+		(aAccessMode & UFS_DATA_ACCESS) && WantsDirectIo(aFileName, layer, filePath);
+	DWORD openAccessMode = aAccessMode;
+	if (directIo) {
+		aFlagsAndAttributes |= FILE_FLAG_NO_BUFFERING;
+		/* Unaligned writes read the partial sectors at their edges, see DirectWrite. */
+		if (aAccessMode & (GENERIC_WRITE | FILE_WRITE_DATA | FILE_APPEND_DATA))
+			openAccessMode |= FILE_READ_DATA;
+	}
+	if (!cached)
+		handle = layer->Open(
+			filePath,
+			openAccessMode,//GENERIC_READ|GENERIC_WRITE|GENERIC_EXECUTE,
+			aShareMode,
+			aCreationDisposition,
+			aFlagsAndAttributes);
+	if (handle == INVALID_HANDLE_VALUE && directIo && (GetLastError() == ERROR_INVALID_PARAMETER || GetLastError() == ERROR_NOT_SUPPORTED ||
+		(openAccessMode != aAccessMode && (GetLastError() == ERROR_ACCESS_DENIED || GetLastError() == ERROR_SHARING_VIOLATION)))) {
+		/* The file system does not do unbuffered handles, or the read right they need here is refused: stream
+		 * through the cache. */
+		aFlagsAndAttributes &= ~FILE_FLAG_NO_BUFFERING;
+		handle = layer->Open(filePath, aAccessMode, aShareMode, aCreationDisposition, aFlagsAndAttributes);
+	}
+	if (handle == INVALID_HANDLE_VALUE && GetLastError() == ERROR_SHARING_VIOLATION && gPrefetchEnabled &&
+		filePath == readFilepath && WaitForPrefetch(aFileName))
+		/* The prefetch of the file held it open, it closed it now. */
+		handle = layer->Open(filePath, aAccessMode, aShareMode, aCreationDisposition, aFlagsAndAttributes);
 
 	if (handle == INVALID_HANDLE_VALUE)	{
 		DWORD error	= GetLastError();
 		DbgPrint(L"CreateFile failed with error	code = %d\n", error);
 		return error * -1; // error	codes are negated value	of Windows System Error	codes
 	}
-	if (shouldUndelete)
+	/* The new handle sees what the other handles of the file wrote. Their errors stay theirs. */
+	if (filePath == writeFilepath) {
+		RememberWriteHandle(handle);
+		if (gWriteCoalescingEnabled)
+			FlushCoalescedWrites(handle);
+	}
+	if (!undelete.empty())
 		try	{
-			MutexLock(gDeletedFilesSet.mhMutex);
-			gDeletedFilesSet.erase(cleanedFilename);
+			UnmarkDeleted(undelete);
 		} catch	(...) {
 			DbgPrint(L"Exception2 thrown in	UFSCreateFile.\n");
-			CloseHandle(handle);
+			if (filePath == writeFilepath && (gWriteCoalescingEnabled || gDirectIoEnabled))
+				ForgetFileKey(handle);
+			(filePath == writeFilepath ? gWriteLayer : gReadLayer)->Close(handle);
 			return -1;
 		}
 	apDokanFileInfo->Context = MakeContext(handle, filePath	== writeFilepath, aAccessMode, aShareMode, aFlagsAndAttributes);
+	if (cached)
+		apDokanFileInfo->Context |= ((ULONG64)UFS_CACHE_TIER) << 32;
+	if (gPrefetchEnabled && !(fileAttributes != INVALID_FILE_ATTRIBUTES && (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)))
+		NotePrefetchOpen(aFileName);
 	if (fileAttributes != INVALID_FILE_ATTRIBUTES) {
 		if (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)
 			apDokanFileInfo->IsDirectory =TRUE;
@@ -386,13 +187,16 @@ static int DOKAN_CALLBACK UFSCreateFile(LPCWSTR	aFileName, DWORD aAccessMode,DWO
 static int DOKAN_CALLBACK UFSCreateDirectory(LPCWSTR aFileName,	PDOKAN_FILE_INFO apDokanFileInfo)
 {
 	DbgPrint(L"CreateDirectory called with:	%s.", aFileName);
+	if (IsMetadataPath(aFileName))
+		return -ERROR_ACCESS_DENIED;
+	UnionFileChange change;
 	WCHAR writeFilepath[MAX_PATHB],	readFilepath[MAX_PATHB];
 	size_t filenameLengthB = wcslen(aFileName)*sizeof(WCHAR);
-	if (PatchPath(writeFilepath, gWriteRootDirectory, aFileName, gWriteRootDirectoryLength,	filenameLengthB))
+	if (MakeWritePath(writeFilepath, aFileName, filenameLengthB))
 		return -ERROR_NOT_SUPPORTED;
-	if (PatchPath(readFilepath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, filenameLengthB))
+	if (MakeReadPath(readFilepath, aFileName, filenameLengthB))
 		return -ERROR_NOT_SUPPORTED;
-	if (GetFileAttributes(readFilepath)	!= INVALID_FILE_ATTRIBUTES)	{
+	if (GetReadRootAttributes(readFilepath)	!= INVALID_FILE_ATTRIBUTES)	{
 		try	{
 			if (!CheckDeleted(aFileName))
 				return -ERROR_ALREADY_EXISTS;
@@ -401,13 +205,18 @@ static int DOKAN_CALLBACK UFSCreateDirectory(LPCWSTR aFileName,	PDOKAN_FILE_INFO
 			return -1;
 		}
 	}
-	if (CheckAndCreateParentDirectories(writeFilepath, readFilepath, filenameLengthB))
+	if (CheckAndCreateParentDirectories(writeFilepath, filenameLengthB))
 		return -ERROR_NOT_ENOUGH_QUOTA;
-	if (!CreateDirectory(writeFilepath,	NULL)) {
+	if (!gWriteLayer->MakeDirectory(writeFilepath)) {
 		DWORD error	= GetLastError();
 		DbgPrint(L"\terror code	= %d\n\n", error);
 		return error * -1; // error	codes are negated value	of Windows System Error	codes
 	}
+	try	{
+		RememberWriteDirectory(aFileName);
+	} catch	(...) {
+		// The cache only saves probes, CreateParentDirectories finds the directory without it.
+	}
 	return 0;
 }
 
@@ -416,13 +225,16 @@ static int DOKAN_CALLBACK UFSOpenDirectory(LPCWSTR aFileName, PDOKAN_FILE_INFO a
 	WCHAR filePath[MAX_PATHW];
 	HANDLE handle;
 
+	if (IsMetadataPath(aFileName))
+		return -ERROR_ACCESS_DENIED;
 	int	area = GetFilePath(filePath, aFileName);
 	if (area ==	UFS_FAILED)
 		return -(LONG)GetLastError();
 
 	DbgPrint(L"OpenDirectory : %s\n", filePath);
 
-	DWORD attributes = GetFileAttributes(filePath);
+	UFSLayer* layer = area == UFS_WRITE_AREA ? gWriteLayer : gReadLayer;
+	DWORD attributes = layer->GetAttributes(filePath);
 	if (attributes == INVALID_FILE_ATTRIBUTES) {
 		DWORD error	= GetLastError();
 		DbgPrint(L"\terror code	= %d\n\n", error);
@@ -432,14 +244,12 @@ static int DOKAN_CALLBACK UFSOpenDirectory(LPCWSTR aFileName, PDOKAN_FILE_INFO a
 		return -1;
 	}
 
-	handle = CreateFile(
+	handle = layer->Open(
 		filePath,
 		0,
 		FILE_SHARE_READ|FILE_SHARE_WRITE,
-		NULL,
 		OPEN_EXISTING,
-		FILE_FLAG_BACKUP_SEMANTICS,
-		NULL);
+		FILE_FLAG_BACKUP_SEMANTICS);
 
 	if (handle == INVALID_HANDLE_VALUE)	{
 		DWORD error	= GetLastError();
@@ -460,7 +270,12 @@ static int DOKAN_CALLBACK UFSCloseFile(LPCWSTR aFileName, PDOKAN_FILE_INFO apDok
 	if (apDokanFileInfo->Context) {
 		DbgPrint(L"CloseFile: %s\n", aFileName);
 		DbgPrint(L"\terror : not cleanuped file\n\n");
-		CloseHandle(GetHandle(apDokanFileInfo->Context));
+		if (apDokanFileInfo->IsDirectory)
+			ForgetDirectoryListing(apDokanFileInfo->Context);
+		if (gWriteCoalescingEnabled && IsInWriteArea(apDokanFileInfo->Context))
+			ReleaseCoalescedWrites(GetHandle(apDokanFileInfo->Context));
+		ForgetWriteHandle(apDokanFileInfo->Context);
+		GetLayer(apDokanFileInfo->Context)->Close(GetHandle(apDokanFileInfo->Context));
 		apDokanFileInfo->Context = 0;
 	} else {
 		DbgPrint(L"Close: %s\n\n", aFileName);
@@ -471,72 +286,36 @@ static int DOKAN_CALLBACK UFSCloseFile(LPCWSTR aFileName, PDOKAN_FILE_INFO apDok
 
 static int DOKAN_CALLBACK UFSCleanup(LPCWSTR aFileName,	PDOKAN_FILE_INFO apDokanFileInfo)
 {
+	UnionFileChange change(apDokanFileInfo->DeleteOnClose || (apDokanFileInfo->Context & (((ULONG64)UFS_OPENED_FOR_WRITING) << 32)));
 	if (apDokanFileInfo->Context) {
 		DbgPrint(L"Cleanup:	%s\n\n", aFileName);
 		ULONG64	context	= apDokanFileInfo->Context;
 		HANDLE handle=GetHandle(context);
-		if (!CloseHandle(handle)) {
+		int writeError = 0;
+		if (apDokanFileInfo->IsDirectory)
+			ForgetDirectoryListing(context);
+		if (gWriteCoalescingEnabled && IsInWriteArea(context) && ReleaseCoalescedWrites(handle)) {
+			writeError = -(int)GetLastError();
+			DbgPrint(L"\tPending writes failed: %d.\n", -writeError);
+		}
+		LARGE_INTEGER fileSize;
+		// Give back what was reserved and not written.
+		if ((context & (((ULONG64)UFS_PREALLOCATED) << 32)) && GetFileSizeEx(handle, &fileSize))
+			SetWriteAllocation(handle, fileSize.QuadPart);
+		ForgetWriteHandle(context);
+		if (!GetLayer(context)->Close(handle)) {
 			DbgPrint(L"Failed to close Handle:%p.",	handle);
 		};
 		apDokanFileInfo->Context = 0;
 		if (apDokanFileInfo->DeleteOnClose)	{
 			DbgPrint(L"\tDeleteOnClose\n");
-			if (apDokanFileInfo->IsDirectory) {
-				DbgPrint(L"\tDeleteDirectory ");
-				WCHAR	filePath[MAX_PATHW];
-				size_t fileNameLengthB = wcslen(aFileName)*sizeof(WCHAR);
-				if (PatchPath(filePath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, fileNameLengthB))
-					return -1;
-				if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)	{
-					if (!RemoveDirectory(filePath))	{
-						int	error =	(int)GetLastError();
-						DbgPrint(L"\tFailed	to remove directory	%s.	Error: %d.\n", filePath, error);
-						return -error;
-					}
-					PatchPath(filePath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, fileNameLengthB);
-					if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
-						goto MarkDeleted;
-					return 0;
-				}
-				if (PatchPath(filePath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, fileNameLengthB))
-					return -ERROR_NOT_SUPPORTED;
-				if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
-					goto MarkDeleted;
-				return -ERROR_FILE_NOT_FOUND;
-			} else {
-				DbgPrint(L"\tDeleting File %s.", aFileName);
-				WCHAR filePath[MAX_PATHW];
-				size_t fileNameLengthB = wcslen(aFileName) * sizeof(WCHAR);
-				if (IsInWriteArea(context))	{
-					if (PatchPath(filePath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, fileNameLengthB))
-						return -ERROR_NOT_SUPPORTED;
-					if (!DeleteFile(filePath)) {
-						int	error =	(int)GetLastError();
-						DbgPrint(L"Failed to delete	file %s. Error %d.\n", filePath, error);
-						return -error;
-					}
-					PatchPath(filePath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, fileNameLengthB);
-					if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
-MarkDeleted:
-						try	{
-							MutexLock lock(gDeletedFilesSet.mhMutex);
-							wstring	filename(aFileName);
-							CleanFileName(filename);
-							gDeletedFilesSet.insert(filename);
-						} catch(...) {
-							return -1;
-						}
-					return 0;
-				} else {
-					if (PatchPath(filePath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, fileNameLengthB))
-						return -1;
-					if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
-						goto MarkDeleted;
-					return ERROR_NOT_FOUND;
-				}
-			}
+			int error = DeleteUnionFile(aFileName, apDokanFileInfo->IsDirectory != 0, IsInWriteArea(context) != 0);
+			if (error)
+				return error;
 		}
 
+		if (writeError)
+			return writeError;
 	} else {
 		DbgPrint(L"Cleanup:	%s\n\tinvalid handle\n\n", aFileName);
 		return -1;
@@ -549,6 +328,7 @@ static int DOKAN_CALLBACK UFSReadFile(LPCWSTR aFileName, LPVOID	aBuffer, DWORD a
 //	bool print;
 //	DbgPrint(L"ReadFile %s at %I64X, %d bytes.\n", aFileName, (__int64)aOffset, aBufferLength);
 	HANDLE	handle = GetHandle(apDokanFileInfo->Context);
+	UFSLayer* layer = GetLayer(apDokanFileInfo->Context);
 	bool closeOnReturn = false;
 	if (!handle	|| handle == INVALID_HANDLE_VALUE) {
 		DbgPrint(L"\tinvalid handle, cleanuped?\n");
@@ -557,27 +337,22 @@ static int DOKAN_CALLBACK UFSReadFile(LPCWSTR aFileName, LPVOID	aBuffer, DWORD a
 		if (returnValue)
 			return returnValue;
 		handle = GetHandle(dokanFileInfo.Context);
+		layer = GetLayer(dokanFileInfo.Context);
 		closeOnReturn =	true;
-	}
-	if (SetFilePointer(handle, (LONG)aOffset, ((LONG*)&aOffset)+1, FILE_BEGIN) == INVALID_SET_FILE_POINTER)	{
-		int	returnValue	= GetLastError();
-		if (NO_ERROR !=	returnValue) {
-			DbgPrint(L"\tseek error	%d,	offset = %I64d\n\n", returnValue, aOffset);
-			if (closeOnReturn)
-				CloseHandle(handle);
-			return -returnValue;
-		}
-	}
-	if (!ReadFile(handle, aBuffer, aBufferLength, aReadLength,NULL)) {
+	} else if (gWriteCoalescingEnabled && IsInWriteArea(apDokanFileInfo->Context) && FlushCoalescedRange(handle, aOffset, aBufferLength))
+		return -(int)GetLastError(); // Reads see the pending writes, whichever handle made them.
+	if (!closeOnReturn && gDirectIoEnabled && IsDirectIo(apDokanFileInfo->Context) ?
+		DirectRead(layer, handle, aBuffer, aBufferLength, aReadLength, aOffset) :
+		!layer->Read(handle, aBuffer, aBufferLength, aReadLength, aOffset)) {
 		LONG retVal =  (LONG)GetLastError();
 		DbgPrint(L"Returned error: %d\n", retVal);
 		if (closeOnReturn)
-			CloseHandle(handle);
+			layer->Close(handle);
 		return -retVal;
 	}
 //	DbgPrint(L"Read %d bytes, %08X %08X ...\n\n", *aReadLength, *((LONG*)aBuffer), *((LONG*)aBuffer + 1));
 	if (closeOnReturn)
-		CloseHandle(handle);
+		layer->Close(handle);
 	return 0;
 }
 
@@ -585,51 +360,57 @@ static int DOKAN_CALLBACK UFSWriteFile(LPCWSTR aFileName, LPCVOID aBuffer,DWORD
 {
 	HANDLE	handle = GetHandle(apDokanFileInfo->Context);
 	bool	closeOnReturn =	false;
+	UnionFileChange change(aFileName);
 	DbgPrint(L"WriteFile : %s, offset %I64d, length	%d\n", aFileName, aOffset, aNumberOfBytesToWrite);
 	// reopen the file
 	if (!handle	|| handle == INVALID_HANDLE_VALUE) {
 		DbgPrint(L"\tinvalid handle, cleanuped?\n");
-		WCHAR writeFilepath[MAX_PATHW],	readFilepath[MAX_PATHW];
-		size_t filenameLength=wcslen(aFileName)*sizeof(WCHAR);
-		if (PatchPath(writeFilepath, gWriteRootDirectory, aFileName, gWriteRootDirectoryLength,	filenameLength))
-			return -ERROR_NOT_SUPPORTED;
-		if (GetFileAttributes(writeFilepath) ==	INVALID_FILE_ATTRIBUTES) {
-			try	{
-				if (CheckDeleted(aFileName))
-					return -ERROR_FILE_NOT_FOUND;
-			} catch	(...) {
-				DbgPrint(L"Exception thrown	in UFSWriteFile.");
-				return -1;
-			}
-			if (PatchPath(readFilepath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, filenameLength))
-				return -ERROR_NOT_SUPPORTED;
-			if (GetFileAttributes(readFilepath)	== INVALID_FILE_ATTRIBUTES)
-				return -ERROR_FILE_NOT_FOUND;
-			if (!CopyFile(readFilepath,	writeFilepath, TRUE))
-				return -ERROR_NOT_ENOUGH_QUOTA;
-		}
-		handle = CreateFile(writeFilepath, GENERIC_WRITE, FILE_SHARE_WRITE,	NULL, OPEN_EXISTING, 0,	NULL);
+		WCHAR writeFilepath[MAX_PATHW];
+		int error = CopyUpUnionFile(aFileName, writeFilepath);
+		if (error)
+			return error;
+		handle = gWriteLayer->Open(writeFilepath, GENERIC_WRITE, FILE_SHARE_WRITE, OPEN_EXISTING, 0);
 		if (handle == INVALID_HANDLE_VALUE)
 			return -(LONG)GetLastError();
 		closeOnReturn =	true;
+		if (gWriteCoalescingEnabled)
+			FlushCoalescedWrites(handle);
 	} else if (!IsInWriteArea(apDokanFileInfo->Context)) {
-		WCHAR writeFilepath[MAX_PATHW],	readFilepath[MAX_PATHW];
-		size_t filenameLength=wcslen(aFileName)*sizeof(WCHAR);
-		if (PatchPath(writeFilepath, gWriteRootDirectory, aFileName, gWriteRootDirectoryLength,	filenameLength))
-			return -ERROR_NOT_SUPPORTED;
-		PatchPath(readFilepath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, filenameLength); // This must succeed since the file was open.
-		CloseHandle(handle);
 		DWORD accessMode, shareMode, flags;
 		GetCreateDataFromContext(apDokanFileInfo->Context,&accessMode, &shareMode, &flags);
-		if (!CopyFile(readFilepath,	writeFilepath, TRUE)) {
-			handle=CreateFile(readFilepath,	accessMode,	shareMode, NULL, OPEN_EXISTING,	flags, NULL);
-			apDokanFileInfo->Context = MakeContext(handle, false, accessMode, shareMode, flags);
-			return -ERROR_NOT_ENOUGH_QUOTA;
+		bool inWriteArea;
+		int error = CopyUpOpenFile(aFileName, &handle, accessMode, shareMode, flags, &inWriteArea);
+		apDokanFileInfo->Context = MakeContext(handle, inWriteArea, accessMode, shareMode, flags);
+		if (error)
+			return error;
+		RememberWriteHandle(handle);
+	}
+	if (gDirectIoEnabled && !closeOnReturn && IsDirectIo(apDokanFileInfo->Context)) {
+		/* Not coalesced, the pending writes of the other handles of the file must not land over it later. */
+		if (gWriteCoalescingEnabled && (apDokanFileInfo->WriteToEndOfFile ? FlushCoalescedWrites(handle) :
+			FlushCoalescedRange(handle, aOffset, aNumberOfBytesToWrite)))
+			return -(int)GetLastError();
+		if (DirectWrite(handle, aBuffer, aNumberOfBytesToWrite, aNumberOfBytesWritten, aOffset, apDokanFileInfo->WriteToEndOfFile != 0)) {
+			int	returnValue	= GetLastError();
+			DbgPrint(L"\tdirect write error = %u\n", returnValue);
+			return -returnValue;
 		}
-		handle = CreateFile(writeFilepath, accessMode, shareMode, NULL,	OPEN_EXISTING, flags, NULL);
-		apDokanFileInfo->Context = MakeContext(handle, true, accessMode, shareMode,	flags);
-		if (handle == INVALID_HANDLE_VALUE)
-			return -(LONG)GetLastError();
+		return 0;
+	}
+	if (gWriteCoalescingEnabled && !closeOnReturn) {
+		/* Writes through must be on the disk when they return, they are not kept. */
+		if (!apDokanFileInfo->WriteToEndOfFile && !IsWriteThrough(apDokanFileInfo->Context)) {
+			if (CoalescedWrite(handle, aBuffer, aNumberOfBytesToWrite, aOffset)) {
+				int	returnValue	= GetLastError();
+				DbgPrint(L"\tcoalesced write error = %u\n", returnValue);
+				return -returnValue;
+			}
+			*aNumberOfBytesWritten = aNumberOfBytesToWrite;
+			return 0;
+		}
+		// The end of the file is where the pending writes leave it, and they must not land over this write later.
+		if (apDokanFileInfo->WriteToEndOfFile ? FlushCoalescedWrites(handle) : FlushCoalescedRange(handle, aOffset, aNumberOfBytesToWrite))
+			return -(int)GetLastError();
 	}
 	if (apDokanFileInfo->WriteToEndOfFile) {
 		if (SetFilePointer(handle, 0, NULL,	FILE_END) == INVALID_SET_FILE_POINTER) {
@@ -641,7 +422,7 @@ static int DOKAN_CALLBACK UFSWriteFile(LPCWSTR aFileName, LPCVOID aBuffer,DWORD
 		if (NO_ERROR !=	returnValue) {
 			DbgPrint(L"\tseek error	%d,	offset = %I64d\n\n", returnValue, aOffset);
 			if (closeOnReturn)
-				CloseHandle(handle);
+				gWriteLayer->Close(handle);
 			return -returnValue;
 		}
 	}
@@ -655,7 +436,7 @@ static int DOKAN_CALLBACK UFSWriteFile(LPCWSTR aFileName, LPCVOID aBuffer,DWORD
 	}
 	// close the file when it is reopened
 	if (closeOnReturn)
-		CloseHandle(handle);
+		gWriteLayer->Close(handle);
 	return 0;
 }
 
@@ -664,13 +445,16 @@ static int DOKAN_CALLBACK UFSFlushFileBuffers(LPCWSTR aFileName, PDOKAN_FILE_INF
 	DbgPrint(L"FlushFileBuffers	called with: %s.", aFileName);
 	HANDLE handle =	GetHandle(apDokanFileInfo->Context);
 	DbgPrint(L"FlushFileBuffers	: %s\n", aFileName);
-	if (!handle	|| handle == INVALID_HANDLE_VALUE) {
-		DbgPrint(L"\tinvalid handle\n\n");
+	if (!handle	|| handle == INVALID_HANDLE_VALUE || !IsInWriteArea(apDokanFileInfo->Context)) {
+		DbgPrint(L"\tinvalid handle or read root file\n\n");
 		return 0;
 	}
-	if (FlushFileBuffers(handle))
+	int	returnValue	= FlushPendingWrites(apDokanFileInfo);
+	if (returnValue)
+		return returnValue;
+	if (gGroupFlushEnabled ? !GroupFlush(handle) : FlushFileBuffers(handle))
 		return 0;
-	int	returnValue	= GetLastError();
+	returnValue	= GetLastError();
 	DbgPrint(L"\tflush error code =	%d\n", returnValue);
 	return -returnValue;
 }
@@ -679,210 +463,70 @@ static int DOKAN_CALLBACK UFSFlushFileBuffers(LPCWSTR aFileName, PDOKAN_FILE_INF
 static int DOKAN_CALLBACK UFSGetFileInformation(LPCWSTR	aFileName, LPBY_HANDLE_FILE_INFORMATION	apHandleFileInformation, PDOKAN_FILE_INFO apDokanFileInfo)
 {
 	HANDLE handle =	GetHandle(apDokanFileInfo->Context);
-	bool closeOnReturn = false;
+	UFSLayer* handleLayer = GetLayer(apDokanFileInfo->Context);
 	DbgPrint(L"GetFileInfo : %s\n",	aFileName);
 	if (!handle	|| handle == INVALID_HANDLE_VALUE) {
-		DbgPrint(L"\tinvalid handle\n\n");
+		DbgPrint(L"\tinvalid handle, stat by name\n\n");
 		// If CreateDirectory returned FILE_ALREADY_EXISTS and 
-		// it is called	with FILE_OPEN_IF, that	handle must	be opened.
-		DOKAN_FILE_INFO	dokanFileInfo;
-		int	returnValue	= UFSCreateFile(aFileName, 0, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, &dokanFileInfo);
-		if (returnValue)
-			return returnValue;
-		handle = GetHandle(dokanFileInfo.Context);
-		closeOnReturn =	true;
+		// it is called	with FILE_OPEN_IF, there is no handle. Rather than opening one,
+		// ask the layer holding the file, once the sizes include the pending writes.
+		if (gWriteCoalescingEnabled)
+			FlushEveryCoalescedWrite();
+		return GetUnionFileInformation(aFileName, apHandleFileInformation);
 	}
-	if (!GetFileInformationByHandle(handle,apHandleFileInformation)) {
-		DbgPrint(L"\terror code	= %d\n", GetLastError());
-
-		// aFileName is	a root directory
-		// in this case, FindFirstFile can't get directory information
-		if (!aFileName[1]) {
-			DbgPrint(L"	 root dir\n");
-			apHandleFileInformation->dwFileAttributes =	GetFileAttributes(gReadRootDirectory);
-		} else {
-			WIN32_FIND_DATAW find;
-			ZeroMemory(&find, sizeof(WIN32_FIND_DATAW));
-			WCHAR filePath[MAX_PATHW];
-			if (GetFilePath(filePath, aFileName) ==	UFS_FAILED)
-				return -ERROR_NOT_SUPPORTED;
-			handle = FindFirstFile(filePath, &find);
-			if (handle == INVALID_HANDLE_VALUE)	{
-				DbgPrint(L"\tFindFirstFile error code =	%d\n\n", GetLastError());
-				return -1;
-			}
-			apHandleFileInformation->dwFileAttributes =	find.dwFileAttributes;
-			apHandleFileInformation->ftCreationTime	= find.ftCreationTime;
-			apHandleFileInformation->ftLastAccessTime =	find.ftLastAccessTime;
-			apHandleFileInformation->ftLastWriteTime = find.ftLastWriteTime;
-			apHandleFileInformation->nFileSizeHigh = find.nFileSizeHigh;
-			apHandleFileInformation->nFileSizeLow =	find.nFileSizeLow;
-			DbgPrint(L"\tFindFiles OK, file	size = %d\n", find.nFileSizeLow);
-			FindClose(handle);
-		}
-	} else {
-		DbgPrint(L"\tGetFileInformationByHandle	success, file size = %d\n",
-			apHandleFileInformation->nFileSizeLow);
+	int returnValue = FlushPendingWrites(apDokanFileInfo); // The size includes the pending writes.
+	if (returnValue)
+		return returnValue;
+	if (IsInCacheTier(apDokanFileInfo->Context)) {
+		/* Report the read root file, not its copy. */
+		WCHAR readFilepath[MAX_PATHW];
+		if (!MakeReadPath(readFilepath, aFileName, wcslen(aFileName)*sizeof(WCHAR)) &&
+			!GetCacheTierInformation(readFilepath, apHandleFileInformation))
+			return 0;
+		return GetUnionFileInformation(aFileName, apHandleFileInformation);
 	}
-	if (closeOnReturn)
-		CloseHandle(handle);
+	if (!handleLayer->GetInformation(handle,apHandleFileInformation)) {
+		// The root directory handle of some volumes cannot be queried.
+		DbgPrint(L"\terror code	= %d, stat by name\n", GetLastError());
+		return GetUnionFileInformation(aFileName, apHandleFileInformation);
+	}
+	DbgPrint(L"\tGetFileInformationByHandle	success, file size = %d\n",
+		apHandleFileInformation->nFileSizeLow);
 	return 0;
 }
 
-static int DOKAN_CALLBACK UFSFindFiles(LPCWSTR aFileName, PFillFindData	aFillFindData, PDOKAN_FILE_INFO	apDokanFileInfo)
+struct DokanFill
+{
+	PFillFindData mpFillFindData;
+	PDOKAN_FILE_INFO mpDokanFileInfo;
+};
+
+static void FillDokan(const WIN32_FIND_DATAW& aFindData, void* apArgument)
+{
+	DokanFill* fill = (DokanFill*)apArgument;
+	DbgPrint(L"\treturning %s.\n", aFindData.cFileName);
+	fill->mpFillFindData((PWIN32_FIND_DATAW)&aFindData, fill->mpDokanFileInfo);
+}
+
+// Lists the entries of aFileName matching aSearchPattern, the pattern is matched before the union merge.
+static int DOKAN_CALLBACK UFSFindFilesWithPattern(LPCWSTR aFileName, LPCWSTR aSearchPattern, PFillFindData aFillFindData, PDOKAN_FILE_INFO apDokanFileInfo)
 {
-	DbgPrint(L"FindFiles called	with %s, %p, %p.\n", aFileName,	aFillFindData, apDokanFileInfo);
+	DbgPrint(L"FindFiles called	with %s, %s, %p, %p.\n", aFileName, aSearchPattern ? aSearchPattern : L"*", aFillFindData, apDokanFileInfo);
+	HotPathSample sample(UFS_HOT_FIND_FILES, aFileName);
 	try	{
-		wstring	relativeFilePath(aFileName);
-		CleanFileName(relativeFilePath);
-		if (CheckDeletedClean(relativeFilePath)) {
-			DbgPrint(L"\tDirectory deleted.\n");
-			return -ERROR_FILE_NOT_FOUND;
-		}
-		WCHAR filePath1[MAX_PATHW +	2];	//This is done to avoid	buffer overruns.
-		size_t relativePathLen = relativeFilePath.size();
-		switch (aFileName[relativePathLen-1]) {
-			case L'\\':
-			case L'/':
-				break;
-			default:
-				relativeFilePath.append(1,L'\\');
-				++relativePathLen;
-		}
-		size_t relativePathLenB	=relativePathLen*sizeof(WCHAR);
-		if (PatchPath(filePath1,gReadRootDirectory,	relativeFilePath.c_str(), gReadRootDirectoryLength,	relativePathLenB)) {
-			DbgPrint(L"\tName too long read.\n");
-			return -ERROR_NOT_SUPPORTED;
-		}
-		LPWSTR p1 =	AdvanceBytes(filePath1,	gReadRootDirectoryLength + relativePathLenB);
-		*(p1++)	= L'*';
-		*p1	= L'\0';
-		WIN32_FIND_DATAW findData1;
-		HANDLE hFind1 =	FindFirstFile(filePath1, &findData1);
-		if (hFind1 == INVALID_HANDLE_VALUE)	{
-			DbgPrint(L"\tNot found in read.\n");
-			if (PatchPath(filePath1,gWriteRootDirectory, relativeFilePath.c_str(), gWriteRootDirectoryLength, relativePathLenB)) {
-				DbgPrint(L"\tName too long write.\n");
-				return -ERROR_NOT_SUPPORTED;
-			}
-			p1 = AdvanceBytes(filePath1, gWriteRootDirectoryLength + relativePathLenB);
-			*(p1++)	= L'*';
-			*p1	= L'\0';
-			hFind1 = FindFirstFile(filePath1, &findData1);
-			if (hFind1 == INVALID_HANDLE_VALUE)	{
-				int	returnValue	= GetLastError();
-				DbgPrint(L"\tinvalid file handle. Error	is %u\n\n",	returnValue);
-				return -returnValue;
-			}
-// Skip	do and ..
-//			DbgPrint(L"\twrite returning %s.\n", findData1.cFileName);
-//			aFillFindData(&findData1, apDokanFileInfo);//No	need to	check deleted files	here since it is about the writeFilePath
-			FindNextFile(hFind1, &findData1);
-			while (FindNextFile(hFind1,	&findData1)) {
-				DbgPrint(L"\twrite returning %s.\n", findData1.cFileName);
-				aFillFindData(&findData1, apDokanFileInfo);
-			}
-			int	returnValue	= GetLastError();
-			FindClose(hFind1);
-			if (returnValue	!= ERROR_NO_MORE_FILES)	{
-				DbgPrint(L"\tFindNextFile error. Error is %u\n\n", returnValue);
-				return -returnValue;
-			}
-			return 0;
-		}
-		FindNextFile(hFind1, &findData1);//	Skip .
-		FindNextFile(hFind1, &findData1); //Skip ..
-		WCHAR filePath2[MAX_PATHW +	2];	//This is done to avoid	buffer overruns.
-		if (PatchPath(filePath2,gWriteRootDirectory, relativeFilePath.c_str(), gWriteRootDirectoryLength, relativePathLenB)) {
-			DbgPrint(L"\tFilename too long write.\n");
-			return -1;
-		}
-		p1 = AdvanceBytes(filePath2, gWriteRootDirectoryLength + relativePathLenB);
-		*(p1++)	= L'*';
-		*p1	= L'\0';
-		WIN32_FIND_DATAW findData2;
-		HANDLE hFind2 =	FindFirstFile(filePath2, &findData2);
-		if (hFind2 == INVALID_HANDLE_VALUE)	{
-			DbgPrint(L"\tDir not found write.\n");
-DoReadDir:
-			if (CheckDeleted(relativeFilePath +	findData1.cFileName))
-				DbgPrint(L"\tFile Deleted %s.\n", findData1.cFileName);
-			else {
-				DbgPrint(L"\tread returning	%s.\n",	findData1.cFileName);
-				aFillFindData(&findData1, apDokanFileInfo);
-			}
-DoReadDirNext:
-			while (FindNextFile(hFind1,	&findData1))
-				if (CheckDeleted(relativeFilePath +	findData1.cFileName))
-					DbgPrint(L"\tFile Deleted %s.\n", findData1.cFileName);
-				else {
-					DbgPrint(L"\tread returning	%s.\n",	findData1.cFileName);
-					aFillFindData(&findData1, apDokanFileInfo);
-				}
-			int	returnValue	= GetLastError();
-			FindClose(hFind1);
-			if (returnValue	!= ERROR_NO_MORE_FILES)	{
-				DbgPrint(L"\tFindNextFile error. Error is %u\n\n", returnValue);
-				return -returnValue;
-			}
-			return 0;
-		}
-		FindNextFile(hFind2, &findData2); //Skip .
-		FindNextFile(hFind2, &findData2); //Skip ..
-		while(true)	{
-			int	compareResult =	_wcsicmp(findData1.cFileName, findData2.cFileName);
-			if(compareResult < 0) {
-				if (CheckDeleted(relativeFilePath +	findData1.cFileName))
-					DbgPrint(L"\tFile Deleted %s.\n", findData1.cFileName);
-				else {
-					DbgPrint(L"\tread returning	%s.\n",	findData1.cFileName);
-					aFillFindData(&findData1, apDokanFileInfo);
-				}
-Move1stDir:
-				if (!FindNextFile(hFind1, &findData1)) {
-					int	returnValue	= GetLastError();
-					FindClose(hFind1);
-					if (returnValue	!= ERROR_NO_MORE_FILES)	{
-						DbgPrint(L"\tFindNextFile error2. Error	is %u\n\n",	returnValue);
-						return -returnValue;
-					}
-					DbgPrint(L"\twrite returning %s.\n", findData2.cFileName);
-					aFillFindData(&findData2, apDokanFileInfo);	// No checks here as it	is the writePath
-					while (FindNextFile(hFind2,	&findData2)) {
-						DbgPrint(L"\twrite returning %s.\n", findData2.cFileName);
-						aFillFindData(&findData2, apDokanFileInfo);
-					}
-					returnValue	= GetLastError();
-					FindClose(hFind2);
-					if (returnValue	!= ERROR_NO_MORE_FILES)	{
-						DbgPrint(L"\tFindNextFile error3. Error	is %u\n\n",	returnValue);
-						return -returnValue;
-					}
-					return 0;
-				}
-			} else {
-				DbgPrint(L"\twrite returning %s.\n", findData2.cFileName);
-				aFillFindData(&findData2, apDokanFileInfo);
-				if (!FindNextFile(hFind2, &findData2)) {
-					int	returnValue	= GetLastError();
-					FindClose(hFind2);
-					if (returnValue	!= ERROR_NO_MORE_FILES)	{
-						DbgPrint(L"\tFindNextFile error4. Error	is %u\n\n",	returnValue);
-						return -returnValue;
-					}
-					if (compareResult)
-						goto DoReadDir;
-					goto DoReadDirNext;
-				}
-				if (!compareResult)
-					goto Move1stDir;
-			}
-		}
+		DokanFill fill = {aFillFindData, apDokanFileInfo};
+		/* Dokan keeps the whole listing and only asks again to restart the scan, so each call restarts the
+		 * listing of the open, which then holds a cursor past its end until UFSCleanup forgets it. */
+		return ListDirectory(apDokanFileInfo->Context, aFileName, aSearchPattern, true, MAXULONG, FillDokan, &fill);
 	} catch(...) {
 		DbgPrint(L"Error thrown	in UFSFindFiles.");
 		return -1;
 	}
-	return 0;
+}
+
+static int DOKAN_CALLBACK UFSFindFiles(LPCWSTR aFileName, PFillFindData	aFillFindData, PDOKAN_FILE_INFO	apDokanFileInfo)
+{
+	return UFSFindFilesWithPattern(aFileName, NULL, aFillFindData, apDokanFileInfo);
 }
 
 static int DOKAN_CALLBACK UFSDeleteFile(LPCWSTR	aFileName, PDOKAN_FILE_INFO	apDokanFileInfo)
@@ -890,13 +534,13 @@ static int DOKAN_CALLBACK UFSDeleteFile(LPCWSTR	aFileName, PDOKAN_FILE_INFO	apDo
   DbgPrint(L"DeleteFile	called with	%s.", aFileName);
 	WCHAR	filePath[MAX_PATHW];
 	size_t fileNameLengthB = wcslen(aFileName)*sizeof(WCHAR);
-	if (PatchPath(filePath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, fileNameLengthB))
+	if (MakeWritePath(filePath, aFileName, fileNameLengthB))
 		return -1;
-	if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
+	if (gWriteLayer->GetAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
 		return 0;
-	if (PatchPath(filePath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, fileNameLengthB))
+	if (MakeReadPath(filePath, aFileName, fileNameLengthB))
 		return -1;
-	if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
+	if (GetReadRootAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
 		return 0;
 	return -ERROR_FILE_NOT_FOUND;
 }
@@ -904,124 +548,39 @@ static int DOKAN_CALLBACK UFSDeleteFile(LPCWSTR	aFileName, PDOKAN_FILE_INFO	apDo
 static int DOKAN_CALLBACK UFSDeleteDirectory(LPCWSTR aFileName,	PDOKAN_FILE_INFO apDokanFileInfo)
 {
 	DbgPrint(L"DeleteDirectory called with %s.", aFileName);
-	WCHAR	filePath[MAX_PATHW];
-	size_t fileNameLengthB = wcslen(aFileName)*sizeof(WCHAR);
-	if (PatchPath(filePath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, fileNameLengthB))
+	try	{
+		return CheckDirectoryEmpty(aFileName);
+	} catch	(...) {
+		DbgPrint(L"Exception throwns in	DeleteDirectory.");
 		return -1;
-	if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)	{
-		WIN32_FIND_DATAW findData;
-		LPWSTR p = AdvanceBytes(filePath, gWriteRootDirectoryLength	+ fileNameLengthB);
-		*(p++) = L'\\';
-		*(p++) = L'*';
-		*p = L'\0';
-		HANDLE hFind =FindFirstFile(filePath, &findData);
-		if (hFind == INVALID_HANDLE_VALUE)
-			return -ERROR_FILE_INVALID;
-		do {
-			if (! wcscmp(findData.cFileName, L"."))
-				continue;
-			if (! wcscmp(findData.cFileName, L".."))
-				continue;
-			FindClose(hFind);
-			return ERROR_DIR_NOT_EMPTY;
-		} while	(FindNextFile(hFind, &findData));
-		FindClose(hFind);
-		if (PatchPath(filePath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, fileNameLengthB))
-			return -1;
-		if (GetFileAttributes(filePath)	== INVALID_FILE_ATTRIBUTES)
-			return 0;
-CheckReadFile:
-		try	{
-			wstring	cleanFilename(aFileName);
-			CleanFileName(cleanFilename);
-			if (CheckDeletedClean(cleanFilename))
-				return 0;
-			if (cleanFilename.at(fileNameLengthB/sizeof(WCHAR) - 1)	!= L'\\')
-				cleanFilename.append(1,	L'\\');
-			p =	AdvanceBytes(filePath, gReadRootDirectoryLength	+ fileNameLengthB);
-			*(p++) = L'\\';
-			*(p++) = L'*';
-			*p = L'\0';
-			HANDLE hFind =FindFirstFile(filePath, &findData);
-			if (hFind == INVALID_HANDLE_VALUE)
-				return -ERROR_FILE_INVALID;
-			do {
-				if (! wcscmp(findData.cFileName, L"."))
-					continue;
-				if (! wcscmp(findData.cFileName, L".."))
-					continue;
-				if (CheckDeleted(cleanFilename + findData.cFileName))
-					continue;
-				return ERROR_DIR_NOT_EMPTY;
-			} while	(FindNextFile(hFind, &findData));
-		} catch	(...) {
-			DbgPrint(L"Exception throwns in	DeleteDirectory.");
-			return -1;
-		}
-		return 0;
 	}
-	if (PatchPath(filePath,	gReadRootDirectory,	aFileName, gReadRootDirectoryLength, fileNameLengthB))
-		return -1;
-	if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)
-		goto CheckReadFile;
-	return -ERROR_FILE_NOT_FOUND;
 }
 
 
+
+/** Closes the handle of a file about to be moved, see MoveUnionFile. */
+static int ReleaseMovedFile(void* apArgument)
+{
+	PDOKAN_FILE_INFO apDokanFileInfo = (PDOKAN_FILE_INFO)apArgument;
+	if (!apDokanFileInfo->Context)
+		return 0;
+	/* The pending writes go to the file before it moves, not to whatever reuses the handle. */
+	if (gWriteCoalescingEnabled && IsInWriteArea(apDokanFileInfo->Context) &&
+		ReleaseCoalescedWrites(GetHandle(apDokanFileInfo->Context)))
+		return -(int)GetLastError();
+	ForgetWriteHandle(apDokanFileInfo->Context);
+	GetLayer(apDokanFileInfo->Context)->Close(GetHandle(apDokanFileInfo->Context));
+	apDokanFileInfo->Context = 0;
+	return 0;
+}
+
 static int DOKAN_CALLBACK UFSMoveFile(LPCWSTR aFileName, LPCWSTR aNewFileName, BOOL	aReplaceIfExisting,	PDOKAN_FILE_INFO apDokanFileInfo)
 {
-	WCHAR filePath[MAX_PATHW], newFilePath[MAX_PATHW];
 	DbgPrint(L"MoveFile	%s -> %s\n\n", aFileName, aNewFileName);
-	size_t relativeFilePathLengthB = wcslen(aFileName) * sizeof(WCHAR);
-	if (PatchPath(filePath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, relativeFilePathLengthB))
-		return -ERROR_NOT_SUPPORTED;
-	size_t relativeNewFilePathLengthB =	wcslen(aNewFileName) * sizeof(WCHAR);
-	if (PatchPath(newFilePath, gWriteRootDirectory,	aNewFileName, gWriteRootDirectoryLength, relativeNewFilePathLengthB))
-		return -ERROR_NOT_SUPPORTED;
-	wstring	cleanFilename(aFileName);
-	CleanFileName(cleanFilename);
-	BOOL status;
-	WCHAR readFilePath[MAX_PATHW];
-	if (PatchPath(readFilePath,	gReadRootDirectory,	aNewFileName, gReadRootDirectoryLength,	relativeNewFilePathLengthB))
-		return -ERROR_NOT_SUPPORTED;
-	if ((GetFileAttributes(readFilePath) !=	INVALID_FILE_ATTRIBUTES) &&	!CheckDeleted(aFileName) &&	!aReplaceIfExisting)
-		return -ERROR_FILE_EXISTS;
-	if (CheckAndCreateParentDirectories(newFilePath, readFilePath, relativeNewFilePathLengthB))
-		return -ERROR_PATH_NOT_FOUND;
-	if (apDokanFileInfo->Context) {
-	  CloseHandle(GetHandle(apDokanFileInfo->Context));
-	  apDokanFileInfo->Context = 0;
-	}
-	if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)	{
-	  DbgPrint(L"MoveFile(Ex) called with %s, %s\n", filePath, newFilePath);
-		status = aReplaceIfExisting	? MoveFileEx(filePath, newFilePath,	MOVEFILE_REPLACE_EXISTING) : MoveFile(filePath,	newFilePath);
-		if ( PatchPath(filePath, gReadRootDirectory, aFileName,	gReadRootDirectoryLength, relativeFilePathLengthB))
-			return -ERROR_NOT_SUPPORTED;
-	} else {
-		wstring	cleanNewFilename(aNewFileName);
-		CleanFileName(cleanNewFilename);
-		if (!cleanFilename.compare(cleanNewFilename))
-			return -ERROR_CANNOT_COPY;
-		if ( PatchPath(filePath, gReadRootDirectory, aFileName,	gReadRootDirectoryLength, relativeFilePathLengthB))
-			return -ERROR_NOT_SUPPORTED;
-		DbgPrint(L"CopyFile	called with	%s,	%s\n", filePath, newFilePath);
-		status = CopyFile(filePath,	newFilePath, ! aReplaceIfExisting);
-	}
-	if (status == FALSE) {
-		DWORD error	= GetLastError();
-		DbgPrint(L"\tMoveFile failed status	= %d, code = %d\n",	status,	error);
-		return -(int)error;
-	}
-	if (GetFileAttributes(filePath)	!= INVALID_FILE_ATTRIBUTES)	{
-		try	{
-			MutexLock(gDeletedFilesSet.mhMutex);
-			gDeletedFilesSet.insert(cleanFilename);
-		} catch	(...) {
-			DbgPrint(L"Exception thrown	in UFSMoveFile.");
-			return -1;
-		}
-	}
-	return 0;
+	if (IsMetadataPath(aFileName) || IsMetadataPath(aNewFileName))
+		return -ERROR_ACCESS_DENIED;
+	UnionFileChange change;
+	return MoveUnionFile(aFileName, aNewFileName, aReplaceIfExisting, ReleaseMovedFile, apDokanFileInfo);
 }
 
 static int DOKAN_CALLBACK UFSLockFile(LPCWSTR aFileName, LONGLONG aByteOffset, LONGLONG	aLength, PDOKAN_FILE_INFO apDokanFileInfo)
@@ -1032,7 +591,7 @@ static int DOKAN_CALLBACK UFSLockFile(LPCWSTR aFileName, LONGLONG aByteOffset, L
 		DbgPrint(L"\tinvalid handle\n\n");
 		return -1;
 	}
-	if (LockFile(handle, *((DWORD*)&aByteOffset), *(((DWORD*)&aByteOffset)+1), *((DWORD*)&aLength),	*(((DWORD*)&aLength)+1))) {
+	if (GetLayer(apDokanFileInfo->Context)->Lock(handle, aByteOffset, aLength)) {
 		DbgPrint(L"\tsuccess\n\n");
 		return 0;
 	} else {
@@ -1045,10 +604,14 @@ static int DOKAN_CALLBACK UFSSetEndOfFile(LPCWSTR aFileName, LONGLONG aByteOffse
 {
 	HANDLE handle;
 	handle = GetHandle(apDokanFileInfo->Context);
+	UnionFileChange change;
 	if (!handle	|| handle == INVALID_HANDLE_VALUE) {
 		DbgPrint(L"\tinvalid handle\n\n");
 		return -1;
 	}
+	int returnValue = FlushPendingWrites(apDokanFileInfo);
+	if (returnValue)
+		return returnValue;
 	if (!SetFilePointerEx(handle, *((LARGE_INTEGER*)&aByteOffset), NULL, FILE_BEGIN)) {
 		DbgPrint(L"\tSetFilePointer	error: %d, offset =	%I64d\n\n",
 				GetLastError(),	aByteOffset);
@@ -1067,10 +630,14 @@ static int DOKAN_CALLBACK UFSSetAllocationSize(LPCWSTR aFileName, LONGLONG aAllo
 	HANDLE			handle;
 	LARGE_INTEGER	fileSize;
 	handle = GetHandle(apDokanFileInfo->Context);
+	UnionFileChange change;
 	if (!handle	|| handle == INVALID_HANDLE_VALUE) {
 		DbgPrint(L"\tinvalid handle\n\n");
 		return -1;
 	}
+	int returnValue = FlushPendingWrites(apDokanFileInfo);
+	if (returnValue)
+		return returnValue;
 	if (GetFileSizeEx(handle, &fileSize)) {
 		if (aAllocSize < fileSize.QuadPart)	{
 			fileSize.QuadPart =	aAllocSize;
@@ -1084,6 +651,13 @@ static int DOKAN_CALLBACK UFSSetAllocationSize(LPCWSTR aFileName, LONGLONG aAllo
 				DbgPrint(L"\terror code	= %d\n\n", error);
 				return error * -1;
 			}
+		} else if (aAllocSize > fileSize.QuadPart && IsInWriteArea(apDokanFileInfo->Context)) {
+			// Reserve the announced size so that the writes to come find contiguous space, Cleanup trims it.
+			// Only a hint: the file has its size either way, and the writes allocate what they need.
+			if (SetWriteAllocation(handle, aAllocSize))
+				DbgPrint(L"\tSetAllocationSize: reservation error: %d, ignored\n\n", GetLastError());
+			else
+				apDokanFileInfo->Context |= ((ULONG64)UFS_PREALLOCATED) << 32;
 		}
 	} else {
 		DWORD error	= GetLastError();
@@ -1098,19 +672,20 @@ static int DOKAN_CALLBACK UFSSetFileAttributes(LPCWSTR aFileName, DWORD	aFileAtt
 {
 	WCHAR	filePath[MAX_PATHW];
 	size_t relativeFilepathLengthB = wcslen(aFileName) * sizeof(WCHAR);
-	if (PatchPath(filePath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, relativeFilepathLengthB))
+	UnionFileChange change;
+	if (MakeWritePath(filePath, aFileName, relativeFilepathLengthB))
 		return -ERROR_NOT_SUPPORTED;
-	if (GetFileAttributes(filePath)	== INVALID_FILE_ATTRIBUTES)	{
+	if (gWriteLayer->GetAttributes(filePath)	== INVALID_FILE_ATTRIBUTES)	{
 		WCHAR filePath2[MAX_PATHW];
-		if (PatchPath(filePath2, gReadRootDirectory, aFileName,	gReadRootDirectoryLength, relativeFilepathLengthB))
+		if (MakeReadPath(filePath2, aFileName, relativeFilepathLengthB))
 			return -ERROR_NOT_SUPPORTED;
-		if (GetFileAttributes(filePath2) ==	aFileAttributes)
+		if (GetReadRootAttributes(filePath2) ==	aFileAttributes)
 			return 0;
-		if (!CopyFile(filePath2, filePath, TRUE))
+		if (!CopyUp(aFileName, filePath2, filePath, TRUE))
 			return -(LONG)GetLastError();
 	}
 	DbgPrint(L"SetFileAttributes %s\n",	filePath);
-	if (!SetFileAttributes(filePath, aFileAttributes)) {
+	if (!gWriteLayer->SetAttributes(filePath, aFileAttributes)) {
 		DWORD error	= GetLastError();
 		DbgPrint(L"\terror code	= %d\n\n", error);
 		return error * -1;
@@ -1121,24 +696,20 @@ static int DOKAN_CALLBACK UFSSetFileAttributes(LPCWSTR aFileName, DWORD	aFileAtt
 static int DOKAN_CALLBACK UFSSetFileTime(LPCWSTR aFileName,	CONST FILETIME*	aCreationTime, CONST FILETIME* aLastAccessTime,	CONST FILETIME*	aLastWriteTime,	PDOKAN_FILE_INFO apDokanFileInfo)
 {
 	HANDLE handle =	GetHandle(apDokanFileInfo->Context);
+	UnionFileChange change;
+	// A pending write would move the last write time past the one set here.
+	int returnValue = FlushPendingWrites(apDokanFileInfo);
+	if (returnValue)
+		return returnValue;
 	if (!IsInWriteArea(apDokanFileInfo->Context)) {
-		WCHAR	filePath[MAX_PATHW];
-		size_t relativeFilepathLengthB = wcslen(aFileName) * sizeof(WCHAR);
-		if (PatchPath(filePath,	gWriteRootDirectory, aFileName,	gWriteRootDirectoryLength, relativeFilepathLengthB))
-			return -ERROR_NOT_SUPPORTED;
-		WCHAR filePath2[MAX_PATHW];
-		if (PatchPath(filePath2, gReadRootDirectory, aFileName,	gReadRootDirectoryLength, relativeFilepathLengthB))
-			return -ERROR_NOT_SUPPORTED;
-		CloseHandle(handle);
 		DWORD accessMode, shareMode, flags;
 		GetCreateDataFromContext(apDokanFileInfo->Context, &accessMode,	&shareMode,	&flags);
-		if (!CopyFile(filePath2, filePath, TRUE)) {
-			handle = CreateFile(filePath2, accessMode, shareMode, NULL,	OPEN_EXISTING, flags, NULL);
-			apDokanFileInfo->Context = MakeContext(handle, false, accessMode, shareMode, flags);
-			return -(LONG)GetLastError();
-		}
-		handle = CreateFile(filePath, accessMode, shareMode, NULL, OPEN_EXISTING, flags, NULL);
-		apDokanFileInfo->Context = MakeContext(handle, true, accessMode, shareMode,	flags);
+		bool inWriteArea;
+		returnValue = CopyUpOpenFile(aFileName, &handle, accessMode, shareMode, flags, &inWriteArea);
+		apDokanFileInfo->Context = MakeContext(handle, inWriteArea, accessMode, shareMode, flags);
+		if (returnValue)
+			return returnValue;
+		RememberWriteHandle(handle);
 	}
 	if (!handle	|| handle == INVALID_HANDLE_VALUE) {
 		DbgPrint(L"\tinvalid handle\n\n");
@@ -1161,7 +732,7 @@ static int DOKAN_CALLBACK UFSUnlockFile(LPCWSTR	aFileName, LONGLONG	aByteOffset,
 		DbgPrint(L"\tinvalid handle\n\n");
 		return -1;
 	}
-	if (UnlockFile(handle, *((DWORD*)&aByteOffset),	*(((DWORD*)&aByteOffset)+1), *((DWORD*)&aLength), *(((DWORD*)&aLength)+1)))	{
+	if (GetLayer(apDokanFileInfo->Context)->Unlock(handle, aByteOffset, aLength))	{
 		DbgPrint(L"\tsuccess\n\n");
 		return 0;
 	} else {
@@ -1208,20 +779,213 @@ static int DOKAN_CALLBACK UFSUnmount(PDOKAN_FILE_INFO apDokanFileInfo)
 	return 0;
 }
 
+/* Callback wrappers installed instead of the UFS callbacks when tracing is enabled with /x.
+ */
+static int DOKAN_CALLBACK TracedCreateFile(LPCWSTR aFileName, DWORD aAccessMode, DWORD aShareMode, DWORD aCreationDisposition, DWORD aFlagsAndAttributes, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_CREATE_FILE, apDokanFileInfo, aFileName, aFlagsAndAttributes, aAccessMode, (aShareMode << 16) | aCreationDisposition);
+	return trace.End(UFSCreateFile(aFileName, aAccessMode, aShareMode, aCreationDisposition, aFlagsAndAttributes, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedOpenDirectory(LPCWSTR aFileName, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_OPEN_DIRECTORY, apDokanFileInfo, aFileName);
+	return trace.End(UFSOpenDirectory(aFileName, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedCreateDirectory(LPCWSTR aFileName, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_CREATE_DIRECTORY, apDokanFileInfo, aFileName);
+	return trace.End(UFSCreateDirectory(aFileName, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedCleanup(LPCWSTR aFileName, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_CLEANUP, apDokanFileInfo, aFileName);
+	return trace.End(UFSCleanup(aFileName, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedCloseFile(LPCWSTR aFileName, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_CLOSE_FILE, apDokanFileInfo, aFileName);
+	return trace.End(UFSCloseFile(aFileName, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedReadFile(LPCWSTR aFileName, LPVOID aBuffer, DWORD aBufferLength, LPDWORD aReadLength, LONGLONG aOffset, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_READ_FILE, apDokanFileInfo, aFileName, aOffset, aBufferLength);
+	int status = UFSReadFile(aFileName, aBuffer, aBufferLength, aReadLength, aOffset, apDokanFileInfo);
+	trace.SetArg2(*aReadLength);
+	return trace.End(status);
+}
+
+static int DOKAN_CALLBACK TracedWriteFile(LPCWSTR aFileName, LPCVOID aBuffer, DWORD aNumberOfBytesToWrite, LPDWORD aNumberOfBytesWritten, LONGLONG aOffset, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_WRITE_FILE, apDokanFileInfo, aFileName, aOffset, aNumberOfBytesToWrite);
+	int status = UFSWriteFile(aFileName, aBuffer, aNumberOfBytesToWrite, aNumberOfBytesWritten, aOffset, apDokanFileInfo);
+	trace.SetArg2(*aNumberOfBytesWritten);
+	return trace.End(status);
+}
+
+static int DOKAN_CALLBACK TracedFlushFileBuffers(LPCWSTR aFileName, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_FLUSH_FILE_BUFFERS, apDokanFileInfo, aFileName);
+	return trace.End(UFSFlushFileBuffers(aFileName, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedGetFileInformation(LPCWSTR aFileName, LPBY_HANDLE_FILE_INFORMATION apHandleFileInformation, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_GET_FILE_INFORMATION, apDokanFileInfo, aFileName);
+	return trace.End(UFSGetFileInformation(aFileName, apHandleFileInformation, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedFindFiles(LPCWSTR aFileName, PFillFindData aFillFindData, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_FIND_FILES, apDokanFileInfo, aFileName);
+	return trace.End(UFSFindFiles(aFileName, aFillFindData, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedFindFilesWithPattern(LPCWSTR aFileName, LPCWSTR aSearchPattern, PFillFindData aFillFindData, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_FIND_FILES, apDokanFileInfo, aFileName);
+	if (aSearchPattern)
+		trace.SetSecondPath(aSearchPattern);
+	return trace.End(UFSFindFilesWithPattern(aFileName, aSearchPattern, aFillFindData, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedSetFileAttributes(LPCWSTR aFileName, DWORD aFileAttributes, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_SET_FILE_ATTRIBUTES, apDokanFileInfo, aFileName, aFileAttributes);
+	return trace.End(UFSSetFileAttributes(aFileName, aFileAttributes, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedSetFileTime(LPCWSTR aFileName, CONST FILETIME* aCreationTime, CONST FILETIME* aLastAccessTime, CONST FILETIME* aLastWriteTime, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_SET_FILE_TIME, apDokanFileInfo, aFileName);
+	return trace.End(UFSSetFileTime(aFileName, aCreationTime, aLastAccessTime, aLastWriteTime, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedDeleteFile(LPCWSTR aFileName, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_DELETE_FILE, apDokanFileInfo, aFileName);
+	return trace.End(UFSDeleteFile(aFileName, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedDeleteDirectory(LPCWSTR aFileName, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_DELETE_DIRECTORY, apDokanFileInfo, aFileName);
+	return trace.End(UFSDeleteDirectory(aFileName, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedMoveFile(LPCWSTR aFileName, LPCWSTR aNewFileName, BOOL aReplaceIfExisting, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_MOVE_FILE, apDokanFileInfo, aFileName, 0, aReplaceIfExisting);
+	trace.SetSecondPath(aNewFileName);
+	return trace.End(UFSMoveFile(aFileName, aNewFileName, aReplaceIfExisting, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedSetEndOfFile(LPCWSTR aFileName, LONGLONG aByteOffset, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_SET_END_OF_FILE, apDokanFileInfo, aFileName, aByteOffset);
+	return trace.End(UFSSetEndOfFile(aFileName, aByteOffset, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedSetAllocationSize(LPCWSTR aFileName, LONGLONG aAllocSize, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_SET_ALLOCATION_SIZE, apDokanFileInfo, aFileName, aAllocSize);
+	return trace.End(UFSSetAllocationSize(aFileName, aAllocSize, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedLockFile(LPCWSTR aFileName, LONGLONG aByteOffset, LONGLONG aLength, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_LOCK_FILE, apDokanFileInfo, aFileName, aByteOffset, (ULONG)aLength);
+	return trace.End(UFSLockFile(aFileName, aByteOffset, aLength, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedUnlockFile(LPCWSTR aFileName, LONGLONG aByteOffset, LONGLONG aLength, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_UNLOCK_FILE, apDokanFileInfo, aFileName, aByteOffset, (ULONG)aLength);
+	return trace.End(UFSUnlockFile(aFileName, aByteOffset, aLength, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedGetDiskFreeSpace(PULONGLONG aFreeBytesAvailable, PULONGLONG aTotalNumberOfBytes, PULONGLONG aTotalNumberOfFreeBytes, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_GET_DISK_FREE_SPACE, apDokanFileInfo, NULL);
+	return trace.End(UFSGetDiskFreeSpace(aFreeBytesAvailable, aTotalNumberOfBytes, aTotalNumberOfFreeBytes, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedGetVolumeInformation(LPWSTR aVolumeNameBuffer, DWORD aVolumeNameSize, LPDWORD aVolumeSerialNumber, LPDWORD aMaximumComponentLength, 
+										LPDWORD aFileSystemFlags, LPWSTR aFileSystemNameBuffer, DWORD aFileSystemNameSize, PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_GET_VOLUME_INFORMATION, apDokanFileInfo, NULL);
+	return trace.End(UFSGetVolumeInformation(aVolumeNameBuffer, aVolumeNameSize, aVolumeSerialNumber, aMaximumComponentLength,
+		aFileSystemFlags, aFileSystemNameBuffer, aFileSystemNameSize, apDokanFileInfo));
+}
+
+static int DOKAN_CALLBACK TracedUnmount(PDOKAN_FILE_INFO apDokanFileInfo)
+{
+	UFSTraceScope trace(UFS_TRACE_UNMOUNT, apDokanFileInfo, NULL);
+	return trace.End(UFSUnmount(apDokanFileInfo));
+}
+
 int	wmain(int argc,	LPWSTR argv[])
 {
 	int	status;
+	LPCWSTR traceFile = NULL;
+	bool recordAll = false;
+	LPCWSTR replayFile = NULL;
+	LPCWSTR indexFile = NULL;
+	bool replayAsFastAsPossible = false;
+	LPCWSTR benchmarkFilter = NULL;
+	LPCWSTR benchmarkBaseline = NULL;
+	ULONG slowCallMicroseconds = 100000;
+	ULONG hotPathReportSeconds = 0;
+	LPCWSTR loadMix = NULL;
+	ULONG loadSeconds = 10;
+	LPCWSTR directPatterns = NULL;
+	ULONG directMegabytes = 0;
+	LPCWSTR cacheDirectory = NULL;
+	ULONG cachePromoteOpens = 0;
+	ULONG cacheMegabytes = 0;
+	ULONG prefetchMegabytes = 0;
+	bool parallelProbes = false;
+	bool watchReadRoot = false;
+	bool coalesceWrites = false;
+	bool groupFlushes = false;
+	int	exitCode = 0;
 	PDOKAN_OPERATIONS dokanOperations =	(PDOKAN_OPERATIONS)malloc(sizeof(DOKAN_OPERATIONS));
 	PDOKAN_OPTIONS dokanOptions	= (PDOKAN_OPTIONS)malloc(sizeof(DOKAN_OPTIONS));
 
 	if (argc < 7) {
 printHelp:
 		fwprintf(stderr, L"WinUnionFS /r <ReadRoot>	/w <WriteRoot> /l <driveletter>	[<other	options>]\n"
-			L"	/r ReadRootDirectory (ex. /r c:\\read)\n"
+			L"	/r ReadRootDirectory (ex. /r c:\\read), or an image file built by UFSTool image\n"
 			L"	/w WriteRootDirectory (ex. /r d:\\)\n"
+			L"	/i IndexFile (answer read root probes and listings from an index built by UFSTool index)\n"
 			L"	/l DriveLetter (ex.	/l m)\n"
 			L"	/t ThreadCount (ex.	/t 5)\n"
 			L"	/d (enable debug output)\n"
+			L"	/x TraceFile (record calls, save them on errors, slow calls and unmount)\n"
+			L"	/k SlowCallMicroseconds (calls slower than this are saved by /x, default 100000)\n"
+			L"	/y RecordFile (record every call for replay with /e)\n"
+			L"	/e ReplayFile (do not mount, replay the calls recorded with /y)\n"
+			L"	/a (replay as fast as possible instead of at the recorded pace)\n"
+			L"	/b BenchmarkFilter (do not mount, run the micro-benchmarks whose names contain the filter, * for all)\n"
+			L"	/c BaselineFile (compare /b with the saved output of an earlier run)\n"
+			L"	/p ReportSeconds (print the hottest paths and directories every ReportSeconds)\n"
+			L"	/g LoadMix (do not mount, run ThreadCount load threads calling the callbacks,\n"
+			L"		ex. /g open:60,seq:5,rand:10,scan:15,rmrf:5,copyup:5)\n"
+			L"	/s LoadSeconds (how long /g runs, default 10)\n"
+			L"	/u Patterns (stream the files matching one of the patterns without the system cache, ex. /u *.iso;*.vhd)\n"
+			L"	/v Megabytes (stream the files at least this large without the system cache)\n"
+			L"	/h CacheDirectory (copy the read root files opened often into this local directory and read them there)\n"
+			L"	/o Opens (read-only opens promoting a read root file to /h, default 3)\n"
+			L"	/q Megabytes (size limit of /h, default 1024, the least recently read copies are evicted)\n"
+			L"	/z MegabytesPerSecond (learn which files follow which, prefetch them reading at most this much)\n"
+			L"	/2 (probe the write and read roots at once when opening, for remote roots)\n"
+			L"	/3 (watch the read root for changes made while mounted and drop what the caches hold of them)\n"
+			L"	/f (coalesce small writes in per file buffers)\n"
+			L"	/j (group concurrent flushes into one, print their batching and latencies on exit)\n"
 			L"	/n (use	network	drive)\n"
 			L"	/m (use	removable drive)\n", *argv);
 		return 2;
@@ -1273,6 +1037,103 @@ printHelp:
 		case 'D':
 			gDebugMode = true;
 			break;
+		case 'X':
+			if(!--argc)	goto printHelp;
+			++argv;
+			traceFile = *argv;
+			recordAll = false;
+			break;
+		case 'Y':
+			if(!--argc)	goto printHelp;
+			++argv;
+			traceFile = *argv;
+			recordAll = true;
+			break;
+		case 'E':
+			if(!--argc)	goto printHelp;
+			++argv;
+			replayFile = *argv;
+			break;
+		case 'I':
+			if(!--argc)	goto printHelp;
+			++argv;
+			indexFile = *argv;
+			break;
+		case 'A':
+			replayAsFastAsPossible = true;
+			break;
+		case 'B':
+			if(!--argc)	goto printHelp;
+			++argv;
+			benchmarkFilter = *argv;
+			break;
+		case 'C':
+			if(!--argc)	goto printHelp;
+			++argv;
+			benchmarkBaseline = *argv;
+			break;
+		case 'K':
+			if(!--argc)	goto printHelp;
+			++argv;
+			slowCallMicroseconds = (ULONG)_wtoi(*argv);
+			break;
+		case 'P':
+			if(!--argc)	goto printHelp;
+			++argv;
+			hotPathReportSeconds = (ULONG)_wtoi(*argv);
+			break;
+		case 'G':
+			if(!--argc)	goto printHelp;
+			++argv;
+			loadMix = *argv;
+			break;
+		case 'U':
+			if(!--argc)	goto printHelp;
+			++argv;
+			directPatterns = *argv;
+			break;
+		case 'V':
+			if(!--argc)	goto printHelp;
+			++argv;
+			directMegabytes = (ULONG)_wtoi(*argv);
+			break;
+		case 'H':
+			if(!--argc)	goto printHelp;
+			++argv;
+			cacheDirectory = *argv;
+			break;
+		case 'O':
+			if(!--argc)	goto printHelp;
+			++argv;
+			cachePromoteOpens = (ULONG)_wtoi(*argv);
+			break;
+		case 'Q':
+			if(!--argc)	goto printHelp;
+			++argv;
+			cacheMegabytes = (ULONG)_wtoi(*argv);
+			break;
+		case 'Z':
+			if(!--argc)	goto printHelp;
+			++argv;
+			prefetchMegabytes = (ULONG)_wtoi(*argv);
+			break;
+		case '2':
+			parallelProbes = true;
+			break;
+		case '3':
+			watchReadRoot = true;
+			break;
+		case 'S':
+			if(!--argc)	goto printHelp;
+			++argv;
+			loadSeconds = (ULONG)_wtoi(*argv);
+			break;
+		case 'F':
+			coalesceWrites = true;
+			break;
+		case 'J':
+			groupFlushes = true;
+			break;
 		case 'N':
 			dokanOptions->Options |= DOKAN_OPTION_NETWORK;
 			break;
@@ -1285,6 +1146,33 @@ printHelp:
 		}
 	}
 
+	DWORD readRootAttributes = GetFileAttributes(gReadRootDirectory);
+	if (readRootAttributes != INVALID_FILE_ATTRIBUTES && !(readRootAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		if (cacheDirectory) {
+			fwprintf(stderr, L"The cache tier needs a read root directory, not an image.\n");
+			return 2;
+		}
+		ImageLayer* imageLayer = new ImageLayer(gReadRootDirectory, gReadRootDirectoryLength);
+		if (imageLayer->Load()) {
+			fwprintf(stderr, L"Cannot load the image %s. Error: %d.\n", gReadRootDirectory, GetLastError());
+			return 2;
+		}
+		gReadLayer = imageLayer;
+	} else if (indexFile) {
+		IndexLayer* indexLayer = new IndexLayer(gReadRootDirectory, gReadRootDirectoryLength);
+		if (indexLayer->Load(indexFile)) {
+			fwprintf(stderr, L"Cannot load the index %s. Error: %d.\n", indexFile, GetLastError());
+			return 2;
+		}
+		gReadLayer = indexLayer;
+	} else
+		gReadLayer = new Win32Layer(gReadRootDirectory, gReadRootDirectoryLength);
+	gWriteLayer = new Win32Layer(gWriteRootDirectory, gWriteRootDirectoryLength);
+	if (LoadMetadata()) {
+		fwprintf(stderr, L"Cannot load the metadata file %s%s. Error: %d.\n", gWriteRootDirectory, UFS_METADATA_FILE, GetLastError());
+		return 2;
+	}
+
 	if (gDebugMode)
 		dokanOptions->Options |= DOKAN_OPTION_DEBUG;
 	dokanOptions->Options |= DOKAN_OPTION_KEEP_ALIVE;
@@ -1299,7 +1187,7 @@ printHelp:
 	dokanOperations->FlushFileBuffers =	UFSFlushFileBuffers;
 	dokanOperations->GetFileInformation	= UFSGetFileInformation;
 	dokanOperations->FindFiles = UFSFindFiles;
-	dokanOperations->FindFilesWithPattern =	NULL;
+	dokanOperations->FindFilesWithPattern =	UFSFindFilesWithPattern;
 	dokanOperations->SetFileAttributes = UFSSetFileAttributes;
 	dokanOperations->SetFileTime = UFSSetFileTime;
 	dokanOperations->DeleteFile	= UFSDeleteFile;
@@ -1313,6 +1201,94 @@ printHelp:
 	dokanOperations->GetVolumeInformation =	UFSGetVolumeInformation;
 	dokanOperations->Unmount = UFSUnmount;
 
+	if (traceFile) {
+		if (UFSTraceOpen(traceFile, slowCallMicroseconds, recordAll)) {
+			fwprintf(stderr, L"Cannot create trace file %s. Error: %d.\n", traceFile, GetLastError());
+			return 2;
+		}
+		dokanOperations->CreateFile = TracedCreateFile;
+		dokanOperations->OpenDirectory = TracedOpenDirectory;
+		dokanOperations->CreateDirectory = TracedCreateDirectory;
+		dokanOperations->Cleanup = TracedCleanup;
+		dokanOperations->CloseFile = TracedCloseFile;
+		dokanOperations->ReadFile = TracedReadFile;
+		dokanOperations->WriteFile = TracedWriteFile;
+		dokanOperations->FlushFileBuffers = TracedFlushFileBuffers;
+		dokanOperations->GetFileInformation = TracedGetFileInformation;
+		dokanOperations->FindFiles = TracedFindFiles;
+		dokanOperations->FindFilesWithPattern = TracedFindFilesWithPattern;
+		dokanOperations->SetFileAttributes = TracedSetFileAttributes;
+		dokanOperations->SetFileTime = TracedSetFileTime;
+		dokanOperations->DeleteFile = TracedDeleteFile;
+		dokanOperations->DeleteDirectory = TracedDeleteDirectory;
+		dokanOperations->MoveFile = TracedMoveFile;
+		dokanOperations->SetEndOfFile = TracedSetEndOfFile;
+		dokanOperations->SetAllocationSize = TracedSetAllocationSize;
+		dokanOperations->LockFile = TracedLockFile;
+		dokanOperations->UnlockFile = TracedUnlockFile;
+		dokanOperations->GetDiskFreeSpace = TracedGetDiskFreeSpace;
+		dokanOperations->GetVolumeInformation = TracedGetVolumeInformation;
+		dokanOperations->Unmount = TracedUnmount;
+	}
+
+	if (coalesceWrites && WriteCoalescerStart()) {
+		fwprintf(stderr, L"Cannot start the write coalescer. Error: %d.\n", GetLastError());
+		return 2;
+	}
+
+	if ((directPatterns || directMegabytes) && DirectIoStart(directPatterns, directMegabytes)) {
+		fwprintf(stderr, L"Cannot start direct I/O. Error: %d.\n", GetLastError());
+		return 2;
+	}
+
+	if (cacheDirectory && CacheTierStart(cacheDirectory, cachePromoteOpens, cacheMegabytes)) {
+		fwprintf(stderr, L"Cannot start the cache tier in %s. Error: %d.\n", cacheDirectory, GetLastError());
+		return 2;
+	}
+
+	/* Without it the caches fed from the read root only notice its changes when they expire or check. */
+	if (watchReadRoot && readRootAttributes != INVALID_FILE_ATTRIBUTES && (readRootAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+		ChangeWatcherStart(gReadLayer->Root(), gReadLayer->RootLength()))
+		fwprintf(stderr, L"Cannot watch the read root for changes. Error: %d.\n", GetLastError());
+
+	if (prefetchMegabytes && PrefetcherStart(prefetchMegabytes)) {
+		fwprintf(stderr, L"Cannot start the prefetcher. Error: %d.\n", GetLastError());
+		return 2;
+	}
+
+	if (parallelProbes && ParallelProbesStart()) {
+		fwprintf(stderr, L"Cannot start the parallel probes. Error: %d.\n", GetLastError());
+		return 2;
+	}
+
+	if (groupFlushes && FlushCoordinatorStart(gWriteRootDirectory)) {
+		fwprintf(stderr, L"Cannot start the flush coordinator. Error: %d.\n", GetLastError());
+		return 2;
+	}
+
+	if (hotPathReportSeconds && HotPathsStart(hotPathReportSeconds, 10)) {
+		fwprintf(stderr, L"Cannot start the hot path profiler. Error: %d.\n", GetLastError());
+		return 2;
+	}
+
+	if (benchmarkFilter) {
+		exitCode = RunBenchmarks(benchmarkFilter, benchmarkBaseline);
+		goto Stop;
+	}
+	if (loadMix) {
+		exitCode = RunLoadGenerator(dokanOperations, loadMix, dokanOptions->ThreadCount, loadSeconds);
+		goto Stop;
+	}
+	if (replayFile) {
+		exitCode = RunReplay(dokanOperations, replayFile, replayAsFastAsPossible);
+		goto Stop;
+	}
+
+	if (StartMetadataLog()) {
+		fwprintf(stderr, L"Cannot start the metadata log %s%s. Error: %d.\n", gWriteRootDirectory, UFS_METADATA_LOG_FILE, GetLastError());
+		exitCode = 2;
+		goto Stop;
+	}
 	status = DokanMain(dokanOptions, dokanOperations);
 	switch (status)	{
 		case DOKAN_SUCCESS:
@@ -1337,10 +1313,25 @@ printHelp:
 			fprintf(stderr,	"Unknown error:	%d\n", status);
 			break;
 	}
-
+	if (SaveMetadata())
+		fwprintf(stderr, L"Cannot save the metadata file %s%s. Error: %d.\n", gWriteRootDirectory, UFS_METADATA_FILE, GetLastError());
+
+Stop:
+	StopMetadataLog();
+	ChangeWatcherStop();
+	WriteCoalescerStop();
+	FlushCoordinatorStop();
+	DirectIoStop();
+	PrefetcherStop();
+	ParallelProbesStop();
+	CacheTierStop();
+	HotPathsStop();
+	UFSTraceClose();
+	delete gReadLayer;
+	delete gWriteLayer;
 	free(dokanOptions);
 	free(dokanOperations);
-	return 0;
+	return exitCode;
 }
 
 
@@ -0,0 +1,307 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "stdafx.h"
+#include <windows.h>
+#include <string.h>
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "UnionEngine.h"
+#include "WriteCoalescer.h"
+
+bool gWriteCoalescingEnabled;
+
+/* The pending writes of a file. Only the lookup of the file takes the lock of the map, its buffer is used and
+ * written under its own lock, so the writes of different files do not wait for each other. */
+struct PendingFile {
+	PendingFile(const FileKey& aFile) : mFile(aFile), mUsers(0), mWriter(NULL), mFailed(NULL), mError(0), mpData(NULL), mLength(0) {
+		InitializeCriticalSection(&mLock);
+	}
+	~PendingFile() {
+		delete[] mpData;
+		DeleteCriticalSection(&mLock);
+	}
+	FileKey mFile;
+	CRITICAL_SECTION mLock;
+	LONG mUsers; /* The threads using the file, under the lock of the map. The file goes when none is left and it keeps nothing. */
+	HANDLE mWriter; /* The handle whose writes are pending, NULL when none are. */
+	HANDLE mFailed; /* The handle whose pending writes failed when written later, and the error, reported by its next call. */
+	DWORD mError;
+	BYTE* mpData; /* UFS_COALESCE_BUFFER_SIZE bytes. */
+	LONGLONG mOffset;
+	DWORD mLength; /* 0 when nothing is pending. */
+	DWORD mTime; /* GetTickCount when the first pending byte was written. */
+};
+class PendingFileMap : public std::map<FileKey, PendingFile*>
+{
+public:
+	PendingFileMap() : std::map<FileKey, PendingFile*>() {
+		InitializeCriticalSection(&mLock);
+	}
+	~PendingFileMap() {
+		DeleteCriticalSection(&mLock);
+	}
+	CRITICAL_SECTION mLock;
+};
+static PendingFileMap gPendingFiles;
+/* The size of gPendingFiles, read without the lock so that calls for files without pending writes skip it. */
+static volatile LONG gPendingWriteCount;
+static HANDLE gStopFlusher, gFlusherThread;
+
+static bool WriteAt(HANDLE aFile, LPCVOID aBuffer, DWORD aLength, LONGLONG aOffset)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = aOffset;
+	DWORD written;
+	if (!SetFilePointerEx(aFile, position, NULL, FILE_BEGIN) || !WriteFile(aFile, aBuffer, aLength, &written, NULL))
+		return true;
+	if (written != aLength) {
+		SetLastError(ERROR_DISK_FULL);
+		return true;
+	}
+	return false;
+}
+
+/** Finds the pending writes of the file aKey, or makes room for them if aCreate, and locks them.
+ * @return NULL if there are none, or if aCreate and UFS_COALESCE_MAX_FILES files already have some.
+ */
+static PendingFile* UseFile(const FileKey& aKey, bool aCreate)
+{
+	PendingFile* file;
+	{
+		CriticalSectionLock lock(gPendingFiles.mLock);
+		PendingFileMap::iterator it = gPendingFiles.find(aKey);
+		if (it != gPendingFiles.end())
+			file = it->second;
+		else if (!aCreate || gPendingFiles.size() >= UFS_COALESCE_MAX_FILES)
+			return NULL;
+		else {
+			file = NULL;
+			try {
+				file = new PendingFile(aKey);
+				file->mpData = new BYTE[UFS_COALESCE_BUFFER_SIZE];
+				gPendingFiles[aKey] = file;
+			} catch (...) {
+				delete file;
+				return NULL;
+			}
+			gPendingWriteCount = (LONG)gPendingFiles.size();
+		}
+		++file->mUsers;
+	}
+	EnterCriticalSection(&file->mLock);
+	return file;
+}
+
+/** Unlocks apFile, and drops it if nothing is pending and no other thread uses it. Keeps the last error. */
+static void LeaveFile(PendingFile* apFile)
+{
+	DWORD error = GetLastError();
+	LeaveCriticalSection(&apFile->mLock);
+	CriticalSectionLock lock(gPendingFiles.mLock);
+	if (!--apFile->mUsers && !apFile->mLength && !apFile->mError) {
+		gPendingFiles.erase(apFile->mFile);
+		gPendingWriteCount = (LONG)gPendingFiles.size();
+		delete apFile;
+	}
+	SetLastError(error);
+}
+
+/** Gets every file with pending writes, for the caller to lock with UseFile one at a time. */
+static void ListFiles(vector<FileKey>& aFiles)
+{
+	CriticalSectionLock lock(gPendingFiles.mLock);
+	try {
+		aFiles.reserve(gPendingFiles.size());
+		for (PendingFileMap::const_iterator it = gPendingFiles.begin(); it != gPendingFiles.end(); ++it)
+			aFiles.push_back(it->first);
+	} catch (...) {
+		// The files left out are written by the flusher thread later.
+	}
+}
+
+/** Writes the pending data of aPending, keeping the error for its writer if it fails. Called locked. */
+static void Flush(PendingFile& aPending)
+{
+	if (aPending.mLength && WriteAt(aPending.mWriter, aPending.mpData, aPending.mLength, aPending.mOffset) && !aPending.mError) {
+		aPending.mError = GetLastError();
+		aPending.mFailed = aPending.mWriter;
+	}
+	aPending.mLength = 0;
+	aPending.mWriter = NULL;
+}
+
+/** Reports the error kept in aPending for aFile. Called locked.
+ * @return false if there was none.
+ */
+static bool TakeError(PendingFile& aPending, HANDLE aFile)
+{
+	if (!aPending.mError || aPending.mFailed != aFile)
+		return false;
+	SetLastError(aPending.mError);
+	aPending.mError = 0;
+	aPending.mFailed = NULL;
+	return true;
+}
+
+/** Keeps the write for later or writes it. Called locked. */
+static bool Write(PendingFile& aPending, HANDLE aFile, LPCVOID aBuffer, DWORD aLength, LONGLONG aOffset)
+{
+	/* Written through another handle: its writes go first, so that they cannot land over this one later. */
+	if (aPending.mWriter && aPending.mWriter != aFile)
+		Flush(aPending);
+	if (TakeError(aPending, aFile))
+		return true;
+	/* The buffer ends at the first multiple of its size after its start. */
+	LONGLONG end = aPending.mOffset + aPending.mLength, limit = (aPending.mOffset / UFS_COALESCE_BUFFER_SIZE + 1) * UFS_COALESCE_BUFFER_SIZE;
+	if (aPending.mLength && (aLength >= UFS_COALESCE_MAX_WRITE || aOffset < aPending.mOffset || aOffset > end || aOffset + aLength > limit)) {
+		Flush(aPending);
+		if (TakeError(aPending, aFile))
+			return true;
+	}
+	limit = (aOffset / UFS_COALESCE_BUFFER_SIZE + 1) * UFS_COALESCE_BUFFER_SIZE;
+	if (aLength >= UFS_COALESCE_MAX_WRITE || (!aPending.mLength && aOffset + aLength > limit))
+		return WriteAt(aFile, aBuffer, aLength, aOffset);
+	if (!aPending.mLength) {
+		aPending.mOffset = aOffset;
+		aPending.mTime = GetTickCount();
+		aPending.mWriter = aFile;
+	}
+	DWORD start = (DWORD)(aOffset - aPending.mOffset);
+	memcpy(aPending.mpData + start, aBuffer, aLength);
+	if (start + aLength > aPending.mLength)
+		aPending.mLength = start + aLength;
+	if (aPending.mOffset + aPending.mLength == (aPending.mOffset / UFS_COALESCE_BUFFER_SIZE + 1) * UFS_COALESCE_BUFFER_SIZE) {
+		Flush(aPending);
+		return TakeError(aPending, aFile);
+	}
+	return false;
+}
+
+bool CoalescedWrite(HANDLE aFile, LPCVOID aBuffer, DWORD aLength, LONGLONG aOffset)
+{
+	if (aLength >= UFS_COALESCE_MAX_WRITE && !gPendingWriteCount)
+		return WriteAt(aFile, aBuffer, aLength, aOffset);
+	FileKey key;
+	PendingFile* file;
+	if (GetFileKey(aFile, key) || !(file = UseFile(key, aLength < UFS_COALESCE_MAX_WRITE)))
+		return WriteAt(aFile, aBuffer, aLength, aOffset);
+	bool failed = Write(*file, aFile, aBuffer, aLength, aOffset);
+	LeaveFile(file);
+	return failed;
+}
+
+/** Writes what is pending for the file of aFile if aAll is set or it overlaps [aOffset, aEnd). */
+static bool FlushOverlapping(HANDLE aFile, LONGLONG aOffset, LONGLONG aEnd, bool aAll)
+{
+	FileKey key;
+	PendingFile* file;
+	if (!gPendingWriteCount || GetFileKey(aFile, key) || !(file = UseFile(key, false)))
+		return false;
+	if (aAll || (aOffset < file->mOffset + file->mLength && file->mOffset < aEnd))
+		Flush(*file);
+	bool failed = TakeError(*file, aFile);
+	LeaveFile(file);
+	return failed;
+}
+
+bool FlushCoalescedRange(HANDLE aFile, LONGLONG aOffset, DWORD aLength)
+{
+	return FlushOverlapping(aFile, aOffset, aOffset + aLength, false);
+}
+
+bool FlushCoalescedWrites(HANDLE aFile)
+{
+	return FlushOverlapping(aFile, 0, 0, true);
+}
+
+/** Writes what is pending for every file, or only what is older than UFS_COALESCE_MILLISECONDS if aOld. */
+static void FlushFiles(bool aOld)
+{
+	if (!gPendingWriteCount)
+		return;
+	vector<FileKey> files;
+	ListFiles(files);
+	for (vector<FileKey>::const_iterator it = files.begin(); it != files.end(); ++it) {
+		PendingFile* file = UseFile(*it, false);
+		if (!file)
+			continue;
+		if (!aOld || (file->mLength && GetTickCount() - file->mTime >= UFS_COALESCE_MILLISECONDS))
+			Flush(*file);
+		LeaveFile(file);
+	}
+}
+
+void FlushEveryCoalescedWrite()
+{
+	FlushFiles(false);
+}
+
+bool ReleaseCoalescedWrites(HANDLE aFile)
+{
+	FileKey key;
+	PendingFile* file;
+	if (!gPendingWriteCount || GetFileKey(aFile, key) || !(file = UseFile(key, false)))
+		return false;
+	if (file->mWriter == aFile)
+		Flush(*file);
+	bool failed = TakeError(*file, aFile);
+	LeaveFile(file);
+	return failed;
+}
+
+static DWORD WINAPI FlusherThread(LPVOID)
+{
+	while (WaitForSingleObject(gStopFlusher, UFS_COALESCE_MILLISECONDS / 4) == WAIT_TIMEOUT)
+		FlushFiles(true);
+	return 0;
+}
+
+bool WriteCoalescerStart()
+{
+	if (!(gStopFlusher = CreateEvent(NULL, TRUE, FALSE, NULL)))
+		return true;
+	if (!(gFlusherThread = CreateThread(NULL, 0, FlusherThread, NULL, 0, NULL))) {
+		CloseHandle(gStopFlusher);
+		return true;
+	}
+	gWriteCoalescingEnabled = true;
+	return false;
+}
+
+void WriteCoalescerStop()
+{
+	if (!gWriteCoalescingEnabled)
+		return;
+	gWriteCoalescingEnabled = false;
+	SetEvent(gStopFlusher);
+	WaitForSingleObject(gFlusherThread, INFINITE);
+	CloseHandle(gFlusherThread);
+	CloseHandle(gStopFlusher);
+	CriticalSectionLock lock(gPendingFiles.mLock);
+	for (PendingFileMap::iterator it = gPendingFiles.begin(); it != gPendingFiles.end(); ++it) {
+		Flush(*it->second);
+		delete it->second;
+	}
+	gPendingFiles.clear();
+	gPendingWriteCount = 0;
+}
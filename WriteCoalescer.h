@@ -0,0 +1,65 @@
+/*
+	Copyright (c) 2010 Carol Szabo cszaboads@gmail.com
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+	GPL clarification: Works hosted or built on filesystems created by this
+	work do not become "covered works" simply because this work was used in
+	its object form to create them.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/** Write coalescing.
+ * Keeps, per write root file, one buffer of pending small writes made through one of its handles and merges
+ * the adjacent ones, so that an application appending in small chunks costs one seek and write per
+ * UFS_COALESCE_BUFFER_SIZE bytes instead of one per call. Buffers end on multiples of their size, so flushes
+ * after the first are aligned. Pending data is written when the buffer fills, when a write does not extend
+ * it, when another handle of the file writes, after UFS_COALESCE_MILLISECONDS, and when one of the functions
+ * below asks for it. While UFS_COALESCE_MAX_FILES files have some, the writes of the others go straight to
+ * them. The functions taking a handle act on the buffer of its file whichever handle wrote it, so other
+ * handles see the pending data once they ask; they find it by the file identity remembered when the handle
+ * was opened, see RememberFileKey, and each file is locked on its own. Errors of the writes done later are
+ * reported by the next call for the handle that wrote them. Handles opened to write through are not
+ * coalesced.
+ */
+
+#define UFS_COALESCE_BUFFER_SIZE 65536
+/* Writes at least this long go straight to the file. */
+#define UFS_COALESCE_MAX_WRITE 16384
+#define UFS_COALESCE_MAX_FILES 256
+#define UFS_COALESCE_MILLISECONDS 1000
+
+extern bool gWriteCoalescingEnabled;
+
+/** Starts the thread flushing the buffers older than UFS_COALESCE_MILLISECONDS and enables coalescing.
+ * @return false on success.
+ */
+bool WriteCoalescerStart();
+/** Stops the thread and writes every pending buffer. */
+void WriteCoalescerStop();
+
+/** Writes aLength bytes at aOffset of the write root file aFile, or keeps them for later.
+ * All these functions return false on success, GetLastError tells why they failed.
+ */
+bool CoalescedWrite(HANDLE aFile, LPCVOID aBuffer, DWORD aLength, LONGLONG aOffset);
+/** Writes what is pending for the file of aFile, before an operation that must see it: an open, a size
+ * query, a flush, a write that is not coalesced or a change of the size or the times of the file. */
+bool FlushCoalescedWrites(HANDLE aFile);
+/** Writes what is pending for the file of aFile if it overlaps the aLength bytes at aOffset, before reading
+ * or writing them. */
+bool FlushCoalescedRange(HANDLE aFile, LONGLONG aOffset, DWORD aLength);
+/** Writes what is pending for every file, before files are queried by name. Errors are kept for the handles. */
+void FlushEveryCoalescedWrite();
+/** Writes what is pending through aFile and forgets it, before the handle is closed. */
+bool ReleaseCoalescedWrites(HANDLE aFile);